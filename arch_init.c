@@ -26,6 +26,7 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <poll.h>
 #endif
 #include "config.h"
 #include "monitor.h"
@@ -37,9 +38,14 @@
 #include "hw/audiodev.h"
 #include "kvm.h"
 #include "migration.h"
+#include "multifd.h"
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "postcopy.h"
+#include "qemu_socket.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -87,71 +93,272 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_CAPS	0x20
+#define RAM_SAVE_FLAG_XBZRLE	0x40
+#define RAM_SAVE_FLAG_POSTCOPY	0x80
+#define RAM_SAVE_FLAG_MULTIFD_SYNC	0x100
 
-static int is_dup_page(uint8_t *page, uint8_t ch)
+/* capabilities announced by a RAM_SAVE_FLAG_CAPS record */
+#define RAM_SAVE_CAP_XBZRLE	0x01
+#define RAM_SAVE_CAP_POSTCOPY	0x02
+#define RAM_SAVE_CAP_MULTIFD	0x04	/* followed by the number of channels */
+
+#define ENCODING_FLAG_XBZRLE	0x01
+
+/* Pages still to be sent in the current pass.  The migration thread owns
+   it; pages dirtied since the pass started are moved in from the
+   MIGRATION client's log when the pass is over.  */
+static unsigned long *migration_bitmap;
+static ram_addr_t migration_bitmap_pages;
+static ram_addr_t migration_dirty_pages;
+
+static uint64_t bytes_transferred;
+
+/* How fast the guest dirtied memory during the last pass, and what
+   stopping it would cost right now.  */
+static struct {
+    int64_t time;               /* of the last sync, 0 before the first */
+    uint64_t bytes;             /* bytes_transferred at the last sync */
+    uint64_t dirty_pages_rate;  /* pages per second */
+    uint64_t expected_downtime; /* milliseconds */
+    int high_rate_count;
+} migration_sync;
+
+#define CPU_THROTTLE_INITIAL    20
+#define CPU_THROTTLE_INCREMENT  10
+
+/* A guest that dirtied more than half of what was sent in the pass is
+   not converging.  With auto-converge, the vCPUs are slowed down further
+   every second such pass.  */
+static void migration_auto_converge(ram_addr_t dirtied)
 {
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
-    int i;
+    uint64_t sent = bytes_transferred - migration_sync.bytes;
 
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val) {
-            return 0;
+    if ((uint64_t)dirtied * TARGET_PAGE_SIZE <= sent / 2) {
+        migration_sync.high_rate_count = 0;
+        return;
+    }
+    if (++migration_sync.high_rate_count < 2) {
+        return;
+    }
+    migration_sync.high_rate_count = 0;
+    if (!cpu_throttle_get()) {
+        cpu_throttle_set(CPU_THROTTLE_INITIAL);
+    } else {
+        cpu_throttle_set(cpu_throttle_get() + CPU_THROTTLE_INCREMENT);
+    }
+}
+
+static void migration_bitmap_sync(void)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    ram_addr_t dirtied;
+
+    dirtied = cpu_physical_memory_take_dirty(DIRTY_MEMORY_MIGRATION,
+                                             migration_bitmap);
+    migration_dirty_pages += dirtied;
+
+    if (migration_sync.time && now > migration_sync.time) {
+        migration_sync.dirty_pages_rate =
+            dirtied * 1000000000ULL / (now - migration_sync.time);
+        if (migrate_use_auto_converge()) {
+            migration_auto_converge(dirtied);
         }
     }
+    migration_sync.time = now;
+    migration_sync.bytes = bytes_transferred;
+}
 
-    return 1;
+/* Copies of the pages sent so far, against which re-dirtied pages are
+   encoded.  Owned by the migration thread like the bitmap.  */
+static struct {
+    PageCache *cache;
+    uint8_t *current_buf;
+    uint8_t *encoded_buf;
+    uint64_t bytes;
+    uint64_t pages;
+    uint64_t cache_miss;
+    uint64_t overflow;
+} XBZRLE;
+
+static int64_t xbzrle_cache_pages(void)
+{
+    return migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE;
 }
 
-static int ram_save_block(QEMUFile *f)
+static void xbzrle_cache_free(void)
 {
-    static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int bytes_sent = 0;
-
-    while (addr < last_ram_offset) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
-
-            p = qemu_get_ram_ptr(current_addr);
-
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-            }
+    cache_fini(XBZRLE.cache);
+    qemu_free(XBZRLE.current_buf);
+    qemu_free(XBZRLE.encoded_buf);
+    XBZRLE.cache = NULL;
+    XBZRLE.current_buf = NULL;
+    XBZRLE.encoded_buf = NULL;
+}
 
-            break;
-        }
-        addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % last_ram_offset;
+/* Post-copy state of the source: whether the guest moves to the
+   destination after the first pass, whether it has, and the page
+   requests read off the return path so far.  */
+static struct {
+    int enabled;
+    int active;
+    uint8_t req[256];
+    int req_len;
+} postcopy;
+
+static void migration_bitmap_free(void)
+{
+    qemu_free(migration_bitmap);
+    migration_bitmap = NULL;
+    migration_dirty_pages = 0;
+    postcopy.active = 0;
+
+    xbzrle_cache_free();
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return XBZRLE.bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return XBZRLE.pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+    return XBZRLE.cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return XBZRLE.overflow;
+}
+
+/* Send the page at addr, whose contents are at p, as a delta against the
+   cached copy and update the cache.  Return the number of bytes sent, or
+   -1 if the page has to be sent whole.  */
+static int save_xbzrle_page(QEMUFile *f, ram_addr_t addr, uint8_t *p)
+{
+    uint8_t *cached = get_cached_data(XBZRLE.cache, addr);
+    int len;
+
+    if (!cached) {
+        XBZRLE.cache_miss++;
+        cache_insert(XBZRLE.cache, addr, p);
+        return -1;
     }
 
-    return bytes_sent;
+    len = xbzrle_encode_buffer(cached, p, TARGET_PAGE_SIZE,
+                               XBZRLE.encoded_buf, TARGET_PAGE_SIZE);
+    memcpy(cached, p, TARGET_PAGE_SIZE);
+    if (len < 0) {
+        XBZRLE.overflow++;
+        return -1;
+    }
+    if (len == 0) {
+        /* rewritten with the same contents */
+        return 0;
+    }
+
+    qemu_put_be64(f, addr | RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, len);
+    XBZRLE.bytes += len + 3;
+    XBZRLE.pages++;
+    return len + 3 + 8;
 }
 
-static uint64_t bytes_transferred;
+/* Send the page at addr.  Only touches the XBZRLE cache and guest RAM,
+   so it may run without the iothread lock.  */
+static int ram_save_page(QEMUFile *f, ram_addr_t addr)
+{
+    uint8_t *p;
+    int bytes_sent;
+
+    p = qemu_get_ram_ptr(addr);
+
+    if (multifd_save_channels()) {
+        return multifd_queue_page(addr, p);
+    }
+
+    if (XBZRLE.cache) {
+        /* The guest may write the page while it is sent: work from a
+           snapshot so that the cache holds exactly what was sent.  */
+        memcpy(XBZRLE.current_buf, p, TARGET_PAGE_SIZE);
+        p = XBZRLE.current_buf;
+    }
 
+    if (buffer_is_uniform(p, TARGET_PAGE_SIZE)) {
+        if (XBZRLE.cache) {
+            uint8_t *cached = get_cached_data(XBZRLE.cache, addr);
+
+            if (cached) {
+                memset(cached, *p, TARGET_PAGE_SIZE);
+            }
+        }
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        return 1;
+    }
+    if (XBZRLE.cache) {
+        bytes_sent = save_xbzrle_page(f, addr, p);
+        if (bytes_sent >= 0) {
+            return bytes_sent;
+        }
+    }
+    qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+    if (XBZRLE.cache) {
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    } else {
+        /* Straight from guest RAM.  If the guest writes the page before
+           it is on the wire, the page is dirty again and will be sent
+           again.  */
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+    }
+    return TARGET_PAGE_SIZE;
+}
+
+/* Send the next page of the current pass, which must not be empty.  */
+static int ram_save_block(QEMUFile *f)
+{
+    static ram_addr_t current_page = 0;
+
+    current_page = find_next_bit(migration_bitmap, migration_bitmap_pages,
+                                 current_page);
+    if (current_page == migration_bitmap_pages) {
+        current_page = find_next_bit(migration_bitmap, migration_bitmap_pages,
+                                     0);
+    }
+    migration_bitmap[BIT_WORD(current_page)] &= ~BIT_MASK(current_page);
+    migration_dirty_pages--;
+
+    return ram_save_page(f, current_page << TARGET_PAGE_BITS);
+}
+
+/* Pages left in the current pass plus pages dirtied since it started.  */
 static ram_addr_t ram_save_remaining(void)
 {
-    ram_addr_t addr;
-    ram_addr_t count = 0;
+    const unsigned long *dirty = phys_ram_dirty[DIRTY_MEMORY_MIGRATION];
+    ram_addr_t i, nwords, count = 0;
 
-    for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
-        if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-            count++;
-        }
+    if (!migration_bitmap) {
+        return cpu_physical_memory_count_dirty(DIRTY_MEMORY_MIGRATION, 0,
+                                               last_ram_offset);
     }
+    nwords = BITS_TO_LONGS(migration_bitmap_pages);
+    for (i = 0; i < nwords; i++) {
+        unsigned long bits = migration_bitmap[i] | dirty[i];
 
+        if (i == nwords - 1) {
+            bits &= BITMAP_LAST_WORD_MASK(migration_bitmap_pages);
+        }
+        if (bits) {
+            count += __builtin_popcountl(bits);
+        }
+    }
     return count;
 }
 
@@ -170,15 +377,94 @@ uint64_t ram_bytes_total(void)
     return last_ram_offset;
 }
 
+uint64_t ram_dirty_pages_rate(void)
+{
+    return migration_sync.dirty_pages_rate;
+}
+
+uint64_t ram_expected_downtime(void)
+{
+    return migration_sync.expected_downtime;
+}
+
+/* The bitmap goes out as 64-bit words whatever the host long size.  */
+#define POSTCOPY_WORD_LONGS (64 / BITS_PER_LONG)
+
+static void ram_save_postcopy_bitmap(QEMUFile *f)
+{
+    ram_addr_t nlongs = BITS_TO_LONGS(migration_bitmap_pages);
+    ram_addr_t i;
+    int j;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    qemu_put_be64(f, migration_bitmap_pages);
+    for (i = 0; i < nlongs; i += POSTCOPY_WORD_LONGS) {
+        uint64_t word = 0;
+
+        for (j = 0; j < POSTCOPY_WORD_LONGS && i + j < nlongs; j++) {
+            word |= (uint64_t)migration_bitmap[i + j] << (j * BITS_PER_LONG);
+        }
+        qemu_put_be64(f, word);
+    }
+}
+
+static int ram_load_postcopy_bitmap(QEMUFile *f)
+{
+    uint64_t npages = qemu_get_be64(f);
+    ram_addr_t nwords, i;
+    unsigned long *pending;
+    int j;
+
+    if (npages != last_ram_offset >> TARGET_PAGE_BITS) {
+        return -EINVAL;
+    }
+    nwords = (npages + 63) / 64;
+    pending = qemu_mallocz(nwords * POSTCOPY_WORD_LONGS *
+                           sizeof(unsigned long));
+    for (i = 0; i < nwords; i++) {
+        uint64_t word = qemu_get_be64(f);
+
+        for (j = 0; j < POSTCOPY_WORD_LONGS; j++) {
+            pending[i * POSTCOPY_WORD_LONGS + j] = word >> (j * BITS_PER_LONG);
+        }
+    }
+    if (qemu_file_has_error(f) ||
+        postcopy_incoming_prepare(pending, npages) < 0) {
+        qemu_free(pending);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* A page may be sent again on another channel in the next pass, so the
+   destination must have stored all the pages of a pass before it stores
+   those of the next one.  The channels stop at their sync point until the
+   record arrives on the main channel, which carries little else, so it is
+   flushed right away.  */
+static void ram_save_multifd_sync(QEMUFile *f)
+{
+    if (multifd_save_channels()) {
+        multifd_send_sync();
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+        qemu_fflush(f);
+    }
+}
+
+/* Called with the iothread lock held.  In stage 2 the lock is dropped
+   while pages are sent, so that the migration thread does not hold up
+   device emulation; only the final pass of stage 3 runs under it.  */
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
     ram_addr_t addr;
     uint64_t bytes_transferred_last;
     double bwidth = 0;
     uint64_t expected_time = 0;
+    int caps;
 
     if (stage < 0) {
         cpu_physical_memory_set_dirty_tracking(0);
+        migration_bitmap_free();
+        cpu_throttle_set(0);
         return 0;
     }
 
@@ -189,6 +475,8 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     if (stage == 1) {
         bytes_transferred = 0;
+        memset(&migration_sync, 0, sizeof(migration_sync));
+        cpu_throttle_set(0);
 
         /* Make sure all dirty bits are set */
         for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
@@ -197,23 +485,64 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
             }
         }
 
+        migration_bitmap_free();
+        migration_bitmap_pages = last_ram_offset >> TARGET_PAGE_BITS;
+        migration_bitmap = qemu_mallocz(BITS_TO_LONGS(migration_bitmap_pages) *
+                                        sizeof(unsigned long));
+
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
 
+        XBZRLE.bytes = 0;
+        XBZRLE.pages = 0;
+        XBZRLE.cache_miss = 0;
+        XBZRLE.overflow = 0;
+        caps = 0;
+        if (migrate_use_xbzrle()) {
+            XBZRLE.cache = cache_init(xbzrle_cache_pages(), TARGET_PAGE_SIZE);
+            XBZRLE.current_buf = qemu_malloc(TARGET_PAGE_SIZE);
+            XBZRLE.encoded_buf = qemu_malloc(TARGET_PAGE_SIZE);
+            caps |= RAM_SAVE_CAP_XBZRLE;
+        }
+        postcopy.enabled = migrate_use_postcopy();
+        postcopy.req_len = 0;
+        if (postcopy.enabled) {
+            caps |= RAM_SAVE_CAP_POSTCOPY;
+        }
+        if (multifd_save_channels()) {
+            caps |= RAM_SAVE_CAP_MULTIFD;
+        }
+
         qemu_put_be64(f, last_ram_offset | RAM_SAVE_FLAG_MEM_SIZE);
+        if (caps) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_CAPS);
+            qemu_put_be32(f, caps);
+        }
+        if (caps & RAM_SAVE_CAP_MULTIFD) {
+            qemu_put_be32(f, multifd_save_channels());
+        }
+    } else if (XBZRLE.cache) {
+        XBZRLE.cache = cache_resize(XBZRLE.cache, xbzrle_cache_pages());
+    }
+
+    if (!migration_dirty_pages || stage == 3) {
+        migration_bitmap_sync();
+        ram_save_multifd_sync(f);
     }
 
     bytes_transferred_last = bytes_transferred;
     bwidth = qemu_get_clock_ns(rt_clock);
 
-    while (!qemu_file_rate_limit(f)) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
-            break;
-        }
+    if (stage == 2) {
+        qemu_mutex_unlock_iothread();
+    }
+    while (migration_dirty_pages && !qemu_file_rate_limit(f) &&
+           !multifd_rate_limit(qemu_file_get_rate_limit(f)) &&
+           !(stage == 3 && postcopy.enabled)) {
+        bytes_transferred += ram_save_block(f);
+    }
+    if (stage == 2) {
+        qemu_mutex_lock_iothread();
     }
 
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
@@ -227,24 +556,181 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     /* try transferring iterative blocks of memory */
     if (stage == 3) {
-        int bytes_sent;
-
+        /* the guest runs at full speed again once it resumes */
+        cpu_throttle_set(0);
+    }
+    if (stage == 3 && postcopy.enabled && migration_dirty_pages) {
+        /* the guest stays stopped here, so the bitmap is final; the pages
+           follow the device state */
+        cpu_physical_memory_set_dirty_tracking(0);
+        ram_save_postcopy_bitmap(f);
+        xbzrle_cache_free();
+        postcopy.active = 1;
+    } else if (stage == 3) {
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+        while (migration_dirty_pages) {
+            bytes_transferred += ram_save_block(f);
         }
         cpu_physical_memory_set_dirty_tracking(0);
+        migration_bitmap_free();
+        ram_save_multifd_sync(f);
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
+    if (multifd_send_error()) {
+        qemu_file_set_error(f);
+        return -1;
+    }
+
     expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    migration_sync.expected_downtime = expected_time / 1000000;
+
+    if (stage == 2 && postcopy.enabled && !migration_dirty_pages) {
+        /* the first pass is over: whatever was dirtied since is sent
+           after the guest has moved */
+        return 1;
+    }
 
     return (stage == 2) && (expected_time <= migrate_max_downtime());
 }
 
+int ram_postcopy_active(void)
+{
+    return postcopy.active;
+}
+
+/* Send a page the destination faulted on, unless it has been sent since
+   the request was made.  */
+static void ram_save_requested(QEMUFile *f, uint64_t addr)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+
+    if (page >= migration_bitmap_pages ||
+        !(migration_bitmap[BIT_WORD(page)] & BIT_MASK(page))) {
+        return;
+    }
+    migration_bitmap[BIT_WORD(page)] &= ~BIT_MASK(page);
+    migration_dirty_pages--;
+    bytes_transferred += ram_save_page(f, page << TARGET_PAGE_BITS);
+}
+
+/* One step of the post-copy phase.  Pages that the destination requests
+   on the return path fd are sent right away, regardless of the rate
+   limit; the rest of the bitmap goes out in the background.  Runs in the
+   migration thread without the iothread lock, as the guest is stopped.
+   Return 1 once every page has been sent, 0 if there is more to do, or
+   -1 if the destination went away.  */
+int ram_postcopy_send(QEMUFile *f, int fd)
+{
+    struct pollfd pfd;
+    ssize_t len;
+    int i, sent = 0;
+
+    for (;;) {
+        len = recv(fd, postcopy.req + postcopy.req_len,
+                   sizeof(postcopy.req) - postcopy.req_len, MSG_DONTWAIT);
+        if (len == 0) {
+            return -1;
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        postcopy.req_len += len;
+        for (i = 0; i + 8 <= postcopy.req_len; i += 8) {
+            uint64_t addr;
+
+            memcpy(&addr, postcopy.req + i, 8);
+            ram_save_requested(f, be64_to_cpu(addr));
+            sent++;
+        }
+        memmove(postcopy.req, postcopy.req + i, postcopy.req_len - i);
+        postcopy.req_len -= i;
+    }
+    if (sent) {
+        /* the destination is waiting for these */
+        qemu_fflush(f);
+    }
+
+    /* a few background pages at a time, so that requests do not wait
+       behind a whole transfer window */
+    for (i = 0; i < 64 && migration_dirty_pages && !qemu_file_rate_limit(f);
+         i++) {
+        bytes_transferred += ram_save_block(f);
+        sent++;
+    }
+
+    if (!migration_dirty_pages) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        migration_bitmap_free();
+        return 1;
+    }
+    if (qemu_file_has_error(f)) {
+        return -1;
+    }
+    if (!sent) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, 10);
+    }
+    return 0;
+}
+
+/* Read one record of the post-copy page stream into buf.  Return 1 for a
+   page, 0 at the end of the stream, or -1 on error.  */
+int ram_postcopy_get_page(QEMUFile *f, ram_addr_t *addr, uint8_t *buf)
+{
+    uint64_t header = qemu_get_be64(f);
+    int flags = header & ~TARGET_PAGE_MASK;
+
+    *addr = header & TARGET_PAGE_MASK;
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        memset(buf, qemu_get_byte(f), TARGET_PAGE_SIZE);
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+    } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+        return -1;
+    }
+    if (qemu_file_has_error(f)) {
+        return -1;
+    }
+    if (flags & RAM_SAVE_FLAG_EOS) {
+        return 0;
+    }
+    return *addr < last_ram_offset ? 1 : -1;
+}
+
+static int load_xbzrle_page(QEMUFile *f, void *host, uint8_t *buf)
+{
+    int len;
+
+    if (qemu_get_byte(f) != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Unknown page encoding in RAM migration stream\n");
+        return -EINVAL;
+    }
+    len = qemu_get_be16(f);
+    if (len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "XBZRLE page too large: %d bytes\n", len);
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, buf, len);
+    if (xbzrle_decode_buffer(buf, len, host, TARGET_PAGE_SIZE) < 0) {
+        fprintf(stderr, "Malformed XBZRLE page\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    static uint8_t *xbzrle_buf;
+    static int caps;
     ram_addr_t addr;
     int flags;
 
@@ -262,6 +748,57 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             if (addr != last_ram_offset) {
                 return -EINVAL;
             }
+            caps = 0;
+        }
+
+        if (flags & RAM_SAVE_FLAG_CAPS) {
+            caps = qemu_get_be32(f);
+            if (caps & ~(RAM_SAVE_CAP_XBZRLE | RAM_SAVE_CAP_POSTCOPY |
+                         RAM_SAVE_CAP_MULTIFD)) {
+                fprintf(stderr, "Unknown RAM migration capabilities %#x\n",
+                        caps);
+                return -EINVAL;
+            }
+            if ((caps & RAM_SAVE_CAP_XBZRLE) && !migrate_use_xbzrle()) {
+                fprintf(stderr, "RAM migration uses xbzrle, which is not "
+                        "enabled on this side\n");
+                return -EINVAL;
+            }
+            if ((caps & RAM_SAVE_CAP_POSTCOPY) && !migrate_use_postcopy()) {
+                fprintf(stderr, "RAM migration uses postcopy, which is not "
+                        "enabled on this side\n");
+                return -EINVAL;
+            }
+            if ((caps & RAM_SAVE_CAP_MULTIFD) && !migrate_use_multifd()) {
+                fprintf(stderr, "RAM migration uses multifd, which is not "
+                        "enabled on this side\n");
+                return -EINVAL;
+            }
+            if ((caps & RAM_SAVE_CAP_MULTIFD) &&
+                multifd_load_setup(qemu_get_be32(f)) < 0) {
+                return -EIO;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            if (!(caps & RAM_SAVE_CAP_MULTIFD)) {
+                return -EINVAL;
+            }
+            if (multifd_load_sync() < 0) {
+                return -EIO;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            int ret;
+
+            if (!(caps & RAM_SAVE_CAP_POSTCOPY)) {
+                return -EINVAL;
+            }
+            ret = ram_load_postcopy_bitmap(f);
+            if (ret < 0) {
+                return ret;
+            }
         }
 
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
@@ -276,6 +813,19 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
 #endif
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             qemu_get_buffer(f, qemu_get_ram_ptr(addr), TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            int ret;
+
+            if (!(caps & RAM_SAVE_CAP_XBZRLE)) {
+                return -EINVAL;
+            }
+            if (!xbzrle_buf) {
+                xbzrle_buf = qemu_malloc(TARGET_PAGE_SIZE);
+            }
+            ret = load_xbzrle_page(f, qemu_get_ram_ptr(addr), xbzrle_buf);
+            if (ret < 0) {
+                return ret;
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -23,6 +23,7 @@ extern const uint32_t arch_type;
 void select_soundhw(const char *optarg);
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
+int ram_postcopy_get_page(QEMUFile *f, ram_addr_t *addr, uint8_t *buf);
 void do_acpitable_option(const char *optarg);
 void do_smbios_option(const char *optarg);
 void cpudef_init(void);
@@ -0,0 +1,74 @@
+/*
+ * Bitmap helpers
+ *
+ * Bitmaps are arrays of unsigned long with bit nr of the map in word
+ * BIT_WORD(nr), so that they can be scanned a host word at a time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_BITOPS_H
+#define QEMU_BITOPS_H
+
+#define BITS_PER_LONG           (sizeof(unsigned long) * 8)
+#define BIT_WORD(nr)            ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)            (1UL << ((nr) % BITS_PER_LONG))
+#define BITS_TO_LONGS(nr)       (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/* Mask of the bits of a word at or above bit nr of the map, and of the
+   bits below bit nr (all ones when nr is word aligned).  */
+#define BITMAP_FIRST_WORD_MASK(nr) (~0UL << ((nr) % BITS_PER_LONG))
+#define BITMAP_LAST_WORD_MASK(nr) \
+    (~0UL >> ((BITS_PER_LONG - (nr) % BITS_PER_LONG) % BITS_PER_LONG))
+
+/* Return the index of the first set bit in [offset, size), or size if
+   there is none.  */
+static inline unsigned long find_next_bit(const unsigned long *map,
+                                          unsigned long size,
+                                          unsigned long offset)
+{
+    unsigned long word, base;
+
+    if (offset >= size) {
+        return size;
+    }
+    base = offset - offset % BITS_PER_LONG;
+    word = map[BIT_WORD(offset)] & BITMAP_FIRST_WORD_MASK(offset);
+    while (!word) {
+        base += BITS_PER_LONG;
+        if (base >= size) {
+            return size;
+        }
+        word = map[BIT_WORD(base)];
+    }
+    base += __builtin_ctzl(word);
+    return base < size ? base : size;
+}
+
+/* Return the number of set bits in [start, end).  */
+static inline unsigned long bitmap_count(const unsigned long *map,
+                                         unsigned long start,
+                                         unsigned long end)
+{
+    unsigned long count = 0;
+
+    while (start < end) {
+        unsigned long word = map[BIT_WORD(start)];
+        unsigned long next = (start | (BITS_PER_LONG - 1)) + 1;
+
+        word &= BITMAP_FIRST_WORD_MASK(start);
+        if (next > end) {
+            word &= BITMAP_LAST_WORD_MASK(end);
+            next = end;
+        }
+        if (word) {
+            count += __builtin_popcountl(word);
+        }
+        start = next;
+    }
+    return count;
+}
+
+#endif
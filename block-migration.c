@@ -26,6 +26,8 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_ZERO_RANGE         0x10
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -68,6 +70,7 @@ typedef struct BlkMigState {
     int shared_base;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
+    int max_inflight;
     int submitted;
     int read_done;
     int transferred;
@@ -80,20 +83,31 @@ typedef struct BlkMigState {
 
 static BlkMigState block_mig_state;
 
+static void blk_put_device_name(QEMUFile *f, BlockDriverState *bs)
+{
+    int len = strlen(bs->device_name);
+
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bs->device_name, len);
+}
+
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
-    int len;
+    int flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
-    /* device name */
-    len = strlen(blk->bmds->bs->device_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    blk_put_device_name(f, blk->bmds->bs);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    /* the data of a zero block is implied */
+    if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    }
 }
 
 int blk_mig_active(void)
@@ -157,6 +171,42 @@ static void blk_mig_read_cb(void *opaque, int ret)
     assert(block_mig_state.submitted >= 0);
 }
 
+/* Return the number of sectors from sector_num on that read as zeros
+   without being allocated in the image, rounded down to whole chunks
+   unless the run reaches the end of the device.  */
+static int64_t blk_unallocated_zero_run(BlkMigDevState *bmds,
+                                        int64_t sector_num)
+{
+    BlockDriverState *bs = bmds->bs;
+    int64_t end = sector_num;
+    int nr_sectors;
+
+    /* unallocated sectors of an image with a backing file come from it */
+    if (bs->backing_hd) {
+        return 0;
+    }
+    while (end < bmds->total_sectors && end - sector_num < INT32_MAX / 2 &&
+           !bdrv_is_allocated(bs, end, MAX_IS_ALLOCATED_SEARCH,
+                              &nr_sectors) && nr_sectors > 0) {
+        end += nr_sectors;
+    }
+    if (end < bmds->total_sectors) {
+        end &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+    } else {
+        end = bmds->total_sectors;
+    }
+    return end > sector_num ? end - sector_num : 0;
+}
+
+static void blk_send_zero_range(QEMUFile *f, BlkMigDevState *bmds,
+                                int64_t sector_num, int64_t nr_sectors)
+{
+    qemu_put_be64(f, (sector_num << BDRV_SECTOR_BITS) |
+                     BLK_MIG_FLAG_ZERO_RANGE);
+    blk_put_device_name(f, bmds->bs);
+    qemu_put_be32(f, nr_sectors);
+}
+
 static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
                                 BlkMigDevState *bmds)
 {
@@ -164,6 +214,7 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
+    int64_t nr_zero;
     int nr_sectors;
 
     if (bmds->shared_base) {
@@ -183,6 +234,16 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
+    /* nothing to read where the image is not allocated: a thin disk costs
+       one record per hole */
+    nr_zero = blk_unallocated_zero_run(bmds, cur_sector);
+    if (nr_zero) {
+        blk_send_zero_range(f, bmds, cur_sector, nr_zero);
+        bdrv_reset_dirty(bs, cur_sector, nr_zero);
+        bmds->cur_sector = bmds->completed_sectors = cur_sector + nr_zero;
+        return (bmds->cur_sector >= total_sectors);
+    }
+
     /* we are going to transfer a full block even if it is not allocated */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
@@ -266,6 +327,7 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
 
 static void init_blk_migration(Monitor *mon, QEMUFile *f)
 {
+    block_mig_state.max_inflight = migrate_block_max_inflight();
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
@@ -397,7 +459,9 @@ static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f, int is_async)
     return ret;
 }
 
-static void flush_blks(QEMUFile* f)
+/* Send the blocks whose read has completed; once the guest is stopped
+   (force), all of them regardless of the rate limit.  */
+static void flush_blks(QEMUFile* f, int force)
 {
     BlkMigBlock *blk;
 
@@ -406,7 +470,7 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (!force && qemu_file_rate_limit(f)) {
             break;
         }
         if (blk->ret < 0) {
@@ -452,6 +516,10 @@ static int is_stage2_completed(void)
 	if (remaining_dirty == 0) {
 	    return 1;
 	}
+	if (block_mig_state.reads == 0) {
+	    /* only holes so far, no idea of the read bandwidth yet */
+	    return 0;
+	}
 
 	bwidth = compute_read_bwidth();
 
@@ -511,7 +579,7 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         set_dirty_tracking(1);
     }
 
-    flush_blks(f);
+    flush_blks(f, stage == 3);
 
     if (qemu_file_has_error(f)) {
         blk_mig_cleanup(mon);
@@ -521,10 +589,13 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     blk_mig_reset_dirty_cursor();
 
     if (stage == 2) {
-        /* control the rate of transfer */
-        while ((block_mig_state.submitted +
+        /* Keep up to max_inflight reads going, as long as their data fits
+           in the transfer window.  What completed is sent on the next
+           call, which tops the window up again.  */
+        while (block_mig_state.submitted < block_mig_state.max_inflight &&
+               (block_mig_state.submitted +
                 block_mig_state.read_done) * BLOCK_SIZE <
-               qemu_file_get_rate_limit(f)) {
+               qemu_file_get_rate_limit(f) && !qemu_file_rate_limit(f)) {
             if (block_mig_state.bulk_completed == 0) {
                 /* first finish the bulk phase */
                 if (blk_mig_save_bulked_block(mon, f) == 0) {
@@ -539,7 +610,7 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
             }
         }
 
-        flush_blks(f);
+        flush_blks(f, 0);
 
         if (qemu_file_has_error(f)) {
             blk_mig_cleanup(mon);
@@ -570,12 +641,73 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     return ((stage == 2) && is_stage2_completed());
 }
 
+static BlockDriverState *blk_load_device(QEMUFile *f)
+{
+    char device_name[256];
+    BlockDriverState *bs;
+    int len;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)device_name, len);
+    device_name[len] = '\0';
+
+    bs = bdrv_find(device_name);
+    if (!bs) {
+        fprintf(stderr, "Error unknown block device %s\n", device_name);
+    }
+    return bs;
+}
+
+/* Return how many of the nr_sectors sectors from sector_num on are
+   within the device, or -1 if sector_num is past its end.  */
+static int64_t blk_load_clamp(BlockDriverState *bs, int64_t sector_num,
+                              int64_t nr_sectors)
+{
+    int64_t total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+
+    if (sector_num < 0 || sector_num >= total_sectors) {
+        return -1;
+    }
+    return MIN(nr_sectors, total_sectors - sector_num);
+}
+
+/* Zero nr_sectors sectors from sector_num on.  Ranges that are already
+   unallocated in an image without a backing file read as zeros, and
+   are left alone so that a thin image stays thin.  */
+static int blk_load_zeros(BlockDriverState *bs, int64_t sector_num,
+                          int64_t nr_sectors)
+{
+    static uint8_t *zero_buf;
+    int64_t end = sector_num + nr_sectors;
+    int n, ret;
+
+    while (sector_num < end) {
+        n = MIN(end - sector_num, BDRV_SECTORS_PER_DIRTY_CHUNK);
+        if (!bs->backing_hd &&
+            !bdrv_is_allocated(bs, sector_num, n, &n) && n > 0) {
+            sector_num += n;
+            continue;
+        }
+        if (n <= 0) {
+            n = MIN(end - sector_num, BDRV_SECTORS_PER_DIRTY_CHUNK);
+        }
+        if (!zero_buf) {
+            zero_buf = qemu_mallocz(BLOCK_SIZE);
+        }
+        ret = bdrv_write(bs, sector_num, zero_buf, n);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += n;
+    }
+    return 0;
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
-    int len, flags;
-    char device_name[256];
-    int64_t addr;
+    int flags, ret;
+    int64_t addr, nr_sectors;
     BlockDriverState *bs;
     uint8_t *buf;
 
@@ -586,24 +718,41 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
         addr >>= BDRV_SECTOR_BITS;
 
         if (flags & BLK_MIG_FLAG_DEVICE_BLOCK) {
-            /* get device name */
-            len = qemu_get_byte(f);
-            qemu_get_buffer(f, (uint8_t *)device_name, len);
-            device_name[len] = '\0';
-
-            bs = bdrv_find(device_name);
+            bs = blk_load_device(f);
             if (!bs) {
-                fprintf(stderr, "Error unknown block device %s\n",
-                        device_name);
+                return -EINVAL;
+            }
+            /* the last chunk of a device may be short */
+            nr_sectors = blk_load_clamp(bs, addr,
+                                        BDRV_SECTORS_PER_DIRTY_CHUNK);
+            if (nr_sectors < 0) {
                 return -EINVAL;
             }
 
-            buf = qemu_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            bdrv_write(bs, addr, buf, BDRV_SECTORS_PER_DIRTY_CHUNK);
-
-            qemu_free(buf);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = blk_load_zeros(bs, addr, nr_sectors);
+            } else {
+                buf = qemu_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+                qemu_free(buf);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (flags & BLK_MIG_FLAG_ZERO_RANGE) {
+            bs = blk_load_device(f);
+            if (!bs) {
+                return -EINVAL;
+            }
+            nr_sectors = qemu_get_be32(f);
+            if (blk_load_clamp(bs, addr, nr_sectors) != nr_sectors) {
+                return -EINVAL;
+            }
+            ret = blk_load_zeros(bs, addr, nr_sectors);
+            if (ret < 0) {
+                return ret;
+            }
         } else if (flags & BLK_MIG_FLAG_PROGRESS) {
             if (!banner_printed) {
                 printf("Receiving block device images\n");
@@ -638,6 +787,6 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
 
-    register_savevm_live("block", 0, 1, block_set_params, block_save_live,
+    register_savevm_live("block", 0, 2, block_set_params, block_save_live,
                          NULL, block_load, &block_mig_state);
 }
@@ -0,0 +1,395 @@
+/*
+ * Background streaming of backing file data into an image
+ *
+ * A stream job reads all ranges that the image does not have yet with
+ * copy-on-read enabled, so that the data of the whole backing chain ends
+ * up in the image.  One read is in flight at a time; the next one is
+ * started from a vm_clock timer, which keeps the job at its speed limit
+ * and pauses it while the VM is stopped.  Once the image is complete, the
+ * backing file is closed and the image header no longer refers to it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "qemu-queue.h"
+#include "qemu-timer.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "monitor.h"
+#include "block-stream.h"
+
+#define STREAM_CHUNK_SECTORS 2048
+
+typedef struct BlockStreamState {
+    BlockDriverState *bs;
+    int64_t sector_num;     /* the image has everything before it */
+    int64_t total_sectors;
+    int64_t speed;          /* bytes per second, 0 for no limit */
+    int64_t next_time;      /* vm_clock time from which on a read may start */
+    int cancelled;
+    int nb_sectors;         /* size of the read in flight */
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    BlockDriverAIOCB *aiocb;
+    QEMUTimer *timer;
+    QLIST_ENTRY(BlockStreamState) entry;
+} BlockStreamState;
+
+static QLIST_HEAD(, BlockStreamState) block_streams =
+    QLIST_HEAD_INITIALIZER(block_streams);
+
+static BlockStreamState *block_stream_find(BlockDriverState *bs)
+{
+    BlockStreamState *s;
+
+    QLIST_FOREACH(s, &block_streams, entry) {
+        if (s->bs == bs) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+int block_stream_active(BlockDriverState *bs)
+{
+    return block_stream_find(bs) != NULL;
+}
+
+static void block_stream_end(BlockStreamState *s)
+{
+    QLIST_REMOVE(s, entry);
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    bdrv_disable_copy_on_read(s->bs);
+    qemu_vfree(s->buf);
+    qemu_free(s);
+}
+
+static void block_stream_fail(BlockStreamState *s, int ret)
+{
+    error_report("streaming into '%s' failed: %s",
+                 bdrv_get_device_name(s->bs), strerror(-ret));
+    block_stream_end(s);
+}
+
+/*
+ * Returns the first sector from sector_num on that the image does not have,
+ * or total_sectors if there is none, and sets *pnum to the number of such
+ * sectors from there on, at most STREAM_CHUNK_SECTORS.
+ */
+static int64_t block_stream_next(BlockStreamState *s, int64_t sector_num,
+                                 int *pnum)
+{
+    int allocated;
+
+    *pnum = 0;
+    while (sector_num < s->total_sectors) {
+        allocated = bdrv_is_allocated(s->bs, sector_num,
+                                      MIN(STREAM_CHUNK_SECTORS,
+                                          s->total_sectors - sector_num),
+                                      pnum);
+        if (*pnum <= 0) {
+            return -EIO;
+        }
+        if (!allocated) {
+            break;
+        }
+        sector_num += *pnum;
+    }
+    return sector_num;
+}
+
+/*
+ * Called once the whole image has been read.  Guest requests may still
+ * read from the backing file, and the image may have lost data since it
+ * was read (loadvm), so wait for the requests and look at the image
+ * again before the backing file goes away.
+ */
+static void block_stream_complete(BlockStreamState *s)
+{
+    BlockDriverState *bs = s->bs;
+    int64_t sector_num;
+    int n, ret;
+
+    qemu_aio_flush();
+
+    sector_num = block_stream_next(s, 0, &n);
+    if (sector_num < 0) {
+        block_stream_fail(s, sector_num);
+        return;
+    }
+    if (sector_num < s->total_sectors) {
+        s->sector_num = sector_num;
+        qemu_mod_timer(s->timer, qemu_get_clock(vm_clock));
+        return;
+    }
+
+    /* the copied data must be stable before the header drops the link */
+    bdrv_flush(bs);
+    ret = bdrv_change_backing_file(bs, NULL, NULL);
+    if (ret < 0) {
+        block_stream_fail(s, ret);
+        return;
+    }
+
+    bdrv_delete(bs->backing_hd);
+    bs->backing_hd = NULL;
+    bs->backing_file[0] = '\0';
+    bs->backing_format[0] = '\0';
+
+    block_stream_end(s);
+}
+
+static void block_stream_read_cb(void *opaque, int ret)
+{
+    BlockStreamState *s = opaque;
+
+    s->aiocb = NULL;
+    if (s->cancelled) {
+        block_stream_end(s);
+        return;
+    }
+    if (ret < 0) {
+        block_stream_fail(s, ret);
+        return;
+    }
+
+    s->sector_num += s->nb_sectors;
+
+    /* start the next read from the main loop, not from qemu_aio_flush() */
+    qemu_mod_timer(s->timer, qemu_get_clock(vm_clock));
+}
+
+static void block_stream_run(void *opaque)
+{
+    BlockStreamState *s = opaque;
+    int64_t now = qemu_get_clock(vm_clock);
+    int64_t sector_num;
+    int n;
+
+    if (s->speed && now < s->next_time) {
+        qemu_mod_timer(s->timer, s->next_time);
+        return;
+    }
+
+    sector_num = block_stream_next(s, s->sector_num, &n);
+    if (sector_num < 0) {
+        block_stream_fail(s, sector_num);
+        return;
+    }
+    s->sector_num = sector_num;
+    if (sector_num == s->total_sectors) {
+        block_stream_complete(s);
+        return;
+    }
+
+    s->nb_sectors = n;
+    s->iov.iov_base = s->buf;
+    s->iov.iov_len = n * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&s->qiov, &s->iov, 1);
+
+    s->aiocb = bdrv_aio_readv(s->bs, sector_num, &s->qiov, n,
+                              block_stream_read_cb, s);
+    if (!s->aiocb) {
+        block_stream_fail(s, -EIO);
+        return;
+    }
+
+    if (s->speed) {
+        s->next_time = now + (int64_t)n * BDRV_SECTOR_SIZE *
+                             get_ticks_per_sec() / s->speed;
+    }
+}
+
+/*
+ * Stops the job on bs, if any, before the device goes away.
+ */
+void block_stream_abort(BlockDriverState *bs)
+{
+    BlockStreamState *s = block_stream_find(bs);
+
+    if (!s) {
+        return;
+    }
+
+    if (s->aiocb) {
+        /* the read callback ends the job */
+        s->cancelled = 1;
+        qemu_aio_flush();
+    } else {
+        block_stream_end(s);
+    }
+}
+
+static int block_stream_get_speed(const QDict *qdict, const char *key,
+                                  int64_t *speed)
+{
+    double d;
+
+    d = qdict_get_double(qdict, key);
+    if (d < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, key,
+                      "a non-negative speed");
+        return -1;
+    }
+    *speed = MIN(INT64_MAX, d);
+    return 0;
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    BlockStreamState *s;
+    int64_t speed = 0;
+    char format[32];
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        qerror_report(QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return -1;
+    }
+    if (bdrv_is_read_only(bs)) {
+        qerror_report(QERR_DEVICE_IS_READ_ONLY, device);
+        return -1;
+    }
+    if (block_stream_active(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+    if (qdict_haskey(qdict, "speed") &&
+        block_stream_get_speed(qdict, "speed", &speed) < 0) {
+        return -1;
+    }
+
+    /* nothing to do without a backing file */
+    if (!bs->backing_hd) {
+        return 0;
+    }
+
+    /* copy-on-read and dropping the backing file come together (qcow2) */
+    if (!bs->drv->bdrv_change_backing_file) {
+        bdrv_get_format(bs, format, sizeof(format));
+        qerror_report(QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED, format,
+                      device, "streaming");
+        return -1;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->bs = bs;
+    s->total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    s->speed = speed;
+    s->buf = qemu_blockalign(bs, STREAM_CHUNK_SECTORS * BDRV_SECTOR_SIZE);
+    s->timer = qemu_new_timer(vm_clock, block_stream_run, s);
+    QLIST_INSERT_HEAD(&block_streams, s, entry);
+
+    bdrv_enable_copy_on_read(bs);
+    qemu_mod_timer(s->timer, qemu_get_clock(vm_clock));
+
+    return 0;
+}
+
+int do_block_stream_set_speed(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    BlockStreamState *s;
+    int64_t speed;
+
+    bs = bdrv_find(device);
+    s = bs ? block_stream_find(bs) : NULL;
+    if (!s) {
+        qerror_report(QERR_BLOCK_STREAM_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (block_stream_get_speed(qdict, "value", &speed) < 0) {
+        return -1;
+    }
+
+    s->speed = speed;
+    s->next_time = 0;
+    if (!s->aiocb && !s->cancelled) {
+        qemu_mod_timer(s->timer, qemu_get_clock(vm_clock));
+    }
+
+    return 0;
+}
+
+int do_block_stream_cancel(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    BlockStreamState *s;
+
+    bs = bdrv_find(device);
+    s = bs ? block_stream_find(bs) : NULL;
+    if (!s || s->cancelled) {
+        qerror_report(QERR_BLOCK_STREAM_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    if (s->aiocb) {
+        /* the read callback ends the job */
+        s->cancelled = 1;
+    } else {
+        block_stream_end(s);
+    }
+
+    return 0;
+}
+
+static void block_stream_print_iter(QObject *data, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "Streaming device %s: Completed %" PRId64
+                        " of %" PRId64 " bytes, speed limit %" PRId64
+                        " bytes/s\n",
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_int(qdict, "offset"),
+                   qdict_get_int(qdict, "len"),
+                   qdict_get_int(qdict, "speed"));
+}
+
+void do_info_block_stream_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active stream\n");
+        return;
+    }
+    qlist_iter(list, block_stream_print_iter, mon);
+}
+
+void do_info_block_stream(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    BlockStreamState *s;
+
+    QLIST_FOREACH(s, &block_streams, entry) {
+        qlist_append_obj(list, qobject_from_jsonf(
+            "{ 'device': %s, 'offset': %" PRId64 ", 'len': %" PRId64 ", "
+            "'speed': %" PRId64 " }",
+            bdrv_get_device_name(s->bs),
+            s->sector_num << BDRV_SECTOR_BITS,
+            s->total_sectors << BDRV_SECTOR_BITS,
+            s->speed));
+    }
+
+    *ret_data = QOBJECT(list);
+}
@@ -0,0 +1,27 @@
+/*
+ * Background streaming of backing file data into an image
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef BLOCK_STREAM_H
+#define BLOCK_STREAM_H
+
+#include "block.h"
+#include "qdict.h"
+#include "qobject.h"
+
+int block_stream_active(BlockDriverState *bs);
+void block_stream_abort(BlockDriverState *bs);
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_stream_set_speed(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+int do_block_stream_cancel(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data);
+void do_info_block_stream_print(Monitor *mon, const QObject *data);
+void do_info_block_stream(Monitor *mon, QObject **ret_data);
+
+#endif /* BLOCK_STREAM_H */
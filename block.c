@@ -397,6 +397,7 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     bs->encrypted = 0;
     bs->valid_key = 0;
     bs->open_flags = flags;
+    bs->copy_on_read = 0;
     /* buffer_alignment defaulted to 512, drivers can change this value */
     bs->buffer_alignment = 512;
 
@@ -422,7 +423,8 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
      * Clear flags that are internal to the block layer before opening the
      * image.
      */
-    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                           BDRV_O_COPY_ON_READ);
 
     /*
      * Snapshots should be writeable.
@@ -447,6 +449,10 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
 
     bs->keep_read_only = bs->read_only = !(open_flags & BDRV_O_RDWR);
 
+    if ((flags & BDRV_O_COPY_ON_READ) && !bs->read_only) {
+        bdrv_enable_copy_on_read(bs);
+    }
+
     ret = refresh_total_sectors(bs, bs->total_sectors);
     if (ret < 0) {
         goto free_and_fail;
@@ -588,8 +594,8 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
             back_drv = bdrv_find_format(bs->backing_format);
 
         /* backing files always opened read-only */
-        back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+        back_flags = flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT |
+                               BDRV_O_NO_BACKING | BDRV_O_COPY_ON_READ);
 
         ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
         if (ret < 0) {
@@ -897,6 +903,86 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
+/* number of sectors written at once by the bdrv_write_zeroes fallback */
+#define BDRV_WRITE_ZEROES_CHUNK 128
+
+/*
+ * Make the given sectors read as zeroes. Drivers that can do this without
+ * writing data (e.g. by updating their metadata) implement bdrv_write_zeroes;
+ * others, or a driver returning -ENOTSUP, get a buffer of zeroes written.
+ */
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+    uint8_t *buf;
+    int n, ret;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (drv->bdrv_write_zeroes) {
+        if (bs->dirty_bitmap) {
+            set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+        }
+        if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
+            bs->wr_highest_sector = sector_num + nb_sectors - 1;
+        }
+
+        ret = drv->bdrv_write_zeroes(bs, sector_num, nb_sectors);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
+    n = MIN(nb_sectors, BDRV_WRITE_ZEROES_CHUNK);
+    buf = qemu_mallocz(n * BDRV_SECTOR_SIZE);
+    ret = 0;
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, BDRV_WRITE_ZEROES_CHUNK);
+        ret = bdrv_write(bs, sector_num, buf, n);
+        if (ret < 0) {
+            break;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    qemu_free(buf);
+
+    return ret;
+}
+
+/*
+ * Tell the driver that the given sectors are no longer in use. Their
+ * content is undefined afterwards; drivers may free the space they occupy.
+ * This is only a hint, so drivers without support succeed doing nothing.
+ */
+int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (!drv->bdrv_discard) {
+        return 0;
+    }
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    return drv->bdrv_discard(bs, sector_num, nb_sectors);
+}
+
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count1)
 {
@@ -1178,6 +1264,28 @@ void bdrv_set_translation_hint(BlockDriverState *bs, int translation)
     bs->translation = translation;
 }
 
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t size)
+{
+    bs->metadata_cache_size = size;
+}
+
+/*
+ * While copy-on-read is enabled, reads of data that comes from the backing
+ * file also store it in the image, so that later reads are served locally.
+ * Only formats with backing files implement it (currently qcow2).  Calls
+ * nest, copying stops after the last bdrv_disable_copy_on_read().
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    bs->copy_on_read++;
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
 void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs)
 {
@@ -1323,6 +1431,17 @@ void bdrv_flush(BlockDriverState *bs)
         bs->drv->bdrv_flush(bs);
 }
 
+/* Writes back whatever the format drivers still cache and closes all
+   images, e.g. when qemu exits */
+void bdrv_close_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        bdrv_close(bs);
+    }
+}
+
 void bdrv_flush_all(void)
 {
     BlockDriverState *bs;
@@ -0,0 +1,791 @@
+/*
+ * L2/refcount table cache for the QCOW2 format
+ *
+ * Tables are one cluster each and are looked up by their offset in the
+ * image file.  Unused tables are evicted in LRU order.  Modified tables
+ * stay in memory until they are evicted or the cache is flushed (or, in
+ * writethrough mode, until the caller releases them), and only their
+ * dirty sectors are written back.
+ *
+ * A cache can depend on another one: before any of its tables is written,
+ * the other cache is flushed.  This is how refcount increases reach the
+ * disk before the L2 entries that point to the new clusters, and L2
+ * entries are dropped before the refcounts of the clusters they pointed
+ * to are decreased.
+ *
+ * Request paths can prefetch a table with AIO instead of blocking on a
+ * miss.  The table is read into a separate buffer and only enters the
+ * cache when the read has completed, so the synchronous users of the
+ * cache never see a table that is still being read.  A prefetched table
+ * only replaces a clean entry; if there is none, the cache is written
+ * back with AIO first.
+ *
+ * Request paths can also write back the dirty tables with AIO.  The dirty
+ * part of each table is copied when its write is issued, and the entry is
+ * not evicted until the write has completed.  Synchronous writes of the
+ * same table wait for it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+typedef struct Qcow2CachedTable {
+    int64_t offset;             /* 0 if the entry is unused */
+    uint64_t lru;               /* value of lru_counter at the last use */
+    int ref;
+    int dirty;
+    int dirty_start;            /* dirty byte range in the table */
+    int dirty_end;
+    int writing;                /* an AIO write of the table is in flight */
+    int next;                   /* next entry in the hash chain, or -1 */
+} Qcow2CachedTable;
+
+typedef struct Qcow2CacheWaiter {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QLIST_ENTRY(Qcow2CacheWaiter) next;
+} Qcow2CacheWaiter;
+
+typedef struct Qcow2CachePrefetch {
+    BlockDriverState *bs;
+    Qcow2Cache *cache;
+    int64_t offset;
+    void *buf;
+    int stale;                  /* the table was written meanwhile */
+    struct iovec iov;
+    QEMUIOVector qiov;
+    QLIST_HEAD(, Qcow2CacheWaiter) waiters;
+    QLIST_ENTRY(Qcow2CachePrefetch) next;
+} Qcow2CachePrefetch;
+
+typedef struct Qcow2CacheFlush {
+    BlockDriverState *bs;
+    Qcow2Cache *cache;
+    Qcow2Cache *depends;        /* the dependency that is being flushed */
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    int pending;                /* writes in flight, plus one while issuing */
+    int written;
+    int ret;
+    QLIST_ENTRY(Qcow2CacheFlush) next;
+} Qcow2CacheFlush;
+
+typedef struct Qcow2CacheWrite {
+    Qcow2CacheFlush *flush;
+    int index;
+    int start;
+    int end;
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} Qcow2CacheWrite;
+
+struct Qcow2Cache {
+    Qcow2CachedTable *entries;
+    uint8_t *tables;
+    int *hash;                  /* first entry of each chain, or -1 */
+    int hash_mask;
+    int size;
+    int table_bits;
+    struct Qcow2Cache *depends;
+    int depends_on_flush;
+    int writethrough;
+    uint64_t lru_counter;
+    QLIST_HEAD(, Qcow2CachePrefetch) prefetches;
+    int writes_in_flight;
+    int nb_flushes;             /* AIO flushes that have not completed */
+    /* AIO flushes waiting for the writes in flight before they issue theirs */
+    QLIST_HEAD(, Qcow2CacheFlush) flush_waiters;
+};
+
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + ((size_t)i << c->table_bits);
+}
+
+static inline int qcow2_cache_hash(Qcow2Cache *c, int64_t offset)
+{
+    return (offset >> c->table_bits) & c->hash_mask;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int writethrough)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int i, hash_size;
+
+    hash_size = 1;
+    while (hash_size < num_tables) {
+        hash_size <<= 1;
+    }
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->table_bits = s->cluster_bits;
+    c->writethrough = writethrough;
+    c->entries = qemu_mallocz(num_tables * sizeof(*c->entries));
+    c->tables = qemu_blockalign(bs, (size_t)num_tables << c->table_bits);
+    c->hash = qemu_malloc(hash_size * sizeof(*c->hash));
+    c->hash_mask = hash_size - 1;
+    for (i = 0; i < hash_size; i++) {
+        c->hash[i] = -1;
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].next = -1;
+    }
+    QLIST_INIT(&c->prefetches);
+    QLIST_INIT(&c->flush_waiters);
+
+    return c;
+}
+
+/* The caller must flush the cache first if it holds dirty tables */
+void qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    /* the completion of a prefetch or a write still refers to the cache */
+    while (!QLIST_EMPTY(&c->prefetches) || c->nb_flushes > 0) {
+        qemu_aio_wait();
+    }
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+    }
+
+    qemu_vfree(c->tables);
+    qemu_free(c->entries);
+    qemu_free(c->hash);
+    qemu_free(c);
+}
+
+/* A prefetch of offset that is in flight would now return outdated data */
+static void qcow2_cache_invalidate_prefetch(Qcow2Cache *c, int64_t offset)
+{
+    Qcow2CachePrefetch *p;
+
+    QLIST_FOREACH(p, &c->prefetches, next) {
+        if (p->offset == offset) {
+            p->stale = 1;
+        }
+    }
+}
+
+static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret;
+
+    ret = qcow2_cache_flush(bs, c->depends);
+    if (ret < 0) {
+        return ret;
+    }
+
+    c->depends = NULL;
+    c->depends_on_flush = 0;
+
+    return 0;
+}
+
+/* Returns 1 if the table was written, 0 if it was clean, -errno on error */
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *e = &c->entries[i];
+    int start, end, ret;
+
+    /* two writes of the table in flight could complete in any order */
+    while (e->writing) {
+        qemu_aio_wait();
+    }
+
+    if (!e->dirty) {
+        return 0;
+    }
+
+    if (c->depends) {
+        ret = qcow2_cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (c->depends_on_flush) {
+        if (!c->writethrough) {
+            bdrv_flush(bs->file);
+        }
+        c->depends_on_flush = 0;
+    }
+
+    if (c == s->refcount_block_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+    } else if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    }
+
+    /* whole sectors, so that bdrv_pwrite does not read-modify-write */
+    start = e->dirty_start & ~511;
+    end = (e->dirty_end + 511) & ~511;
+    ret = bdrv_pwrite(bs->file, e->offset + start,
+                      (uint8_t *)qcow2_cache_table(c, i) + start, end - start);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_invalidate_prefetch(c, e->offset);
+
+    e->dirty = 0;
+    return 1;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int result = 0, written = 0;
+    int ret, i;
+
+    /* tables that are written with AIO are only stable when it completes */
+    while (c->writes_in_flight > 0) {
+        qemu_aio_wait();
+    }
+
+    for (i = 0; i < c->size; i++) {
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret < 0 && result != -ENOSPC) {
+            result = ret;
+        } else if (ret > 0) {
+            written = 1;
+        }
+    }
+
+    /* In writethrough mode the writes are already stable */
+    if (result == 0 && written && !c->writethrough) {
+        bdrv_flush(bs->file);
+    }
+
+    return result;
+}
+
+/* Nonzero if no table is dirty or being written */
+int qcow2_cache_is_clean(Qcow2Cache *c)
+{
+    int i;
+
+    if (c->writes_in_flight > 0) {
+        return 0;
+    }
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void qcow2_cache_flush_async_start(Qcow2CacheFlush *f);
+
+static void qcow2_cache_flush_async_done(void *opaque, int ret)
+{
+    Qcow2CacheFlush *f = opaque;
+
+    f->cache->nb_flushes--;
+    f->cb(f->opaque, ret);
+    qemu_free(f);
+}
+
+/* Drops a reference to f, completing it once all writes have completed */
+static void qcow2_cache_flush_async_release(Qcow2CacheFlush *f)
+{
+    if (--f->pending > 0) {
+        return;
+    }
+
+    /* In writethrough mode the writes are already stable */
+    if (f->ret == 0 && f->written && !f->cache->writethrough &&
+        bdrv_aio_flush(f->bs->file, qcow2_cache_flush_async_done, f)) {
+        return;
+    }
+    qcow2_cache_flush_async_done(f, f->ret);
+}
+
+static void qcow2_cache_write_cb(void *opaque, int ret)
+{
+    Qcow2CacheWrite *w = opaque;
+    Qcow2CacheFlush *f = w->flush;
+    Qcow2Cache *c = f->cache;
+    Qcow2CachedTable *e = &c->entries[w->index];
+
+    e->writing = 0;
+    c->writes_in_flight--;
+    if (ret < 0) {
+        qcow2_cache_entry_mark_dirty(c, qcow2_cache_table(c, w->index),
+                                     w->start, w->end - w->start);
+        f->ret = ret;
+    } else {
+        qcow2_cache_invalidate_prefetch(c, e->offset);
+        f->written = 1;
+    }
+    qemu_vfree(w->buf);
+    qemu_free(w);
+    qcow2_cache_flush_async_release(f);
+
+    /* let the next flush issue its writes */
+    if (c->writes_in_flight == 0 && !QLIST_EMPTY(&c->flush_waiters)) {
+        f = QLIST_FIRST(&c->flush_waiters);
+        QLIST_REMOVE(f, next);
+        qcow2_cache_flush_async_start(f);
+    }
+}
+
+static void qcow2_cache_entry_write_async(Qcow2CacheFlush *f, int i)
+{
+    BlockDriverState *bs = f->bs;
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c = f->cache;
+    Qcow2CachedTable *e = &c->entries[i];
+    Qcow2CacheWrite *w;
+
+    if (c == s->refcount_block_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+    } else if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    }
+
+    /* the table may change while the write is in flight */
+    w = qemu_malloc(sizeof(*w));
+    w->flush = f;
+    w->index = i;
+    w->start = e->dirty_start & ~511;
+    w->end = (e->dirty_end + 511) & ~511;
+    w->buf = qemu_blockalign(bs, w->end - w->start);
+    memcpy(w->buf, (uint8_t *)qcow2_cache_table(c, i) + w->start,
+           w->end - w->start);
+    w->iov.iov_base = w->buf;
+    w->iov.iov_len = w->end - w->start;
+    qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+
+    e->dirty = 0;
+    e->writing = 1;
+    c->writes_in_flight++;
+    f->pending++;
+    if (!bdrv_aio_writev(bs->file, (e->offset + w->start) >> 9, &w->qiov,
+                         (w->end - w->start) >> 9, qcow2_cache_write_cb, w)) {
+        qcow2_cache_write_cb(w, -EIO);
+    }
+}
+
+static void qcow2_cache_flush_async_dependency_cb(void *opaque, int ret)
+{
+    Qcow2CacheFlush *f = opaque;
+    Qcow2Cache *c = f->cache;
+
+    if (ret < 0) {
+        qcow2_cache_flush_async_done(f, ret);
+        return;
+    }
+
+    /* the dependency may have been modified again meanwhile */
+    if (c->depends == f->depends && qcow2_cache_is_clean(f->depends)) {
+        c->depends = NULL;
+        c->depends_on_flush = 0;
+    }
+    f->depends = NULL;
+    qcow2_cache_flush_async_start(f);
+}
+
+static void qcow2_cache_flush_async_barrier_cb(void *opaque, int ret)
+{
+    Qcow2CacheFlush *f = opaque;
+
+    if (ret < 0) {
+        qcow2_cache_flush_async_done(f, ret);
+        return;
+    }
+    qcow2_cache_flush_async_start(f);
+}
+
+static void qcow2_cache_flush_async_start(Qcow2CacheFlush *f)
+{
+    Qcow2Cache *c = f->cache;
+    int i;
+
+    if (c->depends) {
+        f->depends = c->depends;
+        qcow2_cache_flush_async(f->bs, c->depends,
+                                qcow2_cache_flush_async_dependency_cb, f);
+        return;
+    }
+    if (c->depends_on_flush) {
+        c->depends_on_flush = 0;
+        if (!c->writethrough) {
+            if (bdrv_aio_flush(f->bs->file, qcow2_cache_flush_async_barrier_cb,
+                               f)) {
+                return;
+            }
+            bdrv_flush(f->bs->file);
+        }
+    }
+
+    /* a table must not be written twice at the same time */
+    if (c->writes_in_flight > 0) {
+        QLIST_INSERT_HEAD(&c->flush_waiters, f, next);
+        return;
+    }
+
+    f->pending = 1;
+    for (i = 0; i < c->size && f->ret == 0; i++) {
+        if (c->entries[i].dirty) {
+            qcow2_cache_entry_write_async(f, i);
+        }
+    }
+    qcow2_cache_flush_async_release(f);
+}
+
+/*
+ * Writes the dirty tables like qcow2_cache_flush, but with AIO.  cb is
+ * called when they are stable, or with the first error.
+ */
+void qcow2_cache_flush_async(BlockDriverState *bs, Qcow2Cache *c,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Qcow2CacheFlush *f;
+
+    f = qemu_mallocz(sizeof(*f));
+    f->bs = bs;
+    f->cache = c;
+    f->cb = cb;
+    f->opaque = opaque;
+    c->nb_flushes++;
+    qcow2_cache_flush_async_start(f);
+}
+
+int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2Cache *dependency)
+{
+    int ret;
+
+    /* dependency must not wait for anything itself, or we might loop */
+    if (dependency->depends) {
+        ret = qcow2_cache_flush_dependency(bs, dependency);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (c->depends && c->depends != dependency) {
+        ret = qcow2_cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    c->depends = dependency;
+    return 0;
+}
+
+void qcow2_cache_depends_on_flush(Qcow2Cache *c)
+{
+    c->depends_on_flush = 1;
+}
+
+int qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
+    int writethrough)
+{
+    int old = c->writethrough;
+
+    /* writethrough means that the image file itself is writethrough, so
+       the tables are stable once they are written */
+    c->writethrough = writethrough;
+    if (!old && writethrough) {
+        qcow2_cache_flush(bs, c);
+    }
+
+    return old;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, int64_t offset)
+{
+    int i;
+
+    for (i = c->hash[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_unlink(Qcow2Cache *c, int i)
+{
+    int *p;
+
+    for (p = &c->hash[qcow2_cache_hash(c, c->entries[i].offset)]; *p != i;
+         p = &c->entries[*p].next) {
+    }
+    *p = c->entries[i].next;
+    c->entries[i].next = -1;
+    c->entries[i].offset = 0;
+}
+
+static void qcow2_cache_link(Qcow2Cache *c, int i, int64_t offset)
+{
+    int h = qcow2_cache_hash(c, offset);
+
+    c->entries[i].offset = offset;
+    c->entries[i].next = c->hash[h];
+    c->hash[h] = i;
+}
+
+/*
+ * The least recently used entry that nobody holds a reference to and that
+ * is not being written, or -1 if there is none.  Unless dirty is set, only
+ * clean entries are considered.
+ */
+static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c, int dirty)
+{
+    uint64_t min_lru = UINT64_MAX;
+    int i, min_index = -1;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].ref || c->entries[i].writing ||
+            (c->entries[i].dirty && !dirty)) {
+            continue;
+        }
+        if (c->entries[i].offset == 0) {
+            return i;
+        }
+        if (c->entries[i].lru < min_lru) {
+            min_lru = c->entries[i].lru;
+            min_index = i;
+        }
+    }
+
+    return min_index;
+}
+
+static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
+    int64_t offset, void **table, int read_from_disk)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
+
+    /* callers hold at most a few tables at a time, the others can only be
+       busy being written */
+    while ((i = qcow2_cache_find_entry_to_replace(c, 1)) < 0) {
+        assert(c->writes_in_flight > 0);
+        qemu_aio_wait();
+    }
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+    if (c->entries[i].offset) {
+        qcow2_cache_unlink(c, i);
+    }
+
+    if (read_from_disk) {
+        if (c == s->l2_table_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+        } else if (c == s->refcount_block_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
+        }
+
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         1 << c->table_bits);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    qcow2_cache_link(c, i, offset);
+    qcow2_cache_invalidate_prefetch(c, offset);
+
+found:
+    c->entries[i].ref++;
+    c->entries[i].lru = ++c->lru_counter;
+    *table = qcow2_cache_table(c, i);
+    return 0;
+}
+
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, 1);
+}
+
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, 0);
+}
+
+static inline int qcow2_cache_index(Qcow2Cache *c, void *table)
+{
+    return ((uint8_t *)table - c->tables) >> c->table_bits;
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = qcow2_cache_index(c, *table);
+
+    assert(c->entries[i].ref > 0);
+    c->entries[i].ref--;
+    *table = NULL;
+
+    if (c->writethrough) {
+        int ret = qcow2_cache_entry_flush(bs, c, i);
+        return ret < 0 ? ret : 0;
+    }
+
+    return 0;
+}
+
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table, int start,
+    int len)
+{
+    Qcow2CachedTable *e = &c->entries[qcow2_cache_index(c, table)];
+
+    if (!e->dirty) {
+        e->dirty = 1;
+        e->dirty_start = start;
+        e->dirty_end = start + len;
+    } else {
+        e->dirty_start = MIN(e->dirty_start, start);
+        e->dirty_end = MAX(e->dirty_end, start + len);
+    }
+}
+
+/*
+ * Adds a prefetched table in place of a clean entry, which needs no write.
+ * Returns -1 if all entries are dirty or in use.
+ */
+static int qcow2_cache_insert_prefetched(Qcow2Cache *c, Qcow2CachePrefetch *p)
+{
+    int i;
+
+    if (p->stale || qcow2_cache_lookup(c, p->offset) >= 0) {
+        return 0;
+    }
+    i = qcow2_cache_find_entry_to_replace(c, 0);
+    if (i < 0) {
+        return -1;
+    }
+    if (c->entries[i].offset) {
+        qcow2_cache_unlink(c, i);
+    }
+    memcpy(qcow2_cache_table(c, i), p->buf, 1 << c->table_bits);
+    qcow2_cache_link(c, i, p->offset);
+    c->entries[i].lru = ++c->lru_counter;
+    return 0;
+}
+
+static void qcow2_cache_prefetch_done(Qcow2CachePrefetch *p, int ret)
+{
+    Qcow2CacheWaiter *w, *next;
+
+    QLIST_REMOVE(p, next);
+
+    /* If the table could not be added, the waiters load it themselves */
+    QLIST_FOREACH_SAFE(w, &p->waiters, next, next) {
+        w->cb(w->opaque, ret);
+        qemu_free(w);
+    }
+
+    qemu_vfree(p->buf);
+    qemu_free(p);
+}
+
+static void qcow2_cache_prefetch_flush_cb(void *opaque, int ret)
+{
+    Qcow2CachePrefetch *p = opaque;
+
+    if (ret >= 0) {
+        qcow2_cache_insert_prefetched(p->cache, p);
+    }
+    qcow2_cache_prefetch_done(p, 0);
+}
+
+static void qcow2_cache_prefetch_cb(void *opaque, int ret)
+{
+    Qcow2CachePrefetch *p = opaque;
+
+    if (ret >= 0 && qcow2_cache_insert_prefetched(p->cache, p) < 0) {
+        /* Writing back a dirty entry here would block: write them all
+           with AIO and try again when they are clean */
+        qcow2_cache_flush_async(p->bs, p->cache,
+                                qcow2_cache_prefetch_flush_cb, p);
+        return;
+    }
+    qcow2_cache_prefetch_done(p, ret);
+}
+
+/*
+ * Starts reading the table at offset into the cache without blocking.
+ * Returns 0 if the table is cached already or cannot be read
+ * asynchronously; the caller can go on and get it synchronously.
+ * Returns 1 if cb will be called once the read has completed.
+ */
+int qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Qcow2CachePrefetch *p;
+    Qcow2CacheWaiter *w;
+
+    if (qcow2_cache_lookup(c, offset) >= 0) {
+        return 0;
+    }
+
+    QLIST_FOREACH(p, &c->prefetches, next) {
+        if (p->offset == offset && !p->stale) {
+            goto wait;
+        }
+    }
+
+    p = qemu_mallocz(sizeof(*p));
+    p->bs = bs;
+    p->cache = c;
+    p->offset = offset;
+    p->buf = qemu_blockalign(bs, 1 << c->table_bits);
+    p->iov.iov_base = p->buf;
+    p->iov.iov_len = 1 << c->table_bits;
+    qemu_iovec_init_external(&p->qiov, &p->iov, 1);
+    QLIST_INIT(&p->waiters);
+
+    if (!bdrv_aio_readv(bs->file, offset >> 9, &p->qiov,
+                        1 << (c->table_bits - 9),
+                        qcow2_cache_prefetch_cb, p)) {
+        qemu_vfree(p->buf);
+        qemu_free(p);
+        return 0;
+    }
+    QLIST_INSERT_HEAD(&c->prefetches, p, next);
+
+wait:
+    w = qemu_malloc(sizeof(*w));
+    w->cb = cb;
+    w->opaque = opaque;
+    QLIST_INSERT_HEAD(&p->waiters, w, next);
+    return 1;
+}
+
+/* Forgets all callbacks for opaque, e.g. when its request is cancelled */
+void qcow2_cache_prefetch_cancel(Qcow2Cache *c, void *opaque)
+{
+    Qcow2CachePrefetch *p;
+    Qcow2CacheWaiter *w, *next;
+
+    QLIST_FOREACH(p, &c->prefetches, next) {
+        QLIST_FOREACH_SAFE(w, &p->waiters, next, next) {
+            if (w->opaque == opaque) {
+                QLIST_REMOVE(w, next);
+                qemu_free(w);
+            }
+        }
+    }
+}
@@ -61,6 +61,12 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size)
         return new_l1_table_offset;
     }
 
+    /* the header must not point to the table before its refcount is set */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
     BLKDBG_EVENT(bs->file, BLKDBG_L1_GROW_WRITE_TABLE);
     for(i = 0; i < s->l1_size; i++)
         new_l1_table[i] = cpu_to_be64(new_l1_table[i]);
@@ -90,103 +96,23 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size)
     return ret < 0 ? ret : -EIO;
 }
 
-void qcow2_l2_cache_reset(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
-}
-
-static inline int l2_cache_new_entry(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    return min_index;
-}
-
-/*
- * seek_l2_table
- *
- * seek l2_offset in the l2_cache table
- * if not found, return NULL,
- * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
- *   return the pointer to the l2 cache entry
- *
- */
-
-static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
-{
-    int i, j;
-
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
-        }
-    }
-    return NULL;
-}
-
 /*
  * l2_load
  *
  * Loads a L2 table into memory. If the table is in the cache, the cache
  * is used; otherwise the L2 table is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * The table must be released with qcow2_cache_put when the caller is done
+ * with it.
  */
 
 static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
     uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
-    int ret;
-
-    /* seek if the table for the given offset is in the cache */
-
-    *l2_table = seek_l2_table(s, l2_offset);
-    if (*l2_table != NULL) {
-        return 0;
-    }
-
-    /* not found: load a new entry in the least used one */
-
-    min_index = l2_cache_new_entry(bs);
-    *l2_table = s->l2_cache + (min_index << s->l2_bits);
-
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
-    ret = bdrv_pread(bs->file, l2_offset, *l2_table,
-        s->l2_size * sizeof(uint64_t));
-    if (ret < 0) {
-        return ret;
-    }
 
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
-    return 0;
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+                           (void **)l2_table);
 }
 
 /*
@@ -229,9 +155,8 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_table = NULL, *old_table;
     int64_t l2_offset;
     int ret;
 
@@ -244,27 +169,43 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
+    /* its refcount must be on disk before the table is referenced */
+    ret = qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                     s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset,
+                                (void **)&l2_table);
+    if (ret < 0) {
+        return ret;
+    }
 
     if (old_l2_offset == 0) {
         /* if there was no old l2 table, clear the new table */
         memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
     } else {
-        /* if there was an old l2 table, read it from the disk */
+        /* if there was an old l2 table, copy it */
         BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = bdrv_pread(bs->file, old_l2_offset, l2_table,
-            s->l2_size * sizeof(uint64_t));
+        ret = l2_load(bs, old_l2_offset, &old_table);
+        if (ret < 0) {
+            goto fail;
+        }
+        memcpy(l2_table, old_table, s->l2_size * sizeof(uint64_t));
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&old_table);
         if (ret < 0) {
             goto fail;
         }
     }
+
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-    ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
-        s->l2_size * sizeof(uint64_t));
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table, 0,
+                                 s->l2_size * sizeof(uint64_t));
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
     }
@@ -273,19 +214,15 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
     ret = write_l1_entry(bs, l1_index);
     if (ret < 0) {
+        s->l1_table[l1_index] = old_l2_offset;
         goto fail;
     }
 
-    /* update the l2 cache entry */
-
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
     *table = l2_table;
     return 0;
 
 fail:
-    qcow2_l2_cache_reset(bs);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
     return ret;
 }
 
@@ -295,7 +232,7 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     int i;
     uint64_t offset = be64_to_cpu(l2_table[0]) & ~mask;
 
-    if (!offset)
+    if (!offset || qcow2_is_zero_cluster(offset))
         return 0;
 
     for (i = start; i < start + nb_clusters; i++)
@@ -315,6 +252,18 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+static int count_contiguous_zero_clusters(uint64_t nb_clusters,
+                                          uint64_t *l2_table)
+{
+    int i = 0;
+
+    while (nb_clusters-- && qcow2_is_zero_cluster(be64_to_cpu(l2_table[i]))) {
+        i++;
+    }
+
+    return i;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -371,6 +320,8 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
             } else {
                 memset(buf, 0, 512 * n);
             }
+        } else if (cluster_offset == QCOW_OFLAG_ZERO) {
+            memset(buf, 0, 512 * n);
         } else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
             if (qcow2_decompress_cluster(bs, cluster_offset) < 0)
                 return -1;
@@ -416,6 +367,9 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
                      s->cluster_data, n);
     if (ret < 0)
         return ret;
+
+    /* the copy must reach the disk before the L2 entry that points to it */
+    qcow2_cache_depends_on_flush(s->l2_table_cache);
     return 0;
 }
 
@@ -431,6 +385,9 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
  *
  * on exit, *num is the number of contiguous clusters we can read.
  *
+ * Zero clusters are returned as QCOW_OFLAG_ZERO, whether or not they have
+ * space preallocated.
+ *
  * Return 0, if the offset is found
  * Return -errno, otherwise.
  *
@@ -495,7 +452,15 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
-    if (!*cluster_offset) {
+    if (qcow2_is_zero_cluster(*cluster_offset)) {
+        if (s->qcow_version < 3) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+            return -EIO;
+        }
+        /* how many zero clusters ? */
+        c = count_contiguous_zero_clusters(nb_clusters, &l2_table[l2_index]);
+        *cluster_offset = QCOW_OFLAG_ZERO;
+    } else if (!*cluster_offset) {
         /* how many empty clusters ? */
         c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
     } else {
@@ -504,6 +469,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                 &l2_table[l2_index], 0, QCOW_OFLAG_COPIED);
     }
 
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
    nb_available = (c * s->cluster_sectors);
 out:
     if (nb_available > nb_needed)
@@ -522,7 +492,8 @@ out:
  * the l2 table.
  *
  * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * in the l2 table are given to the caller.  The table must be released
+ * with qcow2_cache_put.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -558,12 +529,14 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             return ret;
         }
     } else {
-        if (l2_offset)
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
+        /* the old table may only be freed once nothing points to it */
         ret = l2_allocate(bs, l1_index, &l2_table);
         if (ret < 0) {
             return ret;
         }
+        if (l2_offset) {
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
+        }
         l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
     }
 
@@ -598,6 +571,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
     int l2_index, ret;
     uint64_t l2_offset, *l2_table;
+    uint64_t old_cluster_offset;
     int64_t cluster_offset;
     int nb_csectors;
 
@@ -606,15 +580,16 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
         return 0;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
-    if (cluster_offset & QCOW_OFLAG_COPIED)
-        return cluster_offset & ~QCOW_OFLAG_COPIED;
-
-    if (cluster_offset)
-        qcow2_free_any_clusters(bs, cluster_offset, 1);
+    old_cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    if ((old_cluster_offset & QCOW_OFLAG_COPIED) &&
+        !qcow2_is_zero_cluster(old_cluster_offset)) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+        return old_cluster_offset & ~QCOW_OFLAG_COPIED;
+    }
 
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     if (cluster_offset < 0) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
         return 0;
     }
 
@@ -628,39 +603,27 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* compressed clusters never have the copied flag */
 
+    ret = qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                     s->refcount_block_cache);
+    if (ret < 0) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+        return 0;
+    }
+
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    if (bdrv_pwrite(bs->file,
-                    l2_offset + l2_index * sizeof(uint64_t),
-                    l2_table + l2_index,
-                    sizeof(uint64_t)) != sizeof(uint64_t))
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table,
+                                 l2_index * sizeof(uint64_t),
+                                 sizeof(uint64_t));
+    if (qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table) < 0) {
         return 0;
+    }
 
-    return cluster_offset;
-}
-
-/*
- * Write L2 table updates to disk, writing whole sectors to avoid a
- * read-modify-write in bdrv_pwrite
- */
-#define L2_ENTRIES_PER_SECTOR (512 / 8)
-static int write_l2_entries(BlockDriverState *bs, uint64_t *l2_table,
-    uint64_t l2_offset, int l2_index, int num)
-{
-    int l2_start_index = l2_index & ~(L1_ENTRIES_PER_SECTOR - 1);
-    int start_offset = (8 * l2_index) & ~511;
-    int end_offset = (8 * (l2_index + num) + 511) & ~511;
-    size_t len = end_offset - start_offset;
-    int ret;
-
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
-    ret = bdrv_pwrite(bs->file, l2_offset + start_offset,
-        &l2_table[l2_start_index], len);
-    if (ret < 0) {
-        return ret;
+    if (old_cluster_offset) {
+        qcow2_free_any_clusters(bs, old_cluster_offset, 1);
     }
 
-    return 0;
+    return cluster_offset;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
@@ -691,7 +654,18 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
             goto err;
     }
 
-    /* update L2 table */
+    /*
+     * Update L2 table.
+     *
+     * The refcounts of the new clusters have to be on disk before the L2
+     * entries that point to them.
+     */
+    ret = qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                     s->refcount_block_cache);
+    if (ret < 0) {
+        goto err;
+    }
+
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index);
     if (ret < 0) {
         goto err;
@@ -711,9 +685,11 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
      }
 
-    ret = write_l2_entries(bs, l2_table, l2_offset, l2_index, m->nb_clusters);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table,
+                                 l2_index * sizeof(uint64_t),
+                                 m->nb_clusters * sizeof(uint64_t));
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
     if (ret < 0) {
-        qcow2_l2_cache_reset(bs);
         goto err;
     }
 
@@ -767,12 +743,18 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
-    /* We keep all QCOW_OFLAG_COPIED clusters */
+    /* We keep all QCOW_OFLAG_COPIED clusters, unless they read as zeroes */
 
-    if (cluster_offset & QCOW_OFLAG_COPIED) {
+    if ((cluster_offset & QCOW_OFLAG_COPIED) &&
+        !qcow2_is_zero_cluster(cluster_offset)) {
         nb_clusters = count_contiguous_clusters(nb_clusters, s->cluster_size,
                 &l2_table[l2_index], 0, 0);
 
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+
         cluster_offset &= ~QCOW_OFLAG_COPIED;
         m->nb_clusters = 0;
         m->depends_on = NULL;
@@ -785,17 +767,24 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     if (cluster_offset & QCOW_OFLAG_COMPRESSED)
         nb_clusters = 1;
 
-    /* how many available clusters ? */
+    /* how many available clusters ? Zero clusters get new clusters, too */
 
     while (i < nb_clusters) {
         i += count_contiguous_clusters(nb_clusters - i, s->cluster_size,
                 &l2_table[l2_index], i, 0);
-        if ((i >= nb_clusters) || be64_to_cpu(l2_table[l2_index + i])) {
+        if (i >= nb_clusters) {
+            break;
+        }
+
+        cluster_offset = be64_to_cpu(l2_table[l2_index + i]);
+        if (cluster_offset && !qcow2_is_zero_cluster(cluster_offset)) {
             break;
         }
 
         i += count_contiguous_free_clusters(nb_clusters - i,
                 &l2_table[l2_index + i]);
+        i += count_contiguous_zero_clusters(nb_clusters - i,
+                &l2_table[l2_index + i]);
         if (i >= nb_clusters) {
             break;
         }
@@ -809,6 +798,11 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     assert(i <= nb_clusters);
     nb_clusters = i;
 
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
     /*
      * Check if there already is an AIO write request in flight which allocates
      * the same cluster. In this case we need to wait until the previous
@@ -821,7 +815,7 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
         uint64_t old_end_offset = old_alloc->offset +
             old_alloc->nb_clusters * s->cluster_size;
 
-        if (end_offset < old_offset || offset > old_end_offset) {
+        if (end_offset <= old_offset || offset >= old_end_offset) {
             /* No intersection */
         } else {
             if (offset < old_offset) {
@@ -849,7 +843,7 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* allocate a new cluster */
 
-    cluster_offset = qcow2_alloc_clusters(bs, nb_clusters * s->cluster_size);
+    cluster_offset = qcow2_alloc_data_clusters(bs, offset, nb_clusters);
     if (cluster_offset < 0) {
         QLIST_REMOVE(m, next_in_flight);
         return cluster_offset;
@@ -869,6 +863,105 @@ out:
     return 0;
 }
 
+/*
+ * Replace the L2 entries of up to nb_clusters clusters, all in the same L2
+ * table, with new_entry and free the clusters they pointed to.
+ *
+ * Returns the number of clusters that were handled, -errno on failure.
+ */
+static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
+                             unsigned int nb_clusters, uint64_t new_entry)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_offset, *l2_table, old_entry;
+    unsigned int l1_index;
+    int l2_index, ret, i;
+
+    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+
+    /* nothing to deallocate without an L2 table */
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (new_entry == 0 &&
+        (l1_index >= s->l1_size || s->l1_table[l1_index] == 0)) {
+        return nb_clusters;
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_table, &l2_offset, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        old_entry = be64_to_cpu(l2_table[l2_index + i]);
+        if (old_entry == new_entry) {
+            continue;
+        }
+
+        /*
+         * The L2 table is updated in the cache first; freeing the cluster
+         * makes the refcount block depend on it, so that the cluster can't
+         * be reused while the old entry may still be on disk.
+         */
+        l2_table[l2_index + i] = cpu_to_be64(new_entry);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table,
+                                     (l2_index + i) * sizeof(uint64_t),
+                                     sizeof(uint64_t));
+
+        if (old_entry & QCOW_OFLAG_COMPRESSED) {
+            s->cluster_cache_offset = -1;
+        } else {
+            old_entry &= ~QCOW_OFLAG_COPIED;
+        }
+        qcow2_free_any_clusters(bs, old_entry, 1);
+    }
+
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return nb_clusters;
+}
+
+/*
+ * Deallocate the clusters in the given range, which must be cluster aligned
+ * (except for the end of the image).
+ *
+ * If zero is set, the clusters must read as zeroes afterwards. Otherwise
+ * their content is undefined and nothing is done if the image format can't
+ * express that cheaply.
+ *
+ * Returns 0 on success, -ENOTSUP if the clusters can't be zeroed without
+ * writing data, other -errno values on failure.
+ */
+int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
+    int nb_sectors, int zero)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t new_entry;
+    unsigned int nb_clusters;
+    int ret;
+
+    /* Unallocated clusters would show the backing file's data */
+    new_entry = bs->backing_hd ? QCOW_OFLAG_ZERO : 0;
+    if (new_entry && s->qcow_version < 3) {
+        return zero ? -ENOTSUP : 0;
+    }
+
+    nb_clusters = size_to_clusters(s, (uint64_t)nb_sectors << 9);
+    while (nb_clusters > 0) {
+        ret = discard_single_l2(bs, offset, nb_clusters, new_entry);
+        if (ret < 0) {
+            return ret;
+        }
+        nb_clusters -= ret;
+        offset += (uint64_t)ret << s->cluster_bits;
+    }
+
+    return 0;
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -169,6 +169,10 @@ static int qcow_write_snapshots(BlockDriverState *bs)
         offset += name_size;
     }
 
+    /* the new clusters must be accounted for before the header uses them */
+    if (qcow2_cache_flush(bs, s->refcount_block_cache) < 0)
+        goto fail;
+
     /* update the various header fields */
     data64 = cpu_to_be64(snapshots_offset);
     if (bdrv_pwrite(bs->file, offsetof(QCowHeader, snapshots_offset),
@@ -56,9 +56,10 @@ static int qcow_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
 
-    if (buf_size >= sizeof(QCowHeader) &&
+    if (buf_size >= QCOW2_V2_HEADER_LENGTH &&
         be32_to_cpu(cow_header->magic) == QCOW_MAGIC &&
-        be32_to_cpu(cow_header->version) == QCOW_VERSION)
+        be32_to_cpu(cow_header->version) >= 2 &&
+        be32_to_cpu(cow_header->version) <= QCOW_VERSION)
         return 100;
     else
         return 0;
@@ -139,7 +140,7 @@ static int qcow_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 static int qcow_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    int len, i;
+    int len, i, l2_cache_size, refcount_cache_size, writethrough;
     QCowHeader header;
     uint64_t ext_end;
 
@@ -159,8 +160,41 @@ static int qcow_open(BlockDriverState *bs, int flags)
     be64_to_cpus(&header.snapshots_offset);
     be32_to_cpus(&header.nb_snapshots);
 
-    if (header.magic != QCOW_MAGIC || header.version != QCOW_VERSION)
+    if (header.magic != QCOW_MAGIC || header.version < 2 ||
+        header.version > QCOW_VERSION)
+        goto fail;
+
+    if (header.version == 2) {
+        header.incompatible_features = 0;
+        header.compatible_features = 0;
+        header.autoclear_features = 0;
+        header.refcount_order = 4;
+        header.header_length = QCOW2_V2_HEADER_LENGTH;
+    } else {
+        be64_to_cpus(&header.incompatible_features);
+        be64_to_cpus(&header.compatible_features);
+        be64_to_cpus(&header.autoclear_features);
+        be32_to_cpus(&header.refcount_order);
+        be32_to_cpus(&header.header_length);
+        if (header.header_length < sizeof(header))
+            goto fail;
+    }
+
+    if (header.incompatible_features & ~QCOW2_INCOMPAT_MASK) {
+        fprintf(stderr, "qcow2: image uses unsupported features 0x%" PRIx64
+                "\n", header.incompatible_features & ~QCOW2_INCOMPAT_MASK);
+        goto fail;
+    }
+    /* refcounts are always 16 bits wide */
+    if (header.refcount_order != 4)
         goto fail;
+
+    s->qcow_version = header.version;
+    s->header_length = header.header_length;
+    s->incompatible_features = header.incompatible_features;
+    s->compatible_features = header.compatible_features;
+    s->autoclear_features = header.autoclear_features;
+
     if (header.cluster_bits < MIN_CLUSTER_BITS ||
         header.cluster_bits > MAX_CLUSTER_BITS)
         goto fail;
@@ -203,8 +237,26 @@ static int qcow_open(BlockDriverState *bs, int flags)
             be64_to_cpus(&s->l1_table[i]);
         }
     }
-    /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
+
+    /* alloc the metadata caches; without an explicit size, cache enough L2
+       tables to map the whole image, up to DEFAULT_MAX_L2_CACHE_SIZE */
+    if (bs->metadata_cache_size > 0) {
+        int64_t tables = bs->metadata_cache_size >> s->cluster_bits;
+        refcount_cache_size = MIN(tables / 4, INT_MAX);
+        l2_cache_size = MIN(tables - refcount_cache_size, INT_MAX);
+    } else {
+        l2_cache_size = MIN(s->l1_vm_state_index,
+                            DEFAULT_MAX_L2_CACHE_SIZE >> s->cluster_bits);
+        refcount_cache_size = l2_cache_size / 4;
+    }
+    l2_cache_size = MAX(l2_cache_size, MIN_L2_CACHE_SIZE);
+    refcount_cache_size = MAX(refcount_cache_size, MIN_REFCOUNT_CACHE_SIZE);
+    writethrough = (flags & BDRV_O_CACHE_MASK) == 0;
+    s->metadata_writethrough = writethrough;
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size, writethrough);
+    s->refcount_block_cache =
+        qcow2_cache_create(bs, refcount_cache_size, writethrough);
+
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -215,15 +267,30 @@ static int qcow_open(BlockDriverState *bs, int flags)
         goto fail;
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_commit_waiters);
+    QLIST_INIT(&s->l2_commit_running_waiters);
 
     /* read qcow2 extensions */
     if (header.backing_file_offset)
         ext_end = header.backing_file_offset;
     else
         ext_end = s->cluster_size;
-    if (qcow_read_extensions(bs, sizeof(header), ext_end))
+    if (qcow_read_extensions(bs, s->header_length, ext_end))
         goto fail;
 
+    /* whoever set autoclear bits we don't know about expects them to be
+       cleared by a writer that doesn't maintain the feature */
+    if ((flags & BDRV_O_RDWR) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        uint64_t be_autoclear;
+
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
+        be_autoclear = cpu_to_be64(s->autoclear_features);
+        if (bdrv_pwrite(bs->file, offsetof(QCowHeader, autoclear_features),
+                        &be_autoclear, sizeof(be_autoclear)) < 0)
+            goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -245,7 +312,12 @@ static int qcow_open(BlockDriverState *bs, int flags)
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    if (s->l2_table_cache) {
+        qcow2_cache_destroy(bs, s->l2_table_cache);
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     return -1;
@@ -341,13 +413,36 @@ typedef struct QCowAIOCB {
     QEMUBH *bh;
     QCowL2Meta l2meta;
     QLIST_ENTRY(QCowAIOCB) next_depend;
+    QLIST_ENTRY(QCowAIOCB) next_commit;
+    int is_write;
+    int copy_on_read;   /* reads: store the current part in the image;
+                           writes: only fill clusters that are unallocated */
+    int prefetching;    /* metadata reads in flight, plus one while issuing */
+    int prefetched;     /* metadata for this part has been waited for */
 } QCowAIOCB;
 
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = container_of(blockacb, QCowAIOCB, common);
+    BDRVQcowState *s = blockacb->bs->opaque;
+    QCowAIOCB *req;
+
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
+    QLIST_FOREACH(req, &s->l2_commit_waiters, next_commit) {
+        if (req == acb) {
+            QLIST_REMOVE(acb, next_commit);
+            break;
+        }
+    }
+    QLIST_FOREACH(req, &s->l2_commit_running_waiters, next_commit) {
+        if (req == acb) {
+            QLIST_REMOVE(acb, next_commit);
+            break;
+        }
+    }
+    qcow2_cache_prefetch_cancel(s->l2_table_cache, acb);
+    qcow2_cache_prefetch_cancel(s->refcount_block_cache, acb);
     qemu_aio_release(acb);
 }
 
@@ -356,7 +451,70 @@ static AIOPool qcow_aio_pool = {
     .cancel             = qcow_aio_cancel,
 };
 
+static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write);
 static void qcow_aio_read_cb(void *opaque, int ret);
+static void qcow_aio_write_cb(void *opaque, int ret);
+static void qcow_l2_commit_bh(void *opaque);
+
+static void qcow_aio_prefetch_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+
+    if (--acb->prefetching > 0) {
+        return;
+    }
+
+    /* A failed read shows up again when the table is loaded synchronously */
+    if (acb->is_write) {
+        qcow_aio_write_cb(acb, 0);
+    } else {
+        qcow_aio_read_cb(acb, 0);
+    }
+}
+
+/*
+ * Starts reading the L2 table for the next part of the request and, for
+ * writes, the refcount block that the next cluster allocation is going to
+ * use, unless they are cached.  Returns 1 if the request has to wait for
+ * them; it is continued by qcow_aio_prefetch_cb then, and the metadata
+ * lookups that follow do not block on a cache miss.
+ */
+static int qcow_aio_prefetch_metadata(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l1_index, refcount_table_index;
+    uint64_t l2_offset = 0, refcount_block_offset = 0;
+
+    l1_index = acb->sector_num >> (s->l2_bits + s->cluster_bits - 9);
+    if (l1_index < s->l1_size) {
+        l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    }
+
+    if (acb->is_write) {
+        refcount_table_index =
+            s->free_cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+        if (refcount_table_index < s->refcount_table_size) {
+            refcount_block_offset = s->refcount_table[refcount_table_index];
+        }
+    }
+
+    acb->prefetching = 1;
+    if (l2_offset && qcow2_cache_prefetch(bs, s->l2_table_cache, l2_offset,
+                                          qcow_aio_prefetch_cb, acb)) {
+        acb->prefetching++;
+    }
+    if (refcount_block_offset &&
+        qcow2_cache_prefetch(bs, s->refcount_block_cache,
+                             refcount_block_offset, qcow_aio_prefetch_cb, acb)) {
+        acb->prefetching++;
+    }
+
+    return --acb->prefetching > 0;
+}
+
 static void qcow_aio_read_bh(void *opaque)
 {
     QCowAIOCB *acb = opaque;
@@ -379,6 +537,33 @@ static int qcow_schedule_bh(QEMUBHFunc *cb, QCowAIOCB *acb)
     return 0;
 }
 
+/*
+ * Writes the current part of a read request, which came from the backing
+ * file, to the same place in the image.  Clusters that have been allocated
+ * since they were looked up, e.g. by a guest write, keep their data.  The
+ * read continues when the data is stored.
+ */
+static int qcow_aio_copy_on_read(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    QCowAIOCB *cor_acb;
+
+    acb->hd_iov.iov_base = (void *)acb->buf;
+    acb->hd_iov.iov_len = acb->cur_nr_sectors * 512;
+    qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
+
+    cor_acb = qcow_aio_setup(bs, acb->sector_num, &acb->hd_qiov,
+                             acb->cur_nr_sectors, qcow_aio_read_cb, acb, 1);
+    if (!cor_acb) {
+        return -EIO;
+    }
+    cor_acb->copy_on_read = 1;
+
+    acb->hd_aiocb = &cor_acb->common;
+    qcow_aio_write_cb(cor_acb, 0);
+    return 0;
+}
+
 static void qcow_aio_read_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
@@ -390,8 +575,17 @@ static void qcow_aio_read_cb(void *opaque, int ret)
     if (ret < 0)
         goto done;
 
+    if (acb->copy_on_read) {
+        acb->copy_on_read = 0;
+        ret = qcow_aio_copy_on_read(acb);
+        if (ret < 0) {
+            goto done;
+        }
+        return;
+    }
+
     /* post process the read buffer */
-    if (!acb->cluster_offset) {
+    if (!acb->cluster_offset || acb->cluster_offset == QCOW_OFLAG_ZERO) {
         /* nothing to do */
     } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
         /* nothing to do */
@@ -414,6 +608,14 @@ static void qcow_aio_read_cb(void *opaque, int ret)
     }
 
     /* prepare next AIO request */
+    if (!acb->prefetched && qcow_aio_prefetch_metadata(acb)) {
+        acb->prefetched = 1;
+        acb->cur_nr_sectors = 0;
+        acb->cluster_offset = 0;
+        return;
+    }
+    acb->prefetched = 0;
+
     acb->cur_nr_sectors = acb->remaining_sectors;
     ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
         &acb->cur_nr_sectors, &acb->cluster_offset);
@@ -425,6 +627,7 @@ static void qcow_aio_read_cb(void *opaque, int ret)
 
     if (!acb->cluster_offset) {
         if (bs->backing_hd) {
+            acb->copy_on_read = bs->copy_on_read && !bs->read_only;
             /* read from the base image */
             n1 = qcow2_backing_read1(bs->backing_hd, acb->sector_num,
                                acb->buf, acb->cur_nr_sectors);
@@ -450,6 +653,11 @@ static void qcow_aio_read_cb(void *opaque, int ret)
             if (ret < 0)
                 goto done;
         }
+    } else if (acb->cluster_offset == QCOW_OFLAG_ZERO) {
+        memset(acb->buf, 0, 512 * acb->cur_nr_sectors);
+        ret = qcow_schedule_bh(qcow_aio_read_bh, acb);
+        if (ret < 0)
+            goto done;
     } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
         /* add AIO support for compressed blocks ? */
         if (qcow2_decompress_cluster(bs, acb->cluster_offset) < 0)
@@ -511,6 +719,9 @@ static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
     acb->remaining_sectors = nb_sectors;
     acb->cur_nr_sectors = 0;
     acb->cluster_offset = 0;
+    acb->is_write = is_write;
+    acb->copy_on_read = 0;
+    acb->prefetched = 0;
     acb->l2meta.nb_clusters = 0;
     QLIST_INIT(&acb->l2meta.dependent_requests);
     return acb;
@@ -530,7 +741,117 @@ static BlockDriverAIOCB *qcow_aio_readv(BlockDriverState *bs,
     return &acb->common;
 }
 
-static void qcow_aio_write_cb(void *opaque, int ret);
+/*
+ * With writethrough metadata caches, every table that an allocating write
+ * modifies would be written synchronously as soon as it is released.
+ * Instead, the caches are switched to write-back before AIO writes
+ * allocate clusters, and qcow_l2_commit_bh writes the dirty tables of all
+ * requests that linked their clusters in the same main loop iteration
+ * with AIO.  The requests complete when the tables are stable.  The caches
+ * go back to writethrough once no allocation is in flight and the tables
+ * are clean.
+ */
+static void qcow_metadata_defer(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->metadata_writethrough && !s->metadata_deferred) {
+        qcow2_cache_set_writethrough(bs, s->l2_table_cache, 0);
+        qcow2_cache_set_writethrough(bs, s->refcount_block_cache, 0);
+        s->metadata_deferred = 1;
+    }
+}
+
+static void qcow_l2_commit_schedule(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->l2_commit_bh) {
+        s->l2_commit_bh = qemu_bh_new(qcow_l2_commit_bh, bs);
+    }
+    /* a running commit schedules the BH again when it has completed */
+    if (!s->l2_commit_running) {
+        qemu_bh_schedule(s->l2_commit_bh);
+    }
+}
+
+static void qcow_metadata_undefer(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->metadata_deferred || !QLIST_EMPTY(&s->cluster_allocs) ||
+        s->l2_commit_bh || s->l2_commit_running) {
+        return;
+    }
+
+    /* e.g. a failed request left modified tables behind */
+    if (!qcow2_cache_is_clean(s->l2_table_cache) ||
+        !qcow2_cache_is_clean(s->refcount_block_cache)) {
+        qcow_l2_commit_schedule(bs);
+        return;
+    }
+
+    qcow2_cache_set_writethrough(bs, s->l2_table_cache, 1);
+    qcow2_cache_set_writethrough(bs, s->refcount_block_cache, 1);
+    s->metadata_deferred = 0;
+}
+
+static void qcow_l2_commit_done(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    QCowAIOCB *acb;
+
+    s->l2_commit_running = 0;
+    if (s->l2_commit_bh) {
+        qemu_bh_schedule(s->l2_commit_bh);
+    }
+
+    while ((acb = QLIST_FIRST(&s->l2_commit_running_waiters)) != NULL) {
+        QLIST_REMOVE(acb, next_commit);
+        qcow_aio_write_cb(acb, ret);
+    }
+
+    qcow_metadata_undefer(bs);
+}
+
+static void qcow_l2_commit_l2_done(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    if (ret < 0) {
+        qcow_l2_commit_done(bs, ret);
+        return;
+    }
+
+    /* refcount decreases of clusters the L2 tables no longer point to */
+    qcow2_cache_flush_async(bs, s->refcount_block_cache,
+                            qcow_l2_commit_done, bs);
+}
+
+static void qcow_l2_commit_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    QCowAIOCB *acb;
+
+    if (s->l2_commit_running) {
+        return;
+    }
+    qemu_bh_delete(s->l2_commit_bh);
+    s->l2_commit_bh = NULL;
+
+    /* requests that link their clusters later wait for the next commit */
+    while ((acb = QLIST_FIRST(&s->l2_commit_waiters)) != NULL) {
+        QLIST_REMOVE(acb, next_commit);
+        QLIST_INSERT_HEAD(&s->l2_commit_running_waiters, acb, next_commit);
+    }
+
+    /* the L2 cache depends on the refcount cache, which is written first */
+    s->l2_commit_running = 1;
+    qcow2_cache_flush_async(bs, s->l2_table_cache, qcow_l2_commit_l2_done, bs);
+}
 
 static void run_dependent_requests(QCowL2Meta *m)
 {
@@ -551,6 +872,58 @@ static void run_dependent_requests(QCowL2Meta *m)
     QLIST_INIT(&m->dependent_requests);
 }
 
+/*
+ * Returns the number of sectors from sector_num on, at most nb_sectors, that
+ * make up whole clusters of zeroes in buf which are unallocated or zero
+ * clusters and not being allocated.  Without a backing file such clusters
+ * already read as zeroes, so writing them can be skipped.
+ *
+ * The scan stops at the end of the L2 table of sector_num, which the request
+ * has prefetched, so that it never reads an L2 table synchronously.
+ */
+static int count_zero_clusters_unallocated(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = sector_num << 9;
+    uint64_t cluster_offset;
+    uint64_t l2_sectors;
+    QCowL2Meta *m;
+    int count = 0;
+    int n;
+
+    if (bs->backing_hd || (sector_num & (s->cluster_sectors - 1))) {
+        return 0;
+    }
+
+    l2_sectors = 1ULL << (s->l2_bits + s->cluster_bits - 9);
+    if (nb_sectors > l2_sectors - (sector_num & (l2_sectors - 1))) {
+        nb_sectors = l2_sectors - (sector_num & (l2_sectors - 1));
+    }
+
+    while (nb_sectors - count >= s->cluster_sectors &&
+           buffer_is_zero(buf + count * 512, s->cluster_size)) {
+        n = s->cluster_sectors;
+        if (qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset) < 0 ||
+            (cluster_offset != 0 && cluster_offset != QCOW_OFLAG_ZERO)) {
+            break;
+        }
+        QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+            if (offset >= m->offset &&
+                offset < m->offset + m->nb_clusters * s->cluster_size) {
+                break;
+            }
+        }
+        if (m) {
+            break;
+        }
+        count += s->cluster_sectors;
+        offset += s->cluster_size;
+    }
+
+    return count;
+}
+
 static void qcow_aio_write_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
@@ -558,23 +931,78 @@ static void qcow_aio_write_cb(void *opaque, int ret)
     BDRVQcowState *s = bs->opaque;
     int index_in_cluster;
     const uint8_t *src_buf;
+    uint64_t cluster_offset;
+    uint64_t l2_sectors;
     int n_end;
+    int n;
+    int wait_for_commit = 0;
 
     acb->hd_aiocb = NULL;
 
     if (ret >= 0) {
+        /* the allocation is still in flight, so the caches stay deferred */
+        wait_for_commit = acb->l2meta.nb_clusters != 0 &&
+                          s->metadata_deferred;
         ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
     }
 
     run_dependent_requests(&acb->l2meta);
 
-    if (ret < 0)
+    if (ret < 0) {
         goto done;
+    }
+
+    if (wait_for_commit) {
+        /* continued from qcow_l2_commit_done, without linking again */
+        acb->l2meta.nb_clusters = 0;
+        QLIST_INSERT_HEAD(&s->l2_commit_waiters, acb, next_commit);
+        qcow_l2_commit_schedule(bs);
+        return;
+    }
 
     acb->remaining_sectors -= acb->cur_nr_sectors;
     acb->sector_num += acb->cur_nr_sectors;
     acb->buf += acb->cur_nr_sectors * 512;
 
+ next_l2_table:
+    if (acb->remaining_sectors && !acb->prefetched &&
+        qcow_aio_prefetch_metadata(acb)) {
+        acb->prefetched = 1;
+        acb->cur_nr_sectors = 0;
+        acb->l2meta.nb_clusters = 0;
+        return;
+    }
+    acb->prefetched = 0;
+
+    n = count_zero_clusters_unallocated(bs, acb->sector_num, acb->buf,
+                                        acb->remaining_sectors);
+    acb->remaining_sectors -= n;
+    acb->sector_num += n;
+    acb->buf += n * 512;
+    l2_sectors = 1ULL << (s->l2_bits + s->cluster_bits - 9);
+    if (n && acb->remaining_sectors && !(acb->sector_num & (l2_sectors - 1))) {
+        /* the zeroes may go on in the next L2 table, which must be
+           prefetched before it is looked at */
+        goto next_l2_table;
+    }
+
+    /* Copy-on-read skips what has been written since the backing file read */
+    n = acb->remaining_sectors;
+    while (acb->copy_on_read && acb->remaining_sectors) {
+        n = acb->remaining_sectors;
+        ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9, &n,
+                                       &cluster_offset);
+        if (ret < 0) {
+            goto done;
+        }
+        if (!cluster_offset) {
+            break;
+        }
+        acb->remaining_sectors -= n;
+        acb->sector_num += n;
+        acb->buf += n * 512;
+    }
+
     if (acb->remaining_sectors == 0) {
         /* request completed */
         ret = 0;
@@ -582,16 +1010,20 @@ static void qcow_aio_write_cb(void *opaque, int ret)
     }
 
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
-    n_end = index_in_cluster + acb->remaining_sectors;
+    n_end = index_in_cluster + MIN(acb->remaining_sectors, n);
     if (s->crypt_method &&
         n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
         n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
 
+    qcow_metadata_defer(bs);
     ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
         index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
     if (ret < 0) {
         goto done;
     }
+    if (acb->l2meta.nb_clusters == 0) {
+        qcow_metadata_undefer(bs);
+    }
 
     acb->cluster_offset = acb->l2meta.cluster_offset;
 
@@ -635,6 +1067,7 @@ fail:
         QLIST_REMOVE(&acb->l2meta, next_in_flight);
     }
 done:
+    qcow_metadata_undefer(bs);
     if (acb->qiov->niov > 1)
         qemu_vfree(acb->orig_buf);
     acb->common.cb(acb->common.opaque, ret);
@@ -658,11 +1091,42 @@ static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
     return &acb->common;
 }
 
+static int qcow_flush_metadata(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
+}
+
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+
+    /* a running commit still refers to the caches */
+    while (s->l2_commit_running) {
+        qemu_aio_wait();
+    }
+    if (s->l2_commit_bh) {
+        qemu_bh_delete(s->l2_commit_bh);
+        s->l2_commit_bh = NULL;
+    }
+    if (s->metadata_deferred) {
+        qcow2_cache_set_writethrough(bs, s->l2_table_cache, 1);
+        qcow2_cache_set_writethrough(bs, s->refcount_block_cache, 1);
+        s->metadata_deferred = 0;
+    }
+    qcow2_release_prealloc(bs);
+    qcow_flush_metadata(bs);
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->refcount_block_cache);
+
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     qcow2_refcount_close(bs);
@@ -703,7 +1167,7 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
         backing_file_len = strlen(backing_file);
     }
 
-    size_t header_size = sizeof(QCowHeader) + backing_file_len
+    size_t header_size = s->header_length + backing_file_len
         + backing_fmt_len;
 
     if (header_size > s->cluster_size) {
@@ -711,7 +1175,7 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
     }
 
     /* Rewrite backing file name and qcow2 extensions */
-    size_t ext_size = header_size - sizeof(QCowHeader);
+    size_t ext_size = header_size - s->header_length;
     uint8_t buf[ext_size];
     size_t offset = 0;
     size_t backing_file_offset = 0;
@@ -732,10 +1196,10 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
         }
 
         memcpy(buf + offset, backing_file, backing_file_len);
-        backing_file_offset = sizeof(QCowHeader) + offset;
+        backing_file_offset = s->header_length + offset;
     }
 
-    ret = bdrv_pwrite(bs->file, sizeof(QCowHeader), buf, ext_size);
+    ret = bdrv_pwrite(bs->file, s->header_length, buf, ext_size);
     if (ret < 0) {
         goto fail;
     }
@@ -841,10 +1305,12 @@ static int preallocate(BlockDriverState *bs)
 
 static int qcow_create2(const char *filename, int64_t total_size,
                         const char *backing_file, const char *backing_format,
-                        int flags, size_t cluster_size, int prealloc)
+                        int flags, size_t cluster_size, int prealloc,
+                        int version)
 {
 
     int fd, header_size, backing_filename_len, l1_size, i, shift, l2_bits;
+    int header_length;
     int ref_clusters, reftable_clusters, backing_format_len = 0;
     int rounded_ext_bf_len = 0;
     QCowHeader header;
@@ -861,9 +1327,16 @@ static int qcow_create2(const char *filename, int64_t total_size,
         return -errno;
     memset(&header, 0, sizeof(header));
     header.magic = cpu_to_be32(QCOW_MAGIC);
-    header.version = cpu_to_be32(QCOW_VERSION);
+    header.version = cpu_to_be32(version);
     header.size = cpu_to_be64(total_size * 512);
-    header_size = sizeof(header);
+    if (version >= 3) {
+        header_length = sizeof(header);
+        header.refcount_order = cpu_to_be32(4);
+        header.header_length = cpu_to_be32(header_length);
+    } else {
+        header_length = QCOW2_V2_HEADER_LENGTH;
+    }
+    header_size = header_length;
     backing_filename_len = 0;
     if (backing_file) {
         if (backing_format) {
@@ -956,8 +1429,8 @@ static int qcow_create2(const char *filename, int64_t total_size,
         ref_clusters * s->cluster_size);
 
     /* write all the data */
-    ret = qemu_write_full(fd, &header, sizeof(header));
-    if (ret != sizeof(header)) {
+    ret = qemu_write_full(fd, &header, header_length);
+    if (ret != header_length) {
         ret = -errno;
         goto exit;
     }
@@ -1045,6 +1518,7 @@ static int qcow_create(const char *filename, QEMUOptionParameter *options)
     int flags = 0;
     size_t cluster_size = 65536;
     int prealloc = 0;
+    int version = 2;
 
     /* Read out options */
     while (options && options->name) {
@@ -1070,6 +1544,16 @@ static int qcow_create(const char *filename, QEMUOptionParameter *options)
                     options->value.s);
                 return -EINVAL;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_COMPAT_LEVEL)) {
+            if (!options->value.s || !strcmp(options->value.s, "0.10")) {
+                version = 2;
+            } else if (!strcmp(options->value.s, "1.1")) {
+                version = 3;
+            } else {
+                fprintf(stderr, "Invalid compatibility level: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
         }
         options++;
     }
@@ -1081,7 +1565,7 @@ static int qcow_create(const char *filename, QEMUOptionParameter *options)
     }
 
     return qcow_create2(filename, sectors, backing_file, backing_fmt, flags,
-        cluster_size, prealloc);
+        cluster_size, prealloc, version);
 }
 
 static int qcow_make_empty(BlockDriverState *bs)
@@ -1211,14 +1695,91 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Rounds the range inwards to whole clusters; a partial cluster at the end of
+ * the image counts as whole. Returns the number of sectors in the range.
+ */
+static int qcow_cluster_aligned_range(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int64_t *start)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t end;
+
+    *start = align_offset(sector_num, s->cluster_sectors);
+    end = sector_num + nb_sectors;
+    if (end < bs->total_sectors) {
+        end &= ~(int64_t)(s->cluster_sectors - 1);
+    }
+
+    return end > *start ? end - *start : 0;
+}
+
+static int qcow_discard(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors)
+{
+    int64_t start;
+    int n;
+
+    n = qcow_cluster_aligned_range(bs, sector_num, nb_sectors, &start);
+    if (n == 0) {
+        return 0;
+    }
+
+    /* an AIO request in flight may still read a cluster of the range or
+       link it into an L2 table; it must be done before the cluster is
+       freed and can be allocated again */
+    qemu_aio_flush();
+
+    return qcow2_discard_clusters(bs, start << 9, n, 0);
+}
+
+static int qcow_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors)
+{
+    int64_t start;
+    int n, ret;
+
+    n = qcow_cluster_aligned_range(bs, sector_num, nb_sectors, &start);
+    if (n == 0) {
+        return -ENOTSUP;
+    }
+
+    /* see qcow_discard() */
+    qemu_aio_flush();
+
+    ret = qcow2_discard_clusters(bs, start << 9, n, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* the partial clusters at both ends need real zeroes written */
+    if (start > sector_num) {
+        ret = bdrv_write_zeroes(bs, sector_num, start - sector_num);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (start + n < sector_num + nb_sectors) {
+        ret = bdrv_write_zeroes(bs, start + n,
+                                sector_num + nb_sectors - (start + n));
+    }
+
+    return ret;
+}
+
 static void qcow_flush(BlockDriverState *bs)
 {
+    qcow_flush_metadata(bs);
     bdrv_flush(bs->file);
 }
 
 static BlockDriverAIOCB *qcow_aio_flush(BlockDriverState *bs,
          BlockDriverCompletionFunc *cb, void *opaque)
 {
+    if (qcow_flush_metadata(bs) < 0) {
+        return NULL;
+    }
+
     return bdrv_aio_flush(bs->file, cb, opaque);
 }
 
@@ -1232,6 +1793,8 @@ static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow_vm_state_offset(s);
+    /* see qcow2_discard_clusters() */
+    bdi->can_write_zeroes = !bs->backing_hd || s->qcow_version >= 3;
     return 0;
 }
 
@@ -1323,6 +1886,12 @@ static QEMUOptionParameter qcow_create_options[] = {
         .type = OPT_STRING,
         .help = "Preallocation mode (allowed values: off, metadata)"
     },
+    {
+        .name = BLOCK_OPT_COMPAT_LEVEL,
+        .type = OPT_STRING,
+        .help = "Compatibility level (0.10 or 1.1, which is needed for "
+                "zero clusters)"
+    },
     { NULL }
 };
 
@@ -1337,6 +1906,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_is_allocated	= qcow_is_allocated,
     .bdrv_set_key	= qcow_set_key,
     .bdrv_make_empty	= qcow_make_empty,
+    .bdrv_write_zeroes	= qcow_write_zeroes,
+    .bdrv_discard	= qcow_discard,
 
     .bdrv_aio_readv	= qcow_aio_readv,
     .bdrv_aio_writev	= qcow_aio_writev,
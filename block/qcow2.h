@@ -32,7 +32,7 @@
 //#define DEBUG_EXT
 
 #define QCOW_MAGIC (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
-#define QCOW_VERSION 2
+#define QCOW_VERSION 3 /* highest version understood by this driver */
 
 #define QCOW_CRYPT_NONE 0
 #define QCOW_CRYPT_AES  1
@@ -43,13 +43,24 @@
 #define QCOW_OFLAG_COPIED     (1LL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
 #define QCOW_OFLAG_COMPRESSED (1LL << 62)
+/* the cluster reads as all zeroes (version 3 only, never for compressed
+   clusters) */
+#define QCOW_OFLAG_ZERO       (1LL << 0)
 
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 16 /* tables */
+#define MIN_REFCOUNT_CACHE_SIZE 4 /* tables */
+
+/* Default upper bound of the L2 cache when its size is derived from the
+   image size: 32 MB of L2 tables map 256 GB with 64k clusters */
+#define DEFAULT_MAX_L2_CACHE_SIZE (32 * 1024 * 1024)
+
+/* Largest extent that is reserved ahead of a sequential writer */
+#define MAX_PREALLOC_SIZE (2 * 1024 * 1024)
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -65,8 +76,23 @@ typedef struct QCowHeader {
     uint32_t refcount_table_clusters;
     uint32_t nb_snapshots;
     uint64_t snapshots_offset;
+
+    /* the following fields only exist in version 3 headers */
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+    uint32_t refcount_order;
+    uint32_t header_length;
 } QCowHeader;
 
+#define QCOW2_V2_HEADER_LENGTH offsetof(QCowHeader, incompatible_features)
+
+/* Feature bits that this driver knows about, per category. An image with
+   an unknown incompatible feature bit must not be opened; unknown
+   autoclear bits are cleared when the image is opened read-write. */
+#define QCOW2_INCOMPAT_MASK  0
+#define QCOW2_AUTOCLEAR_MASK 0
+
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
     uint32_t l1_size;
@@ -78,8 +104,16 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+struct Qcow2Cache;
+typedef struct Qcow2Cache Qcow2Cache;
+
 typedef struct BDRVQcowState {
     BlockDriverState *hd;
+    int qcow_version;
+    uint32_t header_length;
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
@@ -92,9 +126,10 @@ typedef struct BDRVQcowState {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
-    uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+
+    Qcow2Cache *l2_table_cache;
+    Qcow2Cache *refcount_block_cache;
+
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -103,11 +138,28 @@ typedef struct BDRVQcowState {
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* clusters reserved for a sequential writer, their refcount is set */
+    int64_t prealloc_offset;
+    int prealloc_clusters;
+    int prealloc_size;          /* size of the next extent, in clusters */
+    uint64_t prealloc_next_guest_offset;
+
+    /*
+     * In writethrough mode, the metadata caches are switched to write-back
+     * while AIO writes allocate clusters (metadata_deferred), and the
+     * tables they modified are written together with AIO
+     */
+    int metadata_writethrough;
+    int metadata_deferred;
+    int l2_commit_running;
+    QEMUBH *l2_commit_bh;
+    QLIST_HEAD(QCowL2Commits, QCowAIOCB) l2_commit_waiters;
+    /* requests whose tables the running commit writes */
+    QLIST_HEAD(, QCowAIOCB) l2_commit_running_waiters;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -162,6 +214,12 @@ static inline int64_t align_offset(int64_t offset, int n)
     return offset;
 }
 
+static inline int qcow2_is_zero_cluster(uint64_t l2_entry)
+{
+    return (l2_entry & QCOW_OFLAG_ZERO) &&
+        !(l2_entry & QCOW_OFLAG_COMPRESSED);
+}
+
 
 // FIXME Need qcow2_ prefix to global functions
 
@@ -174,6 +232,9 @@ int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t guest_offset,
+    int nb_clusters);
+void qcow2_release_prealloc(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
     int64_t offset, int64_t size);
@@ -189,7 +250,6 @@ int qcow2_check_refcounts(BlockDriverState *bs);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size);
-void qcow2_l2_cache_reset(BlockDriverState *bs);
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
@@ -205,6 +265,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          int compressed_size);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
+    int nb_sectors, int zero);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -215,4 +277,30 @@ int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-cache.c functions */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int writethrough);
+void qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
+    int writethrough);
+
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table, int start,
+    int len);
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_flush_async(BlockDriverState *bs, Qcow2Cache *c,
+    BlockDriverCompletionFunc *cb, void *opaque);
+int qcow2_cache_is_clean(Qcow2Cache *c);
+int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2Cache *dependency);
+void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table);
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table);
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+int qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque);
+void qcow2_cache_prefetch_cancel(Qcow2Cache *c, void *opaque);
+
 #endif
@@ -17,12 +17,54 @@
 #include "sysemu.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#ifdef CONFIG_IOTHREAD
+#include <signal.h>
+#include "qemu-thread.h"
+#endif
 
 //#define DEBUG_BUFFERED_FILE
 
+#ifdef CONFIG_IOTHREAD
+/* With the I/O thread the file is written by a writer thread, so that the
+   migration thread can prepare the next data while the previous data is
+   on the wire.  Data is double-buffered: the producer appends to queue
+   while the writer sends out.  The producer is held back once this much
+   is waiting to be sent.  */
+#define BUFFERED_MAX_PENDING (4 << 20)
+#else
+/* Without it, data is sent once this much has been queued, or at the
+   next 100ms tick.  */
+#define BUFFERED_BATCH (64 << 10)
+#endif
+
+/* Segments written out by a single writev.  */
+#define BUFFERED_IOV 64
+
+/* Queued data is a list of segments that either point into the queue's
+   own buffer, for data passed to put_buffer, or straight at the caller's
+   memory, for data passed to put_buffer_async.  Guest pages are queued
+   the latter way and go from guest RAM to the socket without a copy.  */
+typedef struct BufferedSegment {
+    const uint8_t *data;        /* NULL if the data is in the buffer */
+    size_t offset;              /* of the data in the buffer */
+    size_t len;
+} BufferedSegment;
+
+typedef struct BufferedQueue {
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    BufferedSegment *segs;
+    int nsegs;
+    int segs_capacity;
+    int head;                   /* first segment not completely sent */
+    size_t head_offset;         /* bytes of it already sent */
+    size_t size;                /* bytes not sent yet */
+} BufferedQueue;
+
 typedef struct QEMUFileBuffered
 {
-    BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -32,10 +74,19 @@ typedef struct QEMUFileBuffered
     int freeze_output;
     size_t bytes_xfer;
     size_t xfer_limit;
-    uint8_t *buffer;
-    size_t buffer_size;
-    size_t buffer_capacity;
+    BufferedQueue queue;
+#ifdef CONFIG_IOTHREAD
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond data_cond;
+    BufferedQueue out;
+    size_t out_size;
+    int64_t window_start;
+    int closing;
+#else
     QEMUTimer *timer;
+    QEMUBH *ready_bh;
+#endif
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -46,72 +97,314 @@ typedef struct QEMUFileBuffered
     do { } while (0)
 #endif
 
-static void buffered_append(QEMUFileBuffered *s,
-                            const uint8_t *buf, size_t size)
+static BufferedSegment *buffered_queue_new_segment(BufferedQueue *q)
 {
-    if (size > (s->buffer_capacity - s->buffer_size)) {
+    if (q->nsegs == q->segs_capacity) {
+        q->segs_capacity = q->segs_capacity ? q->segs_capacity * 2 : 64;
+        q->segs = qemu_realloc(q->segs,
+                               q->segs_capacity * sizeof(BufferedSegment));
+    }
+    return &q->segs[q->nsegs++];
+}
+
+static void buffered_queue_append(BufferedQueue *q,
+                                  const uint8_t *buf, size_t size)
+{
+    BufferedSegment *seg;
+
+    if (size > (q->buffer_capacity - q->buffer_size)) {
         void *tmp;
 
         DPRINTF("increasing buffer capacity from %zu by %zu\n",
-                s->buffer_capacity, size + 1024);
+                q->buffer_capacity, size + 1024);
 
-        s->buffer_capacity += size + 1024;
+        q->buffer_capacity += size + 1024;
 
-        tmp = qemu_realloc(s->buffer, s->buffer_capacity);
+        tmp = qemu_realloc(q->buffer, q->buffer_capacity);
         if (tmp == NULL) {
             fprintf(stderr, "qemu file buffer expansion failed\n");
             exit(1);
         }
 
-        s->buffer = tmp;
+        q->buffer = tmp;
     }
 
-    memcpy(s->buffer + s->buffer_size, buf, size);
-    s->buffer_size += size;
+    memcpy(q->buffer + q->buffer_size, buf, size);
+
+    /* the last buffer segment always ends at the end of the buffer */
+    seg = q->nsegs ? &q->segs[q->nsegs - 1] : NULL;
+    if (seg && !seg->data) {
+        seg->len += size;
+    } else {
+        seg = buffered_queue_new_segment(q);
+        seg->data = NULL;
+        seg->offset = q->buffer_size;
+        seg->len = size;
+    }
+    q->buffer_size += size;
+    q->size += size;
 }
 
-static void buffered_flush(QEMUFileBuffered *s)
+static void buffered_queue_add(BufferedQueue *q,
+                               const uint8_t *buf, size_t size)
 {
-    size_t offset = 0;
+    BufferedSegment *seg = buffered_queue_new_segment(q);
 
-    if (s->has_error) {
-        DPRINTF("flush when error, bailing\n");
-        return;
-    }
+    seg->data = buf;
+    seg->offset = 0;
+    seg->len = size;
+    q->size += size;
+}
+
+static void buffered_queue_reset(BufferedQueue *q)
+{
+    q->buffer_size = 0;
+    q->nsegs = 0;
+    q->head = 0;
+    q->head_offset = 0;
+    q->size = 0;
+}
 
-    DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
+static void buffered_queue_free(BufferedQueue *q)
+{
+    qemu_free(q->buffer);
+    qemu_free(q->segs);
+}
 
-    while (offset < s->buffer_size) {
-        ssize_t ret;
+/* Drop the first len bytes of the queue, which have been sent.  */
+static void buffered_queue_advance(BufferedQueue *q, size_t len)
+{
+    q->size -= len;
+    len += q->head_offset;
+    while (q->head < q->nsegs && len >= q->segs[q->head].len) {
+        len -= q->segs[q->head].len;
+        q->head++;
+    }
+    q->head_offset = len;
+}
 
-        ret = s->put_buffer(s->opaque, s->buffer + offset,
-                            s->buffer_size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
+/* Send the queue until it is empty or the backend stops taking data.
+   Return 0 once everything has been sent, otherwise the backend's
+   negative errno; the queue then holds whatever is left.  */
+static int buffered_queue_write(QEMUFileBuffered *s, BufferedQueue *q)
+{
+    struct iovec iov[BUFFERED_IOV];
+    ssize_t ret;
+    size_t skip;
+    int i, n;
+
+    while (q->size) {
+        skip = q->head_offset;
+        for (i = q->head, n = 0; i < q->nsegs && n < BUFFERED_IOV; i++, n++) {
+            const BufferedSegment *seg = &q->segs[i];
+            const uint8_t *data = seg->data ? seg->data
+                                            : q->buffer + seg->offset;
+
+            iov[n].iov_base = (void *)(data + skip);
+            iov[n].iov_len = seg->len - skip;
+            skip = 0;
         }
 
+        ret = s->writev(s->opaque, iov, n);
         if (ret <= 0) {
-            DPRINTF("error flushing data, %zd\n", ret);
-            s->has_error = 1;
-            break;
+            return ret ? ret : -EIO;
+        }
+        DPRINTF("wrote %zd byte(s)\n", ret);
+        buffered_queue_advance(q, ret);
+    }
+    buffered_queue_reset(q);
+    return 0;
+}
+
+#ifdef CONFIG_IOTHREAD
+/* Move a 100ms transfer window forward if it is over.  Called with
+   s->lock held.  Returns nonzero if a new window was started.  */
+static int buffered_window_tick(QEMUFileBuffered *s)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+
+    if (now - s->window_start < 100) {
+        return 0;
+    }
+    s->window_start = now;
+    s->bytes_xfer = 0;
+    return 1;
+}
+
+static int buffered_limited(QEMUFileBuffered *s)
+{
+    return s->queue.size + s->out_size > BUFFERED_MAX_PENDING ||
+           s->bytes_xfer > s->xfer_limit;
+}
+
+/* Send all of out, waiting for the backend whenever it is full.  */
+static int buffered_write_out(QEMUFileBuffered *s)
+{
+    int ret;
+
+    while ((ret = buffered_queue_write(s, &s->out)) == -EAGAIN) {
+        DPRINTF("backend not ready, waiting\n");
+        s->wait_for_unfreeze(s->opaque);
+    }
+    if (ret < 0) {
+        DPRINTF("error writing data, %d\n", ret);
+    }
+    return ret;
+}
+
+/* The writer thread sends whatever the producer has queued and tells it
+   through put_ready whenever it may be able to queue more: after each
+   write and at the start of each transfer window.  */
+static void *buffered_writer_thread(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    while (!s->has_error) {
+        int notify;
+
+        if (s->queue.size) {
+            BufferedQueue tmp;
+            int ret;
+
+            tmp = s->out;
+            s->out = s->queue;
+            s->queue = tmp;
+            s->out_size = s->out.size;
+
+            qemu_mutex_unlock(&s->lock);
+            ret = buffered_write_out(s);
+            qemu_mutex_lock(&s->lock);
+
+            DPRINTF("wrote %zu byte(s)\n", s->out_size);
+            buffered_queue_reset(&s->out);
+            s->out_size = 0;
+            if (ret < 0) {
+                s->has_error = 1;
+            }
+            notify = 1;
         } else {
-            DPRINTF("flushed %zd byte(s)\n", ret);
-            offset += ret;
+            if (s->closing) {
+                break;
+            }
+            qemu_cond_timedwait(&s->data_cond, &s->lock, 100);
+            notify = 0;
+        }
+        if (buffered_window_tick(s)) {
+            notify = 1;
         }
+        if (notify && !s->closing) {
+            qemu_mutex_unlock(&s->lock);
+            s->put_ready(s->opaque);
+            qemu_mutex_lock(&s->lock);
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static int buffered_put(QEMUFileBuffered *s, const uint8_t *buf, int size,
+                        int copy)
+{
+    qemu_mutex_lock(&s->lock);
+    if (s->has_error) {
+        DPRINTF("put when error, bailing\n");
+        qemu_mutex_unlock(&s->lock);
+        return -EINVAL;
     }
+    if (copy) {
+        buffered_queue_append(&s->queue, buf, size);
+    } else {
+        buffered_queue_add(&s->queue, buf, size);
+    }
+    s->bytes_xfer += size;
+    qemu_cond_signal(&s->data_cond);
+    qemu_mutex_unlock(&s->lock);
 
-    DPRINTF("flushed %zu of %zu byte(s)\n", offset, s->buffer_size);
-    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
-    s->buffer_size -= offset;
+    return size;
+}
+
+static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
+{
+    DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
+
+    return buffered_put(opaque, buf, size, 1);
+}
+
+static int buffered_put_buffer_async(void *opaque, const uint8_t *buf,
+                                     int64_t pos, int size)
+{
+    DPRINTF("queueing %d bytes at %" PRId64 "\n", size, pos);
+
+    return buffered_put(opaque, buf, size, 0);
+}
+
+/* The migration thread is gone by the time the file is closed; wait for
+   the writer to send what is left.  */
+static int buffered_close(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+    int ret;
+
+    DPRINTF("closing\n");
+
+    qemu_mutex_lock(&s->lock);
+    s->closing = 1;
+    qemu_cond_signal(&s->data_cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
+
+    ret = s->close(s->opaque);
+
+    buffered_queue_free(&s->queue);
+    buffered_queue_free(&s->out);
+    qemu_free(s);
+
+    return ret;
+}
+
+static int buffered_rate_limit(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+    int ret;
+
+    qemu_mutex_lock(&s->lock);
+    buffered_window_tick(s);
+    ret = !s->has_error && buffered_limited(s);
+    qemu_mutex_unlock(&s->lock);
+
+    return ret;
+}
+#else
+static void buffered_flush(QEMUFileBuffered *s)
+{
+    size_t size = s->queue.size;
+    int ret;
+
+    if (s->has_error) {
+        DPRINTF("flush when error, bailing\n");
+        return;
+    }
+
+    DPRINTF("flushing %zu byte(s) of data\n", size);
+
+    ret = buffered_queue_write(s, &s->queue);
+    if (ret == -EAGAIN) {
+        DPRINTF("backend not ready, freezing\n");
+        s->freeze_output = 1;
+    } else if (ret < 0) {
+        DPRINTF("error flushing data, %d\n", ret);
+        s->has_error = 1;
+    }
+
+    DPRINTF("flushed %zu of %zu byte(s)\n", size - s->queue.size, size);
+    s->bytes_xfer += size - s->queue.size;
 }
 
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileBuffered *s = opaque;
-    int offset = 0;
-    ssize_t ret;
 
     DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
 
@@ -120,43 +413,44 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
         return -EINVAL;
     }
 
-    DPRINTF("unfreezing output\n");
-    s->freeze_output = 0;
+    if (size == 0) {
+        /* called by qemu_file_put_notify */
+        DPRINTF("unfreezing output\n");
+        s->freeze_output = 0;
+        buffered_flush(s);
+        if (!s->freeze_output && s->bytes_xfer <= s->xfer_limit) {
+            /* room left in this window: do not wait for the next tick */
+            qemu_bh_schedule(s->ready_bh);
+        }
+        return 0;
+    }
 
-    buffered_flush(s);
+    buffered_queue_append(&s->queue, buf, size);
+    if (!s->freeze_output && s->queue.size >= BUFFERED_BATCH) {
+        buffered_flush(s);
+    }
 
-    while (!s->freeze_output && offset < size) {
-        if (s->bytes_xfer > s->xfer_limit) {
-            DPRINTF("transfer limit exceeded when putting\n");
-            break;
-        }
+    return s->has_error ? -EINVAL : size;
+}
 
-        ret = s->put_buffer(s->opaque, buf + offset, size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
-        }
+static int buffered_put_buffer_async(void *opaque, const uint8_t *buf,
+                                     int64_t pos, int size)
+{
+    QEMUFileBuffered *s = opaque;
 
-        if (ret <= 0) {
-            DPRINTF("error putting\n");
-            s->has_error = 1;
-            offset = -EINVAL;
-            break;
-        }
+    DPRINTF("queueing %d bytes at %" PRId64 "\n", size, pos);
 
-        DPRINTF("put %zd byte(s)\n", ret);
-        offset += ret;
-        s->bytes_xfer += ret;
+    if (s->has_error) {
+        DPRINTF("flush when error, bailing\n");
+        return -EINVAL;
     }
 
-    if (offset >= 0) {
-        DPRINTF("buffering %d bytes\n", size - offset);
-        buffered_append(s, buf + offset, size - offset);
-        offset = size;
+    buffered_queue_add(&s->queue, buf, size);
+    if (!s->freeze_output && s->queue.size >= BUFFERED_BATCH) {
+        buffered_flush(s);
     }
 
-    return offset;
+    return s->has_error ? -EINVAL : size;
 }
 
 static int buffered_close(void *opaque)
@@ -166,17 +460,20 @@ static int buffered_close(void *opaque)
 
     DPRINTF("closing\n");
 
-    while (!s->has_error && s->buffer_size) {
+    while (!s->has_error && s->queue.size) {
         buffered_flush(s);
-        if (s->freeze_output)
-            s->wait_for_unfreeze(s);
+        if (s->freeze_output) {
+            s->wait_for_unfreeze(s->opaque);
+            s->freeze_output = 0;
+        }
     }
 
     ret = s->close(s->opaque);
 
     qemu_del_timer(s->timer);
     qemu_free_timer(s->timer);
-    qemu_free(s->buffer);
+    qemu_bh_delete(s->ready_bh);
+    buffered_queue_free(&s->queue);
     qemu_free(s);
 
     return ret;
@@ -198,24 +495,14 @@ static int buffered_rate_limit(void *opaque)
     return 0;
 }
 
-static size_t buffered_set_rate_limit(void *opaque, size_t new_rate)
+static void buffered_ready(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
 
-    if (s->has_error)
-        goto out;
-
-    s->xfer_limit = new_rate / 10;
-    
-out:
-    return s->xfer_limit;
-}
-
-static size_t buffered_get_rate_limit(void *opaque)
-{
-    QEMUFileBuffered *s = opaque;
-  
-    return s->xfer_limit;
+    if (s->has_error || s->freeze_output || s->bytes_xfer > s->xfer_limit) {
+        return;
+    }
+    s->put_ready(s->opaque);
 }
 
 static void buffered_rate_tick(void *opaque)
@@ -237,21 +524,45 @@ static void buffered_rate_tick(void *opaque)
     /* Add some checks around this */
     s->put_ready(s->opaque);
 }
+#endif
+
+static size_t buffered_set_rate_limit(void *opaque, size_t new_rate)
+{
+    QEMUFileBuffered *s = opaque;
+
+    if (s->has_error)
+        goto out;
+
+    s->xfer_limit = new_rate / 10;
+    
+out:
+    return s->xfer_limit;
+}
+
+static size_t buffered_get_rate_limit(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+  
+    return s->xfer_limit;
+}
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
-                                  BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
 {
     QEMUFileBuffered *s;
+#ifdef CONFIG_IOTHREAD
+    sigset_t set, oldset;
+#endif
 
     s = qemu_mallocz(sizeof(*s));
 
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
-    s->put_buffer = put_buffer;
+    s->writev = writev;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -260,10 +571,24 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
-
+    qemu_file_set_put_buffer_async(s->file, buffered_put_buffer_async);
+
+#ifdef CONFIG_IOTHREAD
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->data_cond);
+    s->window_start = qemu_get_clock(rt_clock);
+
+    /* the main loop handles the signals */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    qemu_thread_create(&s->thread, buffered_writer_thread, s);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#else
     s->timer = qemu_new_timer(rt_clock, buffered_rate_tick, s);
+    s->ready_bh = qemu_bh_new(buffered_ready, s);
 
     qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + 100);
+#endif
 
     return s->file;
 }
@@ -0,0 +1,200 @@
+/*
+ * Zero and uniform buffer detection
+ *
+ * Most of a guest's RAM and most of a disk image is usually zero, so
+ * migration and image conversion spend much of their time in these scans.
+ * The vector versions are selected at runtime from CPUID.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+
+#define ACCEL_GENERIC   0
+#define ACCEL_SSE2      1
+#define ACCEL_AVX2      2
+
+typedef int (BufferAccelFunc)(const uint8_t *buf, size_t len, uint8_t c);
+
+/* Nonzero if all len bytes at buf are c.  */
+static int buffer_is_uniform_generic(const uint8_t *buf, size_t len,
+                                     uint8_t c)
+{
+    unsigned long pattern = (unsigned long)c * (~0UL / 0xff);
+    const unsigned long *p;
+    size_t i, nwords;
+
+    while (len && ((uintptr_t)buf & (sizeof(long) - 1))) {
+        if (*buf != c) {
+            return 0;
+        }
+        buf++;
+        len--;
+    }
+
+    p = (const unsigned long *)buf;
+    nwords = len / sizeof(long);
+    for (i = 0; i + 4 <= nwords; i += 4) {
+        if ((p[i] ^ pattern) | (p[i + 1] ^ pattern) |
+            (p[i + 2] ^ pattern) | (p[i + 3] ^ pattern)) {
+            return 0;
+        }
+    }
+    for (; i < nwords; i++) {
+        if (p[i] != pattern) {
+            return 0;
+        }
+    }
+
+    for (i = nwords * sizeof(long); i < len; i++) {
+        if (buf[i] != c) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static int buffer_is_uniform_sse2(const uint8_t *buf, size_t len, uint8_t c)
+{
+    const __m128i pattern = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    const uint8_t *end = buf + len;
+
+    for (; buf + 64 <= end; buf += 64) {
+        __m128i t0 = _mm_loadu_si128((const __m128i *)buf);
+        __m128i t1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+        __m128i t2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+        __m128i t3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+
+        t0 = _mm_or_si128(_mm_xor_si128(t0, pattern),
+                          _mm_xor_si128(t1, pattern));
+        t2 = _mm_or_si128(_mm_xor_si128(t2, pattern),
+                          _mm_xor_si128(t3, pattern));
+        t0 = _mm_or_si128(t0, t2);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t0, zero)) != 0xffff) {
+            return 0;
+        }
+    }
+    return buffer_is_uniform_generic(buf, end - buf, c);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+
+/* Runs on any x86 host, so it must stay out of the avx2 region below
+   together with the inline functions of cpuid.h that it calls.  */
+static int cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) ||
+        !(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return 0;
+    }
+    /* the OS must save the YMM registers */
+    asm("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+    if ((a & 6) != 6 || __get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) != 0;
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int buffer_is_uniform_avx2(const uint8_t *buf, size_t len, uint8_t c)
+{
+    const __m256i pattern = _mm256_set1_epi8(c);
+    const uint8_t *end = buf + len;
+
+    for (; buf + 128 <= end; buf += 128) {
+        __m256i t0 = _mm256_loadu_si256((const __m256i *)buf);
+        __m256i t1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+        __m256i t2 = _mm256_loadu_si256((const __m256i *)(buf + 64));
+        __m256i t3 = _mm256_loadu_si256((const __m256i *)(buf + 96));
+
+        t0 = _mm256_or_si256(_mm256_xor_si256(t0, pattern),
+                             _mm256_xor_si256(t1, pattern));
+        t2 = _mm256_or_si256(_mm256_xor_si256(t2, pattern),
+                             _mm256_xor_si256(t3, pattern));
+        t0 = _mm256_or_si256(t0, t2);
+        if (!_mm256_testz_si256(t0, t0)) {
+            return 0;
+        }
+    }
+    return buffer_is_uniform_generic(buf, end - buf, c);
+}
+#pragma GCC pop_options
+#endif
+
+static int buffer_accel_best(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (cpu_has_avx2()) {
+        return ACCEL_AVX2;
+    }
+#endif
+#ifdef __SSE2__
+    return ACCEL_SSE2;
+#else
+    return ACCEL_GENERIC;
+#endif
+}
+
+static BufferAccelFunc *buffer_accel_func(int level)
+{
+    switch (level) {
+#ifdef CONFIG_AVX2_OPT
+    case ACCEL_AVX2:
+        return buffer_is_uniform_avx2;
+#endif
+#ifdef __SSE2__
+    case ACCEL_SSE2:
+        return buffer_is_uniform_sse2;
+#endif
+    default:
+        return buffer_is_uniform_generic;
+    }
+}
+
+static int buffer_is_uniform_init(const uint8_t *buf, size_t len, uint8_t c);
+
+static BufferAccelFunc *buffer_accel = buffer_is_uniform_init;
+
+static int buffer_is_uniform_init(const uint8_t *buf, size_t len, uint8_t c)
+{
+    buffer_accel_limit(INT_MAX);
+    return buffer_accel(buf, len, c);
+}
+
+int buffer_accel_limit(int level)
+{
+    level = MIN(level, buffer_accel_best());
+    while (level > ACCEL_GENERIC &&
+           buffer_accel_func(level) == buffer_is_uniform_generic) {
+        level--;
+    }
+    buffer_accel = buffer_accel_func(level);
+    return level;
+}
+
+int buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_accel(buf, len, 0);
+}
+
+int buffer_is_uniform(const void *buf, size_t len)
+{
+    if (!len) {
+        return 1;
+    }
+    return buffer_accel(buf, len, *(const uint8_t *)buf);
+}
@@ -21,6 +21,7 @@
 
 #include "qemu-common.h"
 #include "cpu-common.h"
+#include "bitops.h"
 
 /* some important defines:
  *
@@ -773,7 +774,11 @@ void cpu_dump_statistics (CPUState *env, FILE *f,
 void QEMU_NORETURN cpu_abort(CPUState *env, const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 2, 3)));
 extern CPUState *first_cpu;
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+extern __thread CPUState *cpu_single_env;
+#else
 extern CPUState *cpu_single_env;
+#endif
 
 #define CPU_INTERRUPT_HARD   0x02 /* hardware interrupt pending */
 #define CPU_INTERRUPT_EXITTB 0x04 /* exit the current TB (use for x86 a20 case) */
@@ -824,6 +829,7 @@ void cpu_single_step(CPUState *env, int enabled);
 void cpu_reset(CPUState *s);
 int cpu_is_stopped(CPUState *env);
 void run_on_cpu(CPUState *env, void (*func)(void *data), void *data);
+void async_run_on_cpu(CPUState *env, void (*func)(void *data), void *data);
 
 #define CPU_LOG_TB_OUT_ASM (1 << 0)
 #define CPU_LOG_TB_IN_ASM  (1 << 1)
@@ -859,7 +865,6 @@ target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr);
 /* memory API */
 
 extern int phys_ram_fd;
-extern uint8_t *phys_ram_dirty;
 extern ram_addr_t ram_size;
 extern ram_addr_t last_ram_offset;
 
@@ -884,53 +889,105 @@ extern int mem_prealloc;
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
+/* Each client of the dirty memory log has its own bitmap with one bit per
+   target page, so that a client can scan and clear its log a host word
+   at a time.  The *_DIRTY_FLAG masks select clients in the functions
+   below.  */
+enum {
+    DIRTY_MEMORY_VGA,
+    DIRTY_MEMORY_CODE,
+    DIRTY_MEMORY_MIGRATION,
+    DIRTY_MEMORY_NUM
+};
 
-/* read dirty bit (return 0 or 1) */
-static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+#define VGA_DIRTY_FLAG       (1 << DIRTY_MEMORY_VGA)
+#define CODE_DIRTY_FLAG      (1 << DIRTY_MEMORY_CODE)
+#define MIGRATION_DIRTY_FLAG (1 << DIRTY_MEMORY_MIGRATION)
+#define ALL_DIRTY_FLAGS      ((1 << DIRTY_MEMORY_NUM) - 1)
+
+extern unsigned long *phys_ram_dirty[DIRTY_MEMORY_NUM];
+
+static inline int cpu_physical_memory_test_dirty(int client, ram_addr_t page)
+{
+    return (phys_ram_dirty[client][BIT_WORD(page)] & BIT_MASK(page)) != 0;
+}
+
+/* Setting bits is atomic, as several CPU threads and the I/O thread may
+   dirty pages that share a word.  The unlocked test keeps the common
+   already-dirty case free of locked instructions.  */
+static inline void cpu_physical_memory_mark_dirty(int client, ram_addr_t page)
 {
-    return phys_ram_dirty[addr >> TARGET_PAGE_BITS] == 0xff;
+    unsigned long *p = &phys_ram_dirty[client][BIT_WORD(page)];
+
+    if (!(*p & BIT_MASK(page))) {
+        __sync_fetch_and_or(p, BIT_MASK(page));
+    }
 }
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
-    return phys_ram_dirty[addr >> TARGET_PAGE_BITS];
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    int client, flags = 0;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (cpu_physical_memory_test_dirty(client, page)) {
+            flags |= 1 << client;
+        }
+    }
+    return flags;
 }
 
-static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
-                                                int dirty_flags)
+/* read dirty bit (return 0 or 1) */
+static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return phys_ram_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
+    return cpu_physical_memory_get_dirty_flags(addr) == ALL_DIRTY_FLAGS;
 }
 
-static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
+                                                int dirty_flags)
 {
-    phys_ram_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    int client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if ((dirty_flags & (1 << client)) &&
+            cpu_physical_memory_test_dirty(client, page)) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
-    return phys_ram_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    int client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            cpu_physical_memory_mark_dirty(client, page);
+        }
+    }
+    return cpu_physical_memory_get_dirty_flags(addr);
 }
 
-static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        int length,
-                                                        int dirty_flags)
+static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    int i, mask, len;
-    uint8_t *p;
-
-    len = length >> TARGET_PAGE_BITS;
-    mask = ~dirty_flags;
-    p = phys_ram_dirty + (start >> TARGET_PAGE_BITS);
-    for (i = 0; i < len; i++) {
-        p[i] &= mask;
-    }
+    cpu_physical_memory_set_dirty_flags(addr, ALL_DIRTY_FLAGS);
 }
 
+void cpu_physical_memory_mask_dirty_range(ram_addr_t start, ram_addr_t length,
+                                          int dirty_flags);
+void cpu_physical_memory_set_dirty_lebitmap(ram_addr_t start,
+                                            const unsigned long *bitmap,
+                                            ram_addr_t npages);
+ram_addr_t cpu_physical_memory_find_next_dirty(int client, ram_addr_t start,
+                                               ram_addr_t end);
+ram_addr_t cpu_physical_memory_count_dirty(int client, ram_addr_t start,
+                                           ram_addr_t end);
+ram_addr_t cpu_physical_memory_take_dirty(int client, unsigned long *bitmap);
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
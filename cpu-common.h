@@ -47,6 +47,10 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
 
+typedef void (RAMBlockIterFunc)(void *host, ram_addr_t offset,
+                                ram_addr_t length, void *opaque);
+void qemu_ram_foreach_block(RAMBlockIterFunc *func, void *opaque);
+
 int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            CPUWriteMemoryFunc * const *mem_write,
                            void *opaque);
@@ -73,8 +73,17 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* The TLB size is built into the code generated by the TCG backends,
+   so it can only be changed at configure time (--tlb-bits).  */
+#ifdef CONFIG_TLB_BITS
+#define CPU_TLB_BITS CONFIG_TLB_BITS
+#else
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Number of entries of the fully associative victim TLB, which keeps
+   the entries evicted from the main TLB.  */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -108,8 +117,14 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index; /* next victim TLB entry to replace */     \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* statistics, see dump_exec_info() */                              \
+    uint64_t tlb_miss_count;                                            \
+    uint64_t tlb_victim_hit_count;
 
 #else
 
@@ -163,6 +178,9 @@ typedef struct CPUWatchpoint {
     volatile sig_atomic_t exit_request;                                 \
     CPU_COMMON_TLB                                                      \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
+    /* indirect jumps resolved by helper_lookup_tb_ptr() */             \
+    uint64_t tb_lookup_hits;                                            \
+    uint64_t tb_lookup_misses;                                          \
     /* buffer for temporaries in the code generator */                  \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                 \
                                                                         \
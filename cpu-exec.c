@@ -132,6 +132,7 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     tb_page_addr_t phys_pc, phys_page1, phys_page2;
     target_ulong virt_page2;
 
+    tb_mutex_lock();
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
@@ -150,11 +151,14 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
             tb->flags == flags) {
             /* check next page if needed */
             if (tb->page_addr[1] != -1) {
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
+                virt_page2 = tb_virt_page2(tb);
+                /* the second page of a trace may not be reached, so it
+                   must not fault; the plain block at pc is used instead */
+                if (!tb->trace || tb_trace_page_mapped(env, virt_page2)) {
+                    phys_page2 = get_page_addr_code(env, virt_page2);
+                    if (tb->page_addr[1] == phys_page2)
+                        goto found;
+                }
             } else {
                 goto found;
             }
@@ -168,6 +172,7 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
  found:
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_mutex_unlock();
     return tb;
 }
 
@@ -341,8 +346,17 @@ int cpu_exec(CPUState *env1)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+                if (tcg_multithread && env->icount_decr.u16.high) {
+                    /* re-arm the TB exit check; requests are always
+                       posted before it is set, so they are seen below */
+                    env->icount_decr.u16.high = 0;
+                    __sync_synchronize();
+                }
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    cpu_io_lock();
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~(CPU_INTERRUPT_HARD |
@@ -547,6 +561,9 @@ int cpu_exec(CPUState *env1)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    cpu_io_unlock();
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -587,11 +604,23 @@ int cpu_exec(CPUState *env1)
                              (long)tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
 #endif
+                if (tb_trace_threshold) {
+                    tb = tb_trace_profile(env, &next_tb, tb);
+                }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    TranslationBlock *prev_tb;
+
+                    prev_tb = (TranslationBlock *)(next_tb & ~3);
+                    /* with -tcg-threads multi, another vCPU may have
+                       invalidated either block since it was looked up */
+                    tb_mutex_lock();
+                    if (!tb->invalid && !prev_tb->invalid) {
+                        tb_add_jump(prev_tb, next_tb & 3, tb);
+                    }
+                    tb_mutex_unlock();
                 }
                 spin_unlock(&tb_lock);
 
@@ -617,7 +646,11 @@ int cpu_exec(CPUState *env1)
                         /* Restore PC.  */
                         cpu_pc_from_tb(env, tb);
                         insns_left = env->icount_decr.u32;
-                        if (env->icount_extra && insns_left >= 0) {
+                        if (tcg_multithread) {
+                            /* exit request from another thread, the
+                               flag is re-armed at the top of the loop */
+                            next_tb = 0;
+                        } else if (env->icount_extra && insns_left >= 0) {
                             /* Refill decrementer and continue execution.  */
                             env->icount_extra += insns_left;
                             if (env->icount_extra > 0xffff) {
@@ -641,6 +674,12 @@ int cpu_exec(CPUState *env1)
                 /* reset soft MMU for next block (it can currently
                    only be set by a memory fault) */
             } /* for(;;) */
+        } else {
+            /* drop the locks of a region that raised an exception */
+            tb_mutex_reset();
+#if !defined(CONFIG_USER_ONLY)
+            cpu_io_lock_reset();
+#endif
         }
     } /* for(;;) */
 
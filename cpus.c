@@ -30,6 +30,7 @@
 #include "gdbstub.h"
 #include "dma.h"
 #include "kvm.h"
+#include "exec-all.h"
 
 #include "cpus.h"
 
@@ -96,6 +97,23 @@ int cpu_is_stopped(CPUState *env)
     return !vm_running || env->stopped;
 }
 
+/* Share of the time, in percent, that the vCPU threads sleep between
+   runs.  Migration raises it when the guest dirties memory faster than
+   it can be sent.  Only the vCPU threads of the I/O thread build sleep.  */
+#define CPU_THROTTLE_MAX        99
+
+static int cpu_throttle_pct;
+
+void cpu_throttle_set(int pct)
+{
+    cpu_throttle_pct = MAX(0, MIN(pct, CPU_THROTTLE_MAX));
+}
+
+int cpu_throttle_get(void)
+{
+    return cpu_throttle_pct;
+}
+
 static void do_vm_stop(int reason)
 {
     if (vm_running) {
@@ -264,6 +282,11 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
     func(data);
 }
 
+void async_run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
+{
+    func(data);
+}
+
 void resume_all_vcpus(void)
 {
 }
@@ -293,6 +316,10 @@ void qemu_notify_event(void)
 void qemu_mutex_lock_iothread(void) {}
 void qemu_mutex_unlock_iothread(void) {}
 
+void cpu_io_lock(void) {}
+void cpu_io_unlock(void) {}
+void cpu_io_lock_reset(void) {}
+
 void vm_stop(int reason)
 {
     do_vm_stop(reason);
@@ -317,6 +344,16 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_system_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
+/* exclusive sections (-tcg-threads multi) */
+static QemuCond qemu_exclusive_cond;
+static QemuCond qemu_exclusive_resume;
+static int pending_cpus;
+
+/* nonzero while this vCPU thread runs translated code without
+   qemu_global_mutex; cpu_io_lock() then takes it for device access */
+static __thread int vcpu_io_unlocked;
+static __thread int vcpu_io_lock_depth;
+static __thread int64_t vcpu_run_start;
 
 static void tcg_block_io_signals(void);
 static void kvm_block_io_signals(CPUState *env);
@@ -331,6 +368,9 @@ int qemu_init_main_loop(void)
         return ret;
 
     qemu_cond_init(&qemu_pause_cond);
+    qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
+    qemu_cond_init(&qemu_exclusive_resume);
     qemu_mutex_init(&qemu_fair_mutex);
     qemu_mutex_init(&qemu_global_mutex);
     qemu_mutex_lock(&qemu_global_mutex);
@@ -358,6 +398,7 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
+    wi.free = false;
     if (!env->queued_work_first)
         env->queued_work_first = &wi;
     else
@@ -375,6 +416,31 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
     }
 }
 
+/* Like run_on_cpu, but do not wait for FUNC to complete.  */
+void async_run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_self(env)) {
+        func(data);
+        return;
+    }
+
+    cpu_io_lock();
+    wi = qemu_mallocz(sizeof(*wi));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (!env->queued_work_first)
+        env->queued_work_first = wi;
+    else
+        env->queued_work_last->next = wi;
+    env->queued_work_last = wi;
+
+    qemu_cpu_kick(env);
+    cpu_io_unlock();
+}
+
 static void flush_queued_work(CPUState *env)
 {
     struct qemu_work_item *wi;
@@ -386,11 +452,104 @@ static void flush_queued_work(CPUState *env)
         env->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            qemu_free(wi);
+        }
     }
     env->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/*
+ * With -tcg-threads multi, vCPU threads run translated code without
+ * holding qemu_global_mutex.  Device emulation, interrupt delivery and
+ * anything else that is not thread safe is bracketed with
+ * cpu_io_lock()/cpu_io_unlock(), which take the global mutex on behalf
+ * of such a thread.  They nest, and are no-ops in all other contexts
+ * (I/O thread, single threaded TCG, KVM), where the mutex is already held.
+ */
+void cpu_io_lock(void)
+{
+    if (!vcpu_io_unlocked) {
+        return;
+    }
+    if (vcpu_io_lock_depth++ == 0) {
+        qemu_mutex_lock(&qemu_global_mutex);
+    }
+}
+
+void cpu_io_unlock(void)
+{
+    if (!vcpu_io_unlocked) {
+        return;
+    }
+    if (--vcpu_io_lock_depth == 0) {
+        qemu_mutex_unlock(&qemu_global_mutex);
+    }
+}
+
+/* Drop the global mutex if an exception longjmp'd out of a locked region. */
+void cpu_io_lock_reset(void)
+{
+    if (vcpu_io_unlocked && vcpu_io_lock_depth) {
+        vcpu_io_lock_depth = 0;
+        qemu_mutex_unlock(&qemu_global_mutex);
+    }
+}
+
+/*
+ * Exclusive sections: stop every other vCPU thread outside of cpu_exec.
+ * The caller must hold qemu_global_mutex and must not be inside a
+ * cpu_exec_start()/cpu_exec_end() pair itself.
+ */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&qemu_exclusive_resume, &qemu_global_mutex);
+    }
+}
+
+static void start_exclusive(void)
+{
+    CPUState *other;
+
+    exclusive_idle();
+
+    pending_cpus = 1;
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other->running) {
+            pending_cpus++;
+            cpu_exit(other);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&qemu_exclusive_resume);
+}
+
+static void cpu_exec_start(CPUState *env)
+{
+    exclusive_idle();
+    env->running = 1;
+}
+
+static void cpu_exec_end(CPUState *env)
+{
+    env->running = 0;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&qemu_exclusive_cond);
+        }
+    }
+}
+
 static void qemu_wait_io_event_common(CPUState *env)
 {
     if (env->stop) {
@@ -401,8 +560,34 @@ static void qemu_wait_io_event_common(CPUState *env)
     flush_queued_work(env);
 }
 
+/* Longest single throttle sleep, so that a long run does not keep the
+   vCPU away for too long.  */
+#define CPU_THROTTLE_MAX_SLEEP  (100 * 1000000LL)
+
+/* Sleep for cpu_throttle_pct of the time, given that the vCPU thread
+   ran since vcpu_run_start.  Stop requests and queued work still get
+   through.  */
+static void qemu_throttle_wait(CPUState *env)
+{
+    int pct = cpu_throttle_pct;
+    int64_t now, deadline;
+
+    if (!pct || !vm_running) {
+        return;
+    }
+    now = qemu_get_clock_ns(rt_clock);
+    deadline = now + MIN((now - vcpu_run_start) * pct / (100 - pct),
+                         CPU_THROTTLE_MAX_SLEEP);
+    while (now < deadline && !env->stop && !env->queued_work_first) {
+        qemu_cond_timedwait(env->halt_cond, &qemu_global_mutex,
+                            (deadline - now + 999999) / 1000000);
+        now = qemu_get_clock_ns(rt_clock);
+    }
+}
+
 static void qemu_wait_io_event(CPUState *env)
 {
+    qemu_throttle_wait(env);
     while (!tcg_has_work())
         qemu_cond_timedwait(env->halt_cond, &qemu_global_mutex, 1000);
 
@@ -446,6 +631,7 @@ static void qemu_kvm_eat_signal(CPUState *env, int timeout)
 
 static void qemu_kvm_wait_io_event(CPUState *env)
 {
+    qemu_throttle_wait(env);
     while (!cpu_has_work(env))
         qemu_cond_timedwait(env->halt_cond, &qemu_global_mutex, 1000);
 
@@ -475,6 +661,7 @@ static void *kvm_cpu_thread_fn(void *arg)
         qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
 
     while (1) {
+        vcpu_run_start = qemu_get_clock_ns(rt_clock);
         if (cpu_can_run(env))
             qemu_cpu_exec(env);
         qemu_kvm_wait_io_event(env);
@@ -483,6 +670,80 @@ static void *kvm_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static void qemu_tcg_vcpu_wait_io_event(CPUState *env)
+{
+    qemu_throttle_wait(env);
+    while (!cpu_has_work(env))
+        qemu_cond_timedwait(env->halt_cond, &qemu_global_mutex, 1000);
+
+    qemu_wait_io_event_common(env);
+}
+
+static void qemu_tcg_vcpu_exec(CPUState *env)
+{
+    int ret;
+
+    qemu_clock_enable(vm_clock,
+                      (env->singlestep_enabled & SSTEP_NOTIMER) == 0);
+
+    cpu_exec_start(env);
+    /* any pending kick is also recorded in exit_request or
+       interrupt_request, so the TB exit flag can be reset here */
+    env->icount_decr.u16.high = 0;
+    vcpu_io_unlocked = 1;
+    qemu_mutex_unlock(&qemu_global_mutex);
+
+    ret = qemu_cpu_exec(env);
+
+    qemu_mutex_lock(&qemu_global_mutex);
+    vcpu_io_unlocked = 0;
+    cpu_exec_end(env);
+
+    if (tb_evict_requested) {
+        /* the code buffer region is full; evict the oldest one with
+           everybody else stopped */
+        start_exclusive();
+        if (tb_evict_requested) {
+            tb_evict_region(env);
+        }
+        end_exclusive();
+    }
+
+    if (ret == EXCP_DEBUG) {
+        gdb_set_stop_cpu(env);
+        debug_requested = EXCP_DEBUG;
+        env->stop = 1;
+        qemu_notify_event();
+    }
+}
+
+/* One thread per vCPU (-tcg-threads multi) */
+static void *tcg_vcpu_thread_fn(void *arg)
+{
+    CPUState *env = arg;
+
+    tcg_block_io_signals();
+    qemu_thread_self(env->thread);
+
+    /* signal CPU creation */
+    qemu_mutex_lock(&qemu_global_mutex);
+    env->created = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    /* and wait for machine initialization */
+    while (!qemu_system_ready)
+        qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
+
+    while (1) {
+        vcpu_run_start = qemu_get_clock_ns(rt_clock);
+        if (cpu_can_run(env))
+            qemu_tcg_vcpu_exec(env);
+        qemu_tcg_vcpu_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void *tcg_cpu_thread_fn(void *arg)
 {
     CPUState *env = arg;
@@ -501,6 +762,7 @@ static void *tcg_cpu_thread_fn(void *arg)
         qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
 
     while (1) {
+        vcpu_run_start = qemu_get_clock_ns(rt_clock);
         tcg_cpu_exec();
         qemu_wait_io_event(cur_cpu);
     }
@@ -529,7 +791,8 @@ static void cpu_signal(int sig)
 {
     if (cpu_single_env)
         cpu_exit(cpu_single_env);
-    exit_request = 1;
+    if (!tcg_multithread)
+        exit_request = 1;
 }
 
 static void tcg_block_io_signals(void)
@@ -602,7 +865,7 @@ static void unblock_io_signals(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (kvm_enabled()) {
+    if (kvm_enabled() || tcg_multithread) {
         qemu_mutex_lock(&qemu_fair_mutex);
         qemu_mutex_lock(&qemu_global_mutex);
         qemu_mutex_unlock(&qemu_fair_mutex);
@@ -685,6 +948,16 @@ static void tcg_init_vcpu(void *_env)
     }
 }
 
+static void tcg_start_vcpu(CPUState *env)
+{
+    env->thread = qemu_mallocz(sizeof(QemuThread));
+    env->halt_cond = qemu_mallocz(sizeof(QemuCond));
+    qemu_cond_init(env->halt_cond);
+    qemu_thread_create(env->thread, tcg_vcpu_thread_fn, env);
+    while (env->created == 0)
+        qemu_cond_timedwait(&qemu_cpu_cond, &qemu_global_mutex, 100);
+}
+
 static void kvm_start_vcpu(CPUState *env)
 {
     env->thread = qemu_mallocz(sizeof(QemuThread));
@@ -703,6 +976,8 @@ void qemu_init_vcpu(void *_env)
     env->nr_threads = smp_threads;
     if (kvm_enabled())
         kvm_start_vcpu(env);
+    else if (tcg_multithread)
+        tcg_start_vcpu(env);
     else
         tcg_init_vcpu(env);
 }
@@ -806,6 +1081,35 @@ bool tcg_cpu_exec(void)
     return tcg_has_work();
 }
 
+void configure_tcg_threads(const char *option)
+{
+    if (!option || !strcmp(option, "single")) {
+        return;
+    }
+    if (strcmp(option, "multi")) {
+        fprintf(stderr, "qemu: invalid -tcg-threads mode '%s'\n", option);
+        exit(1);
+    }
+#if !defined(CONFIG_IOTHREAD)
+    fprintf(stderr, "qemu: -tcg-threads multi requires --enable-io-thread\n");
+    exit(1);
+#elif !defined(TARGET_HAS_TCG_THREADS)
+    fprintf(stderr, "qemu: -tcg-threads multi is not supported "
+            "for this target\n");
+    exit(1);
+#else
+    if (kvm_enabled()) {
+        return;
+    }
+    if (use_icount) {
+        fprintf(stderr, "qemu: -tcg-threads multi cannot be used "
+                "with -icount\n");
+        exit(1);
+    }
+    tcg_multithread = 1;
+#endif
+}
+
 void set_numa_modes(void)
 {
     CPUState *env;
@@ -16,6 +16,7 @@ void vm_state_notify(int running, int reason);
 bool tcg_cpu_exec(void);
 void set_numa_modes(void);
 void set_cpu_log(const char *optarg);
+void configure_tcg_threads(const char *option);
 void list_cpus(FILE *f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
                const char *optarg);
 
@@ -107,12 +107,16 @@ void tlb_flush(CPUState *env, int flush_global);
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size);
+int tlb_victim_lookup(CPUState *env, target_ulong addr, int access_type,
+                      int mmu_idx, int index);
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* tb_phys_hash has between 2^CODE_GEN_PHYS_HASH_MIN_BITS and
+   2^CODE_GEN_PHYS_HASH_MAX_BITS buckets, about one per TB */
+#define CODE_GEN_PHYS_HASH_MIN_BITS 12
+#define CODE_GEN_PHYS_HASH_MAX_BITS 22
 
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
@@ -162,8 +166,41 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* nonzero while the TB is not in the lookup tables: from tb_alloc()
+       until tb_link_page(), and once it has been removed; it must not be
+       chained to then */
+    int invalid;
+
+    /* trace formation: execution and exit counts gathered while the TB
+       is cold, and the last TB seen after each exit */
+    uint16_t exec_count;
+    uint16_t exit_count[2];
+    uint8_t trace_head; /* target of a backward jump */
+    struct TranslationBlock *trace_next[2];
+    /* if not NULL, the TB is a trace made of several guest blocks */
+    struct TBTrace *trace;
 };
 
+#define TB_TRACE_MAX_BLOCKS 8
+
+/* A trace translates a hot chain of blocks as a single TB.  Its code
+   may lie on the page of its first block and on one other page.  */
+typedef struct TBTrace {
+    int nb_blocks;
+    target_ulong pc[TB_TRACE_MAX_BLOCKS];
+    uint16_t size[TB_TRACE_MAX_BLOCKS];
+    target_ulong virt_page2; /* virtual address of page_addr[1] */
+} TBTrace;
+
+/* virtual address of the second page of 'tb' (page_addr[1]) */
+static inline target_ulong tb_virt_page2(TranslationBlock *tb)
+{
+    if (tb->trace) {
+        return tb->trace->virt_page2;
+    }
+    return (tb->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+}
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -179,19 +216,22 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
+extern TranslationBlock **tb_phys_hash;
+extern unsigned int tb_phys_hash_bits;
+
 static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
 {
-    return pc & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    return (pc ^ (pc >> tb_phys_hash_bits)) & ((1u << tb_phys_hash_bits) - 1);
 }
 
 TranslationBlock *tb_alloc(target_ulong pc);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *env);
+void tb_evict_region(CPUState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 extern uint8_t *code_gen_ptr;
 extern int code_gen_max_blocks;
 
@@ -203,7 +243,9 @@ extern void ppc_tb_set_jmp_target(unsigned long jmp_addr, unsigned long addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(unsigned long jmp_addr, unsigned long addr)
 {
-    /* patch the branch destination */
+    /* patch the branch destination.  The TCG backend aligns the
+       displacement so that this store is atomic with respect to other
+       vCPU threads executing the jump.  */
     *(uint32_t *)jmp_addr = addr - (jmp_addr + 4);
     /* no need to flush icache explicitly */
 }
@@ -277,6 +319,38 @@ extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
 
+/* execution count after which a loop header is turned into a trace,
+   0 if traces are disabled */
+extern int tb_trace_threshold;
+TranslationBlock *tb_trace_profile(CPUState *env, unsigned long *pnext_tb,
+                                   TranslationBlock *tb);
+int tb_trace_page_mapped(CPUState *env, target_ulong addr);
+
+/* nonzero if each vCPU runs translated code in its own host thread */
+extern int tcg_multithread;
+
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+/* With tcg_multithread, the TB tables, the page descriptors and the
+   code generator are protected by a mutex.  The lock nests, and a
+   longjmp back to cpu_exec() drops it with tb_mutex_reset().  */
+void tb_mutex_lock(void);
+void tb_mutex_unlock(void);
+void tb_mutex_reset(void);
+extern int tb_evict_requested;
+#else
+static inline void tb_mutex_lock(void)
+{
+}
+
+static inline void tb_mutex_unlock(void)
+{
+}
+
+static inline void tb_mutex_reset(void)
+{
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 
 extern CPUWriteMemoryFunc *io_mem_write[IO_MEM_NB_ENTRIES][4];
@@ -285,6 +359,16 @@ extern void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 
 void tlb_fill(target_ulong addr, int is_write, int mmu_idx,
               void *retaddr);
+void cpu_notdirty_store_begin(ram_addr_t ram_addr, int len);
+void cpu_notdirty_store_end(CPUState *env, ram_addr_t ram_addr,
+                            target_ulong vaddr);
+
+/* tb-cache.c */
+extern int tb_cache_enabled;
+int tb_cache_load(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr);
+void tb_cache_save(CPUState *env, TranslationBlock *tb, int gen_code_size);
+void tb_cache_dump_info(FILE *f,
+                        int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 
 #include "softmmu_defs.h"
 
@@ -39,6 +39,12 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+#include "qemu-thread.h"
+#endif
+#if !defined(CONFIG_USER_ONLY)
+#include "postcopy.h"
+#endif
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #include <signal.h>
@@ -80,11 +86,64 @@
 
 static TranslationBlock *tbs;
 int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+/* resized by tb_phys_hash_resize() to keep about one TB per bucket */
+TranslationBlock **tb_phys_hash;
+unsigned int tb_phys_hash_bits;
+static unsigned int tb_phys_hash_count;
+static int tb_phys_hash_resize_count;
 static int nb_tbs;
+
+/* The code buffer is split in regions which are filled in turn.  When
+   the current one is full, the next one, which holds the oldest code,
+   is emptied by invalidating its TBs instead of flushing everything.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *end;           /* end of the code once the region is full */
+    TranslationBlock *tbs;  /* TBs of the region, sorted by tc_ptr */
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_nb_regions;
+static int code_gen_region; /* region being filled */
+static unsigned long code_gen_region_size;
+static int code_gen_region_max_blocks;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+static QemuMutex tb_mutex;
+static __thread int tb_mutex_depth;
+/* set when the code buffer is full while other vCPU threads may still
+   be executing from it; the eviction is deferred to an exclusive
+   section */
+int tb_evict_requested;
+
+void tb_mutex_lock(void)
+{
+    if (tcg_multithread && tb_mutex_depth++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void tb_mutex_unlock(void)
+{
+    if (tcg_multithread && --tb_mutex_depth == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+void tb_mutex_reset(void)
+{
+    if (tb_mutex_depth) {
+        tb_mutex_depth = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+#endif
+
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
  have limited branch ranges (possibly also PPC) so place it in a
@@ -104,13 +163,13 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
+/* threshold to leave the current code buffer region */
 static unsigned long code_gen_buffer_max_size;
 uint8_t *code_gen_ptr;
 
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
-uint8_t *phys_ram_dirty;
+unsigned long *phys_ram_dirty[DIRTY_MEMORY_NUM];
 static int in_migration;
 
 typedef struct RAMBlock {
@@ -130,11 +189,19 @@ ram_addr_t last_ram_offset;
 CPUState *first_cpu;
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+__thread CPUState *cpu_single_env;
+#else
 CPUState *cpu_single_env;
+#endif
 /* 0 = Do not count executed instructions.
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount = 0;
+/* see tb_trace_profile() */
+int tb_trace_threshold = 0;
+/* nonzero if each virtual CPU has its own host thread (-tcg-threads) */
+int tcg_multithread = 0;
 /* Current instruction counter.  While executing translated code this may
    include some instructions that have not yet been executed.  */
 int64_t qemu_icount;
@@ -237,7 +304,10 @@ static int log_append = 0;
 static int tlb_flush_count;
 #endif
 static int tb_flush_count;
+static int tb_evict_count;
+static int tb_evict_tb_count;
 static int tb_phys_invalidate_count;
+static int tb_trace_count;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -477,6 +547,8 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
 
 static void code_gen_alloc(unsigned long tb_size)
 {
+    int i;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
     code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
@@ -556,10 +628,28 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size - 
+    /* a region must hold several blocks of the maximum size */
+    code_gen_nb_regions = code_gen_buffer_size /
+        (4 * code_gen_max_block_size());
+    if (code_gen_nb_regions > CODE_GEN_MAX_REGIONS) {
+        code_gen_nb_regions = CODE_GEN_MAX_REGIONS;
+    } else if (code_gen_nb_regions < 1) {
+        code_gen_nb_regions = 1;
+    }
+    code_gen_region_size = (code_gen_buffer_size / code_gen_nb_regions) &
+        ~(CODE_GEN_ALIGN - 1);
+    code_gen_buffer_max_size = code_gen_region_size -
         code_gen_max_block_size();
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+    code_gen_region_max_blocks = code_gen_region_size /
+        CODE_GEN_AVG_BLOCK_SIZE;
+    code_gen_max_blocks = code_gen_region_max_blocks * code_gen_nb_regions;
     tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].start = code_gen_buffer + i * code_gen_region_size;
+        code_gen_regions[i].end = code_gen_regions[i].start;
+        code_gen_regions[i].tbs = tbs + i * code_gen_region_max_blocks;
+        code_gen_regions[i].nb_tbs = 0;
+    }
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -570,10 +660,16 @@ void cpu_exec_init_all(unsigned long tb_size)
     cpu_gen_init();
     code_gen_alloc(tb_size);
     code_gen_ptr = code_gen_buffer;
+    tb_phys_hash_bits = CODE_GEN_PHYS_HASH_MIN_BITS;
+    tb_phys_hash = qemu_mallocz(sizeof(TranslationBlock *) <<
+                                tb_phys_hash_bits);
     page_init();
 #if !defined(CONFIG_USER_ONLY)
     io_mem_init();
 #endif
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -692,11 +788,37 @@ static void page_flush_tb(void)
     }
 }
 
+/* Rehash the TBs into a table of 2^bits buckets.  The caller holds the
+   TB lock, so no lookup can walk the old table meanwhile.  */
+static void tb_phys_hash_resize(unsigned int bits)
+{
+    TranslationBlock **old_hash, *tb, *next;
+    unsigned int i, h, old_size;
+
+    old_hash = tb_phys_hash;
+    old_size = 1u << tb_phys_hash_bits;
+    tb_phys_hash = qemu_mallocz(sizeof(TranslationBlock *) << bits);
+    tb_phys_hash_bits = bits;
+    for (i = 0; i < old_size; i++) {
+        for (tb = old_hash[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            h = tb_phys_hash_func(tb->page_addr[0] +
+                                  (tb->pc & ~TARGET_PAGE_MASK));
+            tb->phys_hash_next = tb_phys_hash[h];
+            tb_phys_hash[h] = tb;
+        }
+    }
+    qemu_free(old_hash);
+    tb_phys_hash_resize_count++;
+}
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
+/* XXX: tb_flush is currently not thread safe: with tcg_multithread it
+   must be called while no other vCPU executes translated code */
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i;
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
@@ -706,19 +828,41 @@ void tb_flush(CPUState *env1)
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        CodeGenRegion *r = &code_gen_regions[i];
+        int j;
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            qemu_free(r->tbs[j].trace);
+        }
+        r->nb_tbs = 0;
+        r->end = r->start;
+    }
     nb_tbs = 0;
+    code_gen_region = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    if (tb_phys_hash_bits != CODE_GEN_PHYS_HASH_MIN_BITS) {
+        qemu_free(tb_phys_hash);
+        tb_phys_hash_bits = CODE_GEN_PHYS_HASH_MIN_BITS;
+        tb_phys_hash = qemu_mallocz(sizeof(TranslationBlock *) <<
+                                    tb_phys_hash_bits);
+    } else {
+        memset(tb_phys_hash, 0, sizeof(void *) << tb_phys_hash_bits);
+    }
+    tb_phys_hash_count = 0;
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+    tb_evict_requested = 0;
+#endif
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -728,7 +872,7 @@ static void tb_invalidate_check(target_ulong address)
     TranslationBlock *tb;
     int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for(i = 0;i < (1 << tb_phys_hash_bits); i++) {
         for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
@@ -746,7 +890,7 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for(i = 0;i < (1 << tb_phys_hash_bits); i++) {
         for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
@@ -827,19 +971,40 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (unsigned long)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
-void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+/* suppress any remaining jumps to this TB */
+static void tb_reset_incoming_jumps(TranslationBlock *tb)
+{
+    TranslationBlock *tb1, *tb2;
+    unsigned int n1;
+
+    tb1 = tb->jmp_first;
+    for(;;) {
+        n1 = (long)tb1 & 3;
+        if (n1 == 2)
+            break;
+        tb1 = (TranslationBlock *)((long)tb1 & ~3);
+        tb2 = tb1->jmp_next[n1];
+        tb_reset_jump(tb1, n1);
+        tb1->jmp_next[n1] = NULL;
+        tb1 = tb2;
+    }
+    tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
+}
+
+/* remove 'tb' from the lookup tables and the jump lists */
+static void tb_unlink(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUState *env;
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int h;
     tb_page_addr_t phys_pc;
-    TranslationBlock *tb1, *tb2;
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_phys_hash_func(phys_pc);
     tb_remove(&tb_phys_hash[h], tb,
               offsetof(TranslationBlock, phys_hash_next));
+    tb_phys_hash_count--;
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -854,6 +1019,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 
     tb_invalidated_flag = 1;
+    tb->invalid = 1;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -866,20 +1032,12 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_jmp_remove(tb, 0);
     tb_jmp_remove(tb, 1);
 
-    /* suppress any remaining jumps to this TB */
-    tb1 = tb->jmp_first;
-    for(;;) {
-        n1 = (long)tb1 & 3;
-        if (n1 == 2)
-            break;
-        tb1 = (TranslationBlock *)((long)tb1 & ~3);
-        tb2 = tb1->jmp_next[n1];
-        tb_reset_jump(tb1, n1);
-        tb1->jmp_next[n1] = NULL;
-        tb1 = tb2;
-    }
-    tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
+    tb_reset_incoming_jumps(tb);
+}
 
+void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+{
+    tb_unlink(tb, page_addr);
     tb_phys_invalidate_count++;
 }
 
@@ -910,9 +1068,44 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+static inline int tb_nb_blocks(TranslationBlock *tb)
+{
+    return tb->trace ? tb->trace->nb_blocks : 1;
+}
+
+/* Return in [*pstart, *pend[ the offsets within page 'n' of 'tb' of the
+   guest code of its block 'i'.  The range is empty if the block is not
+   in that page.  */
+static void tb_page_range(TranslationBlock *tb, int n, int i,
+                          int *pstart, int *pend)
+{
+    target_ulong pc, vpage;
+    int size, start, end;
+
+    if (tb->trace) {
+        pc = tb->trace->pc[i];
+        size = tb->trace->size[i];
+    } else {
+        pc = tb->pc;
+        size = tb->size;
+    }
+    vpage = n ? tb_virt_page2(tb) : tb->pc & TARGET_PAGE_MASK;
+    /* NOTE: this is subtle as a block may span two physical pages */
+    start = (target_long)(pc - vpage);
+    end = start + size;
+    if (start < 0)
+        start = 0;
+    if (end > TARGET_PAGE_SIZE)
+        end = TARGET_PAGE_SIZE;
+    if (start >= end)
+        start = end = 0;
+    *pstart = start;
+    *pend = end;
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n, i, tb_start, tb_end;
     TranslationBlock *tb;
 
     p->code_bitmap = qemu_mallocz(TARGET_PAGE_SIZE / 8);
@@ -921,23 +1114,39 @@ static void build_page_bitmap(PageDesc *p)
     while (tb != NULL) {
         n = (long)tb & 3;
         tb = (TranslationBlock *)((long)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE)
-                tb_end = TARGET_PAGE_SIZE;
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+        for (i = 0; i < tb_nb_blocks(tb); i++) {
+            tb_page_range(tb, n, i, &tb_start, &tb_end);
+            set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
         }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
         tb = tb->page_next[n];
     }
 }
 
+/* return true if the guest code of 'tb' in its page 'n' intersects
+   [start;end[ */
+static int tb_page_intersects(TranslationBlock *tb, int n,
+                              tb_page_addr_t start, tb_page_addr_t end)
+{
+    int i, tb_start, tb_end;
+
+    for (i = 0; i < tb_nb_blocks(tb); i++) {
+        tb_page_range(tb, n, i, &tb_start, &tb_end);
+        if (tb_start < tb_end &&
+            !(tb->page_addr[n] + tb_end <= start ||
+              tb->page_addr[n] + tb_start >= end)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* move code_gen_ptr past the 'size' bytes of code just generated */
+static inline void code_gen_advance(int size)
+{
+    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + size +
+                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+}
+
 TranslationBlock *tb_gen_code(CPUState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -946,25 +1155,41 @@ TranslationBlock *tb_gen_code(CPUState *env,
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
-    int code_gen_size;
+    int code_gen_size, cached;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+        if (tcg_multithread) {
+            /* other vCPUs may be running code from the region to evict:
+               leave cpu_exec() and let the vCPU thread evict it from an
+               exclusive section */
+            tb_evict_requested = 1;
+            env->current_tb = NULL;
+            env->exception_index = EXCP_INTERRUPT;
+            longjmp(env->jmp_env, 1);
+        }
+#endif
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
-        /* Don't forget to invalidate previous TB info.  */
-        tb_invalidated_flag = 1;
     }
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_cache_enabled && tb_cache_load(env, tb, &code_gen_size)) {
+        cached = 1;
+    } else
+#endif
+    {
+        cpu_gen_code(env, tb, &code_gen_size);
+        cached = 0;
+    }
+    code_gen_advance(code_gen_size);
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -972,7 +1197,225 @@ TranslationBlock *tb_gen_code(CPUState *env,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_cache_enabled && !cached) {
+        tb_cache_save(env, tb, code_gen_size);
+    }
+#endif
+    tb_link_page(tb, phys_pc, phys_page2);
+    return tb;
+}
+
+/* Return nonzero if the code page at 'addr' can be looked up without a
+   TLB fill.  The guest does not necessarily execute all blocks of a trace,
+   so translating a trace or finding one must not raise a guest fault for
+   its code, e.g. if a page was unmapped since the blocks were translated.  */
+int tb_trace_page_mapped(CPUState *env, target_ulong addr)
+{
+#if defined(CONFIG_USER_ONLY)
+    return (page_get_flags(addr) & (PAGE_VALID | PAGE_READ)) ==
+        (PAGE_VALID | PAGE_READ);
+#else
+    CPUTLBEntry *te;
+    int mmu_idx, index;
+
+    mmu_idx = cpu_mmu_index(env);
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    te = &env->tlb_table[mmu_idx][index];
+    if (te->addr_code != addr) {
+        tlb_victim_lookup(env, addr, 2, mmu_idx, index);
+    }
+    /* I/O pages are not traced either */
+    return te->addr_code == addr;
+#endif
+}
+
+/* Add the pages of the code of 'tb' to the pages of a trace which starts
+   in page 'virt_page1'.  Return 0 if 'tb' cannot be part of the trace
+   because that would make three pages or because a page is not mapped.  */
+static int tb_trace_add_pages(CPUState *env, TranslationBlock *tb,
+                              target_ulong virt_page1,
+                              target_ulong *pvirt_page2)
+{
+    target_ulong vpage;
+    int j;
+
+    for (j = 0; j < 2; j++) {
+        vpage = (tb->pc + j * (tb->size - 1)) & TARGET_PAGE_MASK;
+        if (!tb_trace_page_mapped(env, vpage)) {
+            return 0;
+        }
+        if (vpage == virt_page1 || vpage == *pvirt_page2) {
+            continue;
+        }
+        if (*pvirt_page2 != -1) {
+            return 0;
+        }
+        *pvirt_page2 = vpage;
+    }
+    return 1;
+}
+
+/* Translate the chain of blocks starting at 'head' which was the most
+   frequently followed while they were cold as a single trace TB.  The
+   chain stops before a block whose code is in a third page or in a page
+   that is not mapped any more.  */
+static TranslationBlock *tb_gen_trace(CPUState *env, TranslationBlock *head)
+{
+    CPUState *env1;
+    TranslationBlock *tb, *cur, *next;
+    TBTrace *trace;
+    tb_page_addr_t phys_pc, phys_page2, phys;
+    target_ulong virt_page1, virt_page2, vpage;
+    int i, j, n, code_gen_size;
+
+    if (use_icount || head->cflags != 0 || head->invalid) {
+        return NULL;
+    }
+    virt_page1 = head->pc & TARGET_PAGE_MASK;
+    virt_page2 = -1;
+    if (!tb_trace_add_pages(env, head, virt_page1, &virt_page2)) {
+        return NULL;
+    }
+    trace = qemu_mallocz(sizeof(*trace));
+    trace->pc[0] = head->pc;
+    trace->nb_blocks = 1;
+    cur = head;
+    while (trace->nb_blocks < TB_TRACE_MAX_BLOCKS) {
+        n = cur->exit_count[1] > cur->exit_count[0];
+        next = cur->trace_next[n];
+        /* side exits go back to cpu_exec(), so only follow a branch
+           that is strongly biased */
+        if (cur->exit_count[n] == 0 ||
+            cur->exit_count[n] < 4 * cur->exit_count[n ^ 1] ||
+            next == NULL || next->invalid ||
+            next->trace || next->cflags != 0 ||
+            next->cs_base != head->cs_base || next->flags != head->flags) {
+            break;
+        }
+        /* loops are closed by a direct jump to the trace itself */
+        for (i = 0; i < trace->nb_blocks; i++) {
+            if (trace->pc[i] == next->pc) {
+                break;
+            }
+        }
+        if (i < trace->nb_blocks ||
+            !tb_trace_add_pages(env, next, virt_page1, &virt_page2)) {
+            break;
+        }
+        trace->pc[trace->nb_blocks++] = next->pc;
+        cur = next;
+    }
+    if (trace->nb_blocks < 2) {
+        qemu_free(trace);
+        return NULL;
+    }
+
+    phys_pc = get_page_addr_code(env, head->pc);
+    tb = tb_alloc(head->pc);
+    if (!tb) {
+        qemu_free(trace);
+        return NULL;
+    }
+    tb->tc_ptr = code_gen_ptr;
+    tb->cs_base = head->cs_base;
+    tb->flags = head->flags;
+    tb->trace = trace;
+    /* the translator may stop the trace early and updates nb_blocks */
+    cpu_gen_code(env, tb, &code_gen_size);
+
+    /* find the pages of the code that was translated, which are mapped
+       as checked above */
+    virt_page2 = -1;
+    phys_page2 = -1;
+    for (i = 0; i < trace->nb_blocks; i++) {
+        for (j = 0; j < 2; j++) {
+            vpage = (trace->pc[i] + j * (trace->size[i] - 1)) &
+                TARGET_PAGE_MASK;
+            if (vpage == virt_page1 || vpage == virt_page2) {
+                continue;
+            }
+            if (virt_page2 != -1) {
+                goto fail;
+            }
+            phys = get_page_addr_code(env, vpage);
+            virt_page2 = vpage;
+            phys_page2 = phys & TARGET_PAGE_MASK;
+        }
+    }
+    if (trace->nb_blocks < 2) {
+        goto fail;
+    }
+    trace->virt_page2 = virt_page2;
+    code_gen_advance(code_gen_size);
     tb_link_page(tb, phys_pc, phys_page2);
+
+    /* the trace is now found before 'head': make the blocks that were
+       chained to 'head' look it up again */
+    tb_reset_incoming_jumps(head);
+    for (env1 = first_cpu; env1 != NULL; env1 = env1->next_cpu) {
+        env1->tb_jmp_cache[tb_jmp_cache_hash_func(head->pc)] = NULL;
+    }
+    tb_trace_count++;
+    return tb;
+ fail:
+    tb->trace = NULL;
+    tb_free(tb);
+    qemu_free(trace);
+    return NULL;
+}
+
+void tb_trace_init(int threshold)
+{
+    if (use_icount) {
+        fprintf(stderr, "qemu: -tb-trace cannot be used with -icount\n");
+        exit(1);
+    }
+    tb_trace_threshold = threshold;
+}
+
+/* Called by cpu_exec() before executing 'tb', which was reached through
+   the exit *pnext_tb.  An exit is not chained until it has been taken
+   tb_trace_threshold times so that it keeps being counted here.  Return
+   the TB to execute, which is a new trace when 'tb' is a loop header
+   that just became hot.  */
+TranslationBlock *tb_trace_profile(CPUState *env, unsigned long *pnext_tb,
+                                   TranslationBlock *tb)
+{
+    TranslationBlock *prev, *trace;
+    int n;
+
+    prev = (TranslationBlock *)(*pnext_tb & ~3);
+    n = *pnext_tb & 3;
+    /* once both ends of the edge are hot there is nothing left to
+       record; skip the lock so that profiling costs nothing in the
+       steady state */
+    if ((prev == NULL || n >= 2 || prev->trace ||
+         prev->exit_count[n] >= tb_trace_threshold) &&
+        (tb->trace || tb->exec_count >= tb_trace_threshold)) {
+        return tb;
+    }
+    tb_mutex_lock();
+    if (prev != NULL && n < 2 && !prev->trace) {
+        prev->trace_next[n] = tb;
+        if (prev->exit_count[n] < 0xffff) {
+            prev->exit_count[n]++;
+        }
+        if (tb->pc <= prev->pc) {
+            tb->trace_head = 1;
+        }
+        if (prev->exit_count[n] < tb_trace_threshold) {
+            *pnext_tb = 0;
+        }
+    }
+    if (!tb->trace && tb->exec_count < tb_trace_threshold &&
+        ++tb->exec_count == tb_trace_threshold && tb->trace_head) {
+        trace = tb_gen_trace(env, tb);
+        if (trace) {
+            tb = trace;
+        }
+    }
+    tb_mutex_unlock();
     return tb;
 }
 
@@ -981,12 +1424,12 @@ TranslationBlock *tb_gen_code(CPUState *env,
    the same physical page. 'is_cpu_write_access' should be true if called
    from a real cpu write access: the virtual CPU will exit the current
    TB if code is modified inside this TB. */
-void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
-                                   int is_cpu_write_access)
+static void tb_invalidate_phys_page_range1(tb_page_addr_t start,
+                                           tb_page_addr_t end,
+                                           int is_cpu_write_access)
 {
     TranslationBlock *tb, *tb_next, *saved_tb;
     CPUState *env = cpu_single_env;
-    tb_page_addr_t tb_start, tb_end;
     PageDesc *p;
     int n;
 #ifdef TARGET_HAS_PRECISE_SMC
@@ -1015,17 +1458,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         n = (long)tb & 3;
         tb = (TranslationBlock *)((long)tb & ~3);
         tb_next = tb->page_next[n];
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-            tb_end = tb_start + tb->size;
-        } else {
-            tb_start = tb->page_addr[1];
-            tb_end = tb_start + ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        if (!(tb_end <= start || tb_start >= end)) {
+        if (tb_page_intersects(tb, n, start, end)) {
 #ifdef TARGET_HAS_PRECISE_SMC
             if (current_tb_not_found) {
                 current_tb_not_found = 0;
@@ -1087,6 +1520,14 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
 }
 
+void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
+                                   int is_cpu_write_access)
+{
+    tb_mutex_lock();
+    tb_invalidate_phys_page_range1(start, end, is_cpu_write_access);
+    tb_mutex_unlock();
+}
+
 /* len must be <= 8 and start must be a multiple of len */
 static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
@@ -1100,9 +1541,10 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   cpu_single_env->eip + (long)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_mutex_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
-        return;
+        goto out;
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1112,6 +1554,8 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+ out:
+    tb_mutex_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1229,18 +1673,39 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current code buffer region.
+   Return NULL if it has too many translation blocks or too much
+   generated code, in which case a region must be evicted.  The TB stays
+   invalid until tb_link_page(). */
 TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    /* a guest fault while the last TB was translated (longjmp out of
+       cpu_gen_code() or get_page_addr_code()) left it unlinked: reuse
+       it and its code space */
+    if (r->nb_tbs > 0 && r->tbs[r->nb_tbs - 1].page_addr[0] == -1) {
+        tb = &r->tbs[--r->nb_tbs];
+        nb_tbs--;
+        code_gen_ptr = tb->tc_ptr;
+        qemu_free(tb->trace);
+    }
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        (code_gen_ptr - r->start) >= code_gen_buffer_max_size)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
+    tb->tc_ptr = code_gen_ptr;
     tb->cflags = 0;
+    tb->invalid = 1;
+    tb->page_addr[0] = -1;
+    tb->exec_count = 0;
+    tb->exit_count[0] = tb->exit_count[1] = 0;
+    tb->trace_head = 0;
+    tb->trace_next[0] = tb->trace_next[1] = NULL;
+    tb->trace = NULL;
     return tb;
 }
 
@@ -1249,12 +1714,73 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    CodeGenRegion *r = &code_gen_regions[code_gen_region];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         nb_tbs--;
     }
 }
 
+/* Move on to the next code buffer region, which holds the oldest code,
+   and invalidate its TBs.  With tcg_multithread it must be called while
+   no other vCPU executes translated code.  */
+void tb_evict_region(CPUState *env1)
+{
+    CodeGenRegion *r;
+    TranslationBlock *tb, *first, *last;
+    int i, j, n;
+
+    tb_mutex_lock();
+    code_gen_regions[code_gen_region].end = code_gen_ptr;
+    code_gen_region = (code_gen_region + 1) % code_gen_nb_regions;
+    r = &code_gen_regions[code_gen_region];
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &r->tbs[i];
+        if (!tb->invalid) {
+            tb_unlink(tb, -1);
+        }
+        qemu_free(tb->trace);
+        tb->trace = NULL;
+    }
+    /* the other TBs must not remember the evicted ones as the
+       successors to build a trace from */
+    first = r->tbs;
+    last = r->tbs + r->nb_tbs;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        CodeGenRegion *r1 = &code_gen_regions[i];
+
+        for (j = 0; j < r1->nb_tbs && r1 != r; j++) {
+            tb = &r1->tbs[j];
+            for (n = 0; n < 2; n++) {
+                if (tb->trace_next[n] >= first && tb->trace_next[n] < last) {
+                    tb->trace_next[n] = NULL;
+                }
+            }
+        }
+    }
+
+    if (tb_phys_hash_count < (1u << tb_phys_hash_bits) / 8 &&
+        tb_phys_hash_bits > CODE_GEN_PHYS_HASH_MIN_BITS) {
+        tb_phys_hash_resize(tb_phys_hash_bits - 1);
+    }
+
+    nb_tbs -= r->nb_tbs;
+    tb_evict_tb_count += r->nb_tbs;
+    r->nb_tbs = 0;
+    r->end = r->start;
+    code_gen_ptr = r->start;
+    /* the TB the caller was coming from may be gone */
+    tb_invalidated_flag = 1;
+    tb_evict_count++;
+#if defined(CONFIG_IOTHREAD) && !defined(CONFIG_USER_ONLY)
+    tb_evict_requested = 0;
+#endif
+    tb_mutex_unlock();
+}
+
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 void tb_link_page(TranslationBlock *tb,
@@ -1266,11 +1792,13 @@ void tb_link_page(TranslationBlock *tb,
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
+    tb->invalid = 0;
     /* add in the physical hash table */
     h = tb_phys_hash_func(phys_pc);
     ptb = &tb_phys_hash[h];
     tb->phys_hash_next = *ptb;
     *ptb = tb;
+    tb_phys_hash_count++;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1289,6 +1817,12 @@ void tb_link_page(TranslationBlock *tb,
     if (tb->tb_next_offset[1] != 0xffff)
         tb_reset_jump(tb, 1);
 
+    /* the rehash needs page_addr[0] */
+    if (tb_phys_hash_count > (1u << tb_phys_hash_bits) &&
+        tb_phys_hash_bits < CODE_GEN_PHYS_HASH_MAX_BITS) {
+        tb_phys_hash_resize(tb_phys_hash_bits + 1);
+    }
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1297,23 +1831,29 @@ void tb_link_page(TranslationBlock *tb,
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
-TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+static TranslationBlock *tb_find_pc1(unsigned long tc_ptr)
 {
     int m_min, m_max, m;
     unsigned long v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+    uint8_t *end;
 
-    if (nb_tbs <= 0)
+    if (tc_ptr < (unsigned long)code_gen_buffer)
+        return NULL;
+    m = (tc_ptr - (unsigned long)code_gen_buffer) / code_gen_region_size;
+    if (m >= code_gen_nb_regions)
         return NULL;
-    if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+    r = &code_gen_regions[m];
+    end = (m == code_gen_region) ? code_gen_ptr : r->end;
+    if (r->nb_tbs <= 0 || tc_ptr >= (unsigned long)end)
         return NULL;
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1323,7 +1863,17 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
+}
+
+TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+{
+    TranslationBlock *tb;
+
+    tb_mutex_lock();
+    tb = tb_find_pc1(tc_ptr);
+    tb_mutex_unlock();
+    return tb;
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1657,6 +2207,8 @@ void cpu_interrupt(CPUState *env, int mask)
             cpu_abort(env, "Raised interrupt while not in I/O function");
         }
 #endif
+    } else if (tcg_multithread) {
+        env->icount_decr.u16.high = 0xffff;
     } else {
         cpu_unlink_tb(env);
     }
@@ -1670,7 +2222,14 @@ void cpu_reset_interrupt(CPUState *env, int mask)
 void cpu_exit(CPUState *env)
 {
     env->exit_request = 1;
-    cpu_unlink_tb(env);
+    if (tcg_multithread) {
+        /* TB chains are shared between threads: rather than unlinking
+           them, make the check at the start of each TB fail */
+        __sync_synchronize();
+        env->icount_decr.u16.high = 0xffff;
+    } else {
+        cpu_unlink_tb(env);
+    }
 }
 
 const CPULogItem cpu_log_items[] = {
@@ -1927,10 +2486,28 @@ static CPUTLBEntry s_cputlb_empty_entry = {
 
 /* NOTE: if flush_global is true, also flush global entries (not
    implemented yet) */
+#if defined(CONFIG_IOTHREAD)
+static void tlb_flush_work(void *data)
+{
+    tlb_flush(data, 1);
+}
+#endif
+
 void tlb_flush(CPUState *env, int flush_global)
 {
     int i;
 
+#if defined(CONFIG_IOTHREAD)
+    /* with tcg_multithread the TLB belongs to the vCPU thread, which
+       may be using it right now: queue the flush there instead.  A
+       stopped vCPU is flushed at once, cpu_reset() relies on that after
+       clearing the TLB with the rest of the CPU state.  */
+    if (tcg_multithread && env->created && !qemu_cpu_self(env) &&
+        !cpu_is_stopped(env)) {
+        async_run_on_cpu(env, tlb_flush_work, env);
+        return;
+    }
+#endif
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -1944,6 +2521,12 @@ void tlb_flush(CPUState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -1952,14 +2535,20 @@ void tlb_flush(CPUState *env, int flush_global)
     tlb_flush_count++;
 }
 
+/* return true if the entry maps the page 'addr' for any access type */
+static inline int tlb_entry_match(CPUTLBEntry *tlb_entry, target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_match(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
@@ -1991,6 +2580,12 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
 
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][i], addr);
+        }
+    }
+
     tlb_flush_jmp_cache(env, addr);
 }
 
@@ -2011,25 +2606,186 @@ static void tlb_unprotect_code_phys(CPUState *env, ram_addr_t ram_addr,
     cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
 }
 
+/* The entry may belong to another vCPU that is running, so it is only
+   changed if that vCPU did not change it since we looked at it.  A vCPU
+   that makes an entry writable again looks at the dirty bits after the
+   update (tlb_recheck_dirty), so a lost race on either side is repaired
+   by the other one.  */
 static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
                                          unsigned long start, unsigned long length)
 {
+    target_ulong addr_write = tlb_entry->addr_write;
     unsigned long addr;
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
-        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+
+    if ((addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+        addr = (addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write = (tlb_entry->addr_write & TARGET_PAGE_MASK) | TLB_NOTDIRTY;
+            __sync_bool_compare_and_swap(&tlb_entry->addr_write, addr_write,
+                                         (addr_write & TARGET_PAGE_MASK) |
+                                         TLB_NOTDIRTY);
         }
     }
 }
 
+/* Called by a vCPU on its own entry after it stored an addr_write that
+   lets writes to RAM bypass the dirty logging.  With tcg_multithread the
+   page may have been cleaned in the meantime by another thread that did
+   not see the new entry yet; put TLB_NOTDIRTY back in that case.  */
+static inline void tlb_recheck_dirty(CPUTLBEntry *tlb_entry)
+{
+    target_ulong addr_write;
+    ram_addr_t ram_addr;
+    void *p;
+
+    if (!tcg_multithread) {
+        return;
+    }
+    addr_write = tlb_entry->addr_write;
+    if ((addr_write & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
+        return;
+    }
+    /* order the entry update against reading the dirty bits; pairs with
+       the barrier in tlb_reset_dirty_range_all */
+    __sync_synchronize();
+    p = (void *)(unsigned long)((addr_write & TARGET_PAGE_MASK)
+        + tlb_entry->addend);
+    ram_addr = qemu_ram_addr_from_host(p);
+    if (!cpu_physical_memory_is_dirty(ram_addr)) {
+        __sync_bool_compare_and_swap(&tlb_entry->addr_write, addr_write,
+                                     addr_write | TLB_NOTDIRTY);
+    }
+}
+
+/* Make every TLB entry that writes to host RAM in [start1, start1 + length)
+   take the slow path again.  */
+static void tlb_reset_dirty_range_all(unsigned long start1,
+                                      unsigned long length)
+{
+    CPUState *env;
+    int i;
+
+    /* the dirty bits were cleared before; pairs with tlb_recheck_dirty */
+    __sync_synchronize();
+    for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            for(i = 0; i < CPU_TLB_SIZE; i++)
+                tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
+                                      start1, length);
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
+        }
+    }
+}
+
+/* Clear the pages in [start, start + length) from the logs of the clients
+   in dirty_flags.  Whole words are cleared with a single store; partial
+   words at the edges of the range are cleared atomically.  */
+void cpu_physical_memory_mask_dirty_range(ram_addr_t start, ram_addr_t length,
+                                          int dirty_flags)
+{
+    ram_addr_t page, end;
+    int client;
+
+    end = (start + length) >> TARGET_PAGE_BITS;
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        unsigned long *map = phys_ram_dirty[client];
+
+        if (!(dirty_flags & (1 << client))) {
+            continue;
+        }
+        page = start >> TARGET_PAGE_BITS;
+        while (page < end) {
+            unsigned long mask = BITMAP_FIRST_WORD_MASK(page);
+            ram_addr_t next = (page | (BITS_PER_LONG - 1)) + 1;
+
+            if (next > end) {
+                mask &= BITMAP_LAST_WORD_MASK(end);
+                next = end;
+            }
+            if (map[BIT_WORD(page)] & mask) {
+                if (mask == ~0UL) {
+                    map[BIT_WORD(page)] = 0;
+                } else {
+                    __sync_fetch_and_and(&map[BIT_WORD(page)], ~mask);
+                }
+            }
+            page = next;
+        }
+    }
+}
+
+/* Merge a little-endian bitmap of npages dirty pages starting at ram
+   address start, as returned by the KVM dirty log, into every client's
+   log.  When start is word aligned in the logs this is one OR per word.  */
+void cpu_physical_memory_set_dirty_lebitmap(ram_addr_t start,
+                                            const unsigned long *bitmap,
+                                            ram_addr_t npages)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t i, nwords = BITS_TO_LONGS(npages);
+    int client;
+
+    for (i = 0; i < nwords; i++) {
+        unsigned long c;
+
+        if (!bitmap[i]) {
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        if (i == nwords - 1) {
+            c &= BITMAP_LAST_WORD_MASK(npages);
+        }
+        if (page % BITS_PER_LONG == 0) {
+            ram_addr_t w = BIT_WORD(page) + i;
+
+            for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                if ((phys_ram_dirty[client][w] & c) != c) {
+                    __sync_fetch_and_or(&phys_ram_dirty[client][w], c);
+                }
+            }
+        } else {
+            while (c) {
+                int j = ffsl(c) - 1;
+
+                c &= c - 1;
+                for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                    cpu_physical_memory_mark_dirty(client,
+                        page + i * BITS_PER_LONG + j);
+                }
+            }
+        }
+    }
+}
+
+/* Return the ram address of the first page in [start, end) that is dirty
+   for client, or end if there is none.  */
+ram_addr_t cpu_physical_memory_find_next_dirty(int client, ram_addr_t start,
+                                               ram_addr_t end)
+{
+    ram_addr_t last = end >> TARGET_PAGE_BITS;
+    ram_addr_t page;
+
+    page = find_next_bit(phys_ram_dirty[client], last,
+                         start >> TARGET_PAGE_BITS);
+    return page < last ? page << TARGET_PAGE_BITS : end;
+}
+
+/* Count the pages in [start, end) that are dirty for client.  */
+ram_addr_t cpu_physical_memory_count_dirty(int client, ram_addr_t start,
+                                           ram_addr_t end)
+{
+    return bitmap_count(phys_ram_dirty[client], start >> TARGET_PAGE_BITS,
+                        end >> TARGET_PAGE_BITS);
+}
+
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
 {
-    CPUState *env;
     unsigned long length, start1;
-    int i;
 
     start &= TARGET_PAGE_MASK;
     end = TARGET_PAGE_ALIGN(end);
@@ -2049,14 +2805,42 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
         abort();
     }
 
-    for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        int mmu_idx;
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            for(i = 0; i < CPU_TLB_SIZE; i++)
-                tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                      start1, length);
+    tlb_reset_dirty_range_all(start1, length);
+}
+
+/* Move the pages that are dirty for client into bitmap, which has one bit
+   per page of RAM, clear them from the client's log and re-arm the TLBs
+   so that the next write to each page logs it again.  Returns the number
+   of pages that were not already set in bitmap.  */
+ram_addr_t cpu_physical_memory_take_dirty(int client, unsigned long *bitmap)
+{
+    unsigned long *map = phys_ram_dirty[client];
+    ram_addr_t i, nwords, npages, count = 0;
+    RAMBlock *block;
+
+    npages = last_ram_offset >> TARGET_PAGE_BITS;
+    nwords = BITS_TO_LONGS(npages);
+    for (i = 0; i < nwords; i++) {
+        unsigned long bits;
+
+        if (!map[i]) {
+            continue;
+        }
+        bits = __sync_fetch_and_and(&map[i], 0);
+        if (i == nwords - 1) {
+            bits &= BITMAP_LAST_WORD_MASK(npages);
+        }
+        count += __builtin_popcountl(bits & ~bitmap[i]);
+        bitmap[i] |= bits;
+    }
+
+    if (count) {
+        for (block = ram_blocks; block; block = block->next) {
+            tlb_reset_dirty_range_all((unsigned long)block->host,
+                                      block->length);
         }
     }
+    return count;
 }
 
 int cpu_physical_memory_set_dirty_tracking(int enable)
@@ -2104,13 +2888,20 @@ void cpu_tlb_update_dirty(CPUState *env)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
+        }
     }
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY))
-        tlb_entry->addr_write = vaddr;
+    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
+        if (__sync_bool_compare_and_swap(&tlb_entry->addr_write,
+                                         vaddr | TLB_NOTDIRTY, vaddr)) {
+            tlb_recheck_dirty(tlb_entry);
+        }
+    }
 }
 
 /* update the TLB corresponding to virtual page vaddr
@@ -2124,6 +2915,12 @@ static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][i], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -2165,6 +2962,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     CPUTLBEntry *te;
     CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
+    int i;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -2222,8 +3020,25 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* a stale copy of the page may still be in the victim TLB, e.g. if
+       it was not writable yet */
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][i], vaddr);
+    }
+    /* keep the entry we replace in the victim TLB */
+    if (!tlb_entry_match(te, vaddr) &&
+        (te->addr_read != -1 || te->addr_write != -1 ||
+         te->addr_code != -1)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+        tlb_recheck_dirty(&env->tlb_v_table[mmu_idx][vidx]);
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -2246,12 +3061,55 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
             te->addr_write = address | TLB_NOTDIRTY;
         } else {
             te->addr_write = address;
+            tlb_recheck_dirty(te);
         }
     } else {
         te->addr_write = -1;
     }
 }
 
+/* Called by the softmmu helpers when the page of 'addr' is not in the
+   main TLB.  If the victim TLB has it, swap it with the main TLB entry
+   at 'index' and return 1, otherwise return 0 and let the caller do a
+   page table walk with tlb_fill().  'access_type' is 0 for a read, 1
+   for a write and 2 for a code access.  */
+int tlb_victim_lookup(CPUState *env, target_ulong addr, int access_type,
+                      int mmu_idx, int index)
+{
+    CPUTLBEntry *te, *ve, tmp;
+    target_phys_addr_t tmp_io;
+    target_ulong tlb_addr;
+    int i;
+
+    env->tlb_miss_count++;
+    addr &= TARGET_PAGE_MASK;
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        ve = &env->tlb_v_table[mmu_idx][i];
+        if (access_type == 0) {
+            tlb_addr = ve->addr_read;
+        } else if (access_type == 1) {
+            tlb_addr = ve->addr_write;
+        } else {
+            tlb_addr = ve->addr_code;
+        }
+        if (addr == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            te = &env->tlb_table[mmu_idx][index];
+            tmp = *te;
+            *te = *ve;
+            *ve = tmp;
+            tmp_io = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][i];
+            env->iotlb_v[mmu_idx][i] = tmp_io;
+            /* the copies may have lost a concurrent tlb_reset_dirty_range */
+            tlb_recheck_dirty(te);
+            tlb_recheck_dirty(ve);
+            env->tlb_victim_hit_count++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
 #else
 
 void tlb_flush(CPUState *env, int flush_global)
@@ -2773,6 +3631,8 @@ static void *file_ram_alloc(ram_addr_t memory, const char *path)
 ram_addr_t qemu_ram_alloc(ram_addr_t size)
 {
     RAMBlock *new_block;
+    ram_addr_t page;
+    int i;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = qemu_malloc(sizeof(*new_block));
@@ -2809,10 +3669,22 @@ ram_addr_t qemu_ram_alloc(ram_addr_t size)
     new_block->next = ram_blocks;
     ram_blocks = new_block;
 
-    phys_ram_dirty = qemu_realloc(phys_ram_dirty,
-        (last_ram_offset + size) >> TARGET_PAGE_BITS);
-    memset(phys_ram_dirty + (last_ram_offset >> TARGET_PAGE_BITS),
-           0xff, size >> TARGET_PAGE_BITS);
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        ram_addr_t old_words, new_words;
+
+        old_words = BITS_TO_LONGS(last_ram_offset >> TARGET_PAGE_BITS);
+        new_words = BITS_TO_LONGS((last_ram_offset + size) >> TARGET_PAGE_BITS);
+        phys_ram_dirty[i] = qemu_realloc(phys_ram_dirty[i],
+                                         new_words * sizeof(unsigned long));
+        /* New RAM starts dirty for every client.  Bits past the end of
+           RAM in the last word are never looked at.  */
+        for (page = last_ram_offset >> TARGET_PAGE_BITS;
+             page < (old_words * BITS_PER_LONG); page++) {
+            phys_ram_dirty[i][BIT_WORD(page)] |= BIT_MASK(page);
+        }
+        memset(phys_ram_dirty[i] + old_words, 0xff,
+               (new_words - old_words) * sizeof(unsigned long));
+    }
 
     last_ram_offset += size;
 
@@ -2837,31 +3709,27 @@ void qemu_ram_free(ram_addr_t addr)
  */
 void *qemu_get_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *prev;
-    RAMBlock **prevp;
     RAMBlock *block;
 
-    prev = NULL;
-    prevp = &ram_blocks;
-    block = ram_blocks;
-    while (block && (block->offset > addr
-                     || block->offset + block->length <= addr)) {
-        if (prev)
-          prevp = &prev->next;
-        prev = block;
-        block = block->next;
-    }
-    if (!block) {
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+    /* the list is not reordered: the migration threads and the vCPU
+       threads walk it without the iothread lock */
+    for (block = ram_blocks; block; block = block->next) {
+        if (addr - block->offset < block->length) {
+            return block->host + (addr - block->offset);
+        }
     }
-    /* Move this entry to to start of the list.  */
-    if (prev) {
-        prev->next = block->next;
-        block->next = *prevp;
-        *prevp = block;
+    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+    abort();
+}
+
+/* Call func on every RAM block, in no particular order.  */
+void qemu_ram_foreach_block(RAMBlockIterFunc *func, void *opaque)
+{
+    RAMBlock *block;
+
+    for (block = ram_blocks; block; block = block->next) {
+        func(block->host, block->offset, block->length, opaque);
     }
-    return block->host + (addr - block->offset);
 }
 
 /* Some of the softmmu routines need to translate from a host pointer
@@ -2970,11 +3838,11 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stb_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -2990,11 +3858,11 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stw_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3010,14 +3878,39 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stl_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
+/* Bracket a store made directly through a host pointer to a RAM page
+   whose TLB entry is marked TLB_NOTDIRTY, as the atomic helpers do.
+   env->mem_io_pc and env->mem_io_vaddr must be set as for an I/O
+   access.  */
+void cpu_notdirty_store_begin(ram_addr_t ram_addr, int len)
+{
+    if (!(cpu_physical_memory_get_dirty_flags(ram_addr) & CODE_DIRTY_FLAG)) {
+#if !defined(CONFIG_USER_ONLY)
+        tb_invalidate_phys_page_fast(ram_addr, len);
+#endif
+    }
+}
+
+void cpu_notdirty_store_end(CPUState *env, ram_addr_t ram_addr,
+                            target_ulong vaddr)
+{
+    int dirty_flags;
+
+    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    if (dirty_flags == ALL_DIRTY_FLAGS)
+        tlb_set_dirty(env, vaddr);
+}
+
 static CPUReadMemoryFunc * const error_mem_read[3] = {
     NULL, /* never used */
     NULL, /* never used */
@@ -3054,6 +3947,8 @@ static void check_watchpoint(int offset, int len_mask, int flags)
             wp->flags |= BP_WATCHPOINT_HIT;
             if (!env->watchpoint_hit) {
                 env->watchpoint_hit = wp;
+                /* released by cpu_exec() after the longjmp below */
+                tb_mutex_lock();
                 tb = tb_find_pc(env->mem_io_pc);
                 if (!tb) {
                     cpu_abort(env, "check_watchpoint: could not find TB for "
@@ -3404,6 +4299,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
                 /* XXX: could force cpu_single_env to NULL to avoid
                    potential bugs */
+                cpu_io_lock();
                 if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit write access */
                     val = ldl_p(buf);
@@ -3420,6 +4316,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     io_mem_write[io_index][0](io_mem_opaque[io_index], addr1, val);
                     l = 1;
                 }
+                cpu_io_unlock();
             } else {
                 unsigned long addr1;
                 addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -3431,7 +4328,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
                 }
             }
         } else {
@@ -3442,6 +4339,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
                 if (p)
                     addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+                cpu_io_lock();
                 if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit read access */
                     val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr1);
@@ -3458,6 +4356,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     stb_p(buf, val);
                     l = 1;
                 }
+                cpu_io_unlock();
             } else {
                 /* RAM case */
                 ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
@@ -3603,6 +4502,7 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         } else {
             addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
             ptr = qemu_get_ram_ptr(addr1);
+            postcopy_incoming_fault_in(ptr, l);
         }
         if (!done) {
             ret = ptr;
@@ -3638,7 +4538,7 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
                 }
                 addr1 += l;
                 access_len -= l;
@@ -3676,7 +4576,9 @@ uint32_t ldl_phys(target_phys_addr_t addr)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
+        cpu_io_unlock();
     } else {
         /* RAM case */
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
@@ -3708,6 +4610,7 @@ uint64_t ldq_phys(target_phys_addr_t addr)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
 #ifdef TARGET_WORDS_BIGENDIAN
         val = (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr) << 32;
         val |= io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4);
@@ -3715,6 +4618,7 @@ uint64_t ldq_phys(target_phys_addr_t addr)
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
         val |= (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4) << 32;
 #endif
+        cpu_io_unlock();
     } else {
         /* RAM case */
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
@@ -3754,7 +4658,9 @@ uint32_t lduw_phys(target_phys_addr_t addr)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
         val = io_mem_read[io_index][1](io_mem_opaque[io_index], addr);
+        cpu_io_unlock();
     } else {
         /* RAM case */
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
@@ -3785,7 +4691,9 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
+        cpu_io_unlock();
     } else {
         unsigned long addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
         ptr = qemu_get_ram_ptr(addr1);
@@ -3797,7 +4705,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
             }
         }
     }
@@ -3821,6 +4729,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
 #ifdef TARGET_WORDS_BIGENDIAN
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val >> 32);
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val);
@@ -3828,6 +4737,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val >> 32);
 #endif
+        cpu_io_unlock();
     } else {
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
             (addr & ~TARGET_PAGE_MASK);
@@ -3854,7 +4764,9 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
+        cpu_io_unlock();
     } else {
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -3866,7 +4778,7 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -3897,7 +4809,9 @@ void stw_phys(target_phys_addr_t addr, uint32_t val)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        cpu_io_lock();
         io_mem_write[io_index][1](io_mem_opaque[io_index], addr, val);
+        cpu_io_unlock();
     } else {
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -3909,7 +4823,7 @@ void stw_phys(target_phys_addr_t addr, uint32_t val)
             tb_invalidate_phys_page_range(addr1, addr1 + 2, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -4012,44 +4926,144 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
 
 #if !defined(CONFIG_USER_ONLY)
 
+/* chain length histograms for dump_exec_info(): 0, 1, 2, 3, 4-7, 8-15
+   and 16 or more elements */
+#define CHAIN_HIST_SIZE 7
+
+typedef struct ChainHist {
+    int count[CHAIN_HIST_SIZE];
+    int max;
+    int64_t total;
+    int64_t total_sq;
+} ChainHist;
+
+static void chain_hist_add(ChainHist *hist, int len)
+{
+    int i;
+
+    if (len < 4) {
+        i = len;
+    } else if (len < 8) {
+        i = 4;
+    } else if (len < 16) {
+        i = 5;
+    } else {
+        i = 6;
+    }
+    hist->count[i]++;
+    if (len > hist->max) {
+        hist->max = len;
+    }
+    hist->total += len;
+    hist->total_sq += len * len;
+}
+
+static void chain_hist_dump(FILE *f,
+                            int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
+                            const char *name, ChainHist *hist)
+{
+    /* a lookup of an element walks (len + 1) / 2 entries on average */
+    cpu_fprintf(f, "%-19s 0:%d 1:%d 2:%d 3:%d 4-7:%d 8-15:%d 16+:%d "
+                "(max %d, avg walk %0.2f)\n", name,
+                hist->count[0], hist->count[1], hist->count[2],
+                hist->count[3], hist->count[4], hist->count[5],
+                hist->count[6], hist->max,
+                hist->total ?
+                (double)(hist->total_sq + hist->total) / (2 * hist->total) :
+                0);
+}
+
 void dump_exec_info(FILE *f,
                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, n, n1, len, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
-    TranslationBlock *tb;
+    unsigned long code_size;
+    CodeGenRegion *r;
+    TranslationBlock *tb, *tb1;
+    ChainHist hash_hist, page_hist;
+    PageDesc *p;
+    CPUState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        r = &code_gen_regions[i];
+        code_size += (i == code_gen_region ? code_gen_ptr : r->end) - r->start;
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
+            }
+        }
+    }
+
+    memset(&hash_hist, 0, sizeof(hash_hist));
+    for (i = 0; i < (1 << tb_phys_hash_bits); i++) {
+        len = 0;
+        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+            len++;
+        }
+        chain_hist_add(&hash_hist, len);
+    }
+    /* each page list is counted from the TB at its head */
+    memset(&page_hist, 0, sizeof(page_hist));
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        r = &code_gen_regions[i];
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            for (n = 0; n < 2 && !tb->invalid; n++) {
+                if (tb->page_addr[n] == -1) {
+                    continue;
+                }
+                p = page_find(tb->page_addr[n] >> TARGET_PAGE_BITS);
+                if (!p || (TranslationBlock *)((long)p->first_tb & ~3) != tb) {
+                    continue;
+                }
+                len = 0;
+                tb1 = p->first_tb;
+                while (tb1 != NULL) {
+                    n1 = (long)tb1 & 3;
+                    tb1 = (TranslationBlock *)((long)tb1 & ~3);
+                    tb1 = tb1->page_next[n1];
+                    len++;
+                }
+                chain_hist_add(&page_hist, len);
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %ld/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+                code_size, code_gen_buffer_max_size * code_gen_nb_regions);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
+    cpu_fprintf(f, "code regions        %d x %ld KB (filling #%d)\n",
+                code_gen_nb_regions, code_gen_region_size / 1024,
+                code_gen_region);
+    cpu_fprintf(f, "TB hash size        %d buckets for %d TBs (%d resizes)\n",
+                1 << tb_phys_hash_bits, tb_phys_hash_count,
+                tb_phys_hash_resize_count);
+    chain_hist_dump(f, cpu_fprintf, "TB hash chains", &hash_hist);
+    chain_hist_dump(f, cpu_fprintf, "TB page lists", &page_hist);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %d bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+                nb_tbs ? (int)(code_size / nb_tbs) : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4060,8 +5074,26 @@ void dump_exec_info(FILE *f,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB evict count      %d regions (%d TBs)\n",
+                tb_evict_count, tb_evict_tb_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB trace count      %d\n", tb_trace_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB size            %d entries (victim TLB %d)\n",
+                CPU_TLB_SIZE, CPU_VTLB_SIZE);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "CPU #%d indirect jump lookups %" PRIu64
+                    " (%" PRIu64 " hits)\n", env->cpu_index,
+                    env->tb_lookup_hits + env->tb_lookup_misses,
+                    env->tb_lookup_hits);
+        cpu_fprintf(f, "CPU #%d TLB misses %" PRIu64 " (victim hits %"
+                    PRIu64 ", page walks %" PRIu64 ")\n", env->cpu_index,
+                    env->tlb_miss_count, env->tlb_victim_hit_count,
+                    env->tlb_miss_count - env->tlb_victim_hit_count);
+    }
+#if !defined(CONFIG_USER_ONLY)
+    tb_cache_dump_info(f, cpu_fprintf);
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
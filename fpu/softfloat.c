@@ -51,6 +51,28 @@ these four paragraphs for those parts of this code that are retained.
 *----------------------------------------------------------------------------*/
 #include "softfloat-specialize.h"
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  With round-to-nearest-even and the inexact flag already
+| raised, an operation on zero or normal operands whose result is a normal
+| number larger than the smallest one cannot change the exception flags, and
+| the host FPU computes exactly the same result as the code below.  This only
+| holds when the host evaluates float and double expressions in their own
+| precision (no x87 excess precision) and is left in round-to-nearest.  Other
+| cases fall back to the bit exact emulation.
+*----------------------------------------------------------------------------*/
+#include <float.h>
+#include <math.h>
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0 && \
+    !defined(CONFIG_SOFTFLOAT_NO_HOST_FLOAT)
+#define USE_HOST_FLOAT
+#endif
+
+#ifdef USE_HOST_FLOAT
+#define HOST_FLOAT_USABLE()                                             \
+    (STATUS(float_rounding_mode) == float_round_nearest_even &&         \
+     (STATUS(float_exception_flags) & float_flag_inexact))
+#endif
+
 void set_float_rounding_mode(int val STATUS_PARAM)
 {
     STATUS(float_rounding_mode) = val;
@@ -1738,6 +1760,42 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+#ifdef USE_HOST_FLOAT
+typedef union {
+    bits32 i;
+    float f;
+} host_float32;
+
+INLINE float float32_to_host(float32 a)
+{
+    host_float32 u;
+    u.i = float32_val(a);
+    return u.f;
+}
+
+INLINE float32 float32_from_host(float f)
+{
+    host_float32 u;
+    u.f = f;
+    return make_float32(u.i);
+}
+
+/* Zero or normal: neither a NaN, an infinity nor a denormal.  */
+INLINE int float32_host_operand(float32 a)
+{
+    bits32 e = float32_val(a) & 0x7f800000;
+    return (e != 0 && e != 0x7f800000) || float32_is_zero(a);
+}
+
+/* Normal and larger than the smallest normal: rounding can have neither
+   overflowed nor underflowed.  */
+INLINE int float32_host_result(float32 a)
+{
+    bits32 m = float32_val(a) & 0x7fffffff;
+    return m > 0x00800000 && m < 0x7f800000;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -1748,6 +1806,16 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() &&
+        float32_host_operand(a) && float32_host_operand(b)) {
+        /* the sum of two normals is exact when it is zero */
+        float32 z = float32_from_host(float32_to_host(a) + float32_to_host(b));
+        if (float32_host_result(z) || float32_is_zero(z)) {
+            return z;
+        }
+    }
+#endif
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -1769,6 +1837,15 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() &&
+        float32_host_operand(a) && float32_host_operand(b)) {
+        float32 z = float32_from_host(float32_to_host(a) - float32_to_host(b));
+        if (float32_host_result(z) || float32_is_zero(z)) {
+            return z;
+        }
+    }
+#endif
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -1794,6 +1871,16 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     bits64 zSig64;
     bits32 zSig;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() &&
+        float32_host_operand(a) && float32_host_operand(b)) {
+        float32 z = float32_from_host(float32_to_host(a) * float32_to_host(b));
+        if (float32_host_result(z) ||
+            float32_is_zero(a) || float32_is_zero(b)) {
+            return z;
+        }
+    }
+#endif
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -1852,6 +1939,15 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     int16 aExp, bExp, zExp;
     bits32 aSig, bSig, zSig;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() && float32_host_operand(a) &&
+        float32_host_operand(b) && !float32_is_zero(b)) {
+        float32 z = float32_from_host(float32_to_host(a) / float32_to_host(b));
+        if (float32_host_result(z) || float32_is_zero(a)) {
+            return z;
+        }
+    }
+#endif
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2014,6 +2110,12 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     bits32 aSig, zSig;
     bits64 rem, term;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() && float32_host_operand(a) &&
+        (!extractFloat32Sign(a) || float32_is_zero(a))) {
+        return float32_from_host(sqrtf(float32_to_host(a)));
+    }
+#endif
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2883,6 +2985,42 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 
 }
 
+#ifdef USE_HOST_FLOAT
+typedef union {
+    bits64 i;
+    double f;
+} host_float64;
+
+INLINE double float64_to_host(float64 a)
+{
+    host_float64 u;
+    u.i = float64_val(a);
+    return u.f;
+}
+
+INLINE float64 float64_from_host(double f)
+{
+    host_float64 u;
+    u.f = f;
+    return make_float64(u.i);
+}
+
+/* Zero or normal: neither a NaN, an infinity nor a denormal.  */
+INLINE int float64_host_operand(float64 a)
+{
+    bits64 e = float64_val(a) & LIT64(0x7ff0000000000000);
+    return (e != 0 && e != LIT64(0x7ff0000000000000)) || float64_is_zero(a);
+}
+
+/* Normal and larger than the smallest normal: rounding can have neither
+   overflowed nor underflowed.  */
+INLINE int float64_host_result(float64 a)
+{
+    bits64 m = float64_val(a) & LIT64(0x7fffffffffffffff);
+    return m > LIT64(0x0010000000000000) && m < LIT64(0x7ff0000000000000);
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the double-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2893,6 +3031,16 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() &&
+        float64_host_operand(a) && float64_host_operand(b)) {
+        /* the sum of two normals is exact when it is zero */
+        float64 z = float64_from_host(float64_to_host(a) + float64_to_host(b));
+        if (float64_host_result(z) || float64_is_zero(z)) {
+            return z;
+        }
+    }
+#endif
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -2914,6 +3062,15 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() &&
+        float64_host_operand(a) && float64_host_operand(b)) {
+        float64 z = float64_from_host(float64_to_host(a) - float64_to_host(b));
+        if (float64_host_result(z) || float64_is_zero(z)) {
+            return z;
+        }
+    }
+#endif
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -2937,6 +3094,16 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     int16 aExp, bExp, zExp;
     bits64 aSig, bSig, zSig0, zSig1;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() &&
+        float64_host_operand(a) && float64_host_operand(b)) {
+        float64 z = float64_from_host(float64_to_host(a) * float64_to_host(b));
+        if (float64_host_result(z) ||
+            float64_is_zero(a) || float64_is_zero(b)) {
+            return z;
+        }
+    }
+#endif
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -2997,6 +3164,15 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     bits64 rem0, rem1;
     bits64 term0, term1;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() && float64_host_operand(a) &&
+        float64_host_operand(b) && !float64_is_zero(b)) {
+        float64 z = float64_from_host(float64_to_host(a) / float64_to_host(b));
+        if (float64_host_result(z) || float64_is_zero(a)) {
+            return z;
+        }
+    }
+#endif
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -3150,6 +3326,12 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     bits64 aSig, zSig, doubleZSig;
     bits64 rem0, rem1, term0, term1;
 
+#ifdef USE_HOST_FLOAT
+    if (HOST_FLOAT_USABLE() && float64_host_operand(a) &&
+        (!extractFloat64Sign(a) || float64_is_zero(a))) {
+        return float64_from_host(sqrt(float64_to_host(a)));
+    }
+#endif
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -43,6 +43,13 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef size_t (QEMUFileSetRateLimit)(void *opaque, size_t new_rate);
 typedef size_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* Queue a chunk of data without copying it.  The caller keeps buf valid
+ * until the file is closed; the data goes out after everything passed to
+ * the put_buffer function so far.
+ */
+typedef int (QEMUFilePutBufferAsyncFunc)(void *opaque, const uint8_t *buf,
+                                         int64_t pos, int size);
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
@@ -55,9 +62,12 @@ QEMUFile *qemu_fopen_socket(int fd);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_stdio_fd(QEMUFile *f);
+void qemu_file_set_put_buffer_async(QEMUFile *f,
+                                    QEMUFilePutBufferAsyncFunc *put_async);
 void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
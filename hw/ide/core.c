@@ -94,6 +94,11 @@ static void put_le16(uint16_t *p, unsigned int v)
     *p = cpu_to_le16(v);
 }
 
+static int ide_trim_supported(IDEState *s)
+{
+    return s->discard && !bdrv_is_read_only(s->bs);
+}
+
 static void ide_identify(IDEState *s)
 {
     uint16_t *p;
@@ -167,6 +172,9 @@ static void ide_identify(IDEState *s)
     put_le16(p + 103, s->nb_sectors >> 48);
     if (s->conf && s->conf->physical_block_size)
         put_le16(p + 106, 0x6000 | get_physical_block_exp(s->conf));
+    if (ide_trim_supported(s)) {
+        put_le16(p + 169, 1); /* DATA SET MANAGEMENT with TRIM supported */
+    }
 
     memcpy(s->identify_data, p, sizeof(s->identify_data));
     s->identify_set = 1;
@@ -757,6 +765,62 @@ static void ide_sector_write_dma(IDEState *s)
     ide_dma_start(s, ide_write_dma_cb);
 }
 
+/* DATA SET MANAGEMENT with the TRIM bit set: the guest transfers nsector
+   blocks of 8 byte entries, each a 48 bit LBA and a 16 bit sector count */
+static void ide_trim_dma_cb(void *opaque, int ret)
+{
+    BMDMAState *bm = opaque;
+    IDEState *s = bmdma_active_if(bm);
+    uint64_t *entries, entry, sector_num;
+    int i, n, nb_sectors;
+
+    while (s->nsector > 0) {
+        n = MIN(s->nsector, IDE_DMA_BUF_SECTORS);
+        s->io_buffer_index = 0;
+        s->io_buffer_size = n * 512;
+        if (dma_buf_rw(bm, 0) == 0) {
+            /* the PRD table is shorter than the range list */
+            ide_dma_error(s);
+            goto eot;
+        }
+
+        entries = (uint64_t *)s->io_buffer;
+        for (i = 0; i < n * 512 / sizeof(uint64_t); i++) {
+            entry = le64_to_cpu(entries[i]);
+            sector_num = entry & 0x0000ffffffffffffULL;
+            nb_sectors = entry >> 48;
+            if (nb_sectors == 0) {
+                continue;
+            }
+            if (sector_num + nb_sectors > s->nb_sectors) {
+                ide_dma_error(s);
+                goto eot;
+            }
+            /* the ranges are only a hint, failing to release them is fine */
+            bdrv_discard(s->bs, sector_num, nb_sectors);
+        }
+        s->nsector -= n;
+    }
+
+    s->status = READY_STAT | SEEK_STAT;
+    ide_set_irq(s->bus);
+eot:
+    bm->status &= ~BM_STATUS_DMAING;
+    bm->status |= BM_STATUS_INT;
+    bm->dma_cb = NULL;
+    bm->unit = -1;
+    bm->aiocb = NULL;
+}
+
+static void ide_trim_dma(IDEState *s)
+{
+    s->status = READY_STAT | SEEK_STAT | DRQ_STAT | BUSY_STAT;
+    s->io_buffer_index = 0;
+    s->io_buffer_size = 0;
+    s->is_read = 0;
+    ide_dma_start(s, ide_trim_dma_cb);
+}
+
 void ide_atapi_cmd_ok(IDEState *s)
 {
     s->error = 0;
@@ -1939,6 +2003,13 @@ void ide_ioport_write(void *opaque, uint32_t addr, uint32_t val)
             ide_sector_write_dma(s);
             s->media_changed = 1;
             break;
+        case WIN_DSM:
+            if (!s->bs || s->is_cdrom || !ide_trim_supported(s) ||
+                !(s->feature & DSM_TRIM))
+                goto abort_cmd;
+            ide_cmd_lba48_transform(s, 1);
+            ide_trim_dma(s);
+            break;
         case WIN_READ_NATIVE_MAX_EXT:
 	    lba48 = 1;
         case WIN_READ_NATIVE_MAX:
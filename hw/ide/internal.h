@@ -59,7 +59,12 @@ typedef struct BMDMAState BMDMAState;
  */
 #define CFA_REQ_EXT_ERROR_CODE		0x03 /* CFA Request Extended Error Code */
 /*
- *	0x04->0x07 Reserved
+ *	0x04->0x05 Reserved
+ */
+#define WIN_DSM				0x06 /* data set management */
+#define DSM_TRIM			0x01 /* feature bit: ranges are unused */
+/*
+ *	0x07 Reserved
  */
 #define WIN_SRST			0x08 /* ATAPI soft reset command */
 #define WIN_DEVICE_RESET		0x08
@@ -371,6 +376,7 @@ struct IDEState {
     /* ide config */
     int is_cdrom;
     int is_cf;
+    int discard; /* offer TRIM, unless the drive is read-only */
     int cylinders, heads, sectors;
     int64_t nb_sectors;
     int mult_sectors;
@@ -458,6 +464,7 @@ struct IDEDevice {
     uint32_t unit;
     BlockConf conf;
     char *version;
+    uint32_t discard;
 };
 
 typedef int (*ide_qdev_initfn)(IDEDevice *dev);
@@ -99,6 +99,8 @@ typedef struct IDEDrive {
 static int ide_drive_initfn(IDEDevice *dev)
 {
     IDEBus *bus = DO_UPCAST(IDEBus, qbus, dev->qdev.parent_bus);
+
+    bus->ifs[dev->unit].discard = dev->discard & 1;
     ide_init_drive(bus->ifs + dev->unit, dev->conf.dinfo, &dev->conf,
                    dev->version);
     return 0;
@@ -112,6 +114,7 @@ static IDEDeviceInfo ide_drive_info = {
         DEFINE_PROP_UINT32("unit", IDEDrive, dev.unit, -1),
         DEFINE_BLOCK_PROPERTIES(IDEDrive, dev.conf),
         DEFINE_PROP_STRING("ver",  IDEDrive, dev.version),
+        DEFINE_PROP_BIT("discard", IDEDrive, dev.discard, 0, true),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
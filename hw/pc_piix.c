@@ -203,6 +203,18 @@ static QEMUMachine pc_machine_v0_12 = {
     .max_cpus = 255,
     .compat_props = (GlobalProperty[]) {
         {
+            .driver   = "ide-drive",
+            .property = "discard",
+            .value    = "off",
+        },{
+            .driver   = "virtio-blk-pci",
+            .property = "discard",
+            .value    = "off",
+        },{
+            .driver   = "virtio-blk-pci",
+            .property = "write-zeroes",
+            .value    = "off",
+        },{
             .driver   = "virtio-serial-pci",
             .property = "max_nr_ports",
             .value    = stringify(1),
@@ -222,6 +234,18 @@ static QEMUMachine pc_machine_v0_11 = {
     .max_cpus = 255,
     .compat_props = (GlobalProperty[]) {
         {
+            .driver   = "ide-drive",
+            .property = "discard",
+            .value    = "off",
+        },{
+            .driver   = "virtio-blk-pci",
+            .property = "discard",
+            .value    = "off",
+        },{
+            .driver   = "virtio-blk-pci",
+            .property = "write-zeroes",
+            .value    = "off",
+        },{
             .driver   = "virtio-blk-pci",
             .property = "vectors",
             .value    = stringify(0),
@@ -257,6 +281,18 @@ static QEMUMachine pc_machine_v0_10 = {
     .max_cpus = 255,
     .compat_props = (GlobalProperty[]) {
         {
+            .driver   = "ide-drive",
+            .property = "discard",
+            .value    = "off",
+        },{
+            .driver   = "virtio-blk-pci",
+            .property = "discard",
+            .value    = "off",
+        },{
+            .driver   = "virtio-blk-pci",
+            .property = "write-zeroes",
+            .value    = "off",
+        },{
             .driver   = "virtio-blk-pci",
             .property = "class",
             .value    = stringify(PCI_CLASS_STORAGE_OTHER),
@@ -15,10 +15,18 @@
 #include <sysemu.h>
 #include "virtio-blk.h"
 #include "block_int.h"
+#include "iov.h"
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
 
+/* Limits for DISCARD and WRITE ZEROES requests.  Both only update the
+   metadata of the image synchronously; WRITE ZEROES is only offered when
+   the driver can do so (see virtio_blk_can_write_zeroes()).  */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS      (1 << 22)
+#define VIRTIO_BLK_MAX_WRITE_ZEROES_SECTORS (1 << 22)
+#define VIRTIO_BLK_MAX_DISCARD_SEG          32
+
 typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
@@ -28,6 +36,7 @@ typedef struct VirtIOBlock
     QEMUBH *bh;
     BlockConf *conf;
     unsigned short sector_mask;
+    size_t config_size;
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -308,9 +317,177 @@ typedef struct MultiReqBuffer {
     BlockDriverState    *old_bs;
 } MultiReqBuffer;
 
+/* Cluster size in sectors if WRITE ZEROES of whole clusters only updates
+   the metadata of the image, 0 if it would have to write data.  */
+static int virtio_blk_can_write_zeroes(VirtIOBlock *s)
+{
+    BlockDriverInfo bdi;
+
+    if (bdrv_get_info(s->bs, &bdi) < 0 || !bdi.can_write_zeroes) {
+        return 0;
+    }
+    return MAX(bdi.cluster_size / 512, 1);
+}
+
+/* The parts of WRITE ZEROES ranges that do not cover whole clusters are
+   written as data, asynchronously; the request completes when the last
+   of them does.  */
+typedef struct VirtIOBlockZeroes {
+    VirtIOBlockReq *req;
+    uint8_t *buf;
+    struct iovec iov[2 * VIRTIO_BLK_MAX_DISCARD_SEG];
+    QEMUIOVector qiov[2 * VIRTIO_BLK_MAX_DISCARD_SEG];
+    int nb_writes;
+    int nb_pending;
+    int status;
+} VirtIOBlockZeroes;
+
+static void virtio_blk_zeroes_unref(VirtIOBlockZeroes *z)
+{
+    if (--z->nb_pending > 0) {
+        return;
+    }
+    virtio_blk_req_complete(z->req, z->status);
+    qemu_free(z->buf);
+    qemu_free(z);
+}
+
+static void virtio_blk_zeroes_cb(void *opaque, int ret)
+{
+    VirtIOBlockZeroes *z = opaque;
+
+    if (ret < 0) {
+        z->status = VIRTIO_BLK_S_IOERR;
+    }
+    virtio_blk_zeroes_unref(z);
+}
+
+static void virtio_blk_zeroes_write(VirtIOBlockZeroes *z,
+                                    int64_t sector_num, int nb_sectors)
+{
+    struct iovec *iov = &z->iov[z->nb_writes];
+    QEMUIOVector *qiov = &z->qiov[z->nb_writes];
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+    z->nb_writes++;
+    iov->iov_base = z->buf;
+    iov->iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(qiov, iov, 1);
+    z->nb_pending++;
+    if (!bdrv_aio_writev(z->req->dev->bs, sector_num, qiov, nb_sectors,
+                         virtio_blk_zeroes_cb, z)) {
+        virtio_blk_zeroes_cb(z, -EIO);
+    }
+}
+
+/*
+ * Both requests carry an array of ranges after the header.  The block
+ * driver waits for the requests in flight before it changes the metadata
+ * of the ranges, so the writes the guest queued before are submitted
+ * first.
+ */
+static void virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
+    MultiReqBuffer *mrb, int is_zeroes)
+{
+    struct virtio_blk_discard_write_zeroes range;
+    BlockDriverState *bs = req->dev->bs;
+    VirtIOBlockZeroes *z;
+    size_t size, offset;
+    uint32_t max_sectors;
+    int64_t start, end, head_end, tail_start;
+    int cluster_sectors = 0;
+
+    if (mrb->num_writes > 0) {
+        do_multiwrite(mrb->old_bs, mrb->blkreq, mrb->num_writes);
+    }
+    mrb->num_writes = 0;
+    mrb->old_bs = NULL;
+
+    if (is_zeroes) {
+        cluster_sectors = virtio_blk_can_write_zeroes(req->dev);
+        if (!(req->dev->vdev.guest_features &
+              (1 << VIRTIO_BLK_F_WRITE_ZEROES)) || !cluster_sectors) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+            return;
+        }
+    }
+
+    max_sectors = is_zeroes ? VIRTIO_BLK_MAX_WRITE_ZEROES_SECTORS :
+                              VIRTIO_BLK_MAX_DISCARD_SECTORS;
+    size = iov_size(&req->elem.out_sg[1], req->elem.out_num - 1);
+    if (size == 0 || size % sizeof(range) ||
+        size / sizeof(range) > VIRTIO_BLK_MAX_DISCARD_SEG) {
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    /* check all ranges before anything is changed */
+    for (offset = 0; offset < size; offset += sizeof(range)) {
+        iov_to_buf(&req->elem.out_sg[1], req->elem.out_num - 1,
+                   &range, offset, sizeof(range));
+
+        if (range.flags &
+            ~(is_zeroes ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0)) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+            return;
+        }
+        if ((range.sector & req->dev->sector_mask) ||
+            (range.num_sectors & req->dev->sector_mask) ||
+            range.num_sectors > max_sectors) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+            return;
+        }
+    }
+
+    if (!is_zeroes) {
+        for (offset = 0; offset < size; offset += sizeof(range)) {
+            iov_to_buf(&req->elem.out_sg[1], req->elem.out_num - 1,
+                       &range, offset, sizeof(range));
+            if (bdrv_discard(bs, range.sector, range.num_sectors) < 0) {
+                virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+                return;
+            }
+        }
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        return;
+    }
+
+    z = qemu_mallocz(sizeof(*z));
+    z->req = req;
+    z->buf = qemu_mallocz(cluster_sectors * 512);
+    z->status = VIRTIO_BLK_S_OK;
+    /* dropped once all writes are submitted */
+    z->nb_pending = 1;
+
+    for (offset = 0; offset < size; offset += sizeof(range)) {
+        iov_to_buf(&req->elem.out_sg[1], req->elem.out_num - 1,
+                   &range, offset, sizeof(range));
+
+        /* zero the whole clusters in the metadata, write the rest */
+        start = range.sector;
+        end = start + range.num_sectors;
+        head_end = MIN((start + cluster_sectors - 1) &
+                       ~(int64_t)(cluster_sectors - 1), end);
+        tail_start = MAX(end & ~(int64_t)(cluster_sectors - 1), head_end);
+        if (tail_start > head_end &&
+            bdrv_write_zeroes(bs, head_end, tail_start - head_end) < 0) {
+            z->status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        virtio_blk_zeroes_write(z, start, head_end - start);
+        virtio_blk_zeroes_write(z, tail_start, end - tail_start);
+    }
+
+    virtio_blk_zeroes_unref(z);
+}
+
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
     MultiReqBuffer *mrb)
 {
+    uint32_t type;
+
     if (req->elem.out_num < 1 || req->elem.in_num < 1) {
         fprintf(stderr, "virtio-blk missing headers\n");
         exit(1);
@@ -325,7 +502,11 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     req->out = (void *)req->elem.out_sg[0].iov_base;
     req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
 
-    if (req->out->type & VIRTIO_BLK_T_FLUSH) {
+    type = req->out->type & ~VIRTIO_BLK_T_BARRIER;
+    if (type == VIRTIO_BLK_T_DISCARD || type == VIRTIO_BLK_T_WRITE_ZEROES) {
+        virtio_blk_handle_discard_write_zeroes(req, mrb,
+            type == VIRTIO_BLK_T_WRITE_ZEROES);
+    } else if (req->out->type & VIRTIO_BLK_T_FLUSH) {
         virtio_blk_handle_flush(mrb->blkreq, &mrb->num_writes,
             req, &mrb->old_bs);
     } else if (req->out->type & VIRTIO_BLK_T_SCSI_CMD) {
@@ -418,8 +599,10 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
     struct virtio_blk_config blkcfg;
+    BlockDriverInfo bdi;
     uint64_t capacity;
     int cylinders, heads, secs;
+    uint32_t discard_alignment;
 
     bdrv_get_geometry(s->bs, &capacity);
     bdrv_get_geometry_hint(s->bs, &cylinders, &heads, &secs);
@@ -435,7 +618,20 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.alignment_offset = 0;
     blkcfg.min_io_size = s->conf->min_io_size / blkcfg.blk_size;
     blkcfg.opt_io_size = s->conf->opt_io_size / blkcfg.blk_size;
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+
+    /* discarding less than a cluster doesn't free anything */
+    discard_alignment = blkcfg.blk_size;
+    if (bdrv_get_info(s->bs, &bdi) == 0 && bdi.cluster_size > 0) {
+        discard_alignment = MAX(discard_alignment, bdi.cluster_size);
+    }
+    stl_raw(&blkcfg.max_discard_sectors, VIRTIO_BLK_MAX_DISCARD_SECTORS);
+    stl_raw(&blkcfg.max_discard_seg, VIRTIO_BLK_MAX_DISCARD_SEG);
+    stl_raw(&blkcfg.discard_sector_alignment, discard_alignment / 512);
+    stl_raw(&blkcfg.max_write_zeroes_sectors,
+            VIRTIO_BLK_MAX_WRITE_ZEROES_SECTORS);
+    stl_raw(&blkcfg.max_write_zeroes_seg, VIRTIO_BLK_MAX_DISCARD_SEG);
+    blkcfg.write_zeroes_may_unmap = 1;
+    memcpy(config, &blkcfg, s->config_size);
 }
 
 static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
@@ -450,8 +646,15 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCACHE);
     
-    if (bdrv_is_read_only(s->bs))
+    if (bdrv_is_read_only(s->bs)) {
         features |= 1 << VIRTIO_BLK_F_RO;
+        features &= ~((1 << VIRTIO_BLK_F_DISCARD) |
+                      (1 << VIRTIO_BLK_F_WRITE_ZEROES));
+    }
+    /* writing zeroes as data would block the guest for too long */
+    if (!virtio_blk_can_write_zeroes(s)) {
+        features &= ~(1 << VIRTIO_BLK_F_WRITE_ZEROES);
+    }
 
     return features;
 }
@@ -489,15 +692,27 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              uint32_t host_features)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
     static int virtio_blk_id;
+    size_t config_size;
+
+    /* the discard limits extend the config space, which older machine
+       types must not see */
+    if (host_features & ((1 << VIRTIO_BLK_F_DISCARD) |
+                         (1 << VIRTIO_BLK_F_WRITE_ZEROES))) {
+        config_size = sizeof(struct virtio_blk_config);
+    } else {
+        config_size = offsetof(struct virtio_blk_config, writeback);
+    }
 
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
-                                          sizeof(struct virtio_blk_config),
+                                          config_size,
                                           sizeof(VirtIOBlock));
+    s->config_size = config_size;
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.get_features = virtio_blk_get_features;
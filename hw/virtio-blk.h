@@ -33,6 +33,8 @@
 /* #define VIRTIO_BLK_F_IDENTIFY   8       ATA IDENTIFY supported, DEPRECATED */
 #define VIRTIO_BLK_F_WCACHE     9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
+#define VIRTIO_BLK_F_DISCARD    13      /* DISCARD is supported */
+#define VIRTIO_BLK_F_WRITE_ZEROES 14    /* WRITE ZEROES is supported */
 
 struct virtio_blk_config
 {
@@ -47,6 +49,18 @@ struct virtio_blk_config
     uint8_t alignment_offset;
     uint16_t min_io_size;
     uint32_t opt_io_size;
+    /* the following fields are only present with VIRTIO_BLK_F_DISCARD or
+       VIRTIO_BLK_F_WRITE_ZEROES */
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } __attribute__((packed));
 
 /* These two define direction. */
@@ -59,6 +73,12 @@ struct virtio_blk_config
 /* Flush the volatile write cache */
 #define VIRTIO_BLK_T_FLUSH      4
 
+/* Discard sectors; unlike the other types, these are not bit masks */
+#define VIRTIO_BLK_T_DISCARD    11
+
+/* Write zeroes to sectors */
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER    0x80000000
 
@@ -73,6 +93,17 @@ struct virtio_blk_outhdr
     uint64_t sector;
 };
 
+/* Payload of DISCARD and WRITE ZEROES requests, one per range */
+struct virtio_blk_discard_write_zeroes
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+/* WRITE ZEROES may deallocate the range */
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1
+
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
@@ -92,12 +123,20 @@ struct virtio_scsi_inhdr
     uint32_t residual;
 };
 
+#define DEFINE_VIRTIO_BLK_DISCARD_FEATURES(_state, _field) \
+        DEFINE_PROP_BIT("discard", _state, _field, \
+                        VIRTIO_BLK_F_DISCARD, true), \
+        DEFINE_PROP_BIT("write-zeroes", _state, _field, \
+                        VIRTIO_BLK_F_WRITE_ZEROES, true)
+
 #ifdef __linux__
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
         DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
+        DEFINE_VIRTIO_BLK_DISCARD_FEATURES(_state, _field), \
         DEFINE_PROP_BIT("scsi", _state, _field, VIRTIO_BLK_F_SCSI, true)
 #else
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
-        DEFINE_VIRTIO_COMMON_FEATURES(_state, _field)
+        DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
+        DEFINE_VIRTIO_BLK_DISCARD_FEATURES(_state, _field)
 #endif
 #endif
@@ -552,7 +552,8 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         error_report("virtio-blk-pci: drive property not set");
         return -1;
     }
-    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block);
+    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block,
+                           proxy->host_features);
     vdev->nvectors = proxy->nvectors;
     virtio_init_pci(proxy, vdev,
                     PCI_VENDOR_ID_REDHAT_QUMRANET,
@@ -195,25 +195,33 @@ void isa_unassign_ioport(pio_addr_t start, int length)
 void cpu_outb(pio_addr_t addr, uint8_t val)
 {
     LOG_IOPORT("outb: %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
+    cpu_io_lock();
     ioport_write(0, addr, val);
+    cpu_io_unlock();
 }
 
 void cpu_outw(pio_addr_t addr, uint16_t val)
 {
     LOG_IOPORT("outw: %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
+    cpu_io_lock();
     ioport_write(1, addr, val);
+    cpu_io_unlock();
 }
 
 void cpu_outl(pio_addr_t addr, uint32_t val)
 {
     LOG_IOPORT("outl: %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
+    cpu_io_lock();
     ioport_write(2, addr, val);
+    cpu_io_unlock();
 }
 
 uint8_t cpu_inb(pio_addr_t addr)
 {
     uint8_t val;
+    cpu_io_lock();
     val = ioport_read(0, addr);
+    cpu_io_unlock();
     LOG_IOPORT("inb : %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
     return val;
 }
@@ -221,7 +229,9 @@ uint8_t cpu_inb(pio_addr_t addr)
 uint16_t cpu_inw(pio_addr_t addr)
 {
     uint16_t val;
+    cpu_io_lock();
     val = ioport_read(1, addr);
+    cpu_io_unlock();
     LOG_IOPORT("inw : %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
     return val;
 }
@@ -229,7 +239,9 @@ uint16_t cpu_inw(pio_addr_t addr)
 uint32_t cpu_inl(pio_addr_t addr)
 {
     uint32_t val;
+    cpu_io_lock();
     val = ioport_read(2, addr);
+    cpu_io_unlock();
     LOG_IOPORT("inl : %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
     return val;
 }
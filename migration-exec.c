@@ -20,6 +20,7 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "postcopy.h"
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -38,9 +39,10 @@ static int file_errno(FdMigrationState *s)
     return errno;
 }
 
-static int file_write(FdMigrationState *s, const void * buf, size_t size)
+static ssize_t file_writev(FdMigrationState *s, const struct iovec *iov,
+                           int iovcnt)
 {
-    return write(s->fd, buf, size);
+    return writev(s->fd, iov, iovcnt);
 }
 
 static int exec_close(FdMigrationState *s)
@@ -92,7 +94,7 @@ MigrationState *exec_start_outgoing_migration(Monitor *mon,
 
     s->close = exec_close;
     s->get_error = file_errno;
-    s->write = file_write;
+    s->writev = file_writev;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
     s->mig_state.release = migrate_fd_release;
@@ -124,6 +126,10 @@ static void exec_accept_incoming_migration(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
+    if (ret >= 0) {
+        /* without a socket there is no way to request pages */
+        ret = postcopy_incoming_start(f, -1);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         goto err;
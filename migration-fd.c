@@ -19,6 +19,7 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "postcopy.h"
 #include "qemu_socket.h"
 
 //#define DEBUG_MIGRATION_FD
@@ -36,9 +37,10 @@ static int fd_errno(FdMigrationState *s)
     return errno;
 }
 
-static int fd_write(FdMigrationState *s, const void * buf, size_t size)
+static ssize_t fd_writev(FdMigrationState *s, const struct iovec *iov,
+                         int iovcnt)
 {
-    return write(s->fd, buf, size);
+    return writev(s->fd, iov, iovcnt);
 }
 
 static int fd_close(FdMigrationState *s)
@@ -74,7 +76,7 @@ MigrationState *fd_start_outgoing_migration(Monitor *mon,
     }
 
     s->get_error = fd_errno;
-    s->write = fd_write;
+    s->writev = fd_writev;
     s->close = fd_close;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
@@ -107,6 +109,10 @@ static void fd_accept_incoming_migration(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
+    if (ret >= 0) {
+        /* without a socket there is no way to request pages */
+        ret = postcopy_incoming_start(f, -1);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         goto err;
@@ -18,6 +18,8 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "postcopy.h"
+#include "multifd.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -34,9 +36,20 @@ static int socket_errno(FdMigrationState *s)
     return socket_error();
 }
 
-static int socket_write(FdMigrationState *s, const void * buf, size_t size)
+static ssize_t socket_writev(FdMigrationState *s, const struct iovec *iov,
+                             int iovcnt)
 {
-    return send(s->fd, buf, size, 0);
+#ifdef _WIN32
+    /* a short write is fine, the caller sends the rest */
+    return send(s->fd, iov[0].iov_base, iov[0].iov_len, 0);
+#else
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(s->fd, &msg, 0);
+#endif
 }
 
 static int tcp_close(FdMigrationState *s)
@@ -46,9 +59,33 @@ static int tcp_close(FdMigrationState *s)
         close(s->fd);
         s->fd = -1;
     }
+    qemu_free(s->opaque);
+    s->opaque = NULL;
     return 0;
 }
 
+/* The address of the destination is kept in s->opaque.  */
+static int tcp_open_channel(FdMigrationState *s)
+{
+    int fd, ret;
+
+    if (!s->opaque) {
+        return -1;
+    }
+    fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    do {
+        ret = connect(fd, s->opaque, sizeof(struct sockaddr_in));
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 
 static void tcp_wait_for_connect(void *opaque)
 {
@@ -93,8 +130,9 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
     s = qemu_mallocz(sizeof(*s));
 
     s->get_error = socket_errno;
-    s->write = socket_write;
+    s->writev = socket_writev;
     s->close = tcp_close;
+    s->open_channel = tcp_open_channel;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
     s->mig_state.release = migrate_fd_release;
@@ -105,8 +143,11 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
     s->state = MIG_STATE_ACTIVE;
     s->mon = NULL;
     s->bandwidth_limit = bandwidth_limit;
+    s->opaque = qemu_malloc(sizeof(addr));
+    memcpy(s->opaque, &addr, sizeof(addr));
     s->fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
     if (s->fd == -1) {
+        qemu_free(s->opaque);
         qemu_free(s);
         return NULL;
     }
@@ -129,6 +170,7 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
     if (ret < 0 && ret != -EINPROGRESS && ret != -EWOULDBLOCK) {
         DPRINTF("connect failed\n");
         close(s->fd);
+        qemu_free(s->opaque);
         qemu_free(s);
         return NULL;
     } else if (ret >= 0)
@@ -162,7 +204,12 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    migrate_incoming_set_listen_fd(s);
     ret = qemu_loadvm_state(f);
+    migrate_incoming_set_listen_fd(-1);
+    if (ret >= 0) {
+        ret = postcopy_incoming_start(f, c);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         goto out_fopen;
@@ -173,6 +220,13 @@ static void tcp_accept_incoming_migration(void *opaque)
     if (autostart)
         vm_start();
 
+    if (ret > 0) {
+        /* the rest of RAM comes in the background on this socket */
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        close(s);
+        return;
+    }
+
 out_fopen:
     qemu_fclose(f);
 out:
@@ -202,7 +256,8 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         goto err;
 
-    if (listen(s, 1) == -1)
+    /* room for the extra channels of a multifd migration */
+    if (listen(s, MULTIFD_MAX_CHANNELS + 1) == -1)
         goto err;
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
@@ -18,6 +18,8 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "postcopy.h"
+#include "multifd.h"
 
 //#define DEBUG_MIGRATION_UNIX
 
@@ -34,9 +36,15 @@ static int unix_errno(FdMigrationState *s)
     return errno;
 }
 
-static int unix_write(FdMigrationState *s, const void * buf, size_t size)
+static ssize_t unix_writev(FdMigrationState *s, const struct iovec *iov,
+                           int iovcnt)
 {
-    return write(s->fd, buf, size);
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(s->fd, &msg, 0);
 }
 
 static int unix_close(FdMigrationState *s)
@@ -46,9 +54,33 @@ static int unix_close(FdMigrationState *s)
         close(s->fd);
         s->fd = -1;
     }
+    qemu_free(s->opaque);
+    s->opaque = NULL;
     return 0;
 }
 
+/* The address of the destination is kept in s->opaque.  */
+static int unix_open_channel(FdMigrationState *s)
+{
+    int fd, ret;
+
+    if (!s->opaque) {
+        return -1;
+    }
+    fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    do {
+        ret = connect(fd, s->opaque, sizeof(struct sockaddr_un));
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 static void unix_wait_for_connect(void *opaque)
 {
     FdMigrationState *s = opaque;
@@ -92,8 +124,9 @@ MigrationState *unix_start_outgoing_migration(Monitor *mon,
     s = qemu_mallocz(sizeof(*s));
 
     s->get_error = unix_errno;
-    s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
+    s->open_channel = unix_open_channel;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
     s->mig_state.release = migrate_fd_release;
@@ -104,6 +137,8 @@ MigrationState *unix_start_outgoing_migration(Monitor *mon,
     s->state = MIG_STATE_ACTIVE;
     s->mon = NULL;
     s->bandwidth_limit = bandwidth_limit;
+    s->opaque = qemu_malloc(sizeof(addr));
+    memcpy(s->opaque, &addr, sizeof(addr));
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
     if (s->fd < 0) {
         DPRINTF("Unable to open socket");
@@ -139,6 +174,7 @@ err_after_open:
     close(s->fd);
 
 err_after_alloc:
+    qemu_free(s->opaque);
     qemu_free(s);
     return NULL;
 }
@@ -168,7 +204,12 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    migrate_incoming_set_listen_fd(s);
     ret = qemu_loadvm_state(f);
+    migrate_incoming_set_listen_fd(-1);
+    if (ret >= 0) {
+        ret = postcopy_incoming_start(f, c);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         goto out_fopen;
@@ -179,6 +220,13 @@ static void unix_accept_incoming_migration(void *opaque)
     if (autostart)
         vm_start();
 
+    if (ret > 0) {
+        /* the rest of RAM comes in the background on this socket */
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        close(s);
+        return;
+    }
+
 out_fopen:
     qemu_fclose(f);
 out:
@@ -209,7 +257,8 @@ int unix_start_incoming_migration(const char *path)
         fprintf(stderr, "bind(unix:%s): %s\n", un.sun_path, strerror(errno));
         goto err;
     }
-    if (listen(sock, 1) < 0) {
+    /* room for the extra channels of a multifd migration */
+    if (listen(sock, MULTIFD_MAX_CHANNELS + 1) < 0) {
         fprintf(stderr, "listen(unix:%s): %s\n", un.sun_path, strerror(errno));
         goto err;
     }
@@ -20,6 +20,11 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "kvm.h"
+#include "multifd.h"
+#ifdef CONFIG_IOTHREAD
+#include <signal.h>
+#endif
 
 //#define DEBUG_MIGRATION
 
@@ -36,6 +41,9 @@ static uint32_t max_throttle = (32 << 20);
 
 static MigrationState *current_migration;
 
+/* listening socket of the incoming migration, for extra channels */
+static int incoming_listen_fd = -1;
+
 void qemu_start_incoming_migration(const char *uri)
 {
     const char *p;
@@ -54,6 +62,13 @@ void qemu_start_incoming_migration(const char *uri)
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
 }
 
+int migrate_is_active(void)
+{
+    return current_migration &&
+           current_migration->get_status(current_migration) ==
+           MIG_STATE_ACTIVE;
+}
+
 int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     MigrationState *s = NULL;
@@ -61,11 +76,32 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     int detach = qdict_get_int(qdict, "detach");
     const char *uri = qdict_get_str(qdict, "uri");
 
-    if (current_migration &&
-        current_migration->get_status(current_migration) == MIG_STATE_ACTIVE) {
+    if (migrate_is_active()) {
         monitor_printf(mon, "migration already in progress\n");
         return -1;
     }
+    if (savevm_live_active()) {
+        monitor_printf(mon, "a snapshot is in progress\n");
+        return -1;
+    }
+
+    /* the destination requests pages on the migration socket */
+    if (migrate_use_postcopy() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        monitor_printf(mon, "postcopy needs a tcp: or unix: migration\n");
+        return -1;
+    }
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            monitor_printf(mon, "multifd needs a tcp: or unix: migration\n");
+            return -1;
+        }
+        if (migrate_use_xbzrle() || migrate_use_postcopy()) {
+            monitor_printf(mon, "multifd cannot be combined with xbzrle or "
+                           "postcopy\n");
+            return -1;
+        }
+    }
 
     if (strstart(uri, "tcp:", &p)) {
         s = tcp_start_outgoing_migration(mon, p, max_throttle, detach,
@@ -153,6 +189,220 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+/* Capabilities have to be enabled on both sides: the source announces
+   the ones it uses in the stream, and the destination refuses those it
+   has not enabled itself.  auto-converge only affects the source.  */
+static const char *const migration_cap_names[MIGRATION_CAP_NUM] = {
+    [MIGRATION_CAP_XBZRLE] = "xbzrle",
+    [MIGRATION_CAP_POSTCOPY] = "postcopy",
+    [MIGRATION_CAP_AUTO_CONVERGE] = "auto-converge",
+    [MIGRATION_CAP_MULTIFD] = "multifd",
+};
+
+static int migration_caps[MIGRATION_CAP_NUM];
+
+static int64_t xbzrle_cache_size = 64 << 20;
+
+static int multifd_channels = 2;
+
+static int block_max_inflight = 16;
+
+int migrate_use_xbzrle(void)
+{
+    return migration_caps[MIGRATION_CAP_XBZRLE];
+}
+
+int migrate_use_postcopy(void)
+{
+    return migration_caps[MIGRATION_CAP_POSTCOPY];
+}
+
+int migrate_use_auto_converge(void)
+{
+    return migration_caps[MIGRATION_CAP_AUTO_CONVERGE];
+}
+
+int migrate_use_multifd(void)
+{
+    return migration_caps[MIGRATION_CAP_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    return multifd_channels;
+}
+
+int migrate_block_max_inflight(void)
+{
+    return block_max_inflight;
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return xbzrle_cache_size;
+}
+
+int do_migrate_set_capability(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    const char *name = qdict_get_str(qdict, "capability");
+    int i;
+
+    for (i = 0; i < MIGRATION_CAP_NUM; i++) {
+        if (!strcmp(name, migration_cap_names[i])) {
+            break;
+        }
+    }
+    if (i == MIGRATION_CAP_NUM) {
+        qerror_report(QERR_INVALID_PARAMETER, "capability");
+        return -1;
+    }
+    if (migrate_is_active()) {
+        monitor_printf(mon, "migration already in progress\n");
+        return -1;
+    }
+    if (i == MIGRATION_CAP_POSTCOPY && qdict_get_bool(qdict, "state")) {
+#ifdef CONFIG_IOTHREAD
+        if (kvm_enabled()) {
+            monitor_printf(mon, "postcopy is not supported with KVM\n");
+            return -1;
+        }
+#else
+        monitor_printf(mon, "postcopy needs the I/O thread\n");
+        return -1;
+#endif
+    }
+#ifndef CONFIG_IOTHREAD
+    if (i == MIGRATION_CAP_AUTO_CONVERGE && qdict_get_bool(qdict, "state")) {
+        /* only separate vCPU threads can be slowed down */
+        monitor_printf(mon, "auto-converge needs the I/O thread\n");
+        return -1;
+    }
+    if (i == MIGRATION_CAP_MULTIFD && qdict_get_bool(qdict, "state")) {
+        monitor_printf(mon, "multifd needs the I/O thread\n");
+        return -1;
+    }
+#endif
+    migration_caps[i] = qdict_get_bool(qdict, "state");
+    return 0;
+}
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    double d;
+
+    d = qdict_get_double(qdict, "value");
+    /* a cache larger than the guest RAM could never be filled */
+    if (d < 1 || d > ram_bytes_total()) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a positive size up to the guest RAM size");
+        return -1;
+    }
+    xbzrle_cache_size = d;
+
+    return 0;
+}
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (value < 1 || value > MULTIFD_MAX_CHANNELS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a number of channels between 1 and 16");
+        return -1;
+    }
+    if (migrate_is_active()) {
+        monitor_printf(mon, "migration already in progress\n");
+        return -1;
+    }
+    multifd_channels = value;
+
+    return 0;
+}
+
+int do_migrate_set_block_inflight(Monitor *mon, const QDict *qdict,
+                                  QObject **ret_data)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (value < 1 || value > 1024) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a number of reads between 1 and 1024");
+        return -1;
+    }
+    block_max_inflight = value;
+
+    return 0;
+}
+
+void migrate_incoming_set_listen_fd(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+int migrate_incoming_accept_channel(void)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct timeval tv;
+    fd_set rfds;
+    int ret, c;
+
+    if (incoming_listen_fd == -1) {
+        return -1;
+    }
+
+    /* the source connects all its channels before it starts sending */
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(incoming_listen_fd, &rfds);
+        tv.tv_sec = 10;
+        tv.tv_usec = 0;
+        ret = select(incoming_listen_fd + 1, &rfds, NULL, NULL, &tv);
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret <= 0) {
+        return -1;
+    }
+
+    do {
+        addrlen = sizeof(addr);
+        c = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+    } while (c == -1 && socket_error() == EINTR);
+
+    return c;
+}
+
+void do_info_migrate_capabilities_print(Monitor *mon, const QObject *data)
+{
+    QListEntry *entry;
+
+    QLIST_FOREACH_ENTRY(qobject_to_qlist(data), entry) {
+        QDict *cap = qobject_to_qdict(qlist_entry_obj(entry));
+
+        monitor_printf(mon, "%s: %s\n", qdict_get_str(cap, "capability"),
+                       qdict_get_bool(cap, "state") ? "on" : "off");
+    }
+}
+
+void do_info_migrate_capabilities(Monitor *mon, QObject **ret_data)
+{
+    QList *caps = qlist_new();
+    int i;
+
+    for (i = 0; i < MIGRATION_CAP_NUM; i++) {
+        qlist_append_obj(caps,
+                         qobject_from_jsonf("{ 'capability': %s, "
+                                            "'state': %i }",
+                                            migration_cap_names[i],
+                                            migration_caps[i]));
+    }
+    *ret_data = QOBJECT(caps);
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -168,6 +418,24 @@ static void migrate_print_status(Monitor *mon, const char *name,
                         qdict_get_int(qdict, "total") >> 10);
 }
 
+static void migrate_print_xbzrle(Monitor *mon, const QDict *status_dict)
+{
+    QDict *qdict;
+
+    qdict = qobject_to_qdict(qdict_get(status_dict, "xbzrle-cache"));
+
+    monitor_printf(mon, "cache size: %" PRIu64 " bytes\n",
+                   qdict_get_int(qdict, "cache-size"));
+    monitor_printf(mon, "xbzrle transferred: %" PRIu64 " kbytes\n",
+                   qdict_get_int(qdict, "bytes") >> 10);
+    monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
+                   qdict_get_int(qdict, "pages"));
+    monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
+                   qdict_get_int(qdict, "cache-miss"));
+    monitor_printf(mon, "xbzrle overflow: %" PRIu64 "\n",
+                   qdict_get_int(qdict, "overflow"));
+}
+
 void do_info_migrate_print(Monitor *mon, const QObject *data)
 {
     QDict *qdict;
@@ -181,9 +449,25 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
         migrate_print_status(mon, "ram", qdict);
     }
 
+    if (qdict_haskey(qdict, "expected-downtime")) {
+        monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
+                       qdict_get_int(qdict, "expected-downtime"));
+        monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages/s\n",
+                       qdict_get_int(qdict, "dirty-pages-rate"));
+    }
+
+    if (qdict_haskey(qdict, "cpu-throttle-percentage")) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       qdict_get_int(qdict, "cpu-throttle-percentage"));
+    }
+
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "xbzrle-cache")) {
+        migrate_print_xbzrle(mon, qdict);
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -210,6 +494,15 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
 
             migrate_put_status(qdict, "ram", ram_bytes_transferred(),
                                ram_bytes_remaining(), ram_bytes_total());
+            qdict_put(qdict, "expected-downtime",
+                      qint_from_int(ram_expected_downtime()));
+            qdict_put(qdict, "dirty-pages-rate",
+                      qint_from_int(ram_dirty_pages_rate()));
+
+            if (migrate_use_auto_converge()) {
+                qdict_put(qdict, "cpu-throttle-percentage",
+                          qint_from_int(cpu_throttle_get()));
+            }
 
             if (blk_mig_active()) {
                 migrate_put_status(qdict, "disk", blk_mig_bytes_transferred(),
@@ -217,6 +510,20 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
                                    blk_mig_bytes_total());
             }
 
+            if (migrate_use_xbzrle()) {
+                qdict_put_obj(qdict, "xbzrle-cache",
+                              qobject_from_jsonf("{ 'cache-size': %" PRId64 ", "
+                                                 "'bytes': %" PRId64 ", "
+                                                 "'pages': %" PRId64 ", "
+                                                 "'cache-miss': %" PRId64 ", "
+                                                 "'overflow': %" PRId64 " }",
+                                                 migrate_xbzrle_cache_size(),
+                                                 xbzrle_mig_bytes_transferred(),
+                                                 xbzrle_mig_pages_transferred(),
+                                                 xbzrle_mig_pages_cache_miss(),
+                                                 xbzrle_mig_pages_overflow()));
+            }
+
             *ret_data = QOBJECT(qdict);
             break;
         case MIG_STATE_COMPLETED:
@@ -258,6 +565,14 @@ int migrate_fd_cleanup(FdMigrationState *s)
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+    /* the guest must not stay slowed down after a failed migration */
+    cpu_throttle_set(0);
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        multifd_save_shutdown();
+    }
+    multifd_save_cleanup();
+
     if (s->file) {
         DPRINTF("closing file\n");
         if (qemu_fclose(s->file) != 0) {
@@ -287,31 +602,179 @@ void migrate_fd_put_notify(void *opaque)
     qemu_file_put_notify(s->file);
 }
 
-ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
+ssize_t migrate_fd_writev(void *opaque, const struct iovec *iov, int iovcnt)
 {
     FdMigrationState *s = opaque;
     ssize_t ret;
 
     do {
-        ret = s->write(s, data, size);
+        ret = s->writev(s, iov, iovcnt);
     } while (ret == -1 && ((s->get_error(s)) == EINTR));
 
     if (ret == -1)
         ret = -(s->get_error(s));
 
+#ifndef CONFIG_IOTHREAD
+    /* with the I/O thread, the buffered file's writer thread waits for
+       the descriptor itself */
     if (ret == -EAGAIN)
         qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+#endif
 
     return ret;
 }
 
+#ifdef CONFIG_IOTHREAD
+static void migrate_fd_complete(FdMigrationState *s);
+
+/* Wait until the buffered file can take more data, or for at most one
+   100ms transfer window.  */
+static void migrate_fd_thread_wait(FdMigrationState *s)
+{
+    qemu_mutex_lock(&s->thread_lock);
+    do {
+        if (!s->thread_ready) {
+            qemu_cond_timedwait(&s->thread_cond, &s->thread_lock, 100);
+        }
+        s->thread_ready = 0;
+    } while (!s->thread_stop && qemu_file_rate_limit(s->file));
+    qemu_mutex_unlock(&s->thread_lock);
+}
+
+/* The migration thread runs the iterative stage of savevm.  Handlers are
+   called with the iothread lock held; ram_save_live drops it while it
+   copies pages.  */
+static void *migrate_fd_thread(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    int ret = 0;
+
+    qemu_mutex_lock_iothread();
+    while (!s->thread_stop) {
+        DPRINTF("iterate\n");
+        ret = qemu_savevm_state_iterate(s->mon, s->file);
+        if (ret != 0) {
+            break;
+        }
+        qemu_mutex_unlock_iothread();
+        migrate_fd_thread_wait(s);
+        qemu_mutex_lock_iothread();
+    }
+    if (!s->thread_stop) {
+        s->thread_ret = ret;
+        qemu_bh_schedule(s->thread_done);
+    }
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+/* Called with the iothread lock held.  */
+static void migrate_fd_stop_thread(FdMigrationState *s)
+{
+    if (!s->thread_running) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->thread_lock);
+    s->thread_stop = 1;
+    qemu_cond_signal(&s->thread_cond);
+    qemu_mutex_unlock(&s->thread_lock);
+
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&s->thread);
+    qemu_mutex_lock_iothread();
+
+    s->thread_running = 0;
+}
+
+/* Once the guest runs on the destination, the same thread serves its
+   page requests and sends the rest of RAM.  The guest is stopped on this
+   side, so the thread does not need the iothread lock.  */
+static void *migrate_fd_postcopy_thread(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    int ret = 0;
+
+    while (!s->thread_stop) {
+        ret = ram_postcopy_send(s->file, s->fd);
+        if (ret != 0) {
+            break;
+        }
+    }
+    qemu_mutex_lock_iothread();
+    if (!s->thread_stop) {
+        s->thread_ret = ret;
+        qemu_bh_schedule(s->thread_done);
+    }
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+static void migrate_fd_thread_done(void *opaque)
+{
+    FdMigrationState *s = opaque;
+
+    migrate_fd_stop_thread(s);
+    if (s->state != MIG_STATE_ACTIVE) {
+        return;
+    }
+
+    if (s->thread_ret < 0) {
+        migrate_fd_error(s);
+    } else if (s->postcopy) {
+        DPRINTF("postcopy done\n");
+        s->state = migrate_fd_cleanup(s) < 0 ? MIG_STATE_ERROR
+                                             : MIG_STATE_COMPLETED;
+    } else {
+        DPRINTF("done iterating\n");
+        migrate_fd_complete(s);
+    }
+}
+
+static void migrate_fd_start_thread(FdMigrationState *s,
+                                    void *(*func)(void *))
+{
+    sigset_t set, oldset;
+
+    if (!s->thread_done) {
+        qemu_mutex_init(&s->thread_lock);
+        qemu_cond_init(&s->thread_cond);
+        s->thread_done = qemu_bh_new(migrate_fd_thread_done, s);
+    }
+    s->thread_running = 1;
+    s->thread_stop = 0;
+
+    /* the main loop handles the signals */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    qemu_thread_create(&s->thread, func, s);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+#endif
+
+static int migrate_fd_open_channel(void *opaque)
+{
+    FdMigrationState *s = opaque;
+
+    return s->open_channel ? s->open_channel(s) : -1;
+}
+
 void migrate_fd_connect(FdMigrationState *s)
 {
     int ret;
 
+    if (migrate_use_multifd() &&
+        multifd_save_setup(migrate_multifd_channels(),
+                           migrate_fd_open_channel, s) < 0) {
+        migrate_fd_error(s);
+        return;
+    }
+
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
-                                      migrate_fd_put_buffer,
+                                      migrate_fd_writev,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
@@ -324,10 +787,64 @@ void migrate_fd_connect(FdMigrationState *s)
         migrate_fd_error(s);
         return;
     }
-    
+
+#ifdef CONFIG_IOTHREAD
+    migrate_fd_start_thread(s, migrate_fd_thread);
+#else
     migrate_fd_put_ready(s);
+#endif
 }
 
+/* Stop the VM and send the rest of its state.  */
+static void migrate_fd_complete(FdMigrationState *s)
+{
+    int state;
+    int old_vm_running = vm_running;
+
+    vm_stop(0);
+
+    qemu_aio_flush();
+    bdrv_flush_all();
+    if ((qemu_savevm_state_complete(s->mon, s->file)) < 0) {
+        if (old_vm_running) {
+            vm_start();
+        }
+        state = MIG_STATE_ERROR;
+    } else {
+#ifdef CONFIG_IOTHREAD
+        if (ram_postcopy_active()) {
+            /* the guest now runs on the destination; the migration is
+               over once all of its RAM has followed */
+            DPRINTF("starting postcopy\n");
+            s->postcopy = 1;
+            migrate_fd_start_thread(s, migrate_fd_postcopy_thread);
+            return;
+        }
+#endif
+        state = MIG_STATE_COMPLETED;
+    }
+    if (migrate_fd_cleanup(s) < 0) {
+        if (old_vm_running) {
+            vm_start();
+        }
+        state = MIG_STATE_ERROR;
+    }
+    s->state = state;
+}
+
+#ifdef CONFIG_IOTHREAD
+/* Called by the writer thread of the buffered file when it can take more
+   data.  */
+void migrate_fd_put_ready(void *opaque)
+{
+    FdMigrationState *s = opaque;
+
+    qemu_mutex_lock(&s->thread_lock);
+    s->thread_ready = 1;
+    qemu_cond_signal(&s->thread_cond);
+    qemu_mutex_unlock(&s->thread_lock);
+}
+#else
 void migrate_fd_put_ready(void *opaque)
 {
     FdMigrationState *s = opaque;
@@ -339,31 +856,11 @@ void migrate_fd_put_ready(void *opaque)
 
     DPRINTF("iterate\n");
     if (qemu_savevm_state_iterate(s->mon, s->file) == 1) {
-        int state;
-        int old_vm_running = vm_running;
-
         DPRINTF("done iterating\n");
-        vm_stop(0);
-
-        qemu_aio_flush();
-        bdrv_flush_all();
-        if ((qemu_savevm_state_complete(s->mon, s->file)) < 0) {
-            if (old_vm_running) {
-                vm_start();
-            }
-            state = MIG_STATE_ERROR;
-        } else {
-            state = MIG_STATE_COMPLETED;
-        }
-        if (migrate_fd_cleanup(s) < 0) {
-            if (old_vm_running) {
-                vm_start();
-            }
-            state = MIG_STATE_ERROR;
-        }
-        s->state = state;
+        migrate_fd_complete(s);
     }
 }
+#endif
 
 int migrate_fd_get_status(MigrationState *mig_state)
 {
@@ -381,6 +878,10 @@ void migrate_fd_cancel(MigrationState *mig_state)
     DPRINTF("cancelling migration\n");
 
     s->state = MIG_STATE_CANCELLED;
+    multifd_save_shutdown();
+#ifdef CONFIG_IOTHREAD
+    migrate_fd_stop_thread(s);
+#endif
     qemu_savevm_state_cancel(s->mon, s->file);
 
     migrate_fd_cleanup(s);
@@ -394,8 +895,17 @@ void migrate_fd_release(MigrationState *mig_state)
    
     if (s->state == MIG_STATE_ACTIVE) {
         s->state = MIG_STATE_CANCELLED;
+        multifd_save_shutdown();
+#ifdef CONFIG_IOTHREAD
+        migrate_fd_stop_thread(s);
+#endif
         migrate_fd_cleanup(s);
     }
+#ifdef CONFIG_IOTHREAD
+    if (s->thread_done) {
+        qemu_bh_delete(s->thread_done);
+    }
+#endif
     free(s);
 }
 
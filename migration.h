@@ -16,6 +16,9 @@
 
 #include "qdict.h"
 #include "qemu-common.h"
+#ifdef CONFIG_IOTHREAD
+#include "qemu-thread.h"
+#endif
 
 #define MIG_STATE_ERROR		-1
 #define MIG_STATE_COMPLETED	0
@@ -46,12 +49,29 @@ struct FdMigrationState
     int state;
     int (*get_error)(struct FdMigrationState*);
     int (*close)(struct FdMigrationState*);
-    int (*write)(struct FdMigrationState*, const void *, size_t);
+    ssize_t (*writev)(struct FdMigrationState*, const struct iovec *, int);
+    /* connect an extra channel to the destination, for multifd */
+    int (*open_channel)(struct FdMigrationState*);
     void *opaque;
+#ifdef CONFIG_IOTHREAD
+    /* the migration thread runs the iterative stage; thread_done hands
+       the final stage back to the main loop */
+    QemuThread thread;
+    QemuMutex thread_lock;
+    QemuCond thread_cond;
+    QEMUBH *thread_done;
+    int thread_running;
+    int thread_stop;
+    int thread_ready;
+    int thread_ret;
+    int postcopy;
+#endif
 };
 
 void qemu_start_incoming_migration(const char *uri);
 
+int migrate_is_active(void);
+
 int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
 int do_migrate_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data);
@@ -63,6 +83,48 @@ uint64_t migrate_max_downtime(void);
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
+enum {
+    MIGRATION_CAP_XBZRLE,
+    MIGRATION_CAP_POSTCOPY,
+    MIGRATION_CAP_AUTO_CONVERGE,
+    MIGRATION_CAP_MULTIFD,
+    MIGRATION_CAP_NUM,
+};
+
+int migrate_use_xbzrle(void);
+int migrate_use_postcopy(void);
+int migrate_use_auto_converge(void);
+int migrate_use_multifd(void);
+
+int migrate_multifd_channels(void);
+
+int migrate_block_max_inflight(void);
+
+int64_t migrate_xbzrle_cache_size(void);
+
+int do_migrate_set_capability(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
+int do_migrate_set_block_inflight(Monitor *mon, const QDict *qdict,
+                                  QObject **ret_data);
+
+/* While an incoming tcp: or unix: migration is loaded, fd is its
+   listening socket; migrate_incoming_accept_channel accepts a further
+   connection on it, or returns -1.  */
+void migrate_incoming_set_listen_fd(int fd);
+
+int migrate_incoming_accept_channel(void);
+
+void do_info_migrate_capabilities_print(Monitor *mon, const QObject *data);
+
+void do_info_migrate_capabilities(Monitor *mon, QObject **ret_data);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -111,7 +173,7 @@ int migrate_fd_cleanup(FdMigrationState *s);
 
 void migrate_fd_put_notify(void *opaque);
 
-ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size);
+ssize_t migrate_fd_writev(void *opaque, const struct iovec *iov, int iovcnt);
 
 void migrate_fd_connect(FdMigrationState *s);
 
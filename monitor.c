@@ -39,6 +39,7 @@
 #include "readline.h"
 #include "console.h"
 #include "block.h"
+#include "block-stream.h"
 #include "audio/audio.h"
 #include "disas.h"
 #include "balloon.h"
@@ -541,6 +542,11 @@ static void do_commit(Monitor *mon, const QDict *qdict)
         if (!all_devices)
             if (strcmp(bdrv_get_device_name(dinfo->bdrv), device))
                 continue;
+        if (block_stream_active(dinfo->bdrv)) {
+            qerror_report(QERR_DEVICE_IN_USE,
+                          bdrv_get_device_name(dinfo->bdrv));
+            continue;
+        }
         bdrv_commit(dinfo->bdrv);
     }
 }
@@ -962,7 +968,12 @@ static int eject_device(Monitor *mon, BlockDriverState *bs, int force)
                 qerror_report(QERR_DEVICE_LOCKED, bdrv_get_device_name(bs));
                 return -1;
             }
+            if (block_stream_active(bs)) {
+                qerror_report(QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+                return -1;
+            }
         }
+        block_stream_abort(bs);
         bdrv_close(bs);
     }
     return 0;
@@ -2448,6 +2459,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "blockstream",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the active block streams",
+        .user_print = do_info_block_stream_print,
+        .mhandler.info_new = do_info_block_stream,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -2648,6 +2667,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_migrate_print,
         .mhandler.info_new = do_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show migration capabilities",
+        .user_print = do_info_migrate_capabilities_print,
+        .mhandler.info_new = do_info_migrate_capabilities,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
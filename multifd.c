@@ -0,0 +1,535 @@
+/*
+ * Multi-stream live migration
+ *
+ * On the source, the migration thread fills batches of pages and hands
+ * each one to an idle channel; the channel's sender thread writes it out
+ * with a single writev, straight from guest RAM.  On the destination,
+ * one receiver thread per channel stores the pages it reads directly in
+ * guest RAM, while the main thread loads the rest of the stream.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <signal.h>
+#include <sys/mman.h>
+#include "qemu-common.h"
+#include "cpu.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "kvm.h"
+#include "migration.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "multifd.h"
+
+//#define DEBUG_MULTIFD
+
+#ifdef DEBUG_MULTIFD
+#define DPRINTF(fmt, ...) \
+    do { printf("multifd: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* sent at the start of each channel, followed by its index */
+#define MULTIFD_MAGIC           0x514d4643
+
+/* record types, in the low bits of the page address */
+#define MULTIFD_FLAG_UNIFORM    0x01
+#define MULTIFD_FLAG_PAGE       0x02
+#define MULTIFD_FLAG_SYNC       0x04
+#define MULTIFD_FLAG_EOS        0x08
+
+/* pages handed to a channel at a time */
+#define MULTIFD_BATCH           64
+
+typedef struct MultiFDPage {
+    uint64_t header;            /* big endian address and record type */
+    const uint8_t *host;        /* NULL for a uniform page */
+    uint8_t byte;               /* contents of a uniform page */
+} MultiFDPage;
+
+typedef struct MultiFDSendChannel {
+    int fd;
+    QemuThread thread;
+    /* work handed over by the producer */
+    MultiFDPage pages[MULTIFD_BATCH];
+    int npages;
+    int sync;
+    int pending;
+} MultiFDSendChannel;
+
+/* Everything but the batch and the window is protected by lock.  */
+static struct {
+    MultiFDSendChannel *channels;
+    int nchannels;
+    int next;
+    int quit;
+    int error;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond idle_cond;
+    MultiFDPage batch[MULTIFD_BATCH];
+    int batch_len;
+    int64_t window_start;
+    size_t window_bytes;
+} multifd_send;
+
+typedef struct MultiFDRecvChannel {
+    QEMUFile *file;
+    int fd;
+} MultiFDRecvChannel;
+
+static struct {
+    MultiFDRecvChannel *channels;
+    int nchannels;
+    int arrived;                /* channels waiting at a sync point */
+    int generation;             /* bumped when they are let go */
+    int error;
+    QemuMutex lock;
+    QemuCond cond;
+} multifd_recv;
+
+static int multifd_write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *c = opaque;
+    MultiFDPage pages[MULTIFD_BATCH];
+    struct iovec iov[MULTIFD_BATCH * 2 + 1];
+    uint64_t sync_header = cpu_to_be64(MULTIFD_FLAG_SYNC);
+    uint64_t eos_header = cpu_to_be64(MULTIFD_FLAG_EOS);
+    int npages, sync, i, n, ret = 0;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    for (;;) {
+        while (!c->pending && !multifd_send.quit) {
+            qemu_cond_wait(&multifd_send.work_cond, &multifd_send.lock);
+        }
+        if (!c->pending || multifd_send.error) {
+            break;
+        }
+        npages = c->npages;
+        sync = c->sync;
+        memcpy(pages, c->pages, npages * sizeof(MultiFDPage));
+        c->npages = 0;
+        c->sync = 0;
+        c->pending = 0;
+        qemu_cond_broadcast(&multifd_send.idle_cond);
+        qemu_mutex_unlock(&multifd_send.lock);
+
+        for (i = 0, n = 0; i < npages; i++) {
+            iov[n].iov_base = &pages[i].header;
+            iov[n++].iov_len = sizeof(pages[i].header);
+            if (pages[i].host) {
+                iov[n].iov_base = (void *)pages[i].host;
+                iov[n++].iov_len = TARGET_PAGE_SIZE;
+            } else {
+                iov[n].iov_base = &pages[i].byte;
+                iov[n++].iov_len = 1;
+            }
+        }
+        if (sync) {
+            iov[n].iov_base = &sync_header;
+            iov[n++].iov_len = sizeof(sync_header);
+        }
+        ret = multifd_write_all(c->fd, iov, n);
+
+        qemu_mutex_lock(&multifd_send.lock);
+        if (ret < 0) {
+            DPRINTF("write error on channel %d\n",
+                    (int)(c - multifd_send.channels));
+            multifd_send.error = 1;
+            qemu_cond_broadcast(&multifd_send.idle_cond);
+            break;
+        }
+    }
+    ret = multifd_send.error;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    if (!ret) {
+        iov[0].iov_base = &eos_header;
+        iov[0].iov_len = sizeof(eos_header);
+        multifd_write_all(c->fd, iov, 1);
+    }
+    return NULL;
+}
+
+int multifd_save_setup(int nchannels, MultiFDOpenChannelFunc *open_channel,
+                       void *opaque)
+{
+    sigset_t set, oldset;
+    uint32_t hello[2];
+    struct iovec iov;
+    int i, fd;
+
+    memset(&multifd_send, 0, sizeof(multifd_send));
+    multifd_send.channels = qemu_mallocz(nchannels *
+                                         sizeof(MultiFDSendChannel));
+    for (i = 0; i < nchannels; i++) {
+        fd = open_channel(opaque);
+        hello[0] = cpu_to_be32(MULTIFD_MAGIC);
+        hello[1] = cpu_to_be32(i);
+        iov.iov_base = hello;
+        iov.iov_len = sizeof(hello);
+        if (fd < 0 || multifd_write_all(fd, &iov, 1) < 0) {
+            fprintf(stderr, "could not open migration channel %d\n", i);
+            if (fd >= 0) {
+                close(fd);
+            }
+            while (i--) {
+                close(multifd_send.channels[i].fd);
+            }
+            qemu_free(multifd_send.channels);
+            multifd_send.channels = NULL;
+            return -1;
+        }
+        multifd_send.channels[i].fd = fd;
+    }
+
+    qemu_mutex_init(&multifd_send.lock);
+    qemu_cond_init(&multifd_send.work_cond);
+    qemu_cond_init(&multifd_send.idle_cond);
+    multifd_send.nchannels = nchannels;
+    multifd_send.window_start = qemu_get_clock(rt_clock);
+
+    /* the main loop handles the signals */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < nchannels; i++) {
+        qemu_thread_create(&multifd_send.channels[i].thread,
+                           multifd_send_thread, &multifd_send.channels[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    DPRINTF("%d channels\n", nchannels);
+    return 0;
+}
+
+int multifd_save_channels(void)
+{
+    return multifd_send.nchannels;
+}
+
+/* Hand the current batch to the next idle channel or, if sync is set,
+   to the given channel along with a sync point.  */
+static void multifd_send_batch(int sync, int index)
+{
+    MultiFDSendChannel *c = NULL;
+    int i, n = multifd_send.nchannels;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    while (!multifd_send.error) {
+        if (sync) {
+            c = &multifd_send.channels[index];
+            if (!c->pending) {
+                break;
+            }
+        } else {
+            for (i = 0; i < n; i++) {
+                c = &multifd_send.channels[(multifd_send.next + i) % n];
+                if (!c->pending) {
+                    break;
+                }
+            }
+            if (i < n) {
+                multifd_send.next = (multifd_send.next + i + 1) % n;
+                break;
+            }
+        }
+        qemu_cond_wait(&multifd_send.idle_cond, &multifd_send.lock);
+    }
+    if (!multifd_send.error) {
+        memcpy(c->pages, multifd_send.batch,
+               multifd_send.batch_len * sizeof(MultiFDPage));
+        c->npages = multifd_send.batch_len;
+        c->sync = sync;
+        c->pending = 1;
+        qemu_cond_broadcast(&multifd_send.work_cond);
+    }
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    multifd_send.batch_len = 0;
+}
+
+int multifd_queue_page(uint64_t addr, const uint8_t *host)
+{
+    MultiFDPage *page = &multifd_send.batch[multifd_send.batch_len++];
+    int bytes;
+
+    if (buffer_is_uniform(host, TARGET_PAGE_SIZE)) {
+        page->header = cpu_to_be64(addr | MULTIFD_FLAG_UNIFORM);
+        page->host = NULL;
+        page->byte = *host;
+        bytes = sizeof(page->header) + 1;
+    } else {
+        /* like single-stream migration, the page is sent from guest RAM
+           and sent again if the guest dirties it in the meantime */
+        page->header = cpu_to_be64(addr | MULTIFD_FLAG_PAGE);
+        page->host = host;
+        bytes = sizeof(page->header) + TARGET_PAGE_SIZE;
+    }
+    multifd_send.window_bytes += bytes;
+
+    if (multifd_send.batch_len == MULTIFD_BATCH) {
+        multifd_send_batch(0, 0);
+    }
+    return bytes;
+}
+
+void multifd_send_sync(void)
+{
+    int i;
+
+    /* the first channel carries the pending batch along with its sync
+       point, the others get an empty batch */
+    for (i = 0; i < multifd_send.nchannels; i++) {
+        multifd_send_batch(1, i);
+    }
+}
+
+int multifd_rate_limit(size_t limit)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+
+    if (now - multifd_send.window_start >= 100) {
+        multifd_send.window_start = now;
+        multifd_send.window_bytes = 0;
+    }
+    return multifd_send.window_bytes > limit;
+}
+
+int multifd_send_error(void)
+{
+    int ret;
+
+    if (!multifd_send.nchannels) {
+        return 0;
+    }
+    qemu_mutex_lock(&multifd_send.lock);
+    ret = multifd_send.error;
+    qemu_mutex_unlock(&multifd_send.lock);
+    return ret;
+}
+
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send.nchannels) {
+        return;
+    }
+    qemu_mutex_lock(&multifd_send.lock);
+    multifd_send.error = 1;
+    multifd_send.quit = 1;
+    for (i = 0; i < multifd_send.nchannels; i++) {
+        shutdown(multifd_send.channels[i].fd, SHUT_RDWR);
+    }
+    qemu_cond_broadcast(&multifd_send.work_cond);
+    qemu_cond_broadcast(&multifd_send.idle_cond);
+    qemu_mutex_unlock(&multifd_send.lock);
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send.nchannels) {
+        return;
+    }
+    if (multifd_send.batch_len) {
+        multifd_send_batch(0, 0);
+    }
+    qemu_mutex_lock(&multifd_send.lock);
+    multifd_send.quit = 1;
+    qemu_cond_broadcast(&multifd_send.work_cond);
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    for (i = 0; i < multifd_send.nchannels; i++) {
+        qemu_thread_join(&multifd_send.channels[i].thread);
+        close(multifd_send.channels[i].fd);
+    }
+    qemu_free(multifd_send.channels);
+    multifd_send.channels = NULL;
+    multifd_send.nchannels = 0;
+    DPRINTF("channels closed\n");
+}
+
+static void multifd_recv_fail(void)
+{
+    qemu_mutex_lock(&multifd_recv.lock);
+    multifd_recv.error = 1;
+    qemu_cond_broadcast(&multifd_recv.cond);
+    qemu_mutex_unlock(&multifd_recv.lock);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *c = opaque;
+    QEMUFile *f = c->file;
+    uint64_t header;
+    ram_addr_t addr;
+    uint8_t *host;
+    int flags, generation, ch;
+
+    pthread_detach(pthread_self());
+
+    for (;;) {
+        header = qemu_get_be64(f);
+        flags = header & ~TARGET_PAGE_MASK;
+        addr = header & TARGET_PAGE_MASK;
+        if (qemu_file_has_error(f)) {
+            break;
+        }
+
+        if (flags == MULTIFD_FLAG_SYNC) {
+            qemu_mutex_lock(&multifd_recv.lock);
+            generation = multifd_recv.generation;
+            multifd_recv.arrived++;
+            qemu_cond_broadcast(&multifd_recv.cond);
+            while (generation == multifd_recv.generation &&
+                   !multifd_recv.error) {
+                qemu_cond_wait(&multifd_recv.cond, &multifd_recv.lock);
+            }
+            qemu_mutex_unlock(&multifd_recv.lock);
+            continue;
+        }
+        if (flags == MULTIFD_FLAG_EOS) {
+            qemu_fclose(f);
+            close(c->fd);
+            return NULL;
+        }
+        if (addr >= last_ram_offset) {
+            break;
+        }
+
+        host = qemu_get_ram_ptr(addr);
+        if (flags == MULTIFD_FLAG_UNIFORM) {
+            ch = qemu_get_byte(f);
+            memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+            if (ch == 0 &&
+                (!kvm_enabled() || kvm_has_sync_mmu())) {
+                madvise(host, TARGET_PAGE_SIZE, MADV_DONTNEED);
+            }
+#endif
+        } else if (flags == MULTIFD_FLAG_PAGE) {
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else {
+            break;
+        }
+    }
+
+    fprintf(stderr, "error on a migration channel\n");
+    multifd_recv_fail();
+    qemu_fclose(f);
+    close(c->fd);
+    return NULL;
+}
+
+int multifd_load_setup(int nchannels)
+{
+    MultiFDRecvChannel *channels;
+    sigset_t set, oldset;
+    QemuThread thread;
+    int i;
+
+    if (nchannels < 1 || nchannels > MULTIFD_MAX_CHANNELS) {
+        fprintf(stderr, "invalid number of migration channels: %d\n",
+                nchannels);
+        return -1;
+    }
+    if (multifd_recv.nchannels) {
+        fprintf(stderr, "multi-stream migration already in progress\n");
+        return -1;
+    }
+
+    channels = qemu_mallocz(nchannels * sizeof(MultiFDRecvChannel));
+    for (i = 0; i < nchannels; i++) {
+        channels[i].fd = migrate_incoming_accept_channel();
+        if (channels[i].fd < 0) {
+            fprintf(stderr, "could not accept migration channel %d\n", i);
+            goto fail;
+        }
+        channels[i].file = qemu_fopen_socket(channels[i].fd);
+        if (qemu_get_be32(channels[i].file) != MULTIFD_MAGIC ||
+            qemu_get_be32(channels[i].file) >= nchannels) {
+            fprintf(stderr, "bad migration channel\n");
+            i++;
+            goto fail;
+        }
+    }
+
+    /* the receiver threads stay around until their channel ends, so the
+       channels are never freed */
+    qemu_mutex_init(&multifd_recv.lock);
+    qemu_cond_init(&multifd_recv.cond);
+    multifd_recv.channels = channels;
+    multifd_recv.nchannels = nchannels;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < nchannels; i++) {
+        qemu_thread_create(&thread, multifd_recv_thread, &channels[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    DPRINTF("%d channels\n", nchannels);
+    return 0;
+
+fail:
+    while (i--) {
+        qemu_fclose(channels[i].file);
+        close(channels[i].fd);
+    }
+    qemu_free(channels);
+    return -1;
+}
+
+int multifd_load_sync(void)
+{
+    int ret;
+
+    if (!multifd_recv.nchannels) {
+        return -1;
+    }
+    qemu_mutex_lock(&multifd_recv.lock);
+    while (multifd_recv.arrived < multifd_recv.nchannels &&
+           !multifd_recv.error) {
+        qemu_cond_wait(&multifd_recv.cond, &multifd_recv.lock);
+    }
+    ret = multifd_recv.error ? -1 : 0;
+    multifd_recv.arrived = 0;
+    multifd_recv.generation++;
+    qemu_cond_broadcast(&multifd_recv.cond);
+    qemu_mutex_unlock(&multifd_recv.lock);
+
+    return ret;
+}
@@ -0,0 +1,115 @@
+/*
+ * Multi-stream live migration
+ *
+ * RAM pages can be spread over several extra sockets, each with its own
+ * sender thread on the source and receiver thread on the destination,
+ * while the device state stays on the main channel.  A page may be sent
+ * once per pass over RAM, so the passes are separated by sync points:
+ * every channel gets a sync record, and no channel goes past it on the
+ * destination until all of them have reached it and the main channel
+ * has asked for it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MULTIFD_H
+#define QEMU_MULTIFD_H
+
+#include "qemu-common.h"
+
+#define MULTIFD_MAX_CHANNELS 16
+
+typedef int (MultiFDOpenChannelFunc)(void *opaque);
+
+#ifdef CONFIG_IOTHREAD
+/* Source.  Open nchannels channels with open_channel and start their
+   sender threads.  Return 0, or -1 on error.  */
+int multifd_save_setup(int nchannels, MultiFDOpenChannelFunc *open_channel,
+                       void *opaque);
+
+/* Number of channels in use, 0 if the migration is single-stream.  */
+int multifd_save_channels(void);
+
+/* Queue the page at addr, whose contents are at host, to a channel.
+   Return the number of bytes it takes on the wire.  */
+int multifd_queue_page(uint64_t addr, const uint8_t *host);
+
+/* Put a sync point on every channel.  */
+void multifd_send_sync(void);
+
+/* Nonzero once the pages queued in the current 100ms window reach
+   limit bytes.  */
+int multifd_rate_limit(size_t limit);
+
+int multifd_send_error(void);
+
+/* Make the sender threads give up, so that the producer cannot stay
+   blocked on a stalled channel.  */
+void multifd_save_shutdown(void);
+
+/* Close the channels; unless the migration failed, what was queued is
+   sent first.  */
+void multifd_save_cleanup(void);
+
+/* Destination.  Accept nchannels channels and start their receiver
+   threads.  Return 0, or -1 on error.  */
+int multifd_load_setup(int nchannels);
+
+/* Wait until every channel has reached its next sync point, then let
+   them go on.  Return 0, or -1 if a channel failed.  */
+int multifd_load_sync(void);
+#else
+static inline int multifd_save_setup(int nchannels,
+                                     MultiFDOpenChannelFunc *open_channel,
+                                     void *opaque)
+{
+    return -1;
+}
+
+static inline int multifd_save_channels(void)
+{
+    return 0;
+}
+
+static inline int multifd_queue_page(uint64_t addr, const uint8_t *host)
+{
+    abort();
+}
+
+static inline void multifd_send_sync(void)
+{
+}
+
+static inline int multifd_rate_limit(size_t limit)
+{
+    return 0;
+}
+
+static inline int multifd_send_error(void)
+{
+    return 0;
+}
+
+static inline void multifd_save_shutdown(void)
+{
+}
+
+static inline void multifd_save_cleanup(void)
+{
+}
+
+static inline int multifd_load_setup(int nchannels)
+{
+    fprintf(stderr, "multi-stream migration needs the I/O thread\n");
+    return -1;
+}
+
+static inline int multifd_load_sync(void)
+{
+    return -1;
+}
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Page cache for migration
+ *
+ * The entries are allocated up front and live on one LRU list, most
+ * recently used first; entries holding a page are also chained in a hash
+ * table indexed by page number.  An insert that misses reuses the entry
+ * at the tail of the list.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "page_cache.h"
+
+typedef struct CacheItem CacheItem;
+
+struct CacheItem {
+    uint64_t it_addr;
+    uint8_t *it_data;
+    int it_cached;
+    QLIST_ENTRY(CacheItem) hash_next;
+    QTAILQ_ENTRY(CacheItem) lru_next;
+};
+
+struct PageCache {
+    CacheItem *items;
+    uint8_t *data;
+    QLIST_HEAD(, CacheItem) *buckets;
+    QTAILQ_HEAD(CacheLRU, CacheItem) lru;
+    int64_t max_num_items;
+    unsigned int page_size;
+    int hash_bits;
+};
+
+static unsigned int cache_hash(const PageCache *cache, uint64_t addr)
+{
+    uint64_t page = addr / cache->page_size;
+
+    if (!cache->hash_bits) {
+        return 0;
+    }
+    return (page * 0x9e3779b97f4a7c15ULL) >> (64 - cache->hash_bits);
+}
+
+static CacheItem *cache_find(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it;
+
+    QLIST_FOREACH(it, &cache->buckets[cache_hash(cache, addr)], hash_next) {
+        if (it->it_addr == addr) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+static int cache_hash_bits(int64_t num_pages)
+{
+    int bits = 0;
+
+    while (bits < 40 && (2LL << bits) <= num_pages) {
+        bits++;
+    }
+    return bits;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    PageCache *cache;
+    int64_t i;
+    int bits = cache_hash_bits(num_pages);
+
+    cache = qemu_mallocz(sizeof(*cache));
+    cache->max_num_items = 1LL << bits;
+    cache->page_size = page_size;
+    cache->hash_bits = bits;
+    cache->items = qemu_mallocz(cache->max_num_items * sizeof(CacheItem));
+    cache->data = qemu_malloc(cache->max_num_items * page_size);
+    cache->buckets = qemu_mallocz(cache->max_num_items *
+                                  sizeof(*cache->buckets));
+
+    QTAILQ_INIT(&cache->lru);
+    for (i = 0; i < cache->max_num_items; i++) {
+        CacheItem *it = &cache->items[i];
+
+        it->it_data = cache->data + i * page_size;
+        QTAILQ_INSERT_TAIL(&cache->lru, it, lru_next);
+    }
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    qemu_free(cache->buckets);
+    qemu_free(cache->data);
+    qemu_free(cache->items);
+    qemu_free(cache);
+}
+
+int64_t cache_max_num_items(const PageCache *cache)
+{
+    return cache->max_num_items;
+}
+
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+    if (it != QTAILQ_FIRST(&cache->lru)) {
+        QTAILQ_REMOVE(&cache->lru, it, lru_next);
+        QTAILQ_INSERT_HEAD(&cache->lru, it, lru_next);
+    }
+    return it->it_data;
+}
+
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (!it) {
+        it = QTAILQ_LAST(&cache->lru, CacheLRU);
+        if (it->it_cached) {
+            QLIST_REMOVE(it, hash_next);
+        }
+        it->it_addr = addr;
+        it->it_cached = 1;
+        QLIST_INSERT_HEAD(&cache->buckets[cache_hash(cache, addr)], it,
+                          hash_next);
+    }
+    if (it != QTAILQ_FIRST(&cache->lru)) {
+        QTAILQ_REMOVE(&cache->lru, it, lru_next);
+        QTAILQ_INSERT_HEAD(&cache->lru, it, lru_next);
+    }
+    if (it->it_data != pdata) {
+        memcpy(it->it_data, pdata, cache->page_size);
+    }
+}
+
+PageCache *cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    PageCache *new_cache;
+    CacheItem *it;
+    int64_t n;
+
+    if (cache_hash_bits(new_num_pages) == cache->hash_bits) {
+        return cache;
+    }
+    new_cache = cache_init(new_num_pages, cache->page_size);
+
+    /* Insert from the least recently used end of the part that fits, so
+       that the old order is kept.  */
+    it = QTAILQ_FIRST(&cache->lru);
+    for (n = 1; n < new_cache->max_num_items; n++) {
+        if (!QTAILQ_NEXT(it, lru_next)) {
+            break;
+        }
+        it = QTAILQ_NEXT(it, lru_next);
+    }
+    for (; it; it = QTAILQ_PREV(it, CacheLRU, lru_next)) {
+        if (it->it_cached) {
+            cache_insert(new_cache, it->it_addr, it->it_data);
+        }
+    }
+    cache_fini(cache);
+    return new_cache;
+}
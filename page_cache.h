@@ -0,0 +1,38 @@
+/*
+ * Page cache for migration
+ *
+ * A bounded cache of page contents keyed by address, with least recently
+ * used replacement.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_PAGE_CACHE_H
+#define QEMU_PAGE_CACHE_H
+
+typedef struct PageCache PageCache;
+
+/* Create a cache of num_pages pages of page_size bytes each.  num_pages
+   is rounded down to a power of two, and is at least one.  */
+PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+
+void cache_fini(PageCache *cache);
+
+/* Number of pages the cache can hold.  */
+int64_t cache_max_num_items(const PageCache *cache);
+
+/* Return the cached contents of the page at addr and make it the most
+   recently used entry, or NULL if the page is not cached.  */
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
+
+/* Copy the page at pdata into the cache as the contents of addr,
+   evicting the least recently used page if the cache is full.  */
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
+
+/* Return a cache of new_num_pages pages holding the most recently used
+   pages of cache, which is freed.  */
+PageCache *cache_resize(PageCache *cache, int64_t new_num_pages);
+
+#endif
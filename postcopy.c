@@ -0,0 +1,385 @@
+/*
+ * Post-copy live migration, destination side
+ *
+ * Every RAM block is moved to shared memory, mapped twice: the guest
+ * keeps using the original address, where missing pages are PROT_NONE,
+ * and the receiver thread fills pages in through a writable alias before
+ * opening them up.  That way no thread ever sees a partially received
+ * page.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "qemu-common.h"
+#include "cpu.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "kvm.h"
+#include "arch_init.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "postcopy.h"
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { printf("postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct PostcopyRegion {
+    uint8_t *host;              /* guest mapping */
+    uint8_t *alias;             /* writable mapping of the same memory */
+    ram_addr_t offset;
+    ram_addr_t length;
+} PostcopyRegion;
+
+int postcopy_incoming_active;
+
+/* The bitmaps and the regions are read by the SIGSEGV handler, so they
+   are never freed: a handler may still be looking at them when the last
+   page arrives.  */
+static struct {
+    unsigned long *pending;     /* pages not received yet */
+    unsigned long *requested;   /* pages asked for by a fault */
+    ram_addr_t npages;
+    ram_addr_t nr_pending;
+    PostcopyRegion *regions;
+    int nregions;
+    int map_error;
+    QEMUFile *file;
+    int fd;
+    int send_lock;
+    QemuThread thread;
+    struct sigaction old_segv;
+} postcopy;
+
+static inline int postcopy_page_pending(ram_addr_t page)
+{
+    volatile unsigned long *p = &postcopy.pending[BIT_WORD(page)];
+
+    return (*p & BIT_MASK(page)) != 0;
+}
+
+/* Ask the source for a page.  Called from the SIGSEGV handler, so only
+   async-signal-safe functions may be used.  */
+static void postcopy_request(ram_addr_t page)
+{
+    unsigned long mask = BIT_MASK(page);
+    uint64_t addr;
+    size_t done = 0;
+    ssize_t ret;
+
+    if (__sync_fetch_and_or(&postcopy.requested[BIT_WORD(page)], mask) &
+        mask) {
+        return;
+    }
+
+    addr = cpu_to_be64((uint64_t)page << TARGET_PAGE_BITS);
+    while (__sync_lock_test_and_set(&postcopy.send_lock, 1)) {
+        sched_yield();
+    }
+    while (done < sizeof(addr)) {
+        ret = send(postcopy.fd, (char *)&addr + done, sizeof(addr) - done, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* the receiver thread will find the stream broken too */
+            break;
+        }
+        done += ret;
+    }
+    __sync_lock_release(&postcopy.send_lock);
+}
+
+/* Request the page and wait until the receiver thread has filled it in.  */
+static void postcopy_wait(ram_addr_t page)
+{
+    static const struct timespec ts = { 0, 20000 };
+
+    if (!postcopy_page_pending(page)) {
+        return;
+    }
+    postcopy_request(page);
+    while (postcopy_page_pending(page)) {
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void postcopy_segv_handler(int sig, siginfo_t *info, void *ctx)
+{
+    uint8_t *addr = info->si_addr;
+    int saved_errno = errno;
+    int i;
+
+    for (i = 0; i < postcopy.nregions; i++) {
+        PostcopyRegion *r = &postcopy.regions[i];
+
+        if (addr >= r->host && addr < r->host + r->length) {
+            postcopy_wait((r->offset + (addr - r->host)) >> TARGET_PAGE_BITS);
+            errno = saved_errno;
+            return;
+        }
+    }
+
+    /* not a guest page: fault again with the previous action */
+    sigaction(SIGSEGV, &postcopy.old_segv, NULL);
+}
+
+void postcopy_incoming_touch(const void *host, size_t len)
+{
+    const volatile uint8_t *p, *end;
+
+    p = (const uint8_t *)((uintptr_t)host & TARGET_PAGE_MASK);
+    end = (const uint8_t *)host + len;
+    for (; p < end; p += TARGET_PAGE_SIZE) {
+        (void)*p;
+    }
+}
+
+static PostcopyRegion *postcopy_find_region(ram_addr_t addr)
+{
+    int i;
+
+    for (i = 0; i < postcopy.nregions; i++) {
+        PostcopyRegion *r = &postcopy.regions[i];
+
+        if (addr - r->offset < r->length) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Return the end of the run of pages starting at page whose pending bit
+   is equal to pending, stopping at end.  */
+static ram_addr_t postcopy_run_end(ram_addr_t page, ram_addr_t end,
+                                   int pending)
+{
+    while (page < end && postcopy_page_pending(page) == pending) {
+        page++;
+    }
+    return page;
+}
+
+static int postcopy_shm_open(void)
+{
+    static const char *const dirs[] = { "/dev/shm", "/tmp" };
+    char path[64];
+    int i, fd;
+
+    for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+        snprintf(path, sizeof(path), "%s/qemu-postcopy.XXXXXX", dirs[i]);
+        fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/* Move a RAM block to shared memory and protect its missing pages.  The
+   guest is not running yet, so the block can be copied as is.  */
+static void postcopy_map_block(void *host, ram_addr_t offset,
+                               ram_addr_t length, void *opaque)
+{
+    PostcopyRegion *r;
+    ram_addr_t page, next, first, end;
+    uint8_t *alias;
+    int fd;
+
+    if (postcopy.map_error) {
+        return;
+    }
+
+    fd = postcopy_shm_open();
+    if (fd < 0 || ftruncate(fd, length) < 0) {
+        perror("postcopy: cannot create shared memory");
+        goto fail;
+    }
+    alias = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (alias == MAP_FAILED) {
+        perror("postcopy: mmap");
+        goto fail;
+    }
+
+    first = offset >> TARGET_PAGE_BITS;
+    end = (offset + length) >> TARGET_PAGE_BITS;
+    for (page = first; page < end; page = next) {
+        next = postcopy_run_end(page, end, 0);
+        memcpy(alias + ((page - first) << TARGET_PAGE_BITS),
+               (uint8_t *)host + ((page - first) << TARGET_PAGE_BITS),
+               (next - page) << TARGET_PAGE_BITS);
+        next = postcopy_run_end(next, end, 1);
+    }
+
+    if (mmap(host, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        perror("postcopy: mmap");
+        munmap(alias, length);
+        goto fail;
+    }
+    close(fd);
+
+    for (page = postcopy_run_end(first, end, 0); page < end;
+         page = postcopy_run_end(next, end, 0)) {
+        next = postcopy_run_end(page, end, 1);
+        mprotect((uint8_t *)host + ((page - first) << TARGET_PAGE_BITS),
+                 (next - page) << TARGET_PAGE_BITS, PROT_NONE);
+    }
+
+    r = &postcopy.regions[postcopy.nregions++];
+    r->host = host;
+    r->alias = alias;
+    r->offset = offset;
+    r->length = length;
+    return;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    postcopy.map_error = 1;
+}
+
+static void postcopy_count_block(void *host, ram_addr_t offset,
+                                 ram_addr_t length, void *opaque)
+{
+    (*(int *)opaque)++;
+}
+
+/* Install a received page and let the guest at it.  */
+static void postcopy_fill_page(ram_addr_t addr, const uint8_t *buf)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    PostcopyRegion *r = postcopy_find_region(addr);
+
+    if (!r || !postcopy_page_pending(page)) {
+        /* already here, the guest may have written it since */
+        return;
+    }
+    memcpy(r->alias + (addr - r->offset), buf, TARGET_PAGE_SIZE);
+    mprotect(r->host + (addr - r->offset), TARGET_PAGE_SIZE,
+             PROT_READ | PROT_WRITE);
+    cpu_physical_memory_set_dirty(addr);
+    __sync_fetch_and_and(&postcopy.pending[BIT_WORD(page)], ~BIT_MASK(page));
+    postcopy.nr_pending--;
+}
+
+static void postcopy_incoming_finish(void)
+{
+    int i;
+
+    sigaction(SIGSEGV, &postcopy.old_segv, NULL);
+    postcopy_incoming_active = 0;
+
+    for (i = 0; i < postcopy.nregions; i++) {
+        munmap(postcopy.regions[i].alias, postcopy.regions[i].length);
+        postcopy.regions[i].alias = NULL;
+    }
+    qemu_fclose(postcopy.file);
+    close(postcopy.fd);
+    postcopy.file = NULL;
+    postcopy.fd = -1;
+}
+
+static void *postcopy_incoming_thread(void *opaque)
+{
+    uint8_t *buf = qemu_malloc(TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    int ret;
+
+    pthread_detach(pthread_self());
+
+    while ((ret = ram_postcopy_get_page(postcopy.file, &addr, buf)) > 0) {
+        postcopy_fill_page(addr, buf);
+    }
+    if (ret < 0 || postcopy.nr_pending) {
+        /* the guest is already running here and cannot go on without its
+           memory */
+        fprintf(stderr, "post-copy migration failed with %" PRIu64
+                " pages missing\n", (uint64_t)postcopy.nr_pending);
+        exit(1);
+    }
+
+    DPRINTF("all pages received\n");
+    postcopy_incoming_finish();
+    qemu_free(buf);
+    return NULL;
+}
+
+int postcopy_incoming_prepare(unsigned long *pending, size_t npages)
+{
+    if (kvm_enabled()) {
+        fprintf(stderr, "post-copy migration is not supported with KVM\n");
+        return -1;
+    }
+    if (TARGET_PAGE_SIZE < getpagesize()) {
+        fprintf(stderr, "post-copy migration needs target pages at least "
+                "as large as host pages\n");
+        return -1;
+    }
+    if (postcopy.pending) {
+        fprintf(stderr, "post-copy migration already in progress\n");
+        return -1;
+    }
+
+    postcopy.pending = pending;
+    postcopy.npages = npages;
+    postcopy.nr_pending = bitmap_count(pending, 0, npages);
+    return 0;
+}
+
+int postcopy_incoming_start(QEMUFile *f, int fd)
+{
+    struct sigaction act;
+    sigset_t set, oldset;
+    int nblocks = 0;
+
+    if (!postcopy.pending || postcopy.file) {
+        return 0;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "post-copy migration needs a socket\n");
+        return -1;
+    }
+
+    DPRINTF("%" PRIu64 " pages missing\n", (uint64_t)postcopy.nr_pending);
+
+    postcopy.requested = qemu_mallocz(BITS_TO_LONGS(postcopy.npages) *
+                                      sizeof(unsigned long));
+    qemu_ram_foreach_block(postcopy_count_block, &nblocks);
+    postcopy.regions = qemu_mallocz(nblocks * sizeof(PostcopyRegion));
+    qemu_ram_foreach_block(postcopy_map_block, NULL);
+    if (postcopy.map_error) {
+        return -1;
+    }
+
+    postcopy.file = f;
+    postcopy.fd = fd;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = postcopy_segv_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, &postcopy.old_segv);
+    postcopy_incoming_active = 1;
+
+    /* the receiver never touches guest pages through the guest mapping,
+       so it can leave all signals to the other threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    qemu_thread_create(&postcopy.thread, postcopy_incoming_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    return 1;
+}
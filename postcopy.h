@@ -0,0 +1,61 @@
+/*
+ * Post-copy live migration, destination side
+ *
+ * The destination starts running before all of RAM has arrived.  Pages
+ * that are still missing are mapped PROT_NONE; a guest access faults,
+ * the page is requested from the source on the migration socket, and the
+ * faulting thread waits until the page has been received.  Meanwhile the
+ * source pushes the remaining pages in the background.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_H
+#define QEMU_POSTCOPY_H
+
+#include "qemu-common.h"
+
+#ifdef CONFIG_IOTHREAD
+extern int postcopy_incoming_active;
+
+/* Take the bitmap of npages pages that the source will send after the
+   device state.  Return 0, or -1 if post-copy cannot be used here.  */
+int postcopy_incoming_prepare(unsigned long *pending, size_t npages);
+
+/* Start the post-copy phase once the device state has been loaded from f.
+   Return 0 if the migration is not post-copy, 1 if the post-copy phase
+   now owns f and the socket fd, or -1 on error.  */
+int postcopy_incoming_start(QEMUFile *f, int fd);
+
+void postcopy_incoming_touch(const void *host, size_t len);
+
+/* Wait for the pages of the given range to be received.  Guest RAM that
+   is handed to a system call (rather than touched by a thread) has to go
+   through here, because the kernel fails such accesses instead of
+   raising SIGSEGV.  */
+static inline void postcopy_incoming_fault_in(const void *host, size_t len)
+{
+    if (postcopy_incoming_active) {
+        postcopy_incoming_touch(host, len);
+    }
+}
+#else
+static inline int postcopy_incoming_prepare(unsigned long *pending,
+                                            size_t npages)
+{
+    return -1;
+}
+
+static inline int postcopy_incoming_start(QEMUFile *f, int fd)
+{
+    return 0;
+}
+
+static inline void postcopy_incoming_fault_in(const void *host, size_t len)
+{
+}
+#endif
+
+#endif
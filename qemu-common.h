@@ -136,6 +136,13 @@ int qemu_fls(int i);
 int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
 
+/* bufferiszero.c */
+int buffer_is_zero(const void *buf, size_t len);
+int buffer_is_uniform(const void *buf, size_t len);
+/* Use at most implementation level (0 portable C, 1 SSE2, 2 AVX2) from
+   now on and return the level actually used; for benchmarks.  */
+int buffer_accel_limit(int level);
+
 /* path.c */
 void init_paths(const char *prefix);
 const char *path(const char *pathname);
@@ -234,6 +241,8 @@ typedef struct VirtIODevice VirtIODevice;
 typedef uint64_t pcibus_t;
 
 void cpu_exec_init_all(unsigned long tb_size);
+void tb_cache_init(const char *filename);
+void tb_trace_init(int threshold);
 
 /* CPU save/load.  */
 void cpu_save(QEMUFile *f, void *opaque);
@@ -255,6 +264,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    int free; /* queued by async_run_on_cpu, freed once run */
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -297,4 +307,10 @@ static inline uint8_t from_bcd(uint8_t val)
 
 #endif /* dyngen-exec.h hack */
 
+/* Device access from a vCPU thread that runs translated code without
+   the global mutex (-tcg-threads multi).  Nests; no-ops otherwise.  */
+void cpu_io_lock(void);
+void cpu_io_unlock(void);
+void cpu_io_lock_reset(void);
+
 #endif
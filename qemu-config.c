@@ -59,6 +59,10 @@ QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "metadata-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "image format metadata cache size (qcow2)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -79,6 +83,10 @@ QemuOptsList qemu_drive_opts = {
         },{
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy read backing file data into the image",
         },
         { /* end if list */ }
     },
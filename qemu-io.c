@@ -195,6 +195,17 @@ static int do_write(char *buf, int64_t offset, int count, int *total)
 	return 1;
 }
 
+static int do_write_zeroes(int64_t offset, int count, int *total)
+{
+	int ret;
+
+	ret = bdrv_write_zeroes(bs, offset >> 9, count >> 9);
+	if (ret < 0)
+		return ret;
+	*total = count;
+	return 1;
+}
+
 static int do_pread(char *buf, int64_t offset, int count, int *total)
 {
 	*total = bdrv_pread(bs, offset, (uint8_t *)buf, count);
@@ -634,6 +645,7 @@ write_help(void)
 " -P, -- use different pattern to fill file\n"
 " -C, -- report statistics in a machine parsable format\n"
 " -q, -- quite mode, do not show I/O statistics\n"
+" -z, -- write zeroes using bdrv_write_zeroes\n"
 "\n");
 }
 
@@ -645,7 +657,7 @@ static const cmdinfo_t write_cmd = {
 	.cfunc		= write_f,
 	.argmin		= 2,
 	.argmax		= -1,
-	.args		= "[-abCpq] [-P pattern ] off len",
+	.args		= "[-abCpqz] [-P pattern ] off len",
 	.oneline	= "writes a number of bytes at a specified offset",
 	.help		= write_help,
 };
@@ -654,16 +666,16 @@ static int
 write_f(int argc, char **argv)
 {
 	struct timeval t1, t2;
-	int Cflag = 0, pflag = 0, qflag = 0, bflag = 0;
+	int Cflag = 0, pflag = 0, qflag = 0, bflag = 0, zflag = 0;
 	int c, cnt;
-	char *buf;
+	char *buf = NULL;
 	int64_t offset;
 	int count;
         /* Some compilers get confused and warn if this is not initialized.  */
         int total = 0;
 	int pattern = 0xcd;
 
-	while ((c = getopt(argc, argv, "bCpP:q")) != EOF) {
+	while ((c = getopt(argc, argv, "bCpP:qz")) != EOF) {
 		switch (c) {
 		case 'b':
 			bflag = 1;
@@ -682,6 +694,9 @@ write_f(int argc, char **argv)
 		case 'q':
 			qflag = 1;
 			break;
+		case 'z':
+			zflag = 1;
+			break;
 		default:
 			return command_usage(&write_cmd);
 		}
@@ -695,6 +710,11 @@ write_f(int argc, char **argv)
 		return 0;
 	}
 
+	if (zflag && (bflag || pflag)) {
+		printf("-z cannot be specified together with -b or -p\n");
+		return 0;
+	}
+
 	offset = cvtnum(argv[optind]);
 	if (offset < 0) {
 		printf("non-numeric length argument -- %s\n", argv[optind]);
@@ -722,10 +742,13 @@ write_f(int argc, char **argv)
 		}
 	}
 
-	buf = qemu_io_alloc(count, pattern);
+	if (!zflag)
+		buf = qemu_io_alloc(count, pattern);
 
 	gettimeofday(&t1, NULL);
-	if (pflag)
+	if (zflag)
+		cnt = do_write_zeroes(offset, count, &total);
+	else if (pflag)
 		cnt = do_pwrite(buf, offset, count, &total);
 	else if (bflag)
 		cnt = do_save_vmstate(buf, offset, count, &total);
@@ -746,7 +769,8 @@ write_f(int argc, char **argv)
 	print_report("wrote", &t2, offset, count, total, cnt, Cflag);
 
 out:
-	qemu_io_free(buf);
+	if (buf)
+		qemu_io_free(buf);
 
 	return 0;
 }
@@ -1334,6 +1358,103 @@ static const cmdinfo_t truncate_cmd = {
 	.oneline	= "truncates the current file at the given offset",
 };
 
+static void
+discard_help(void)
+{
+	printf(
+"\n"
+" discards a range of bytes from the given offset\n"
+"\n"
+" Example:\n"
+" 'discard 512 1M' - discards 1 megabyte at 512 bytes into the open file\n"
+"\n"
+" Tells the image format that a segment of the currently open file is no\n"
+" longer used. The contents of the segment are undefined afterwards.\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -q, -- quite mode, do not show I/O statistics\n"
+"\n");
+}
+
+static int discard_f(int argc, char **argv);
+
+static const cmdinfo_t discard_cmd = {
+	.name		= "discard",
+	.altname	= "d",
+	.cfunc		= discard_f,
+	.argmin		= 2,
+	.argmax		= -1,
+	.args		= "[-Cq] off len",
+	.oneline	= "discards a number of bytes at a specified offset",
+	.help		= discard_help,
+};
+
+static int
+discard_f(int argc, char **argv)
+{
+	struct timeval t1, t2;
+	int Cflag = 0, qflag = 0;
+	int c, ret;
+	int64_t offset;
+	int count;
+
+	while ((c = getopt(argc, argv, "Cq")) != EOF) {
+		switch (c) {
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'q':
+			qflag = 1;
+			break;
+		default:
+			return command_usage(&discard_cmd);
+		}
+	}
+
+	if (optind != argc - 2)
+		return command_usage(&discard_cmd);
+
+	offset = cvtnum(argv[optind]);
+	if (offset < 0) {
+		printf("non-numeric length argument -- %s\n", argv[optind]);
+		return 0;
+	}
+
+	optind++;
+	count = cvtnum(argv[optind]);
+	if (count < 0) {
+		printf("non-numeric length argument -- %s\n", argv[optind]);
+		return 0;
+	}
+
+	if (offset & 0x1ff) {
+		printf("offset %" PRId64 " is not sector aligned\n", offset);
+		return 0;
+	}
+
+	if (count & 0x1ff) {
+		printf("count %d is not sector aligned\n", count);
+		return 0;
+	}
+
+	gettimeofday(&t1, NULL);
+	ret = bdrv_discard(bs, offset >> 9, count >> 9);
+	gettimeofday(&t2, NULL);
+
+	if (ret < 0) {
+		printf("discard failed: %s\n", strerror(-ret));
+		return 0;
+	}
+
+	if (qflag)
+		return 0;
+
+	/* Finally, report back -- -C gives a parsable format */
+	t2 = tsub(t2, t1);
+	print_report("discard", &t2, offset, count, count, 1, Cflag);
+
+	return 0;
+}
+
 static int
 length_f(int argc, char **argv)
 {
@@ -1495,12 +1616,14 @@ open_help(void)
 " opens a new file in the requested mode\n"
 "\n"
 " Example:\n"
-" 'open -Cn /tmp/data' - creates/opens data file read-write and uncached\n"
+" 'open -Cn /tmp/data' - opens data file read-write, uncached and with\n"
+"                        copy-on-read\n"
 "\n"
 " Opens a file for subsequent use by all of the other qemu-io commands.\n"
 " -r, -- open file read-only\n"
 " -s, -- use snapshot file\n"
 " -n, -- disable host cache\n"
+" -C, -- copy data read from the backing file into the image\n"
 " -g, -- allow file to grow (only applies to protocols)"
 "\n");
 }
@@ -1527,7 +1650,7 @@ open_f(int argc, char **argv)
 	int growable = 0;
 	int c;
 
-	while ((c = getopt(argc, argv, "snrg")) != EOF) {
+	while ((c = getopt(argc, argv, "snrgC")) != EOF) {
 		switch (c) {
 		case 's':
 			flags |= BDRV_O_SNAPSHOT;
@@ -1535,6 +1658,9 @@ open_f(int argc, char **argv)
 		case 'n':
 			flags |= BDRV_O_NOCACHE;
 			break;
+		case 'C':
+			flags |= BDRV_O_COPY_ON_READ;
+			break;
 		case 'r':
 			readonly = 1;
 			break;
@@ -1582,7 +1708,7 @@ init_check_command(
 static void usage(const char *name)
 {
 	printf(
-"Usage: %s [-h] [-V] [-rsnm] [-c cmd] ... [file]\n"
+"Usage: %s [-h] [-V] [-rsnmC] [-c cmd] ... [file]\n"
 "QEMU Disk exerciser\n"
 "\n"
 "  -c, --cmd            command to execute\n"
@@ -1592,6 +1718,7 @@ static void usage(const char *name)
 "  -g, --growable       allow file to grow (only applies to protocols)\n"
 "  -m, --misalign       misalign allocations for O_DIRECT\n"
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
+"  -C, --copy-on-read   copy data read from the backing file into the image\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n",
@@ -1603,7 +1730,7 @@ int main(int argc, char **argv)
 {
 	int readonly = 0;
 	int growable = 0;
-	const char *sopt = "hVc:rsnmgk";
+	const char *sopt = "hVc:rsnmgkC";
         const struct option lopt[] = {
 		{ "help", 0, NULL, 'h' },
 		{ "version", 0, NULL, 'V' },
@@ -1615,6 +1742,7 @@ int main(int argc, char **argv)
 		{ "misalign", 0, NULL, 'm' },
 		{ "growable", 0, NULL, 'g' },
 		{ "native-aio", 0, NULL, 'k' },
+		{ "copy-on-read", 0, NULL, 'C' },
 		{ NULL, 0, NULL, 0 }
 	};
 	int c;
@@ -1646,6 +1774,9 @@ int main(int argc, char **argv)
 		case 'k':
 			flags |= BDRV_O_NATIVE_AIO;
 			break;
+		case 'C':
+			flags |= BDRV_O_COPY_ON_READ;
+			break;
 		case 'V':
 			printf("%s version %s\n", progname, VERSION);
 			exit(0);
@@ -1680,6 +1811,7 @@ int main(int argc, char **argv)
 	add_command(&aio_flush_cmd);
 	add_command(&flush_cmd);
 	add_command(&truncate_cmd);
+	add_command(&discard_cmd);
 	add_command(&length_cmd);
 	add_command(&info_cmd);
 	add_command(&alloc_cmd);
@@ -75,6 +75,110 @@ STEXI
 Commit changes to the disk images (if -snapshot is used) or backing files.
 ETEXI
 
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:f?",
+        .params     = "device [speed]",
+        .help       = "copy the backing files of a block device into its image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy all data that the image of @var{device} reads from its backing files
+into the image, at most @var{speed} bytes per second if given.  The guest
+keeps running; reads of backing file data are written to the image while
+the stream is active.  When the image holds all data, the backing file is
+closed and removed from the image header.  The stream only makes progress
+while the VM is running.  Only qcow2 images support streaming.
+ETEXI
+SQMP
+block_stream
+------------
+
+Copy the backing file data of a block device into its image.
+
+Arguments:
+
+- "device": the device's ID (json-string)
+- "speed": maximum speed, in bytes per second; no limit if omitted or 0
+           (json-number, optional)
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "ide0-hd0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream_set_speed",
+        .args_type  = "device:B,value:f",
+        .params     = "device value",
+        .help       = "set maximum speed (in bytes) for block streaming",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream_set_speed,
+    },
+
+STEXI
+@item block_stream_set_speed @var{device} @var{value}
+@findex block_stream_set_speed
+Set maximum speed to @var{value} (in bytes) for streaming into @var{device};
+0 removes the limit.
+ETEXI
+SQMP
+block_stream_set_speed
+----------------------
+
+Set maximum speed for block streaming.
+
+Arguments:
+
+- "device": the device's ID (json-string)
+- "value": maximum speed, in bytes per second (json-number)
+
+Example:
+
+-> { "execute": "block_stream_set_speed",
+     "arguments": { "device": "ide0-hd0", "value": 1048576 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop streaming into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream_cancel,
+    },
+
+STEXI
+@item block_stream_cancel @var{device}
+@findex block_stream_cancel
+Stop streaming into @var{device}.  The data copied so far stays in the image
+and the backing file is kept.
+ETEXI
+SQMP
+block_stream_cancel
+-------------------
+
+Stop streaming into a block device.
+
+Arguments:
+
+- "device": the device's ID (json-string)
+
+Example:
+
+-> { "execute": "block_stream_cancel", "arguments": { "device": "ide0-hd0" } }
+<- { "return": {} }
+
+EQMP
+
     {
         .name       = "q|quit",
         .args_type  = "",
@@ -275,19 +379,27 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save RAM while the VM runs",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, RAM is saved while the virtual machine keeps running,
+and the pages it dirties meanwhile are saved again, as in a live
+migration.  The virtual machine is only stopped for the last pages, the
+device state and the disk snapshots, which are all taken at that point;
+@code{migrate_set_downtime} bounds that pause.  The monitor waits until
+the snapshot is complete.
 ETEXI
 
     {
@@ -1099,6 +1211,161 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "enable or disable a migration capability",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable or disable migration capability @var{capability}, which must be
+enabled on both the source and the destination.  The capabilities are:
+
+@table @code
+@item xbzrle
+Re-dirtied pages are sent as deltas against a cache of the pages sent
+before.
+@item postcopy
+The guest moves to the destination after one pass over its RAM; the pages
+dirtied since are sent while it runs there, and those it touches first are
+fetched on demand.  This needs the I/O thread, TCG and a @code{tcp:} or
+@code{unix:} migration.  If either side fails after the switch, the guest
+is lost.
+@item auto-converge
+When the guest dirties memory faster than it can be sent, its vCPUs are
+slowed down in steps until the migration converges.  This only needs to
+be enabled on the source, and needs the I/O thread.
+@item multifd
+Guest pages are spread over several extra connections, set with
+@code{migrate_set_channels}, each sent and received by its own thread.
+This needs the I/O thread and a @code{tcp:} or @code{unix:} migration,
+and cannot be combined with @code{xbzrle} or @code{postcopy}.
+@end table
+ETEXI
+SQMP
+migrate_set_capability
+----------------------
+
+Enable or disable a migration capability.  This is not allowed while a
+migration is in progress.
+
+Arguments:
+
+- "capability": capability name (json-string)
+- "state": new state of the capability (json-bool)
+
+Example:
+
+-> { "execute": "migrate_set_capability",
+     "arguments": { "capability": "xbzrle", "state": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:f",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set the XBZRLE page cache size to @var{value} (in bytes), rounded down to
+a power of two pages.  It cannot be larger than the guest RAM.  The new
+size applies from the next iteration of a running migration.
+ETEXI
+SQMP
+migrate_set_cache_size
+----------------------
+
+Set the XBZRLE page cache size.
+
+Arguments:
+
+- "value": cache size, in bytes, at most the guest RAM size (json-number)
+
+Example:
+
+-> { "execute": "migrate_set_cache_size", "arguments": { "value": 67108864 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of channels for multifd migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{value}
+@findex migrate_set_channels
+Set the number of extra connections of a @code{multifd} migration, from 1
+to 16.  The destination uses as many as the source asks for.
+ETEXI
+SQMP
+migrate_set_channels
+--------------------
+
+Set the number of channels of multifd migrations.  This is not allowed
+while a migration is in progress.
+
+Arguments:
+
+- "value": number of channels (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_block_inflight",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of disk reads in flight during block migration",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_block_inflight,
+    },
+
+STEXI
+@item migrate_set_block_inflight @var{value}
+@findex migrate_set_block_inflight
+Set the number of 1 MB disk reads that a block migration (@code{migrate -b}
+or @code{-i}) keeps in flight, from 1 to 1024.  The default is 16.  The
+new value applies to the next migration.
+ETEXI
+SQMP
+migrate_set_block_inflight
+--------------------------
+
+Set the number of disk reads in flight during block migration.
+
+Arguments:
+
+- "value": number of reads (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_block_inflight", "arguments": { "value": 32 } }
+<- { "return": {} }
+
 EQMP
 
 #if defined(TARGET_I386)
@@ -1867,6 +2134,39 @@ Example:
 
 EQMP
 
+STEXI
+@item info blockstream
+show the active block streams
+ETEXI
+SQMP
+query-blockstream
+-----------------
+
+Show the active block streams.
+
+Returns a json-array of json-objects, one for each stream, containing:
+
+- "device": device name (json-string)
+- "offset": bytes of the image that have been streamed (json-int)
+- "len": size of the image in bytes (json-int)
+- "speed": maximum speed in bytes per second, 0 for no limit (json-int)
+
+Example:
+
+-> { "execute": "query-blockstream" }
+<- {
+      "return":[
+         {
+            "device":"ide0-hd0",
+            "offset":1048576,
+            "len":10737418240,
+            "speed":0
+         }
+      ]
+   }
+
+EQMP
+
 STEXI
 @item info registers
 show the cpu registers
@@ -2409,11 +2709,28 @@ The main json-object contains the following:
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "expected-downtime": only present if "status" is "active", the time in
+  milliseconds that stopping the guest to send the rest of its RAM would
+  take at the measured bandwidth (json-int)
+- "dirty-pages-rate": only present if "status" is "active", the rate in
+  pages per second at which the guest dirtied RAM during the last pass
+  (json-int)
+- "cpu-throttle-percentage": only present if "status" is "active" and the
+  auto-converge capability is enabled, the share of the time that the
+  guest's vCPUs are kept from running (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "xbzrle-cache": only present if "status" is "active" and the xbzrle
+  capability is enabled, it is a json-object with the following information:
+         - "cache-size": XBZRLE cache size, in bytes (json-int)
+         - "bytes": amount of XBZRLE encoded data transferred (json-int)
+         - "pages": number of pages sent XBZRLE encoded (json-int)
+         - "cache-miss": number of pages that were not cached (json-int)
+         - "overflow": number of pages whose encoding was larger than the
+           page (json-int)
 
 Examples:
 
@@ -2442,7 +2759,9 @@ Examples:
             "transferred":123,
             "remaining":123,
             "total":246
-         }
+         },
+         "expected-downtime":12,
+         "dirty-pages-rate":1024
       }
    }
 
@@ -2467,6 +2786,11 @@ Examples:
 
 EQMP
 
+STEXI
+@item info migrate_capabilities
+show the state of the migration capabilities
+ETEXI
+
 STEXI
 @item info balloon
 show balloon information
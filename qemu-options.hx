@@ -120,7 +120,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|unsafe|none][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,metadata-cache-size=size]\n"
+    "       [,copy-on-read=on|off]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -152,6 +153,15 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@item metadata-cache-size=@var{size}
+Amount of memory used to cache image format metadata (the L2 and refcount
+tables of qcow2 images).  By default qcow2 caches enough L2 tables to map the
+whole image, up to 32 MB.  Modified tables are written back lazily unless the
+drive uses @option{cache=writethrough}.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off".  When it is on, data that is read from
+the backing file is also written to the image (qcow2 only), so that a slow
+or shared backing file is only read once.  See also @code{block_stream}.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -2125,6 +2135,59 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-trace", HAS_ARG, QEMU_OPTION_tb_trace, \
+    "-tb-trace n     translate hot loops as traces after n executions\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-trace @var{n}
+@findex -tb-trace
+Retranslate the blocks of a loop as a single trace once its first block
+has been executed @var{n} times (at most 65535).  Inside a trace, one guest
+block goes on to the next one without returning to the main loop, and the
+guest registers held in host registers are not reloaded from memory after a
+jump or conditional jump to the next block.  Blocks are
+not chained to each other until they have been executed @var{n} times, so
+that the most frequent path can be found.  The default, 0, disables
+traces.  Traces are not available with @option{-icount}.
+ETEXI
+
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  keep translated code in 'file' and reuse it in later runs\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-cache @var{file}
+@findex -tb-cache
+Save the code produced by the dynamic translator in @var{file}, and reuse
+the translations found there instead of translating the same guest code
+again.  This shortens the boot of short-lived guests that run the same
+image over and over.  Cached blocks are validated against the guest code
+they were translated from; the file is discarded when it was written by a
+different QEMU binary or CPU model.  Several instances can share the file.
+A @var{file} without a directory is kept in the per-user cache directory,
+@file{$XDG_CACHE_HOME/qemu} or @file{~/.cache/qemu}.  The file is created
+readable and writable only by its owner, and is not used if it belongs to
+another user or other users can write to it.
+Only available on x86_64 hosts.
+ETEXI
+
+DEF("tcg-threads", HAS_ARG, QEMU_OPTION_tcg_threads, \
+    "-tcg-threads single|multi\n" \
+    "                run all virtual CPUs in one host thread (default) or\n" \
+    "                give each virtual CPU its own host thread\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcg-threads single|multi
+@findex -tcg-threads
+Select how the dynamic translator maps virtual CPUs to host threads.  With
+@code{single} (the default) all virtual CPUs are executed round-robin by one
+thread.  With @code{multi} each virtual CPU runs translated code in its own
+host thread, so an SMP guest can use several host cores.  Device emulation
+is still serialized.  This mode requires a build with
+@option{--enable-io-thread}, is only available for targets whose atomic
+instructions are emulated with host atomics (currently x86) and cannot be
+combined with @option{-icount}.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -142,6 +142,15 @@ void qemu_thread_create(QemuThread *thread,
         error_exit(err, __func__);
 }
 
+void qemu_thread_join(QemuThread *thread)
+{
+    int err;
+
+    err = pthread_join(thread->thread, NULL);
+    if (err)
+        error_exit(err, __func__);
+}
+
 void qemu_thread_signal(QemuThread *thread, int sig)
 {
     int err;
@@ -167,6 +167,7 @@ struct QEMUFile {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFilePutBufferAsyncFunc *put_buffer_async;
     void *opaque;
     int is_write;
 
@@ -380,29 +381,117 @@ fail:
     return NULL;
 }
 
+/* The VM state area of an image is read and written in VMSTATE_CHUNK
+   pieces rather than in IO_BUF_SIZE ones.  */
+#define VMSTATE_CHUNK (1 << 20)
+
+typedef struct QEMUFileBdrv {
+    BlockDriverState *bs;
+    uint8_t *buf;
+    int64_t buf_pos;            /* offset of buf in the VM state */
+    size_t buf_len;
+    size_t buf_size;
+    /* In live mode the data is only written out by savevm_live_flush: the
+       savevm handlers may run without the iothread lock.  */
+    int live;
+    size_t bytes_xfer;
+    size_t xfer_limit;
+} QEMUFileBdrv;
+
+static int block_flush(QEMUFileBdrv *s)
+{
+    int ret = 0;
+
+    if (s->buf_len) {
+        ret = bdrv_save_vmstate(s->bs, s->buf, s->buf_pos, s->buf_len);
+        s->buf_pos += s->buf_len;
+        s->buf_len = 0;
+    }
+    return ret < 0 ? ret : 0;
+}
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
+    QEMUFileBdrv *s = opaque;
+    int ret;
+
+    if (!s->live && s->buf_len + size > VMSTATE_CHUNK) {
+        ret = block_flush(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (s->buf_len + size > s->buf_size) {
+        s->buf_size = MAX(s->buf_size * 2, s->buf_len + size);
+        s->buf = qemu_realloc(s->buf, s->buf_size);
+    }
+    if (!s->buf_len) {
+        s->buf_pos = pos;
+    }
+    memcpy(s->buf + s->buf_len, buf, size);
+    s->buf_len += size;
+    s->bytes_xfer += size;
     return size;
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
-    return bdrv_load_vmstate(opaque, buf, pos, size);
+    QEMUFileBdrv *s = opaque;
+    int ret;
+
+    if (pos < s->buf_pos || pos >= s->buf_pos + s->buf_len) {
+        ret = bdrv_load_vmstate(s->bs, s->buf, pos, VMSTATE_CHUNK);
+        if (ret <= 0) {
+            s->buf_len = 0;
+            return ret;
+        }
+        s->buf_pos = pos;
+        s->buf_len = ret;
+    }
+    size = MIN(size, s->buf_pos + s->buf_len - pos);
+    memcpy(buf, s->buf + (pos - s->buf_pos), size);
+    return size;
+}
+
+static int block_rate_limit(void *opaque)
+{
+    QEMUFileBdrv *s = opaque;
+
+    return s->live && s->bytes_xfer > s->xfer_limit;
+}
+
+static size_t block_get_rate_limit(void *opaque)
+{
+    QEMUFileBdrv *s = opaque;
+
+    return s->live ? s->xfer_limit : 0;
 }
 
 static int bdrv_fclose(void *opaque)
 {
-    return 0;
+    QEMUFileBdrv *s = opaque;
+    int ret;
+
+    ret = block_flush(s);
+    qemu_free(s->buf);
+    qemu_free(s);
+    return ret;
 }
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
-    if (is_writable)
-        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
-			      NULL, NULL, NULL);
-    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
+    QEMUFileBdrv *s = qemu_mallocz(sizeof(QEMUFileBdrv));
+
+    s->bs = bs;
+    if (is_writable) {
+        return qemu_fopen_ops(s, block_put_buffer, NULL, bdrv_fclose,
+                              block_rate_limit, NULL, block_get_rate_limit);
+    }
+    s->buf_size = VMSTATE_CHUNK;
+    s->buf = qemu_malloc(s->buf_size);
+    return qemu_fopen_ops(s, NULL, block_get_buffer, bdrv_fclose, NULL, NULL,
+                          NULL);
 }
 
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
@@ -428,6 +517,12 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     return f;
 }
 
+void qemu_file_set_put_buffer_async(QEMUFile *f,
+                                    QEMUFilePutBufferAsyncFunc *put_async)
+{
+    f->put_buffer_async = put_async;
+}
+
 int qemu_file_has_error(QEMUFile *f)
 {
     return f->has_error;
@@ -513,6 +608,33 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/* Like qemu_put_buffer, but the data is not copied if the file supports
+   it, so buf must stay valid until the file is closed.  */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->put_buffer_async) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    f->is_write = 1;
+    qemu_fflush(f);
+    if (f->has_error) {
+        return;
+    }
+    if (f->put_buffer_async(f->opaque, buf, f->buf_offset, size) == size) {
+        f->buf_offset += size;
+    } else {
+        f->has_error = 1;
+    }
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
@@ -1659,21 +1781,232 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+static void savevm_set_date(QEMUSnapshotInfo *sn)
 {
-    DriveInfo *dinfo;
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint32_t vm_state_size;
 #ifdef _WIN32
     struct _timeb tb;
+
+    _ftime(&tb);
+    sn->date_sec = tb.time;
+    sn->date_nsec = tb.millitm * 1000000;
 #else
     struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
 #endif
+    sn->vm_clock_nsec = qemu_get_clock(vm_clock);
+}
+
+/* Pick the name and id of the new snapshot and delete the old snapshots
+   that it replaces.  */
+static int savevm_prepare(Monitor *mon, BlockDriverState *bs,
+                          QEMUSnapshotInfo *sn, const char *name)
+{
+    QEMUSnapshotInfo old_sn;
+
+    memset(sn, 0, sizeof(*sn));
+    if (name) {
+        if (bdrv_snapshot_find(bs, &old_sn, name) >= 0) {
+            pstrcpy(sn->name, sizeof(sn->name), old_sn.name);
+            pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn.id_str);
+        } else {
+            pstrcpy(sn->name, sizeof(sn->name), name);
+        }
+    }
+
+    /* Delete old snapshots of the same name */
+    if (name && del_existing_snapshots(mon, name) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void savevm_create_snapshots(Monitor *mon, BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint32_t vm_state_size)
+{
+    DriveInfo *dinfo;
+    BlockDriverState *bs1;
+    int ret;
+
+    QTAILQ_FOREACH(dinfo, &drives, next) {
+        bs1 = dinfo->bdrv;
+        if (bdrv_has_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+/* A live snapshot writes RAM out from a timer while the guest runs, one
+   SAVEVM_LIVE_STEP at a time, until the RAM handler reports that the
+   rest can be saved within the maximum downtime or the live phase has
+   written SAVEVM_LIVE_PASSES times the size of RAM.  Only then is the
+   guest stopped for the final dirty pages, the device state and the
+   disk snapshots.  */
+#define SAVEVM_LIVE_STEP    (8 << 20)
+#define SAVEVM_LIVE_PASSES  4
+
+static struct {
+    Monitor *mon;
+    QEMUFile *file;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    QEMUTimer *timer;
+} savevm_live;
+
+int savevm_live_active(void)
+{
+    return savevm_live.file != NULL;
+}
+
+/* Write out what the savevm handlers have produced.  Called with the
+   iothread lock held.  */
+static int savevm_live_flush(QEMUFile *f)
+{
+    QEMUFileBdrv *s = f->opaque;
+
+    qemu_fflush(f);
+    if (block_flush(s) < 0) {
+        qemu_file_set_error(f);
+    }
+    s->bytes_xfer = 0;
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
+static void savevm_live_end(int ret)
+{
+    Monitor *mon = savevm_live.mon;
+
+    if (qemu_fclose(savevm_live.file) != 0 && ret == 0) {
+        ret = -EIO;
+    }
+    savevm_live.file = NULL;
+    qemu_free_timer(savevm_live.timer);
+    savevm_live.timer = NULL;
+
+    if (ret < 0) {
+        monitor_printf(mon, "Error %d while writing VM\n", ret);
+    }
+    if (mon) {
+        monitor_resume(mon);
+    }
+}
+
+static void savevm_live_complete(void)
+{
+    QEMUFile *f = savevm_live.file;
+    QEMUFileBdrv *s = f->opaque;
+    int saved_vm_running = vm_running;
+    uint32_t vm_state_size;
+    int ret;
+
+    vm_stop(0);
+    qemu_aio_flush();
+    bdrv_flush_all();
+
+    /* With the guest stopped the final stage may write directly, in
+       VMSTATE_CHUNK pieces, instead of collecting the remaining dirty
+       memory and the device state in one buffer.  */
+    s->live = 0;
+    s->xfer_limit = 0;
+
+    savevm_set_date(&savevm_live.sn);
+    ret = qemu_savevm_state_complete(savevm_live.mon, f);
+    if (ret == 0) {
+        ret = savevm_live_flush(f);
+    }
+    vm_state_size = qemu_ftell(f);
+    if (ret == 0) {
+        savevm_create_snapshots(savevm_live.mon, savevm_live.bs,
+                                &savevm_live.sn, vm_state_size);
+    } else {
+        qemu_savevm_state_cancel(savevm_live.mon, f);
+    }
+    savevm_live_end(ret);
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+static void savevm_live_step(void *opaque)
+{
+    QEMUFile *f = savevm_live.file;
+    int ret;
+
+    ret = qemu_savevm_state_iterate(savevm_live.mon, f);
+    if (ret >= 0 && savevm_live_flush(f) < 0) {
+        qemu_savevm_state_cancel(savevm_live.mon, f);
+        ret = -EIO;
+    }
+    if (ret < 0) {
+        savevm_live_end(ret);
+    } else if (ret == 0 &&
+               qemu_ftell(f) < SAVEVM_LIVE_PASSES * ram_bytes_total()) {
+        qemu_mod_timer(savevm_live.timer, qemu_get_clock(rt_clock));
+    } else {
+        savevm_live_complete();
+    }
+}
+
+static void do_savevm_live(Monitor *mon, BlockDriverState *bs,
+                           const char *name)
+{
+    QEMUFileBdrv *s;
+    QEMUFile *f;
+
+    if (savevm_prepare(mon, bs, &savevm_live.sn, name) < 0) {
+        return;
+    }
+
+    f = qemu_fopen_bdrv(bs, 1);
+    s = f->opaque;
+    s->live = 1;
+    s->xfer_limit = SAVEVM_LIVE_STEP;
+
+    if (qemu_savevm_state_begin(mon, f, 0, 0) < 0 ||
+        savevm_live_flush(f) < 0) {
+        monitor_printf(mon, "Error while writing VM\n");
+        qemu_fclose(f);
+        return;
+    }
+
+    savevm_live.bs = bs;
+    savevm_live.file = f;
+    savevm_live.timer = qemu_new_timer(rt_clock, savevm_live_step, NULL);
+    savevm_live.mon = NULL;
+    if (monitor_suspend(mon) == 0) {
+        savevm_live.mon = mon;
+    } else {
+        monitor_printf(mon, "terminal does not allow synchronous "
+                       "savevm, continuing in the background\n");
+    }
+    qemu_mod_timer(savevm_live.timer, qemu_get_clock(rt_clock));
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint32_t vm_state_size;
     const char *name = qdict_get_try_str(qdict, "name");
+    int live = qdict_get_int(qdict, "live");
+
+    if (savevm_live_active() || migrate_is_active()) {
+        monitor_printf(mon, "A snapshot or a migration is in progress\n");
+        return;
+    }
 
     bs = get_bs_snapshots();
     if (!bs) {
@@ -1684,36 +2017,18 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     /* ??? Should this occur after vm_stop?  */
     qemu_aio_flush();
 
-    saved_vm_running = vm_running;
-    vm_stop(0);
-
-    memset(sn, 0, sizeof(*sn));
-    if (name) {
-        ret = bdrv_snapshot_find(bs, old_sn, name);
-        if (ret >= 0) {
-            pstrcpy(sn->name, sizeof(sn->name), old_sn->name);
-            pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn->id_str);
-        } else {
-            pstrcpy(sn->name, sizeof(sn->name), name);
-        }
+    if (live) {
+        do_savevm_live(mon, bs, name);
+        return;
     }
 
-    /* fill auxiliary fields */
-#ifdef _WIN32
-    _ftime(&tb);
-    sn->date_sec = tb.time;
-    sn->date_nsec = tb.millitm * 1000000;
-#else
-    gettimeofday(&tv, NULL);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-#endif
-    sn->vm_clock_nsec = qemu_get_clock(vm_clock);
+    saved_vm_running = vm_running;
+    vm_stop(0);
 
-    /* Delete old snapshots of the same name */
-    if (name && del_existing_snapshots(mon, name) < 0) {
+    if (savevm_prepare(mon, bs, sn, name) < 0) {
         goto the_end;
     }
+    savevm_set_date(sn);
 
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
@@ -1723,26 +2038,16 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
     ret = qemu_savevm_state(mon, f);
     vm_state_size = qemu_ftell(f);
-    qemu_fclose(f);
+    if (qemu_fclose(f) != 0 && ret == 0) {
+        ret = -EIO;
+    }
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
     }
 
     /* create the snapshots */
-
-    QTAILQ_FOREACH(dinfo, &drives, next) {
-        bs1 = dinfo->bdrv;
-        if (bdrv_has_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -1757,6 +2062,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live_active()) {
+        error_report("A snapshot is in progress");
+        return -EBUSY;
+    }
+
     bs = get_bs_snapshots();
     if (!bs) {
         error_report("No block device supports snapshots");
@@ -1822,6 +2132,11 @@ void do_delvm(Monitor *mon, const QDict *qdict)
     int ret;
     const char *name = qdict_get_str(qdict, "name");
 
+    if (savevm_live_active()) {
+        monitor_printf(mon, "A snapshot is in progress\n");
+        return;
+    }
+
     bs = get_bs_snapshots();
     if (!bs) {
         monitor_printf(mon, "No block device supports snapshots\n");
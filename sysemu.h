@@ -33,10 +33,20 @@ void qemu_del_vm_change_state_handler(VMChangeStateEntry *e);
 
 void vm_start(void);
 void vm_stop(int reason);
+void cpu_throttle_set(int pct);
+int cpu_throttle_get(void);
 
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_dirty_pages_rate(void);
+uint64_t ram_expected_downtime(void);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+int ram_postcopy_active(void);
+int ram_postcopy_send(QEMUFile *f, int fd);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
@@ -52,6 +62,7 @@ extern qemu_irq qemu_system_powerdown;
 void qemu_system_reset(void);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
+int savevm_live_active(void);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
@@ -35,6 +35,13 @@
 
 #define TARGET_HAS_ICE 1
 
+/* locked instructions can be emulated with host atomics, so each vCPU
+   may run in its own thread (-tcg-threads multi).  This relies on the
+   host having the same byte order and tolerating unaligned atomics.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define TARGET_HAS_TCG_THREADS
+#endif
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -381,6 +388,12 @@
 #define CPUID_EXT_OSXSAVE  (1 << 27)
 #define CPUID_EXT_HYPERVISOR  (1 << 31)
 
+/* With -tcg-threads multi, cmpxchg16b needs a 16 byte compare-and-swap
+   on the host; without one CX16 is not offered to the guest.  */
+#if defined(__x86_64__) || defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define HOST_HAS_ATOMIC_CAS16
+#endif
+
 #define CPUID_EXT2_SYSCALL (1 << 11)
 #define CPUID_EXT2_MP      (1 << 19)
 #define CPUID_EXT2_NX      (1 << 20)
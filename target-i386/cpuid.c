@@ -823,6 +823,11 @@ int cpu_x86_register (CPUX86State *env, const char *cpu_model)
 #endif
             );
         env->cpuid_ext3_features &= TCG_EXT3_FEATURES;
+#ifndef HOST_HAS_ATOMIC_CAS16
+        if (tcg_multithread) {
+            env->cpuid_ext_features &= ~CPUID_EXT_CX16;
+        }
+#endif
     }
     {
         const char *model_id = def->model_id;
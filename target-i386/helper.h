@@ -61,8 +61,10 @@ DEF_HELPER_1(sysret, void, int)
 DEF_HELPER_1(hlt, void, int)
 DEF_HELPER_1(monitor, void, tl)
 DEF_HELPER_1(mwait, void, int)
+DEF_HELPER_0(pause, void)
 DEF_HELPER_0(debug, void)
 DEF_HELPER_0(reset_rf, void)
+DEF_HELPER_0(lookup_tb_ptr, ptr)
 DEF_HELPER_2(raise_interrupt, void, int, int)
 DEF_HELPER_1(raise_exception, void, int)
 DEF_HELPER_0(cli, void)
@@ -77,6 +79,8 @@ DEF_HELPER_1(cmpxchg8b, void, tl)
 #ifdef TARGET_X86_64
 DEF_HELPER_1(cmpxchg16b, void, tl)
 #endif
+DEF_HELPER_4(atomic_stcond, void, tl, tl, tl, i32)
+DEF_HELPER_4(atomic_cmpxchg, tl, tl, tl, tl, i32)
 DEF_HELPER_0(single_step, void)
 DEF_HELPER_0(cpuid, void)
 DEF_HELPER_0(rdtsc, void)
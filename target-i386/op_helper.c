@@ -21,6 +21,9 @@
 #include "exec-all.h"
 #include "host-utils.h"
 #include "ioport.h"
+#ifndef _WIN32
+#include <sched.h>
+#endif
 
 //#define DEBUG_PCALL
 
@@ -1387,7 +1390,9 @@ void do_smm_enter(void)
     log_cpu_state_mask(CPU_LOG_INT, env, X86_DUMP_CCOP);
 
     env->hflags |= HF_SMM_MASK;
+    cpu_io_lock();
     cpu_smm_update(env);
+    cpu_io_unlock();
 
     sm_state = env->smbase + 0x8000;
 
@@ -1622,7 +1627,9 @@ void helper_rsm(void)
 #endif
     CC_OP = CC_OP_EFLAGS;
     env->hflags &= ~HF_SMM_MASK;
+    cpu_io_lock();
     cpu_smm_update(env);
+    cpu_io_unlock();
 
     qemu_log_mask(CPU_LOG_INT, "SMM: after RSM\n");
     log_cpu_state_mask(CPU_LOG_INT, env, X86_DUMP_CCOP);
@@ -1876,12 +1883,34 @@ void helper_into(int next_eip_addend)
     }
 }
 
+static uint64_t atomic_cas(target_ulong addr, uint64_t cmpv, uint64_t newv,
+                           int idx, void *retaddr);
+#ifdef TARGET_X86_64
+static int atomic_cas16(target_ulong addr, uint64_t *lo, uint64_t *hi,
+                        uint64_t newlo, uint64_t newhi, int mmu_idx,
+                        void *retaddr);
+#endif
+
 void helper_cmpxchg8b(target_ulong a0)
 {
-    uint64_t d;
+    uint64_t d, cmpv;
     int eflags;
 
     eflags = helper_cc_compute_all(CC_OP);
+    if (tcg_multithread) {
+        cmpv = ((uint64_t)EDX << 32) | (uint32_t)EAX;
+        d = atomic_cas(a0, cmpv, ((uint64_t)ECX << 32) | (uint32_t)EBX,
+                       3 + (cpu_mmu_index(env) + 1) * 4, GETPC());
+        if (d == cmpv) {
+            eflags |= CC_Z;
+        } else {
+            EDX = (uint32_t)(d >> 32);
+            EAX = (uint32_t)d;
+            eflags &= ~CC_Z;
+        }
+        CC_SRC = eflags;
+        return;
+    }
     d = ldq(a0);
     if (d == (((uint64_t)EDX << 32) | (uint32_t)EAX)) {
         stq(a0, ((uint64_t)ECX << 32) | (uint32_t)EBX);
@@ -1905,6 +1934,20 @@ void helper_cmpxchg16b(target_ulong a0)
     if ((a0 & 0xf) != 0)
         raise_exception(EXCP0D_GPF);
     eflags = helper_cc_compute_all(CC_OP);
+    if (tcg_multithread) {
+        d0 = EAX;
+        d1 = EDX;
+        if (atomic_cas16(a0, &d0, &d1, EBX, ECX, cpu_mmu_index(env),
+                         GETPC())) {
+            eflags |= CC_Z;
+        } else {
+            EDX = d1;
+            EAX = d0;
+            eflags &= ~CC_Z;
+        }
+        CC_SRC = eflags;
+        return;
+    }
     d0 = ldq(a0);
     d1 = ldq(a0 + 8);
     if (d0 == EAX && d1 == EDX) {
@@ -2888,7 +2931,9 @@ target_ulong helper_read_crN(int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            cpu_io_lock();
             val = cpu_get_apic_tpr(env);
+            cpu_io_unlock();
         } else {
             val = env->v_tpr;
         }
@@ -2912,7 +2957,9 @@ void helper_write_crN(int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            cpu_io_lock();
             cpu_set_apic_tpr(env, t0);
+            cpu_io_unlock();
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -3020,7 +3067,9 @@ void helper_wrmsr(void)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
+        cpu_io_lock();
         cpu_set_apic_base(env, val);
+        cpu_io_unlock();
         break;
     case MSR_EFER:
         {
@@ -3153,7 +3202,9 @@ void helper_rdmsr(void)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
+        cpu_io_lock();
         val = cpu_get_apic_base(env);
+        cpu_io_unlock();
         break;
     case MSR_EFER:
         val = env->efer;
@@ -4701,6 +4752,15 @@ void helper_mwait(int next_eip_addend)
     }
 }
 
+void helper_pause(void)
+{
+    /* With -tcg-threads multi a spinning vCPU may be waiting for a lock
+       held by a vCPU whose host thread is not running; let it run.  */
+#ifndef _WIN32
+    sched_yield();
+#endif
+}
+
 void helper_debug(void)
 {
     env->exception_index = EXCP_DEBUG;
@@ -4712,6 +4772,29 @@ void helper_reset_rf(void)
     env->eflags &= ~RF_MASK;
 }
 
+/* Find the TB for the current CPU state so that an indirect jump can
+   continue in generated code.  Return NULL if we must go back to
+   cpu_exec(), either because the TB is not in the jump cache or
+   because an interrupt or an exit request is pending.  */
+void *helper_lookup_tb_ptr(void)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || tb->invalid ||
+                 env->interrupt_request || env->exit_request)) {
+        env->tb_lookup_misses++;
+        return NULL;
+    }
+    env->tb_lookup_hits++;
+    env->current_tb = tb;
+    return tb->tc_ptr;
+}
+
 void helper_raise_interrupt(int intno, int next_eip_addend)
 {
     raise_interrupt(intno, 1, 0, next_eip_addend);
@@ -4842,6 +4925,237 @@ void tlb_fill(target_ulong addr, int is_write, int mmu_idx, void *retaddr)
 }
 #endif
 
+/* Atomic memory operations for -tcg-threads multi.  IDX encodes the
+   operand size and MMU index the same way as the translator's memory
+   accesses.  */
+
+#if !defined(CONFIG_USER_ONLY)
+/* Compare-and-swap on guest memory, returns the previous value.  */
+static uint64_t atomic_cas(target_ulong addr, uint64_t cmpv, uint64_t newv,
+                           int idx, void *retaddr)
+{
+    int size = 1 << (idx & 3);
+    int mmu_idx = (idx >> 2) - 1;
+    int index;
+    target_ulong tlb_addr;
+    ram_addr_t ram_addr = 0;
+    uint64_t old;
+    void *host;
+
+    if ((addr & TARGET_PAGE_MASK) != ((addr + size - 1) & TARGET_PAGE_MASK))
+        goto slow_path;
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+ redo:
+    tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    if ((addr & TARGET_PAGE_MASK) !=
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!tlb_victim_lookup(env, addr, 1, mmu_idx, index)) {
+            tlb_fill(addr, 1, mmu_idx, retaddr);
+        }
+        goto redo;
+    }
+    if (tlb_addr & TLB_MMIO)
+        goto slow_path;
+
+    host = (void *)(unsigned long)(addr +
+                                   env->tlb_table[mmu_idx][index].addend);
+    if (tlb_addr & TLB_NOTDIRTY) {
+        /* the page may contain translated code */
+        ram_addr = qemu_ram_addr_from_host(host);
+        env->mem_io_pc = (unsigned long)retaddr;
+        env->mem_io_vaddr = addr;
+        cpu_notdirty_store_begin(ram_addr, size);
+    }
+    switch (size) {
+    case 1:
+        old = __sync_val_compare_and_swap((uint8_t *)host,
+                                          (uint8_t)cmpv, (uint8_t)newv);
+        break;
+    case 2:
+        old = __sync_val_compare_and_swap((uint16_t *)host,
+                                          (uint16_t)cmpv, (uint16_t)newv);
+        break;
+    case 4:
+        old = __sync_val_compare_and_swap((uint32_t *)host,
+                                          (uint32_t)cmpv, (uint32_t)newv);
+        break;
+    default:
+        old = __sync_val_compare_and_swap((uint64_t *)host, cmpv, newv);
+        break;
+    }
+    if (tlb_addr & TLB_NOTDIRTY)
+        cpu_notdirty_store_end(env, ram_addr, addr);
+    return old;
+
+ slow_path:
+    /* I/O, watchpoints and accesses crossing a page: raise any fault
+       now, then do the operation under the global mutex */
+    tlb_fill(addr, 1, mmu_idx, retaddr);
+    tlb_fill(addr + size - 1, 1, mmu_idx, retaddr);
+    cpu_io_lock();
+    switch (size) {
+    case 1:
+        old = __ldb_mmu(addr, mmu_idx);
+        if (old == (uint8_t)cmpv)
+            __stb_mmu(addr, newv, mmu_idx);
+        break;
+    case 2:
+        old = __ldw_mmu(addr, mmu_idx);
+        if (old == (uint16_t)cmpv)
+            __stw_mmu(addr, newv, mmu_idx);
+        break;
+    case 4:
+        old = __ldl_mmu(addr, mmu_idx);
+        if (old == (uint32_t)cmpv)
+            __stl_mmu(addr, newv, mmu_idx);
+        break;
+    default:
+        old = __ldq_mmu(addr, mmu_idx);
+        if (old == cmpv)
+            __stq_mmu(addr, newv, mmu_idx);
+        break;
+    }
+    cpu_io_unlock();
+    return old;
+}
+
+#if defined(TARGET_X86_64) && defined(HOST_HAS_ATOMIC_CAS16)
+/* 16 byte compare-and-swap on host memory.  On failure, *LO and *HI
+   are set to the current value.  */
+static inline int host_cas16(void *host, uint64_t *lo, uint64_t *hi,
+                             uint64_t newlo, uint64_t newhi)
+{
+#if defined(__x86_64__)
+    uint8_t ok;
+
+    asm volatile("lock; cmpxchg16b %1\n"
+                 "sete %0"
+                 : "=q" (ok), "+m" (*(uint64_t (*)[2])host),
+                   "+a" (*lo), "+d" (*hi)
+                 : "b" (newlo), "c" (newhi)
+                 : "memory", "cc");
+    return ok;
+#else
+    unsigned __int128 cmpv, newv, old;
+
+    cmpv = ((unsigned __int128)*hi << 64) | *lo;
+    newv = ((unsigned __int128)newhi << 64) | newlo;
+    old = __sync_val_compare_and_swap((unsigned __int128 *)host, cmpv, newv);
+    *lo = old;
+    *hi = old >> 64;
+    return old == cmpv;
+#endif
+}
+#endif
+
+#ifdef TARGET_X86_64
+/* cmpxchg16b on guest memory, ADDR is 16 byte aligned.  Returns nonzero
+   if the value was stored, otherwise *LO and *HI hold the memory
+   contents.  */
+static int atomic_cas16(target_ulong addr, uint64_t *lo, uint64_t *hi,
+                        uint64_t newlo, uint64_t newhi, int mmu_idx,
+                        void *retaddr)
+{
+    int index, ok;
+    target_ulong tlb_addr;
+    uint64_t d0, d1;
+#ifdef HOST_HAS_ATOMIC_CAS16
+    ram_addr_t ram_addr = 0;
+    void *host;
+#endif
+
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+ redo:
+    tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    if ((addr & TARGET_PAGE_MASK) !=
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!tlb_victim_lookup(env, addr, 1, mmu_idx, index)) {
+            tlb_fill(addr, 1, mmu_idx, retaddr);
+        }
+        goto redo;
+    }
+#ifdef HOST_HAS_ATOMIC_CAS16
+    if (tlb_addr & TLB_MMIO)
+        goto slow_path;
+
+    host = (void *)(unsigned long)(addr +
+                                   env->tlb_table[mmu_idx][index].addend);
+    if (tlb_addr & TLB_NOTDIRTY) {
+        ram_addr = qemu_ram_addr_from_host(host);
+        env->mem_io_pc = (unsigned long)retaddr;
+        env->mem_io_vaddr = addr;
+        cpu_notdirty_store_begin(ram_addr, 16);
+    }
+    ok = host_cas16(host, lo, hi, newlo, newhi);
+    if (tlb_addr & TLB_NOTDIRTY)
+        cpu_notdirty_store_end(env, ram_addr, addr);
+    return ok;
+
+ slow_path:
+#endif
+    /* I/O and watchpoints (or a host without a 16 byte compare-and-swap,
+       which hides CX16 from the guest): do the operation under the
+       global mutex */
+    cpu_io_lock();
+    d0 = __ldq_mmu(addr, mmu_idx);
+    d1 = __ldq_mmu(addr + 8, mmu_idx);
+    ok = d0 == *lo && d1 == *hi;
+    if (ok) {
+        __stq_mmu(addr, newlo, mmu_idx);
+        __stq_mmu(addr + 8, newhi, mmu_idx);
+    } else {
+        *lo = d0;
+        *hi = d1;
+    }
+    cpu_io_unlock();
+    return ok;
+}
+#endif
+#else
+/* -tcg-threads multi is not available in user mode */
+static uint64_t atomic_cas(target_ulong addr, uint64_t cmpv, uint64_t newv,
+                           int idx, void *retaddr)
+{
+    abort();
+}
+
+#ifdef TARGET_X86_64
+static int atomic_cas16(target_ulong addr, uint64_t *lo, uint64_t *hi,
+                        uint64_t newlo, uint64_t newhi, int mmu_idx,
+                        void *retaddr)
+{
+    abort();
+}
+#endif
+#endif
+
+/* Store NEWV if memory still holds OLDV, the value read by the first half
+   of a locked read-modify-write instruction.  Otherwise another vCPU got
+   in between, so restart the instruction.  */
+void helper_atomic_stcond(target_ulong a0, target_ulong oldv,
+                          target_ulong newv, uint32_t idx)
+{
+    void *retaddr = GETPC();
+    uint64_t mask;
+    TranslationBlock *tb;
+
+    mask = (idx & 3) == 3 ? -1ULL : (1ULL << (8 << (idx & 3))) - 1;
+    if (atomic_cas(a0, oldv, newv, idx, retaddr) != (oldv & mask)) {
+        tb = tb_find_pc((unsigned long)retaddr);
+        if (tb) {
+            cpu_restore_state(tb, env, (unsigned long)retaddr, NULL);
+        }
+        env->exception_index = -1;
+        cpu_loop_exit();
+    }
+}
+
+target_ulong helper_atomic_cmpxchg(target_ulong a0, target_ulong cmpv,
+                                   target_ulong newv, uint32_t idx)
+{
+    return atomic_cas(a0, cmpv, newv, idx, GETPC());
+}
+
 /* Secure Virtual Machine helpers */
 
 #if defined(CONFIG_USER_ONLY)
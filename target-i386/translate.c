@@ -71,6 +71,8 @@ static TCGv_ptr cpu_ptr0, cpu_ptr1;
 static TCGv_i32 cpu_tmp2_i32, cpu_tmp3_i32;
 static TCGv_i64 cpu_tmp1_i64;
 static TCGv cpu_tmp5;
+/* value loaded by a locked read-modify-write (-tcg-threads multi) */
+static TCGv cpu_lock_val;
 
 static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 
@@ -116,6 +118,18 @@ typedef struct DisasContext {
     int cpuid_ext_features;
     int cpuid_ext2_features;
     int cpuid_ext3_features;
+    int atomic; /* emulate the current insn's memory RMW with host atomics */
+    /* trace translation (see tb_gen_trace) */
+    TBTrace *trace;
+    int trace_block; /* index in the trace of the block being translated */
+    int trace_label; /* start of the next block of the trace, or -1 */
+    int trace_nb_br; /* number of jumps to trace_label */
+    int trace_nb_slots; /* direct jump slots of the TB used so far */
+    /* side exits of the conditional jumps inside the trace, generated
+       after its last block */
+    int trace_nb_exits;
+    int trace_exit_label[TB_TRACE_MAX_BLOCKS];
+    target_ulong trace_exit_eip[TB_TRACE_MAX_BLOCKS];
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -603,6 +617,29 @@ static inline void gen_op_st_T1_A0(int idx)
     gen_op_st_v(idx, cpu_T[1], cpu_A0);
 }
 
+/* Load and store of a read-modify-write memory operand.  When the
+   instruction must be atomic with respect to other vCPU threads, the
+   store is a compare-and-swap against the loaded value, and the
+   instruction is restarted if the location changed in between.  */
+static inline void gen_op_ld_rmw(DisasContext *s, int idx, TCGv t0, TCGv a0)
+{
+    gen_op_ld_v(idx, t0, a0);
+    if (s->atomic) {
+        tcg_gen_mov_tl(cpu_lock_val, t0);
+    }
+}
+
+static inline void gen_op_st_rmw(DisasContext *s, int idx, TCGv t0, TCGv a0)
+{
+    if (s->atomic) {
+        TCGv_i32 tmp = tcg_const_i32(idx);
+        gen_helper_atomic_stcond(a0, cpu_lock_val, t0, tmp);
+        tcg_temp_free_i32(tmp);
+    } else {
+        gen_op_st_v(idx, t0, a0);
+    }
+}
+
 static inline void gen_jmp_im(target_ulong pc)
 {
     tcg_gen_movi_tl(cpu_tmp0, pc);
@@ -1310,7 +1347,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
     if (d != OR_TMP0) {
         gen_op_mov_TN_reg(ot, 0, d);
     } else {
-        gen_op_ld_T0_A0(ot + s1->mem_index);
+        gen_op_ld_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
     }
     switch(op) {
     case OP_ADCL:
@@ -1322,7 +1359,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
         tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
         tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cpu_tmp4);
@@ -1339,7 +1376,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
         tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
         tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cpu_tmp4);
@@ -1352,7 +1389,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         gen_op_update2_cc();
         s1->cc_op = CC_OP_ADDB + ot;
         break;
@@ -1361,7 +1398,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         gen_op_update2_cc();
         s1->cc_op = CC_OP_SUBB + ot;
         break;
@@ -1371,7 +1408,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         gen_op_update1_cc();
         s1->cc_op = CC_OP_LOGICB + ot;
         break;
@@ -1380,7 +1417,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         gen_op_update1_cc();
         s1->cc_op = CC_OP_LOGICB + ot;
         break;
@@ -1389,7 +1426,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
         if (d != OR_TMP0)
             gen_op_mov_reg_T0(ot, d);
         else
-            gen_op_st_T0_A0(ot + s1->mem_index);
+            gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
         gen_op_update1_cc();
         s1->cc_op = CC_OP_LOGICB + ot;
         break;
@@ -1406,7 +1443,7 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c)
     if (d != OR_TMP0)
         gen_op_mov_TN_reg(ot, 0, d);
     else
-        gen_op_ld_T0_A0(ot + s1->mem_index);
+        gen_op_ld_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
     if (s1->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s1->cc_op);
     if (c > 0) {
@@ -1419,7 +1456,7 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c)
     if (d != OR_TMP0)
         gen_op_mov_reg_T0(ot, d);
     else
-        gen_op_st_T0_A0(ot + s1->mem_index);
+        gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0], cpu_A0);
     gen_compute_eflags_c(cpu_cc_src);
     tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
 }
@@ -2283,6 +2320,14 @@ static inline int insn_const_size(unsigned int ot)
         return 4;
 }
 
+/* nonzero if the trace being translated goes on with the block at 'eip' */
+static inline int gen_trace_continues(DisasContext *s, target_ulong eip)
+{
+    return s->trace && s->trace_block + 1 < s->trace->nb_blocks &&
+        s->cs_base + eip == s->trace->pc[s->trace_block + 1] &&
+        gen_opc_ptr < gen_opc_buf + OPC_MAX_SIZE / 2;
+}
+
 static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 {
     TranslationBlock *tb;
@@ -2290,10 +2335,32 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
+    if (s->trace) {
+        if (gen_trace_continues(s, eip)) {
+            /* the trace goes on with the block at 'pc' */
+            if (s->trace_label < 0) {
+                s->trace_label = gen_new_label();
+            }
+            tcg_gen_br(s->trace_label);
+            s->trace_nb_br++;
+            return;
+        }
+        /* the two jump slots of the TB are kept for the exits of the
+           last block, which usually loops back to the trace; the side
+           exits of the other blocks return to cpu_exec() */
+        if (s->trace_block + 1 < s->trace->nb_blocks ||
+            s->trace_nb_slots >= 2) {
+            gen_jmp_im(eip);
+            gen_eob(s);
+            return;
+        }
+        tb_num = s->trace_nb_slots;
+    }
     /* NOTE: we handle the case where the TB spans two pages here */
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
         /* jump to same page: we can use a direct jump */
+        s->trace_nb_slots++;
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb((long)tb + tb_num);
@@ -2308,13 +2375,32 @@ static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
     int l1, l2, cc_op;
+    target_ulong eip;
 
     cc_op = s->cc_op;
     if (s->cc_op != CC_OP_DYNAMIC) {
         gen_op_set_cc_op(s->cc_op);
         s->cc_op = CC_OP_DYNAMIC;
     }
-    if (s->jmp_opt) {
+    if (s->jmp_opt &&
+        (gen_trace_continues(s, val) || gen_trace_continues(s, next_eip))) {
+        /* the trace goes on after the jump without a label, so that the
+           globals stay in registers; the other target is reached through
+           a side exit generated after the trace */
+        if (gen_trace_continues(s, val)) {
+            b ^= 1;
+            eip = val;
+            val = next_eip;
+            next_eip = eip;
+        }
+        l1 = gen_new_label();
+        s->trace_exit_label[s->trace_nb_exits] = l1;
+        s->trace_exit_eip[s->trace_nb_exits] = val;
+        s->trace_nb_exits++;
+        gen_jcc1(s, cc_op, b, l1);
+        gen_goto_tb(s, 0, next_eip);
+        s->is_jmp = 3;
+    } else if (s->jmp_opt) {
         l1 = gen_new_label();
         gen_jcc1(s, cc_op, b, l1);
         
@@ -2699,7 +2785,10 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 
 /* generate a generic end of block. Trace exception is also generated
    if needed */
-static void gen_eob(DisasContext *s)
+/* end of block.  If 'jr' is set, eip was computed at run time (ret,
+   indirect call or jmp) and the next TB is looked up without leaving
+   the generated code when possible. */
+static void do_gen_eob(DisasContext *s, int jr)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s->cc_op);
@@ -2713,12 +2802,32 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug();
     } else if (s->tf) {
 	gen_helper_single_step();
+    } else if (jr) {
+        TCGv_ptr ptr = tcg_temp_local_new_ptr();
+        int l1 = gen_new_label();
+
+        gen_helper_lookup_tb_ptr(ptr);
+        tcg_gen_brcondi_ptr(TCG_COND_EQ, ptr, 0, l1);
+        tcg_gen_jmp_ptr(ptr);
+        gen_set_label(l1);
+        tcg_gen_exit_tb(0);
+        tcg_temp_free_ptr(ptr);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = 3;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    do_gen_eob(s, 0);
+}
+
+static void gen_jr(DisasContext *s)
+{
+    do_gen_eob(s, 1);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2939,6 +3048,87 @@ static void *sse_op_table1[256][4] = {
     [0xfe] = MMX_OP2(paddl),
 };
 
+#ifdef TCG_TARGET_HAS_v128
+/* SSE operations of sse_op_table1 that the TCG backend can emit
+   directly on 128-bit registers, as TCGVecOp + 1 (0 means use the
+   helper).  Only the packed XMM forms are listed: MMX and scalar
+   operations always go through the helpers.  */
+#define VOP(x) (TCG_VEC_ ## x + 1)
+#define VOP_PS_PD(x) { VOP(x ## F32), VOP(x ## F64) }
+#define VOP_XMM(x) { 0, VOP(x) }
+
+static const uint8_t sse_vec_op[256][4] = {
+    [0x14] = { VOP(UNPCKL32), VOP(UNPCKL64) }, /* unpcklps, unpcklpd */
+    [0x15] = { VOP(UNPCKH32), VOP(UNPCKH64) }, /* unpckhps, unpckhpd */
+    [0x51] = VOP_PS_PD(SQRT),
+    [0x54] = { VOP(AND), VOP(AND) }, /* andps, andpd */
+    [0x55] = { VOP(ANDN), VOP(ANDN) }, /* andnps, andnpd */
+    [0x56] = { VOP(OR), VOP(OR) }, /* orps, orpd */
+    [0x57] = { VOP(XOR), VOP(XOR) }, /* xorps, xorpd */
+    [0x58] = VOP_PS_PD(ADD),
+    [0x59] = VOP_PS_PD(MUL),
+    [0x5c] = VOP_PS_PD(SUB),
+    [0x5d] = VOP_PS_PD(MIN),
+    [0x5e] = VOP_PS_PD(DIV),
+    [0x5f] = VOP_PS_PD(MAX),
+    [0x60] = VOP_XMM(UNPCKL8),
+    [0x61] = VOP_XMM(UNPCKL16),
+    [0x62] = VOP_XMM(UNPCKL32),
+    [0x63] = VOP_XMM(PACKSS16),
+    [0x64] = VOP_XMM(CMPGT8),
+    [0x65] = VOP_XMM(CMPGT16),
+    [0x66] = VOP_XMM(CMPGT32),
+    [0x67] = VOP_XMM(PACKUS16),
+    [0x68] = VOP_XMM(UNPCKH8),
+    [0x69] = VOP_XMM(UNPCKH16),
+    [0x6a] = VOP_XMM(UNPCKH32),
+    [0x6b] = VOP_XMM(PACKSS32),
+    [0x6c] = VOP_XMM(UNPCKL64),
+    [0x6d] = VOP_XMM(UNPCKH64),
+    [0x70] = { 0, VOP(SHUF32), VOP(SHUFHI16), VOP(SHUFLO16) },
+    [0x74] = VOP_XMM(CMPEQ8),
+    [0x75] = VOP_XMM(CMPEQ16),
+    [0x76] = VOP_XMM(CMPEQ32),
+    [0xc6] = { VOP(SHUFF32), VOP(SHUFF64) }, /* shufps, shufpd */
+    [0xd4] = VOP_XMM(ADD64),
+    [0xd5] = VOP_XMM(MUL16),
+    [0xd8] = VOP_XMM(SUBUS8),
+    [0xd9] = VOP_XMM(SUBUS16),
+    [0xda] = VOP_XMM(MINU8),
+    [0xdb] = VOP_XMM(AND),
+    [0xdc] = VOP_XMM(ADDUS8),
+    [0xdd] = VOP_XMM(ADDUS16),
+    [0xde] = VOP_XMM(MAXU8),
+    [0xdf] = VOP_XMM(ANDN),
+    [0xe0] = VOP_XMM(AVGU8),
+    [0xe3] = VOP_XMM(AVGU16),
+    [0xe4] = VOP_XMM(MULHU16),
+    [0xe5] = VOP_XMM(MULHS16),
+    [0xe8] = VOP_XMM(SUBS8),
+    [0xe9] = VOP_XMM(SUBS16),
+    [0xea] = VOP_XMM(MINS16),
+    [0xeb] = VOP_XMM(OR),
+    [0xec] = VOP_XMM(ADDS8),
+    [0xed] = VOP_XMM(ADDS16),
+    [0xee] = VOP_XMM(MAXS16),
+    [0xef] = VOP_XMM(XOR),
+    [0xf4] = VOP_XMM(MULU32),
+    [0xf5] = VOP_XMM(MADDS16),
+    [0xf6] = VOP_XMM(SADU8),
+    [0xf8] = VOP_XMM(SUB8),
+    [0xf9] = VOP_XMM(SUB16),
+    [0xfa] = VOP_XMM(SUB32),
+    [0xfb] = VOP_XMM(SUB64),
+    [0xfc] = VOP_XMM(ADD8),
+    [0xfd] = VOP_XMM(ADD16),
+    [0xfe] = VOP_XMM(ADD32),
+};
+
+#undef VOP
+#undef VOP_PS_PD
+#undef VOP_XMM
+#endif
+
 static void *sse_op_table2[3 * 8][2] = {
     [0 + 2] = MMX_OP2(psrlw),
     [0 + 4] = MMX_OP2(psraw),
@@ -4031,6 +4221,12 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
         case 0x70: /* pshufx insn */
         case 0xc6: /* pshufx insn */
             val = ldub_code(s->pc++);
+#ifdef TCG_TARGET_HAS_v128
+            if (is_xmm && sse_vec_op[b][b1]) {
+                tcg_gen_v128(sse_vec_op[b][b1] - 1, op1_offset, op2_offset, val);
+                break;
+            }
+#endif
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv_i32))sse_op2)(cpu_ptr0, cpu_ptr1, tcg_const_i32(val));
@@ -4066,6 +4262,12 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv))sse_op2)(cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+#ifdef TCG_TARGET_HAS_v128
+            if (is_xmm && sse_vec_op[b][b1]) {
+                tcg_gen_v128(sse_vec_op[b][b1] - 1, op1_offset, op2_offset, 0);
+                break;
+            }
+#endif
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr))sse_op2)(cpu_ptr0, cpu_ptr1);
@@ -4209,7 +4411,8 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     s->dflag = dflag;
 
     /* lock generation */
-    if (prefixes & PREFIX_LOCK)
+    s->atomic = tcg_multithread && (prefixes & PREFIX_LOCK);
+    if ((prefixes & PREFIX_LOCK) && !tcg_multithread)
         gen_helper_lock();
 
     /* now check op code */
@@ -4359,7 +4562,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (op == 0)
                 s->rip_offset = insn_const_size(ot);
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -4374,7 +4577,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         case 2: /* not */
             tcg_gen_not_tl(cpu_T[0], cpu_T[0]);
             if (mod != 3) {
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
             } else {
                 gen_op_mov_reg_T0(ot, rm);
             }
@@ -4382,7 +4585,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         case 3: /* neg */
             tcg_gen_neg_tl(cpu_T[0], cpu_T[0]);
             if (mod != 3) {
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
             } else {
                 gen_op_mov_reg_T0(ot, rm);
             }
@@ -4632,7 +4835,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4659,7 +4862,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4837,9 +5040,9 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         } else {
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
-            gen_op_ld_T1_A0(ot + s->mem_index);
+            gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[1], cpu_A0);
             gen_op_addl_T0_T1();
-            gen_op_st_T0_A0(ot + s->mem_index);
+            gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
             gen_op_mov_reg_T1(ot, reg);
         }
         gen_op_update2_cc();
@@ -4869,7 +5072,14 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             } else {
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 tcg_gen_mov_tl(a0, cpu_A0);
-                gen_op_ld_v(ot + s->mem_index, t0, a0);
+                if (s->atomic) {
+                    TCGv_i32 tmp = tcg_const_i32(ot + s->mem_index);
+                    gen_helper_atomic_cmpxchg(t0, a0, cpu_regs[R_EAX],
+                                              t1, tmp);
+                    tcg_temp_free_i32(tmp);
+                } else {
+                    gen_op_ld_v(ot + s->mem_index, t0, a0);
+                }
                 rm = 0; /* avoid warning */
             }
             label1 = gen_new_label();
@@ -4883,6 +5093,10 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 gen_set_label(label1);
                 gen_op_mov_reg_v(ot, rm, t1);
                 gen_set_label(label2);
+            } else if (s->atomic) {
+                /* the store has already been done by the helper */
+                gen_op_mov_reg_v(ot, R_EAX, t0);
+                gen_set_label(label1);
             } else {
                 tcg_gen_mov_tl(t1, t0);
                 gen_op_mov_reg_v(ot, R_EAX, t0);
@@ -5317,11 +5531,14 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
             /* for xchg, lock is implicit */
-            if (!(prefixes & PREFIX_LOCK))
+            if (tcg_multithread) {
+                s->atomic = 1;
+            } else if (!(prefixes & PREFIX_LOCK)) {
                 gen_helper_lock();
-            gen_op_ld_T1_A0(ot + s->mem_index);
-            gen_op_st_T0_A0(ot + s->mem_index);
-            if (!(prefixes & PREFIX_LOCK))
+            }
+            gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[1], cpu_A0);
+            gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
+            if (!(prefixes & PREFIX_LOCK) && !tcg_multithread)
                 gen_helper_unlock();
             gen_op_mov_reg_T1(ot, reg);
         }
@@ -6185,7 +6402,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6193,7 +6410,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = ldsw_code(s->pc);
@@ -6488,7 +6705,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (mod != 3) {
             s->rip_offset = 1;
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -6524,7 +6741,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             tcg_gen_sari_tl(cpu_tmp0, cpu_T[1], 3 + ot);
             tcg_gen_shli_tl(cpu_tmp0, cpu_tmp0, ot);
             tcg_gen_add_tl(cpu_A0, cpu_A0, cpu_tmp0);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -6559,7 +6776,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         s->cc_op = CC_OP_SARB + ot;
         if (op != 0) {
             if (mod != 3)
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0], cpu_A0);
             else
                 gen_op_mov_reg_T0(ot, rm);
             tcg_gen_mov_tl(cpu_cc_src, cpu_tmp4);
@@ -6669,6 +6886,8 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             goto illegal_op;
         if (prefixes & PREFIX_REPZ) {
             gen_svm_check_intercept(s, pc_start, SVM_EXIT_PAUSE);
+            if (tcg_multithread)
+                gen_helper_pause();
         }
         break;
     case 0x9b: /* fwait */
@@ -7647,11 +7866,11 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         goto illegal_op;
     }
     /* lock generation */
-    if (s->prefix & PREFIX_LOCK)
+    if ((s->prefix & PREFIX_LOCK) && !tcg_multithread)
         gen_helper_unlock();
     return s->pc;
  illegal_op:
-    if (s->prefix & PREFIX_LOCK)
+    if ((s->prefix & PREFIX_LOCK) && !tcg_multithread)
         gen_helper_unlock();
     /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
@@ -7732,6 +7951,27 @@ void optimize_flags_init(void)
 #include "helper.h"
 }
 
+#ifdef DEBUG_DISAS
+static void log_target_block(DisasContext *dc, target_ulong pc_start,
+                             target_ulong pc_end)
+{
+    if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)) {
+        int disas_flags;
+        qemu_log("----------------\n");
+        qemu_log("IN: %s%s\n", lookup_symbol(pc_start),
+                 dc->trace ? " (trace)" : "");
+#ifdef TARGET_X86_64
+        if (dc->code64)
+            disas_flags = 2;
+        else
+#endif
+            disas_flags = !dc->code32;
+        log_target_disas(pc_start, pc_end - pc_start, disas_flags);
+        qemu_log("\n");
+    }
+}
+#endif
+
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
@@ -7743,12 +7983,13 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     target_ulong pc_ptr;
     uint16_t *gen_opc_end;
     CPUBreakpoint *bp;
-    int j, lj;
+    int i, j, lj;
     uint64_t flags;
     target_ulong pc_start;
     target_ulong cs_base;
     int num_insns;
     int max_insns;
+    int size;
 
     /* generate intermediate code */
     pc_start = tb->pc;
@@ -7786,6 +8027,12 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     dc->code64 = (flags >> HF_CS64_SHIFT) & 1;
 #endif
     dc->flags = flags;
+    dc->trace = tb->trace;
+    dc->trace_block = 0;
+    dc->trace_label = -1;
+    dc->trace_nb_br = 0;
+    dc->trace_nb_slots = 0;
+    dc->trace_nb_exits = 0;
     dc->jmp_opt = !(dc->tf || env->singlestep_enabled ||
                     (flags & HF_INHIBIT_IRQ_MASK)
 #ifndef CONFIG_SOFTMMU
@@ -7809,6 +8056,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     cpu_tmp3_i32 = tcg_temp_new_i32();
     cpu_tmp4 = tcg_temp_new();
     cpu_tmp5 = tcg_temp_new();
+    cpu_lock_val = tcg_temp_new();
     cpu_ptr0 = tcg_temp_new_ptr();
     cpu_ptr1 = tcg_temp_new_ptr();
 
@@ -7818,11 +8066,13 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     pc_ptr = pc_start;
     lj = -1;
     num_insns = 0;
+    size = 0;
     max_insns = tb->cflags & CF_COUNT_MASK;
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
     gen_icount_start();
+ next_block:
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -7878,6 +8128,45 @@ static inline void gen_intermediate_code_internal(CPUState *env,
             break;
         }
     }
+    size += pc_ptr - pc_start;
+    if (dc->trace) {
+        if (!search_pc) {
+            dc->trace->size[dc->trace_block] = pc_ptr - pc_start;
+        }
+#ifdef DEBUG_DISAS
+        log_target_block(dc, pc_start, pc_ptr);
+#endif
+        if (dc->trace_label >= 0) {
+            /* when the jump to the next block is the last op, the two
+               blocks can simply be concatenated */
+            if (gen_opc_ptr[-1] == INDEX_op_br &&
+                gen_opparam_ptr[-1] == dc->trace_label) {
+                gen_opc_ptr--;
+                gen_opparam_ptr--;
+                dc->trace_nb_br--;
+            }
+            if (dc->trace_nb_br > 0) {
+                gen_set_label(dc->trace_label);
+            }
+            dc->trace_block++;
+            dc->trace_label = -1;
+            dc->trace_nb_br = 0;
+            dc->is_jmp = DISAS_NEXT;
+            dc->cc_op = CC_OP_DYNAMIC;
+            pc_start = pc_ptr = dc->trace->pc[dc->trace_block];
+            goto next_block;
+        }
+        /* cc_op was stored before each conditional jump */
+        dc->cc_op = CC_OP_DYNAMIC;
+        for (i = 0; i < dc->trace_nb_exits; i++) {
+            gen_set_label(dc->trace_exit_label[i]);
+            gen_jmp_im(dc->trace_exit_eip[i]);
+            gen_eob(dc);
+        }
+        if (!search_pc) {
+            dc->trace->nb_blocks = dc->trace_block + 1;
+        }
+    }
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
     gen_icount_end(tb, num_insns);
@@ -7891,23 +8180,13 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     }
 
 #ifdef DEBUG_DISAS
-    if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)) {
-        int disas_flags;
-        qemu_log("----------------\n");
-        qemu_log("IN: %s\n", lookup_symbol(pc_start));
-#ifdef TARGET_X86_64
-        if (dc->code64)
-            disas_flags = 2;
-        else
-#endif
-            disas_flags = !dc->code32;
-        log_target_disas(pc_start, pc_ptr - pc_start, disas_flags);
-        qemu_log("\n");
+    if (!dc->trace) {
+        log_target_block(dc, pc_start, pc_ptr);
     }
 #endif
 
     if (!search_pc) {
-        tb->size = pc_ptr - pc_start;
+        tb->size = size;
         tb->icount = num_insns;
     }
 }
@@ -0,0 +1,815 @@
+/*
+ * Persistent translation block cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Translated blocks are appended to a file together with the guest code
+ * they were generated from and the relocations of the host addresses
+ * they contain.  A later run of the same QEMU binary maps the file and,
+ * when it is about to translate a block, looks for a record with the same
+ * pc, cs_base, flags and guest code bytes.  If one is found its host code
+ * is copied into the code buffer and relocated instead of being
+ * translated again.
+ *
+ * The file starts with a fingerprint of the binary (its ELF build-id, or
+ * the contents of the executable if it has none) and of the CPU
+ * configuration; a file with another fingerprint is replaced by a new one
+ * (rename(), so that processes which still map the old file are not
+ * affected).  Several processes may share a file: records are only ever
+ * appended, as whole records and under an flock().
+ *
+ * The file holds code that is executed, so it is created with mode 0600
+ * and a file that is not owned by the user running QEMU, or that others
+ * may write to, is not used.  A file name without a directory refers to
+ * the per-user cache directory ($XDG_CACHE_HOME/qemu or ~/.cache/qemu).
+ * Cached code may only refer to addresses inside the executable, which
+ * the fingerprint covers; blocks that call into shared libraries are not
+ * saved and records that refer to other addresses are ignored.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "qemu-timer.h"
+
+#if defined(TCG_TARGET_HAS_HOST_RELOCS) && defined(USE_DIRECT_JUMP) && \
+    !defined(_WIN32)
+#define TB_CACHE_SUPPORTED
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <link.h>
+#include <elf.h>
+#endif
+
+int tb_cache_enabled;
+
+#ifdef TB_CACHE_SUPPORTED
+
+//#define DEBUG_TB_CACHE
+
+#define TB_CACHE_MAGIC      0x43425451 /* "QTBC" */
+#define TB_CACHE_VERSION    2
+#define TB_CACHE_REC_MAGIC  0x43455254 /* "TREC" */
+
+#define TB_CACHE_HASH_BITS  16
+#define TB_CACHE_HASH_SIZE  (1 << TB_CACHE_HASH_BITS)
+
+/* pending records are written once they add up to this size */
+#define TB_CACHE_WRITE_BATCH (256 * 1024)
+
+typedef struct TBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+} TBCacheHeader;
+
+/* A record is followed by the guest code, the host relocations and the
+   host code.  In the saved host code, relocated words hold the offset
+   of the address from the QEMU image base (TCG_HOST_RELOC_IMAGE) or
+   from the TranslationBlock (TCG_HOST_RELOC_TB).  */
+typedef struct TBCacheRecord {
+    uint32_t magic;
+    uint32_t size;          /* of the whole record, multiple of 8 */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t icount;
+    uint16_t cflags;
+    uint16_t guest_size;
+    uint16_t code_size;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t checksum;      /* of the record with this field zeroed */
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    const TBCacheRecord *rec;
+    struct TBCacheEntry *next;
+} TBCacheEntry;
+
+static char *tb_cache_filename;
+static int tb_cache_fd = -1;
+static int tb_cache_opened;
+static uint64_t tb_cache_fingerprint;
+static uint8_t *tb_cache_map;
+static size_t tb_cache_map_size;
+static TBCacheEntry *tb_cache_hash[TB_CACHE_HASH_SIZE];
+
+/* records of this run which are not written yet */
+static TBCacheRecord **tb_cache_pending;
+static int tb_cache_nb_pending;
+static int tb_cache_max_pending;
+static size_t tb_cache_pending_size;
+
+static int tb_cache_loaded_count;
+static int tb_cache_hit_count;
+static int tb_cache_miss_count;
+static int tb_cache_saved_count;
+
+/* all host addresses recorded by the backend are relative to this */
+#define TB_CACHE_IMAGE_BASE ((tcg_target_long)tb_gen_code)
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+/* the loaded segments of the QEMU executable */
+static tcg_target_long tb_cache_image_start;
+static tcg_target_long tb_cache_image_end;
+
+static uint64_t tb_cache_hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    /* FNV-1a */
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+typedef struct TBCacheImageInfo {
+    uint64_t hash;
+    int has_build_id;
+} TBCacheImageInfo;
+
+/* Called for the executable, which is reported first: record the range
+   of its segments and hash its build-id note.  */
+static int tb_cache_phdr_callback(struct dl_phdr_info *info, size_t size,
+                                  void *opaque)
+{
+    TBCacheImageInfo *img = opaque;
+    const ElfW(Phdr) *ph;
+    const ElfW(Nhdr) *note;
+    const uint8_t *p, *end, *name, *desc;
+    tcg_target_long start;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        ph = &info->dlpi_phdr[i];
+        start = info->dlpi_addr + ph->p_vaddr;
+        if (ph->p_type == PT_LOAD) {
+            if (tb_cache_image_end == 0 || start < tb_cache_image_start) {
+                tb_cache_image_start = start;
+            }
+            if (start + (tcg_target_long)ph->p_memsz > tb_cache_image_end) {
+                tb_cache_image_end = start + ph->p_memsz;
+            }
+        } else if (ph->p_type == PT_NOTE && !img->has_build_id) {
+            p = (const uint8_t *)start;
+            end = p + ph->p_memsz;
+            while (p + sizeof(*note) <= end) {
+                note = (const ElfW(Nhdr) *)p;
+                name = p + sizeof(*note);
+                desc = name + ((note->n_namesz + 3) & ~3);
+                p = desc + ((note->n_descsz + 3) & ~3);
+                if (p > end) {
+                    break;
+                }
+                if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                    memcmp(name, "GNU", 4) == 0) {
+                    img->hash = tb_cache_hash_bytes(img->hash, desc,
+                                                    note->n_descsz);
+                    img->has_build_id = 1;
+                    break;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/* hash the contents of the executable */
+static int tb_cache_hash_exe(uint64_t *h)
+{
+    uint8_t buf[65536];
+    size_t len;
+    FILE *f;
+
+    f = fopen("/proc/self/exe", "rb");
+    if (!f) {
+        return -1;
+    }
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+        *h = tb_cache_hash_bytes(*h, buf, len);
+    }
+    if (ferror(f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Returns -1 if the executable cannot be identified.  */
+static int tb_cache_compute_fingerprint(CPUState *env, uint64_t *fingerprint)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    tcg_target_long v[6];
+    TBCacheImageInfo img;
+
+    img.hash = h;
+    img.has_build_id = 0;
+    dl_iterate_phdr(tb_cache_phdr_callback, &img);
+    /* the addresses in the cache are relative to TB_CACHE_IMAGE_BASE,
+       which must be inside the executable */
+    if (TB_CACHE_IMAGE_BASE < tb_cache_image_start ||
+        TB_CACHE_IMAGE_BASE >= tb_cache_image_end) {
+        return -1;
+    }
+    h = img.hash;
+    if (!img.has_build_id && tb_cache_hash_exe(&h) < 0) {
+        return -1;
+    }
+
+    v[0] = TB_CACHE_VERSION;
+    v[1] = sizeof(CPUState);
+    v[2] = tb_cache_image_start - TB_CACHE_IMAGE_BASE;
+    v[3] = tb_cache_image_end - TB_CACHE_IMAGE_BASE;
+    v[4] = use_icount;
+    v[5] = tcg_multithread;
+    h = tb_cache_hash_bytes(h, v, sizeof(v));
+    h = tb_cache_hash_bytes(h, QEMU_VERSION, sizeof(QEMU_VERSION));
+    h = tb_cache_hash_bytes(h, code_gen_prologue, 1024);
+#if defined(TARGET_I386)
+    /* the translator checks the CPUID bits of the instructions */
+    h = tb_cache_hash_bytes(h, &env->cpuid_features,
+                            sizeof(env->cpuid_features));
+    h = tb_cache_hash_bytes(h, &env->cpuid_ext_features,
+                            sizeof(env->cpuid_ext_features));
+    h = tb_cache_hash_bytes(h, &env->cpuid_ext2_features,
+                            sizeof(env->cpuid_ext2_features));
+    h = tb_cache_hash_bytes(h, &env->cpuid_ext3_features,
+                            sizeof(env->cpuid_ext3_features));
+#endif
+    *fingerprint = h;
+    return 0;
+}
+
+static uint32_t tb_cache_record_checksum(const TBCacheRecord *rec)
+{
+    TBCacheRecord tmp;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    tmp = *rec;
+    tmp.checksum = 0;
+    h = tb_cache_hash_bytes(h, &tmp, sizeof(tmp));
+    h = tb_cache_hash_bytes(h, rec + 1, rec->size - sizeof(tmp));
+    return h ^ (h >> 32);
+}
+
+static inline unsigned int tb_cache_hash_func(target_ulong pc,
+                                              target_ulong cs_base,
+                                              uint64_t flags)
+{
+    uint64_t h = pc ^ cs_base ^ flags;
+
+    h ^= h >> 32;
+    return (h ^ (h >> TB_CACHE_HASH_BITS)) & (TB_CACHE_HASH_SIZE - 1);
+}
+
+static inline const uint8_t *tb_cache_rec_guest_code(const TBCacheRecord *rec)
+{
+    return (const uint8_t *)(rec + 1);
+}
+
+static inline const TCGHostReloc *tb_cache_rec_relocs(const TBCacheRecord *rec)
+{
+    return (const TCGHostReloc *)(tb_cache_rec_guest_code(rec) +
+                                  rec->guest_size);
+}
+
+static inline const uint8_t *tb_cache_rec_code(const TBCacheRecord *rec)
+{
+    return (const uint8_t *)(tb_cache_rec_relocs(rec) + rec->nb_relocs);
+}
+
+/* Nonzero if 'v', a relocated address with the base of its type
+   subtracted, may be kept in the cache.  Only addresses inside the
+   executable are covered by the fingerprint.  */
+static int tb_cache_reloc_valid(int type, tcg_target_long v)
+{
+    switch (type) {
+    case TCG_HOST_RELOC_IMAGE:
+        return v >= tb_cache_image_start - TB_CACHE_IMAGE_BASE &&
+            v < tb_cache_image_end - TB_CACHE_IMAGE_BASE;
+    case TCG_HOST_RELOC_TB:
+        return v >= 0 && v < (tcg_target_long)sizeof(TranslationBlock);
+    default:
+        return 0;
+    }
+}
+
+/* nonzero if all relocations of a record are valid */
+static int tb_cache_check_relocs(const TBCacheRecord *rec)
+{
+    const TCGHostReloc *relocs = tb_cache_rec_relocs(rec);
+    const uint8_t *code = tb_cache_rec_code(rec);
+    tcg_target_long v;
+    int i;
+
+    for (i = 0; i < rec->nb_relocs; i++) {
+        if (relocs[i].offset + sizeof(v) > rec->code_size) {
+            return 0;
+        }
+        memcpy(&v, code + relocs[i].offset, sizeof(v));
+        if (!tb_cache_reloc_valid(relocs[i].type, v)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void tb_cache_insert(const TBCacheRecord *rec)
+{
+    TBCacheEntry *e;
+    unsigned int h;
+
+    h = tb_cache_hash_func(rec->pc, rec->cs_base, rec->flags);
+    e = qemu_malloc(sizeof(*e));
+    e->rec = rec;
+    e->next = tb_cache_hash[h];
+    tb_cache_hash[h] = e;
+}
+
+/* index the records of the mapped file, stopping at the first one that
+   is damaged (e.g. a truncated write) */
+static void tb_cache_index(void)
+{
+    size_t offset, size;
+    const TBCacheRecord *rec;
+
+    offset = sizeof(TBCacheHeader);
+    while (offset + sizeof(TBCacheRecord) <= tb_cache_map_size) {
+        rec = (const TBCacheRecord *)(tb_cache_map + offset);
+        size = rec->size;
+        if (rec->magic != TB_CACHE_REC_MAGIC ||
+            size < sizeof(TBCacheRecord) || (size & 7) != 0 ||
+            size > tb_cache_map_size - offset ||
+            sizeof(TBCacheRecord) + rec->guest_size +
+            rec->nb_relocs * sizeof(TCGHostReloc) + rec->code_size > size ||
+            tb_cache_record_checksum(rec) != rec->checksum) {
+#ifdef DEBUG_TB_CACHE
+            fprintf(stderr, "tb-cache: bad record at offset %zd\n", offset);
+#endif
+            break;
+        }
+        /* a record that refers outside the executable is not trusted */
+        if (tb_cache_check_relocs(rec)) {
+            tb_cache_insert(rec);
+            tb_cache_loaded_count++;
+        }
+        offset += size;
+    }
+}
+
+static int tb_cache_read_header(TBCacheHeader *hdr)
+{
+    return pread(tb_cache_fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr) &&
+        hdr->magic == TB_CACHE_MAGIC && hdr->version == TB_CACHE_VERSION &&
+        hdr->fingerprint == tb_cache_fingerprint;
+}
+
+static void tb_cache_disable(const char *msg)
+{
+    fprintf(stderr, "qemu: tb-cache: %s: %s\n", tb_cache_filename, msg);
+    if (tb_cache_fd >= 0) {
+        close(tb_cache_fd);
+        tb_cache_fd = -1;
+    }
+}
+
+/* nonzero if tb_cache_fd is no longer the file at tb_cache_filename */
+static int tb_cache_replaced(void)
+{
+    struct stat st1, st2;
+
+    if (fstat(tb_cache_fd, &st1) < 0 || stat(tb_cache_filename, &st2) < 0) {
+        return 1;
+    }
+    return st1.st_dev != st2.st_dev || st1.st_ino != st2.st_ino;
+}
+
+/* Replace the file with an empty one for our fingerprint.  The old file
+   may be mapped by other processes, so it must not be truncated.  */
+static int tb_cache_create(void)
+{
+    TBCacheHeader hdr;
+    char *tmp;
+    int fd, err;
+
+    tmp = qemu_malloc(strlen(tb_cache_filename) + 8);
+    sprintf(tmp, "%s.XXXXXX", tb_cache_filename);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        err = errno;
+        goto fail;
+    }
+    hdr.magic = TB_CACHE_MAGIC;
+    hdr.version = TB_CACHE_VERSION;
+    hdr.fingerprint = tb_cache_fingerprint;
+    if (fcntl(fd, F_SETFL, O_APPEND) < 0 ||
+        qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        rename(tmp, tb_cache_filename) < 0) {
+        err = errno;
+        close(fd);
+        unlink(tmp);
+        goto fail;
+    }
+    qemu_free(tmp);
+
+    /* the lock on the old file is dropped with it */
+    close(tb_cache_fd);
+    tb_cache_fd = fd;
+    return 0;
+
+fail:
+    qemu_free(tmp);
+    errno = err;
+    return -1;
+}
+
+/* Create the directories of tb_cache_filename that do not exist yet,
+   accessible only to the current user.  */
+static int tb_cache_mkdir(void)
+{
+    char *dir, *p;
+    int ret = 0;
+
+    dir = qemu_strdup(tb_cache_filename);
+    for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+            ret = -1;
+            break;
+        }
+        *p = '/';
+    }
+    qemu_free(dir);
+    return ret;
+}
+
+/* Returns an error message if the file must not be used, NULL if it is
+   fine.  */
+static const char *tb_cache_check_owner(void)
+{
+    struct stat st;
+
+    if (fstat(tb_cache_fd, &st) < 0) {
+        return strerror(errno);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return "not a regular file";
+    }
+    if (st.st_uid != geteuid()) {
+        return "not owned by the current user";
+    }
+    if (st.st_mode & (S_IWGRP | S_IWOTH)) {
+        return "writable by other users";
+    }
+    return NULL;
+}
+
+/* The file is opened at the first translation: the fingerprint depends
+   on the CPU model.  */
+static void tb_cache_open(CPUState *env)
+{
+    TBCacheHeader hdr;
+    struct stat st;
+    const char *msg;
+    void *map;
+
+    tb_cache_opened = 1;
+    if (tb_cache_compute_fingerprint(env, &tb_cache_fingerprint) < 0) {
+        tb_cache_disable("cannot identify the QEMU executable");
+        return;
+    }
+    if (tb_cache_mkdir() < 0) {
+        tb_cache_disable(strerror(errno));
+        return;
+    }
+    for (;;) {
+        tb_cache_fd = open(tb_cache_filename,
+                           O_RDWR | O_CREAT | O_APPEND | O_NOFOLLOW, 0600);
+        if (tb_cache_fd < 0) {
+            tb_cache_disable(strerror(errno));
+            return;
+        }
+        msg = tb_cache_check_owner();
+        if (msg) {
+            tb_cache_disable(msg);
+            return;
+        }
+        flock(tb_cache_fd, LOCK_EX);
+        /* another process may have replaced the file before we locked it */
+        if (!tb_cache_replaced()) {
+            break;
+        }
+        close(tb_cache_fd);
+    }
+    if (!tb_cache_read_header(&hdr)) {
+        /* new file, or written by another binary or CPU model */
+        if (tb_cache_create() < 0) {
+            tb_cache_disable(strerror(errno));
+            return;
+        }
+    } else if (fstat(tb_cache_fd, &st) == 0 &&
+               st.st_size > (off_t)sizeof(TBCacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, tb_cache_fd, 0);
+        if (map != MAP_FAILED) {
+            tb_cache_map = map;
+            tb_cache_map_size = st.st_size;
+            tb_cache_index();
+        }
+    }
+    flock(tb_cache_fd, LOCK_UN);
+}
+
+static void tb_cache_flush(void)
+{
+    uint8_t *buf, *p;
+    int i, ret;
+
+    if (tb_cache_fd < 0 || tb_cache_nb_pending == 0) {
+        return;
+    }
+    buf = qemu_malloc(tb_cache_pending_size);
+    p = buf;
+    for (i = 0; i < tb_cache_nb_pending; i++) {
+        memcpy(p, tb_cache_pending[i], tb_cache_pending[i]->size);
+        p += tb_cache_pending[i]->size;
+    }
+    ret = 0;
+    flock(tb_cache_fd, LOCK_EX);
+    /* another process may have replaced the file meanwhile */
+    if (!tb_cache_replaced()) {
+        ret = qemu_write_full(tb_cache_fd, buf, tb_cache_pending_size);
+    }
+    flock(tb_cache_fd, LOCK_UN);
+    qemu_free(buf);
+    if (ret < 0) {
+        tb_cache_disable(strerror(errno));
+    }
+    tb_cache_nb_pending = 0;
+    tb_cache_pending_size = 0;
+}
+
+static void tb_cache_exit(void)
+{
+    tb_mutex_lock();
+    tb_cache_flush();
+    tb_mutex_unlock();
+}
+
+/* host pointer to the guest code at 'addr' */
+static const uint8_t *tb_cache_guest_ptr(CPUState *env, target_ulong addr)
+{
+    int mmu_idx, page_index;
+
+    /* fills the TLB and checks that the code is in RAM or ROM */
+    get_page_addr_code(env, addr);
+    mmu_idx = cpu_mmu_index(env);
+    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    return (const uint8_t *)((unsigned long)addr +
+                             env->tlb_table[mmu_idx][page_index].addend);
+}
+
+/* compare (cmp != 0) or copy the guest code of a block */
+static int tb_cache_guest_code(CPUState *env, target_ulong pc,
+                               uint8_t *buf, int size, int cmp)
+{
+    int len, ret;
+
+    ret = 0;
+    while (size > 0 && ret == 0) {
+        len = TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK);
+        if (len > size) {
+            len = size;
+        }
+        if (cmp) {
+            ret = memcmp(tb_cache_guest_ptr(env, pc), buf, len);
+        } else {
+            memcpy(buf, tb_cache_guest_ptr(env, pc), len);
+        }
+        pc += len;
+        buf += len;
+        size -= len;
+    }
+    return ret;
+}
+
+static inline int tb_cache_usable(CPUState *env)
+{
+    if (!tb_cache_opened) {
+        tb_cache_open(env);
+    }
+    /* breakpoints and single stepping change the generated code */
+    return tb_cache_fd >= 0 && !singlestep && !env->singlestep_enabled &&
+        QTAILQ_EMPTY(&env->breakpoints);
+}
+
+/* Copy a cached translation of 'tb' into tb->tc_ptr.  Return 1 and
+   fill in 'tb' if one is found.  */
+int tb_cache_load(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
+{
+    const TBCacheRecord *rec;
+    const TCGHostReloc *relocs;
+    TBCacheEntry *e;
+    tcg_target_long v;
+    uint8_t *p;
+    int i;
+
+    if (!tb_cache_usable(env)) {
+        return 0;
+    }
+    e = tb_cache_hash[tb_cache_hash_func(tb->pc, tb->cs_base, tb->flags)];
+    for (; e != NULL; e = e->next) {
+        rec = e->rec;
+        if (rec->pc != tb->pc || rec->cs_base != tb->cs_base ||
+            rec->flags != tb->flags || rec->cflags != tb->cflags) {
+            continue;
+        }
+        if (tb_cache_guest_code(env, tb->pc,
+                                (uint8_t *)tb_cache_rec_guest_code(rec),
+                                rec->guest_size, 1) != 0) {
+            continue;
+        }
+        memcpy(tb->tc_ptr, tb_cache_rec_code(rec), rec->code_size);
+        relocs = tb_cache_rec_relocs(rec);
+        for (i = 0; i < rec->nb_relocs; i++) {
+            p = tb->tc_ptr + relocs[i].offset;
+            memcpy(&v, p, sizeof(v));
+            if (relocs[i].type == TCG_HOST_RELOC_TB) {
+                v += (tcg_target_long)tb;
+            } else {
+                v += TB_CACHE_IMAGE_BASE;
+            }
+            memcpy(p, &v, sizeof(v));
+        }
+        flush_icache_range((unsigned long)tb->tc_ptr,
+                           (unsigned long)tb->tc_ptr + rec->code_size);
+        tb->size = rec->guest_size;
+        tb->icount = rec->icount;
+        for (i = 0; i < 2; i++) {
+            tb->tb_next_offset[i] = rec->tb_next_offset[i];
+            tb->tb_jmp_offset[i] = rec->tb_jmp_offset[i];
+        }
+        *gen_code_size_ptr = rec->code_size;
+        tb_cache_hit_count++;
+        return 1;
+    }
+    tb_cache_miss_count++;
+    return 0;
+}
+
+/* Record the block which was just translated by cpu_gen_code().  It
+   must be called before anything else is translated: the relocations
+   are taken from tcg_ctx.  */
+void tb_cache_save(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord *rec;
+    TCGHostReloc *relocs;
+    tcg_target_long v;
+    uint8_t *code, *p;
+    size_t size;
+    int i;
+
+    if (!tb_cache_usable(env) || s->nb_host_relocs > TCG_MAX_HOST_RELOCS ||
+        gen_code_size > 0xffff) {
+        return;
+    }
+    size = sizeof(TBCacheRecord) + tb->size +
+        s->nb_host_relocs * sizeof(TCGHostReloc) + gen_code_size;
+    size = (size + 7) & ~7;
+    rec = qemu_mallocz(size);
+    rec->magic = TB_CACHE_REC_MAGIC;
+    rec->size = size;
+    rec->pc = tb->pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->icount = tb->icount;
+    rec->cflags = tb->cflags;
+    rec->guest_size = tb->size;
+    rec->code_size = gen_code_size;
+    rec->nb_relocs = s->nb_host_relocs;
+    for (i = 0; i < 2; i++) {
+        rec->tb_next_offset[i] = tb->tb_next_offset[i];
+        rec->tb_jmp_offset[i] = tb->tb_jmp_offset[i];
+    }
+    tb_cache_guest_code(env, tb->pc, (uint8_t *)tb_cache_rec_guest_code(rec),
+                        tb->size, 0);
+    relocs = (TCGHostReloc *)tb_cache_rec_relocs(rec);
+    memcpy(relocs, s->host_relocs, s->nb_host_relocs * sizeof(TCGHostReloc));
+    code = (uint8_t *)tb_cache_rec_code(rec);
+    memcpy(code, tb->tc_ptr, gen_code_size);
+    for (i = 0; i < rec->nb_relocs; i++) {
+        p = code + relocs[i].offset;
+        memcpy(&v, p, sizeof(v));
+        if (relocs[i].type == TCG_HOST_RELOC_TB) {
+            v -= (tcg_target_long)tb;
+        } else {
+            v -= TB_CACHE_IMAGE_BASE;
+        }
+        if (!tb_cache_reloc_valid(relocs[i].type, v)) {
+            /* e.g. a call into a shared library */
+            qemu_free(rec);
+            return;
+        }
+        memcpy(p, &v, sizeof(v));
+    }
+    rec->checksum = tb_cache_record_checksum(rec);
+
+    /* the record also serves this run after a tb_flush() */
+    tb_cache_insert(rec);
+    if (tb_cache_nb_pending == tb_cache_max_pending) {
+        tb_cache_max_pending = tb_cache_max_pending * 2 + 64;
+        tb_cache_pending = qemu_realloc(tb_cache_pending,
+                                        tb_cache_max_pending *
+                                        sizeof(*tb_cache_pending));
+    }
+    tb_cache_pending[tb_cache_nb_pending++] = rec;
+    tb_cache_pending_size += size;
+    tb_cache_saved_count++;
+    if (tb_cache_pending_size >= TB_CACHE_WRITE_BATCH) {
+        tb_cache_flush();
+    }
+}
+
+void tb_cache_init(const char *filename)
+{
+    const char *dir;
+
+    if (strchr(filename, '/')) {
+        tb_cache_filename = qemu_strdup(filename);
+    } else {
+        /* relative to the per-user cache directory */
+        dir = getenv("XDG_CACHE_HOME");
+        if (dir && dir[0] == '/') {
+            tb_cache_filename = qemu_malloc(strlen(dir) + strlen(filename) + 7);
+            sprintf(tb_cache_filename, "%s/qemu/%s", dir, filename);
+        } else {
+            dir = getenv("HOME");
+            if (!dir || dir[0] != '/') {
+                fprintf(stderr, "qemu: -tb-cache: no cache directory, "
+                        "HOME is not set\n");
+                exit(1);
+            }
+            tb_cache_filename = qemu_malloc(strlen(dir) + strlen(filename) +
+                                            14);
+            sprintf(tb_cache_filename, "%s/.cache/qemu/%s", dir, filename);
+        }
+    }
+    tb_cache_enabled = 1;
+    tcg_ctx.record_host_relocs = 1;
+    atexit(tb_cache_exit);
+}
+
+void tb_cache_dump_info(FILE *f,
+                        int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    if (!tb_cache_enabled) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %s (%s)\n", tb_cache_filename,
+                tb_cache_fd >= 0 ? "active" : "disabled");
+    cpu_fprintf(f, "TB cache records    %d loaded, %d saved\n",
+                tb_cache_loaded_count, tb_cache_saved_count);
+    cpu_fprintf(f, "TB cache lookups    %d hits, %d misses\n",
+                tb_cache_hit_count, tb_cache_miss_count);
+}
+
+#else
+
+void tb_cache_init(const char *filename)
+{
+    fprintf(stderr, "qemu: -tb-cache is not supported on this host\n");
+    exit(1);
+}
+
+int tb_cache_load(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
+{
+    return 0;
+}
+
+void tb_cache_save(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+}
+
+void tb_cache_dump_info(FILE *f,
+                        int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+}
+
+#endif
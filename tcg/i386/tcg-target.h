@@ -61,6 +61,12 @@ enum {
 // #define TCG_TARGET_HAS_nand_i32
 // #define TCG_TARGET_HAS_nor_i32
 
+/* 128-bit SSE2 operations on CPU state, see tcg_out_v128().  Only
+   when the host is known to have SSE2.  */
+#ifdef __SSE2__
+#define TCG_TARGET_HAS_v128
+#endif
+
 #define TCG_TARGET_HAS_GUEST_BASE
 
 /* Note: must be synced with dyngen-exec.h */
@@ -0,0 +1,973 @@
+/*
+ * Optimizations for Tiny Code Generator for QEMU
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "qemu-common.h"
+
+#define NO_CPU_IO_DEFS
+#include "cpu.h"
+
+#include "tcg-op.h"
+
+/* The optimizer works on the op stream produced by the front end, before
+   liveness analysis.  Each op is rewritten in place into at most one op
+   so that the op indexes used by gen_opc_pc[] and friends stay valid.
+   The parameters are compacted in place as well: a rewritten op never
+   needs more parameters than the original one.
+
+   Within a basic block we track which temps hold a known constant and
+   which temps hold the same value (copies).  Both pieces of information
+   are dropped at every basic block boundary. */
+
+#if TCG_TARGET_REG_BITS == 64
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32):    \
+        glue(glue(case INDEX_op_, x), _i64)
+#else
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32)
+#endif
+
+struct tcg_temp_info {
+    int is_const;
+    uint16_t prev_copy;
+    uint16_t next_copy;
+    tcg_target_ulong val;
+};
+
+static struct tcg_temp_info temps[TCG_MAX_TEMPS];
+
+/* Reset the state of a temp: it no longer holds a known constant and it
+   is removed from the copy list it belongs to. */
+static void reset_temp(TCGArg temp)
+{
+    temps[temps[temp].next_copy].prev_copy = temps[temp].prev_copy;
+    temps[temps[temp].prev_copy].next_copy = temps[temp].next_copy;
+    temps[temp].next_copy = temp;
+    temps[temp].prev_copy = temp;
+    temps[temp].is_const = 0;
+}
+
+static void reset_all_temps(int nb_temps)
+{
+    int i;
+
+    for (i = 0; i < nb_temps; i++) {
+        temps[i].is_const = 0;
+        temps[i].next_copy = i;
+        temps[i].prev_copy = i;
+    }
+}
+
+static void reset_global_temps(int nb_globals)
+{
+    int i;
+
+    for (i = 0; i < nb_globals; i++) {
+        reset_temp(i);
+    }
+}
+
+static inline int temp_is_copy(TCGArg temp)
+{
+    return temps[temp].next_copy != temp;
+}
+
+/* Among all the temps holding the same value, prefer a global, then a
+   local temp: they live longer and it lets the plain temps die early. */
+static TCGArg find_better_copy(TCGContext *s, TCGArg temp)
+{
+    TCGArg i;
+
+    if (temp < s->nb_globals) {
+        return temp;
+    }
+
+    for (i = temps[temp].next_copy; i != temp; i = temps[i].next_copy) {
+        if (i < s->nb_globals) {
+            return i;
+        }
+    }
+
+    if (!s->temps[temp].temp_local) {
+        for (i = temps[temp].next_copy; i != temp; i = temps[i].next_copy) {
+            if (s->temps[i].temp_local) {
+                return i;
+            }
+        }
+    }
+
+    return temp;
+}
+
+static int temps_are_copies(TCGArg arg1, TCGArg arg2)
+{
+    TCGArg i;
+
+    if (arg1 == arg2) {
+        return 1;
+    }
+
+    if (!temp_is_copy(arg1) || !temp_is_copy(arg2)) {
+        return 0;
+    }
+
+    for (i = temps[arg1].next_copy; i != arg1; i = temps[i].next_copy) {
+        if (i == arg2) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int op_bits(TCGOpcode op)
+{
+    switch (op) {
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_mov_i64:
+    case INDEX_op_movi_i64:
+    case INDEX_op_setcond_i64:
+    case INDEX_op_brcond_i64:
+    case INDEX_op_add_i64:
+    case INDEX_op_sub_i64:
+    case INDEX_op_mul_i64:
+    case INDEX_op_and_i64:
+    case INDEX_op_or_i64:
+    case INDEX_op_xor_i64:
+    case INDEX_op_shl_i64:
+    case INDEX_op_shr_i64:
+    case INDEX_op_sar_i64:
+#ifdef TCG_TARGET_HAS_rot_i64
+    case INDEX_op_rotl_i64:
+    case INDEX_op_rotr_i64:
+#endif
+#ifdef TCG_TARGET_HAS_not_i64
+    case INDEX_op_not_i64:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+    case INDEX_op_ext8u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+    case INDEX_op_ext16u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+    case INDEX_op_ext32u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_andc_i64
+    case INDEX_op_andc_i64:
+#endif
+#ifdef TCG_TARGET_HAS_orc_i64
+    case INDEX_op_orc_i64:
+#endif
+#ifdef TCG_TARGET_HAS_eqv_i64
+    case INDEX_op_eqv_i64:
+#endif
+#ifdef TCG_TARGET_HAS_nand_i64
+    case INDEX_op_nand_i64:
+#endif
+#ifdef TCG_TARGET_HAS_nor_i64
+    case INDEX_op_nor_i64:
+#endif
+        return 64;
+#endif
+    default:
+        return 32;
+    }
+}
+
+static TCGOpcode op_to_movi(TCGOpcode op)
+{
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 64) {
+        return INDEX_op_movi_i64;
+    }
+#endif
+    return INDEX_op_movi_i32;
+}
+
+static TCGOpcode op_to_mov(TCGOpcode op)
+{
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 64) {
+        return INDEX_op_mov_i64;
+    }
+#endif
+    return INDEX_op_mov_i32;
+}
+
+static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args,
+                            TCGArg dst, TCGArg src)
+{
+    reset_temp(dst);
+    /* Moves between temps of different types (e.g. truncation of a 64 bit
+       value) only share the low part, so they are not recorded as copies. */
+    if (s->temps[src].type == s->temps[dst].type) {
+        temps[dst].next_copy = temps[src].next_copy;
+        temps[dst].prev_copy = src;
+        temps[temps[dst].next_copy].prev_copy = dst;
+        temps[src].next_copy = dst;
+    }
+    gen_args[0] = dst;
+    gen_args[1] = src;
+}
+
+static void tcg_opt_gen_movi(TCGArg *gen_args, TCGArg dst, TCGArg val)
+{
+    reset_temp(dst);
+    temps[dst].is_const = 1;
+    temps[dst].val = val;
+    gen_args[0] = dst;
+    gen_args[1] = val;
+}
+
+static inline uint32_t rol32(uint32_t x, int n)
+{
+    return n ? (x << n) | (x >> (32 - n)) : x;
+}
+
+static inline uint64_t rol64(uint64_t x, int n)
+{
+    return n ? (x << n) | (x >> (64 - n)) : x;
+}
+
+static TCGArg do_constant_folding_2(TCGOpcode op, TCGArg x, TCGArg y)
+{
+    switch (op) {
+    CASE_OP_32_64(add):
+        return x + y;
+    CASE_OP_32_64(sub):
+        return x - y;
+    CASE_OP_32_64(mul):
+        return x * y;
+    CASE_OP_32_64(and):
+        return x & y;
+    CASE_OP_32_64(or):
+        return x | y;
+    CASE_OP_32_64(xor):
+        return x ^ y;
+
+    case INDEX_op_shl_i32:
+        return (uint32_t)x << (y & 31);
+    case INDEX_op_shr_i32:
+        return (uint32_t)x >> (y & 31);
+    case INDEX_op_sar_i32:
+        return (int32_t)x >> (y & 31);
+#ifdef TCG_TARGET_HAS_rot_i32
+    case INDEX_op_rotl_i32:
+        return rol32(x, y & 31);
+    case INDEX_op_rotr_i32:
+        return rol32(x, (32 - (y & 31)) & 31);
+#endif
+#ifdef TCG_TARGET_HAS_not_i32
+    case INDEX_op_not_i32:
+        return ~x;
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+    case INDEX_op_neg_i32:
+        return -x;
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+    case INDEX_op_ext8s_i32:
+        return (int8_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+    case INDEX_op_ext16s_i32:
+        return (int16_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i32
+    case INDEX_op_ext8u_i32:
+        return (uint8_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i32
+    case INDEX_op_ext16u_i32:
+        return (uint16_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_andc_i32
+    case INDEX_op_andc_i32:
+        return x & ~y;
+#endif
+#ifdef TCG_TARGET_HAS_orc_i32
+    case INDEX_op_orc_i32:
+        return x | ~y;
+#endif
+#ifdef TCG_TARGET_HAS_eqv_i32
+    case INDEX_op_eqv_i32:
+        return ~(x ^ y);
+#endif
+#ifdef TCG_TARGET_HAS_nand_i32
+    case INDEX_op_nand_i32:
+        return ~(x & y);
+#endif
+#ifdef TCG_TARGET_HAS_nor_i32
+    case INDEX_op_nor_i32:
+        return ~(x | y);
+#endif
+
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_shl_i64:
+        return (uint64_t)x << (y & 63);
+    case INDEX_op_shr_i64:
+        return (uint64_t)x >> (y & 63);
+    case INDEX_op_sar_i64:
+        return (int64_t)x >> (y & 63);
+#ifdef TCG_TARGET_HAS_rot_i64
+    case INDEX_op_rotl_i64:
+        return rol64(x, y & 63);
+    case INDEX_op_rotr_i64:
+        return rol64(x, (64 - (y & 63)) & 63);
+#endif
+#ifdef TCG_TARGET_HAS_not_i64
+    case INDEX_op_not_i64:
+        return ~x;
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+        return -x;
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+        return (int8_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+        return (int16_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+        return (int32_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+    case INDEX_op_ext8u_i64:
+        return (uint8_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+    case INDEX_op_ext16u_i64:
+        return (uint16_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+    case INDEX_op_ext32u_i64:
+        return (uint32_t)x;
+#endif
+#ifdef TCG_TARGET_HAS_andc_i64
+    case INDEX_op_andc_i64:
+        return x & ~y;
+#endif
+#ifdef TCG_TARGET_HAS_orc_i64
+    case INDEX_op_orc_i64:
+        return x | ~y;
+#endif
+#ifdef TCG_TARGET_HAS_eqv_i64
+    case INDEX_op_eqv_i64:
+        return ~(x ^ y);
+#endif
+#ifdef TCG_TARGET_HAS_nand_i64
+    case INDEX_op_nand_i64:
+        return ~(x & y);
+#endif
+#ifdef TCG_TARGET_HAS_nor_i64
+    case INDEX_op_nor_i64:
+        return ~(x | y);
+#endif
+#endif
+
+    default:
+        fprintf(stderr,
+                "Unrecognized operation %d in do_constant_folding.\n", op);
+        tcg_abort();
+    }
+}
+
+static TCGArg do_constant_folding(TCGOpcode op, TCGArg x, TCGArg y)
+{
+    TCGArg res = do_constant_folding_2(op, x, y);
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 32) {
+        res &= 0xffffffff;
+    }
+#endif
+    return res;
+}
+
+static int do_constant_folding_cond(TCGOpcode op, TCGArg x, TCGArg y,
+                                    TCGCond c)
+{
+    if (op_bits(op) == 32) {
+        switch (c) {
+        case TCG_COND_EQ:
+            return (uint32_t)x == (uint32_t)y;
+        case TCG_COND_NE:
+            return (uint32_t)x != (uint32_t)y;
+        case TCG_COND_LT:
+            return (int32_t)x < (int32_t)y;
+        case TCG_COND_GE:
+            return (int32_t)x >= (int32_t)y;
+        case TCG_COND_LE:
+            return (int32_t)x <= (int32_t)y;
+        case TCG_COND_GT:
+            return (int32_t)x > (int32_t)y;
+        case TCG_COND_LTU:
+            return (uint32_t)x < (uint32_t)y;
+        case TCG_COND_GEU:
+            return (uint32_t)x >= (uint32_t)y;
+        case TCG_COND_LEU:
+            return (uint32_t)x <= (uint32_t)y;
+        case TCG_COND_GTU:
+            return (uint32_t)x > (uint32_t)y;
+        }
+    } else {
+        switch (c) {
+        case TCG_COND_EQ:
+            return (uint64_t)x == (uint64_t)y;
+        case TCG_COND_NE:
+            return (uint64_t)x != (uint64_t)y;
+        case TCG_COND_LT:
+            return (int64_t)x < (int64_t)y;
+        case TCG_COND_GE:
+            return (int64_t)x >= (int64_t)y;
+        case TCG_COND_LE:
+            return (int64_t)x <= (int64_t)y;
+        case TCG_COND_GT:
+            return (int64_t)x > (int64_t)y;
+        case TCG_COND_LTU:
+            return (uint64_t)x < (uint64_t)y;
+        case TCG_COND_GEU:
+            return (uint64_t)x >= (uint64_t)y;
+        case TCG_COND_LEU:
+            return (uint64_t)x <= (uint64_t)y;
+        case TCG_COND_GTU:
+            return (uint64_t)x > (uint64_t)y;
+        }
+    }
+
+    fprintf(stderr,
+            "Unrecognized condition %d in do_constant_folding_cond.\n", c);
+    tcg_abort();
+}
+
+/* Return the all-ones value for the width of 'op', as produced by
+   do_constant_folding. */
+static TCGArg op_mask(TCGOpcode op)
+{
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 32) {
+        return 0xffffffff;
+    }
+#endif
+    return -1;
+}
+
+/* Propagate constants and copies, fold constant expressions and simplify
+   trivial algebraic identities.  Return the new end of the op parameter
+   buffer. */
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
+                     TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
+    int nb_oargs, nb_iargs;
+    TCGOpcode op;
+    const TCGOpDef *def;
+    TCGArg *gen_args;
+    TCGArg tmp;
+    TCGCond cond;
+
+    nb_temps = s->nb_temps;
+    nb_globals = s->nb_globals;
+    reset_all_temps(nb_temps);
+
+    nb_ops = tcg_opc_ptr - gen_opc_buf;
+    gen_args = args;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        op = gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+
+        /* Do copy propagation */
+        if (op == INDEX_op_call) {
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            for (i = nb_oargs + 1; i < nb_oargs + nb_iargs + 1; i++) {
+                if (args[i] != TCG_CALL_DUMMY_ARG && temp_is_copy(args[i])) {
+                    args[i] = find_better_copy(s, args[i]);
+                }
+            }
+        } else {
+            for (i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
+                if (temp_is_copy(args[i])) {
+                    args[i] = find_better_copy(s, args[i]);
+                }
+            }
+        }
+
+        /* For commutative operations make the constant the second
+           argument, which is the only one backends accept as an
+           immediate. */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+            if (temps[args[1]].is_const && !temps[args[2]].is_const) {
+                tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+            }
+            break;
+        CASE_OP_32_64(brcond):
+            if (temps[args[0]].is_const && !temps[args[1]].is_const) {
+                tmp = args[0];
+                args[0] = args[1];
+                args[1] = tmp;
+                args[2] = tcg_swap_cond(args[2]);
+            }
+            break;
+        CASE_OP_32_64(setcond):
+            if (temps[args[1]].is_const && !temps[args[2]].is_const) {
+                tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+                args[3] = tcg_swap_cond(args[3]);
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Simplify expressions for "shift/rot r, 0, a => movi r, 0" */
+        switch (op) {
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+#ifdef TCG_TARGET_HAS_rot_i32
+        case INDEX_op_rotl_i32:
+        case INDEX_op_rotr_i32:
+#endif
+#ifdef TCG_TARGET_HAS_rot_i64
+        case INDEX_op_rotl_i64:
+        case INDEX_op_rotr_i64:
+#endif
+            if (temps[args[1]].is_const && temps[args[1]].val == 0
+                && !temps[args[2]].is_const) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], 0);
+                args += 3;
+                gen_args += 2;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Simplify expressions for "op r, a, 0 => mov r, a" cases */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+#ifdef TCG_TARGET_HAS_rot_i32
+        case INDEX_op_rotl_i32:
+        case INDEX_op_rotr_i32:
+#endif
+#ifdef TCG_TARGET_HAS_rot_i64
+        case INDEX_op_rotl_i64:
+        case INDEX_op_rotr_i64:
+#endif
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+            if (temps[args[1]].is_const) {
+                /* Proceed with possible constant folding. */
+                break;
+            }
+            if (temps[args[2]].is_const && temps[args[2]].val == 0) {
+                goto do_mov3;
+            }
+            break;
+        CASE_OP_32_64(and):
+            if (temps[args[1]].is_const) {
+                break;
+            }
+            if (temps[args[2]].is_const
+                && (temps[args[2]].val & op_mask(op)) == op_mask(op)) {
+                goto do_mov3;
+            }
+            break;
+        CASE_OP_32_64(mul):
+            if (temps[args[1]].is_const) {
+                break;
+            }
+            if (temps[args[2]].is_const && temps[args[2]].val == 1) {
+                goto do_mov3;
+            }
+            break;
+        default:
+            break;
+        do_mov3:
+            if (temps_are_copies(args[0], args[1])) {
+                gen_opc_buf[op_index] = INDEX_op_nop;
+#ifdef CONFIG_PROFILER
+                s->opt_del_count++;
+#endif
+            } else {
+                gen_opc_buf[op_index] = op_to_mov(op);
+                tcg_opt_gen_mov(s, gen_args, args[0], args[1]);
+                gen_args += 2;
+#ifdef CONFIG_PROFILER
+                s->opt_copy_count++;
+#endif
+            }
+            args += 3;
+            continue;
+        }
+
+        /* Simplify expressions for "op r, a, 0 => movi r, 0" cases */
+        switch (op) {
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(mul):
+            if (temps[args[2]].is_const && temps[args[2]].val == 0) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], 0);
+                args += 3;
+                gen_args += 2;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Simplify expressions for "op r, a, a => mov r, a" cases */
+        switch (op) {
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(and):
+            if (temps_are_copies(args[1], args[2])) {
+                if (temps_are_copies(args[0], args[1])) {
+                    gen_opc_buf[op_index] = INDEX_op_nop;
+#ifdef CONFIG_PROFILER
+                    s->opt_del_count++;
+#endif
+                } else {
+                    gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], args[1]);
+                    gen_args += 2;
+#ifdef CONFIG_PROFILER
+                    s->opt_copy_count++;
+#endif
+                }
+                args += 3;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Simplify expressions for "op r, a, a => movi r, 0" cases */
+        switch (op) {
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(xor):
+            if (temps_are_copies(args[1], args[2])) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], 0);
+                gen_args += 2;
+                args += 3;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Propagate constants through copy operations and do constant
+           folding.  Constants will be substituted to arguments by register
+           allocator where needed and possible.  Also detect copies. */
+        switch (op) {
+        CASE_OP_32_64(mov):
+            if (temps_are_copies(args[0], args[1])) {
+                args += 2;
+                gen_opc_buf[op_index] = INDEX_op_nop;
+#ifdef CONFIG_PROFILER
+                s->opt_del_count++;
+#endif
+                break;
+            }
+            if (!temps[args[1]].is_const) {
+                tcg_opt_gen_mov(s, gen_args, args[0], args[1]);
+                gen_args += 2;
+                args += 2;
+                break;
+            }
+            /* Source argument is constant.  Rewrite the operation and
+               let movi case handle it. */
+            args[1] = temps[args[1]].val;
+#if TCG_TARGET_REG_BITS == 64
+            if (op_bits(op) == 32) {
+                args[1] &= 0xffffffff;
+            }
+#endif
+            op = op_to_movi(op);
+            gen_opc_buf[op_index] = op;
+            /* fallthrough */
+        CASE_OP_32_64(movi):
+            tcg_opt_gen_movi(gen_args, args[0], args[1]);
+            gen_args += 2;
+            args += 2;
+            break;
+
+#ifdef TCG_TARGET_HAS_not_i32
+        case INDEX_op_not_i32:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+        case INDEX_op_neg_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+        case INDEX_op_ext8s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+        case INDEX_op_ext16s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i32
+        case INDEX_op_ext8u_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i32
+        case INDEX_op_ext16u_i32:
+#endif
+#ifdef TCG_TARGET_HAS_not_i64
+        case INDEX_op_not_i64:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+        case INDEX_op_neg_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+        case INDEX_op_ext8s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+        case INDEX_op_ext16s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+        case INDEX_op_ext32s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+        case INDEX_op_ext8u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+        case INDEX_op_ext16u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+        case INDEX_op_ext32u_i64:
+#endif
+            if (temps[args[1]].is_const) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tmp = do_constant_folding(op, temps[args[1]].val, 0);
+                tcg_opt_gen_movi(gen_args, args[0], tmp);
+                gen_args += 2;
+                args += 2;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                break;
+            }
+            goto do_default;
+
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+#ifdef TCG_TARGET_HAS_rot_i32
+        case INDEX_op_rotl_i32:
+        case INDEX_op_rotr_i32:
+#endif
+#ifdef TCG_TARGET_HAS_rot_i64
+        case INDEX_op_rotl_i64:
+        case INDEX_op_rotr_i64:
+#endif
+#ifdef TCG_TARGET_HAS_andc_i32
+        case INDEX_op_andc_i32:
+#endif
+#ifdef TCG_TARGET_HAS_orc_i32
+        case INDEX_op_orc_i32:
+#endif
+#ifdef TCG_TARGET_HAS_eqv_i32
+        case INDEX_op_eqv_i32:
+#endif
+#ifdef TCG_TARGET_HAS_nand_i32
+        case INDEX_op_nand_i32:
+#endif
+#ifdef TCG_TARGET_HAS_nor_i32
+        case INDEX_op_nor_i32:
+#endif
+#ifdef TCG_TARGET_HAS_andc_i64
+        case INDEX_op_andc_i64:
+#endif
+#ifdef TCG_TARGET_HAS_orc_i64
+        case INDEX_op_orc_i64:
+#endif
+#ifdef TCG_TARGET_HAS_eqv_i64
+        case INDEX_op_eqv_i64:
+#endif
+#ifdef TCG_TARGET_HAS_nand_i64
+        case INDEX_op_nand_i64:
+#endif
+#ifdef TCG_TARGET_HAS_nor_i64
+        case INDEX_op_nor_i64:
+#endif
+            if (temps[args[1]].is_const && temps[args[2]].is_const) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tmp = do_constant_folding(op, temps[args[1]].val,
+                                          temps[args[2]].val);
+                tcg_opt_gen_movi(gen_args, args[0], tmp);
+                gen_args += 2;
+                args += 3;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                break;
+            }
+            goto do_default;
+
+        CASE_OP_32_64(setcond):
+            if (temps[args[1]].is_const && temps[args[2]].is_const) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tmp = do_constant_folding_cond(op, temps[args[1]].val,
+                                               temps[args[2]].val, args[3]);
+                tcg_opt_gen_movi(gen_args, args[0], tmp);
+                gen_args += 2;
+                args += 4;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                break;
+            }
+            goto do_default;
+
+        CASE_OP_32_64(brcond):
+            if (temps[args[0]].is_const && temps[args[1]].is_const) {
+                cond = args[2];
+                if (do_constant_folding_cond(op, temps[args[0]].val,
+                                             temps[args[1]].val, cond)) {
+                    /* The branch is always taken. */
+                    reset_all_temps(nb_temps);
+                    gen_opc_buf[op_index] = INDEX_op_br;
+                    gen_args[0] = args[3];
+                    gen_args += 1;
+                } else {
+                    /* The branch is never taken: the state of the
+                       fallthrough path is unchanged. */
+                    gen_opc_buf[op_index] = INDEX_op_nop;
+                }
+                args += 4;
+#ifdef CONFIG_PROFILER
+                s->opt_const_count++;
+#endif
+                break;
+            }
+            goto do_default;
+
+        case INDEX_op_call:
+            nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
+            if (!(args[nb_call_args + 1] & (TCG_CALL_CONST | TCG_CALL_PURE))) {
+                reset_global_temps(nb_globals);
+            }
+            for (i = 0; i < (args[0] >> 16); i++) {
+                reset_temp(args[i + 1]);
+            }
+            i = nb_call_args + 3;
+            while (i) {
+                *gen_args = *args;
+                args++;
+                gen_args++;
+                i--;
+            }
+            break;
+
+        case INDEX_op_set_label:
+            reset_all_temps(nb_temps);
+            gen_args[0] = args[0];
+            gen_args++;
+            args++;
+            break;
+
+        case INDEX_op_nopn:
+            i = args[0];
+            while (i) {
+                *gen_args = *args;
+                args++;
+                gen_args++;
+                i--;
+            }
+            break;
+
+        default:
+        do_default:
+            /* Default case: we know nothing about the operation so no
+               propagation is done.  We trash everything if the operation
+               is the end of a basic block, otherwise we only trash the
+               output args. */
+            if (def->flags & TCG_OPF_BB_END) {
+                reset_all_temps(nb_temps);
+            } else {
+                for (i = 0; i < def->nb_oargs; i++) {
+                    reset_temp(args[i]);
+                }
+            }
+            for (i = 0; i < def->nb_args; i++) {
+                gen_args[i] = args[i];
+            }
+            args += def->nb_args;
+            gen_args += def->nb_args;
+            break;
+        }
+    }
+
+    return gen_args;
+}
@@ -2027,6 +2027,29 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+#ifdef TCG_TARGET_HAS_v128
+/* env->dofs = vop(env->dofs, env->sofs), on 128-bit values */
+static inline void tcg_gen_v128(TCGVecOp vop, tcg_target_long dofs,
+                                tcg_target_long sofs, int imm)
+{
+    *gen_opc_ptr++ = INDEX_op_v128;
+    *gen_opparam_ptr++ = vop;
+    *gen_opparam_ptr++ = dofs;
+    *gen_opparam_ptr++ = sofs;
+    *gen_opparam_ptr++ = imm;
+}
+#endif
+
+/* jump to the host code address 'arg', e.g. the tc_ptr of a TB */
+static inline void tcg_gen_jmp_ptr(TCGv_ptr arg)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_jmp, arg);
+#else
+    tcg_gen_op1_i64(INDEX_op_jmp, arg);
+#endif
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
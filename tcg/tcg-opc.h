@@ -78,11 +78,13 @@ DEF2(rotl_i32, 1, 2, 0, 0)
 DEF2(rotr_i32, 1, 2, 0, 0)
 #endif
 
-DEF2(brcond_i32, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF2(brcond_i32, 0, 2, 2,
+     TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | TCG_OPF_SIDE_EFFECTS)
 #if TCG_TARGET_REG_BITS == 32
 DEF2(add2_i32, 2, 4, 0, 0)
 DEF2(sub2_i32, 2, 4, 0, 0)
-DEF2(brcond2_i32, 0, 4, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF2(brcond2_i32, 0, 4, 2,
+     TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | TCG_OPF_SIDE_EFFECTS)
 DEF2(mulu2_i32, 2, 2, 0, 0)
 DEF2(setcond2_i32, 1, 4, 1, 0)
 #endif
@@ -168,7 +170,8 @@ DEF2(rotl_i64, 1, 2, 0, 0)
 DEF2(rotr_i64, 1, 2, 0, 0)
 #endif
 
-DEF2(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
+DEF2(brcond_i64, 0, 2, 2,
+     TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | TCG_OPF_SIDE_EFFECTS)
 #ifdef TCG_TARGET_HAS_ext8s_i64
 DEF2(ext8s_i64, 1, 1, 0, 0)
 #endif
@@ -219,6 +222,11 @@ DEF2(nor_i64, 1, 2, 0, 0)
 #endif
 #endif
 
+#ifdef TCG_TARGET_HAS_v128
+/* TCGVecOp on two 128-bit CPU state fields: vop, dofs, sofs, imm */
+DEF2(v128, 0, 0, 4, TCG_OPF_SIDE_EFFECTS)
+#endif
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF2(debug_insn_start, 0, 0, 2, 0)
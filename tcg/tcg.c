@@ -24,6 +24,9 @@
 
 /* define it to use liveness analysis (better code) */
 #define USE_LIVENESS_ANALYSIS
+/* define it to run the op optimizer (constant folding and copy
+   propagation) before liveness analysis */
+#define USE_TCG_OPTIMIZATIONS
 
 #include "config.h"
 
@@ -66,7 +69,7 @@
 static void patch_reloc(uint8_t *code_ptr, int type, 
                         tcg_target_long value, tcg_target_long addend);
 
-static TCGOpDef tcg_op_defs[] = {
+TCGOpDef tcg_op_defs[] = {
 #define DEF(s, n, copy_size) { #s, 0, 0, n, n, 0, copy_size },
 #define DEF2(s, oargs, iargs, cargs, flags) { #s, oargs, iargs, cargs, iargs + oargs + cargs, flags, 0 },
 #include "tcg-opc.h"
@@ -98,6 +101,17 @@ static inline void tcg_out32(TCGContext *s, uint32_t v)
     s->code_ptr += 4;
 }
 
+/* host relocation recording */
+
+static inline void tcg_out_host_reloc(TCGContext *s, int type)
+{
+    if (s->nb_host_relocs < TCG_MAX_HOST_RELOCS) {
+        s->host_relocs[s->nb_host_relocs].offset = s->code_ptr - s->code_buf;
+        s->host_relocs[s->nb_host_relocs].type = type;
+    }
+    s->nb_host_relocs++;
+}
+
 /* label relocation processing */
 
 static void tcg_out_reloc(TCGContext *s, uint8_t *code_ptr, int type,
@@ -269,6 +283,7 @@ void tcg_func_start(TCGContext *s)
         s->first_free_temp[i] = -1;
     s->labels = tcg_malloc(sizeof(TCGLabel) * TCG_MAX_LABELS);
     s->nb_labels = 0;
+    s->nb_host_relocs = 0;
     s->current_frame_offset = s->frame_start;
 
     gen_opc_ptr = gen_opc_buf;
@@ -1474,9 +1489,33 @@ static void save_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* store the modified globals to their canonical location, but keep
+   the registers that hold them valid. 'allocated_regs' is used in case
+   a temporary registers needs to be allocated to store a constant. */
+static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->val_type == TEMP_VAL_REG && !ts->fixed_reg) {
+            if (!ts->mem_coherent) {
+                tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+                ts->mem_coherent = 1;
+            }
+        } else {
+            temp_save(s, i, allocated_regs);
+        }
+    }
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
-   all globals are stored at their canonical location. */
-static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+   all globals are stored at their canonical location. After a
+   conditional branch ('keep_globals' set), the code that follows can
+   still use the globals held in registers. */
+static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs,
+                                 int keep_globals)
 {
     TCGTemp *ts;
     int i;
@@ -1493,7 +1532,11 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
         }
     }
 
-    save_globals(s, allocated_regs);
+    if (keep_globals) {
+        sync_globals(s, allocated_regs);
+    } else {
+        save_globals(s, allocated_regs);
+    }
 }
 
 #define IS_DEAD_IARG(n) ((dead_iargs >> (n)) & 1)
@@ -1661,7 +1704,8 @@ static void tcg_reg_alloc_op(TCGContext *s,
     }
     
     if (def->flags & TCG_OPF_BB_END) {
-        tcg_reg_alloc_bb_end(s, allocated_regs);
+        tcg_reg_alloc_bb_end(s, allocated_regs,
+                             def->flags & TCG_OPF_COND_BRANCH);
     } else {
         /* mark dead temporaries and free the associated registers */
         for(i = 0; i < nb_iargs; i++) {
@@ -1957,6 +2001,17 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     }
 #endif
 
+#ifdef USE_TCG_OPTIMIZATIONS
+#ifdef CONFIG_PROFILER
+    s->opt_time -= profile_getclock();
+#endif
+    gen_opparam_ptr =
+        tcg_optimize(s, gen_opc_ptr, gen_opparam_buf, tcg_op_defs);
+#ifdef CONFIG_PROFILER
+    s->opt_time += profile_getclock();
+#endif
+#endif
+
 #ifdef CONFIG_PROFILER
     s->la_time -= profile_getclock();
 #endif
@@ -2030,7 +2085,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
             }
             break;
         case INDEX_op_set_label:
-            tcg_reg_alloc_bb_end(s, s->reserved_regs);
+            tcg_reg_alloc_bb_end(s, s->reserved_regs, 0);
             tcg_out_label(s, args[0], (long)s->code_ptr);
             break;
         case INDEX_op_call:
@@ -2113,6 +2168,15 @@ void tcg_dump_info(FILE *f,
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "folded ops/TB       %0.2f\n",
+                s->tb_count ?
+                (double)s->opt_const_count / s->tb_count : 0);
+    cpu_fprintf(f, "copy-prop ops/TB    %0.2f\n",
+                s->tb_count ?
+                (double)s->opt_copy_count / s->tb_count : 0);
+    cpu_fprintf(f, "removed ops/TB      %0.2f\n",
+                s->tb_count ?
+                (double)s->opt_del_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
@@ -2130,6 +2194,8 @@ void tcg_dump_info(FILE *f,
                 (double)s->interm_time / tot * 100.0);
     cpu_fprintf(f, "  gen_code time     %0.1f%%\n", 
                 (double)s->code_time / tot * 100.0);
+    cpu_fprintf(f, "optim./code time    %0.1f%%\n",
+                (double)s->opt_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n", 
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
@@ -92,6 +92,20 @@ typedef struct TCGPool {
 
 #define TCG_MAX_TEMPS 512
 
+/* host relocations: references from the generated code to addresses
+   outside of it. They are only recorded by hosts which define
+   TCG_TARGET_HAS_HOST_RELOCS, so that a translation can be saved and
+   reloaded at another address (see tb-cache.c) */
+#define TCG_HOST_RELOC_IMAGE 0 /* 64 bit address inside the QEMU binary */
+#define TCG_HOST_RELOC_TB    1 /* 64 bit TranslationBlock pointer + n */
+
+#define TCG_MAX_HOST_RELOCS 256
+
+typedef struct TCGHostReloc {
+    uint16_t offset; /* from the start of the generated code */
+    uint16_t type;
+} TCGHostReloc;
+
 /* when the size of the arguments of a called function is smaller than
    this value, they are statically allocated in the TB stack frame */
 #define TCG_STATIC_CALL_ARGS_SIZE 128
@@ -210,6 +224,86 @@ typedef enum {
     TCG_COND_GTU,
 } TCGCond;
 
+/* operations of INDEX_op_v128.  Each one computes
+   d = op(d, s) on two 128-bit values; lanes are named by their width
+   in bits. */
+typedef enum {
+    TCG_VEC_ADD8,
+    TCG_VEC_ADD16,
+    TCG_VEC_ADD32,
+    TCG_VEC_ADD64,
+    TCG_VEC_SUB8,
+    TCG_VEC_SUB16,
+    TCG_VEC_SUB32,
+    TCG_VEC_SUB64,
+    /* saturating, signed and unsigned */
+    TCG_VEC_ADDS8,
+    TCG_VEC_ADDS16,
+    TCG_VEC_ADDUS8,
+    TCG_VEC_ADDUS16,
+    TCG_VEC_SUBS8,
+    TCG_VEC_SUBS16,
+    TCG_VEC_SUBUS8,
+    TCG_VEC_SUBUS16,
+    TCG_VEC_AND,
+    TCG_VEC_ANDN, /* d = ~d & s */
+    TCG_VEC_OR,
+    TCG_VEC_XOR,
+    TCG_VEC_CMPEQ8,
+    TCG_VEC_CMPEQ16,
+    TCG_VEC_CMPEQ32,
+    TCG_VEC_CMPGT8, /* signed */
+    TCG_VEC_CMPGT16,
+    TCG_VEC_CMPGT32,
+    TCG_VEC_MUL16, /* low half of the product */
+    TCG_VEC_MULHS16, /* high half of the product */
+    TCG_VEC_MULHU16,
+    TCG_VEC_MULU32, /* even 32-bit lanes to 64-bit products */
+    TCG_VEC_MADDS16, /* pairwise sum of the 16-bit products */
+    TCG_VEC_SADU8, /* sum of absolute differences per 64 bits */
+    TCG_VEC_MINU8,
+    TCG_VEC_MAXU8,
+    TCG_VEC_MINS16,
+    TCG_VEC_MAXS16,
+    TCG_VEC_AVGU8,
+    TCG_VEC_AVGU16,
+    /* interleave the low or high halves of d and s */
+    TCG_VEC_UNPCKL8,
+    TCG_VEC_UNPCKL16,
+    TCG_VEC_UNPCKL32,
+    TCG_VEC_UNPCKL64,
+    TCG_VEC_UNPCKH8,
+    TCG_VEC_UNPCKH16,
+    TCG_VEC_UNPCKH32,
+    TCG_VEC_UNPCKH64,
+    /* narrow d (low half) and s (high half) with saturation */
+    TCG_VEC_PACKSS16,
+    TCG_VEC_PACKSS32,
+    TCG_VEC_PACKUS16,
+    /* IEEE single and double precision */
+    TCG_VEC_ADDF32,
+    TCG_VEC_SUBF32,
+    TCG_VEC_MULF32,
+    TCG_VEC_DIVF32,
+    TCG_VEC_MINF32,
+    TCG_VEC_MAXF32,
+    TCG_VEC_SQRTF32, /* d = sqrt(s) */
+    TCG_VEC_ADDF64,
+    TCG_VEC_SUBF64,
+    TCG_VEC_MULF64,
+    TCG_VEC_DIVF64,
+    TCG_VEC_MINF64,
+    TCG_VEC_MAXF64,
+    TCG_VEC_SQRTF64,
+    /* shuffles using the immediate argument, with x86 semantics */
+    TCG_VEC_SHUF32, /* d = s shuffled */
+    TCG_VEC_SHUFLO16, /* d = s with the low 4 lanes shuffled */
+    TCG_VEC_SHUFHI16, /* d = s with the high 4 lanes shuffled */
+    TCG_VEC_SHUFF32, /* low half from d, high half from s */
+    TCG_VEC_SHUFF64,
+    TCG_VEC_NB_OPS,
+} TCGVecOp;
+
 /* Invert the sense of the comparison.  */
 static inline TCGCond tcg_invert_cond(TCGCond c)
 {
@@ -299,6 +393,12 @@ struct TCGContext {
     int allocated_helpers;
     int helpers_sorted;
 
+    /* if set, the backend emits position independent sequences for host
+       addresses and records them in host_relocs */
+    int record_host_relocs;
+    int nb_host_relocs; /* > TCG_MAX_HOST_RELOCS if some were lost */
+    TCGHostReloc host_relocs[TCG_MAX_HOST_RELOCS];
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -308,11 +408,15 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t opt_const_count; /* ops folded to a constant by the optimizer */
+    int64_t opt_copy_count; /* ops simplified to a copy by the optimizer */
+    int64_t opt_del_count; /* ops removed by the optimizer */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
     int64_t code_time;
     int64_t la_time;
+    int64_t opt_time;
     int64_t restore_count;
     int64_t restore_time;
 #endif
@@ -410,6 +514,9 @@ typedef struct TCGArgConstraint {
 #define TCG_OPF_SIDE_EFFECTS 0x04 /* instruction has side effects : it
                                      cannot be removed if its output
                                      are not used */
+#define TCG_OPF_COND_BRANCH 0x08 /* with TCG_OPF_BB_END: the code after
+                                    the instruction is reached when the
+                                    branch is not taken */
 
 typedef struct TCGOpDef {
     const char *name;
@@ -439,6 +546,11 @@ do {\
 
 void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 
+extern TCGOpDef tcg_op_defs[];
+
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
+                     TCGOpDef *tcg_op_def);
+
 #if TCG_TARGET_REG_BITS == 32
 #define tcg_const_ptr tcg_const_i32
 #define tcg_add_ptr tcg_add_i32
@@ -448,7 +560,9 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_global_reg_new_ptr tcg_global_reg_new_i32
 #define tcg_global_mem_new_ptr tcg_global_mem_new_i32
 #define tcg_temp_new_ptr tcg_temp_new_i32
+#define tcg_temp_local_new_ptr tcg_temp_local_new_i32
 #define tcg_temp_free_ptr tcg_temp_free_i32
+#define tcg_gen_brcondi_ptr tcg_gen_brcondi_i32
 #else
 #define tcg_const_ptr tcg_const_i64
 #define tcg_add_ptr tcg_add_i64
@@ -458,7 +572,9 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_global_reg_new_ptr tcg_global_reg_new_i64
 #define tcg_global_mem_new_ptr tcg_global_mem_new_i64
 #define tcg_temp_new_ptr tcg_temp_new_i64
+#define tcg_temp_local_new_ptr tcg_temp_local_new_i64
 #define tcg_temp_free_ptr tcg_temp_free_i64
+#define tcg_gen_brcondi_ptr tcg_gen_brcondi_i64
 #endif
 
 void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
@@ -377,12 +377,29 @@ static inline void tcg_out_movi(TCGContext *s, TCGType type,
     }
 }
 
+/* movabs of a host address, always 10 bytes long so that it can be
+   relocated */
+static void tcg_out_movi_reloc(TCGContext *s, int ret, tcg_target_long arg,
+                               int type)
+{
+    tcg_out_opc(s, (0xb8 + (ret & 7)) | P_REXW, 0, ret, 0);
+    tcg_out_host_reloc(s, type);
+    tcg_out32(s, arg);
+    tcg_out32(s, arg >> 32);
+}
+
 static void tcg_out_goto(TCGContext *s, int call, uint8_t *target)
 {
     int32_t disp;
 
     disp = target - s->code_ptr - 5;
-    if (disp == (target - s->code_ptr - 5)) {
+    if (s->record_host_relocs) {
+        /* the distance to the target depends on where the code is
+           loaded: always use an absolute address */
+        tcg_out_movi_reloc(s, TCG_REG_R10, (tcg_target_long)target,
+                           TCG_HOST_RELOC_IMAGE);
+        tcg_out_modrm(s, 0xff, call ? 2 : 4, TCG_REG_R10);
+    } else if (disp == (target - s->code_ptr - 5)) {
         tcg_out8(s, call ? 0xe8 : 0xe9);
         tcg_out32(s, disp);
     } else {
@@ -903,6 +920,107 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 }
 
+#ifdef TCG_TARGET_HAS_v128
+/* mandatory prefix and 0x0f xx opcode of the SSE2 instruction
+   implementing each TCGVecOp */
+static const struct {
+    uint8_t prefix;
+    uint8_t opc;
+} tcg_vec_opc[TCG_VEC_NB_OPS] = {
+    [TCG_VEC_ADD8] = { 0x66, 0xfc },
+    [TCG_VEC_ADD16] = { 0x66, 0xfd },
+    [TCG_VEC_ADD32] = { 0x66, 0xfe },
+    [TCG_VEC_ADD64] = { 0x66, 0xd4 },
+    [TCG_VEC_SUB8] = { 0x66, 0xf8 },
+    [TCG_VEC_SUB16] = { 0x66, 0xf9 },
+    [TCG_VEC_SUB32] = { 0x66, 0xfa },
+    [TCG_VEC_SUB64] = { 0x66, 0xfb },
+    [TCG_VEC_ADDS8] = { 0x66, 0xec },
+    [TCG_VEC_ADDS16] = { 0x66, 0xed },
+    [TCG_VEC_ADDUS8] = { 0x66, 0xdc },
+    [TCG_VEC_ADDUS16] = { 0x66, 0xdd },
+    [TCG_VEC_SUBS8] = { 0x66, 0xe8 },
+    [TCG_VEC_SUBS16] = { 0x66, 0xe9 },
+    [TCG_VEC_SUBUS8] = { 0x66, 0xd8 },
+    [TCG_VEC_SUBUS16] = { 0x66, 0xd9 },
+    [TCG_VEC_AND] = { 0x66, 0xdb },
+    [TCG_VEC_ANDN] = { 0x66, 0xdf },
+    [TCG_VEC_OR] = { 0x66, 0xeb },
+    [TCG_VEC_XOR] = { 0x66, 0xef },
+    [TCG_VEC_CMPEQ8] = { 0x66, 0x74 },
+    [TCG_VEC_CMPEQ16] = { 0x66, 0x75 },
+    [TCG_VEC_CMPEQ32] = { 0x66, 0x76 },
+    [TCG_VEC_CMPGT8] = { 0x66, 0x64 },
+    [TCG_VEC_CMPGT16] = { 0x66, 0x65 },
+    [TCG_VEC_CMPGT32] = { 0x66, 0x66 },
+    [TCG_VEC_MUL16] = { 0x66, 0xd5 },
+    [TCG_VEC_MULHS16] = { 0x66, 0xe5 },
+    [TCG_VEC_MULHU16] = { 0x66, 0xe4 },
+    [TCG_VEC_MULU32] = { 0x66, 0xf4 },
+    [TCG_VEC_MADDS16] = { 0x66, 0xf5 },
+    [TCG_VEC_SADU8] = { 0x66, 0xf6 },
+    [TCG_VEC_MINU8] = { 0x66, 0xda },
+    [TCG_VEC_MAXU8] = { 0x66, 0xde },
+    [TCG_VEC_MINS16] = { 0x66, 0xea },
+    [TCG_VEC_MAXS16] = { 0x66, 0xee },
+    [TCG_VEC_AVGU8] = { 0x66, 0xe0 },
+    [TCG_VEC_AVGU16] = { 0x66, 0xe3 },
+    [TCG_VEC_UNPCKL8] = { 0x66, 0x60 },
+    [TCG_VEC_UNPCKL16] = { 0x66, 0x61 },
+    [TCG_VEC_UNPCKL32] = { 0x66, 0x62 },
+    [TCG_VEC_UNPCKL64] = { 0x66, 0x6c },
+    [TCG_VEC_UNPCKH8] = { 0x66, 0x68 },
+    [TCG_VEC_UNPCKH16] = { 0x66, 0x69 },
+    [TCG_VEC_UNPCKH32] = { 0x66, 0x6a },
+    [TCG_VEC_UNPCKH64] = { 0x66, 0x6d },
+    [TCG_VEC_PACKSS16] = { 0x66, 0x63 },
+    [TCG_VEC_PACKSS32] = { 0x66, 0x6b },
+    [TCG_VEC_PACKUS16] = { 0x66, 0x67 },
+    [TCG_VEC_ADDF32] = { 0, 0x58 },
+    [TCG_VEC_SUBF32] = { 0, 0x5c },
+    [TCG_VEC_MULF32] = { 0, 0x59 },
+    [TCG_VEC_DIVF32] = { 0, 0x5e },
+    [TCG_VEC_MINF32] = { 0, 0x5d },
+    [TCG_VEC_MAXF32] = { 0, 0x5f },
+    [TCG_VEC_SQRTF32] = { 0, 0x51 },
+    [TCG_VEC_ADDF64] = { 0x66, 0x58 },
+    [TCG_VEC_SUBF64] = { 0x66, 0x5c },
+    [TCG_VEC_MULF64] = { 0x66, 0x59 },
+    [TCG_VEC_DIVF64] = { 0x66, 0x5e },
+    [TCG_VEC_MINF64] = { 0x66, 0x5d },
+    [TCG_VEC_MAXF64] = { 0x66, 0x5f },
+    [TCG_VEC_SQRTF64] = { 0x66, 0x51 },
+    [TCG_VEC_SHUF32] = { 0x66, 0x70 },
+    [TCG_VEC_SHUFLO16] = { 0xf2, 0x70 },
+    [TCG_VEC_SHUFHI16] = { 0xf3, 0x70 },
+    [TCG_VEC_SHUFF32] = { 0, 0xc6 },
+    [TCG_VEC_SHUFF64] = { 0x66, 0xc6 },
+};
+
+/* The guest vectors are not necessarily 16 byte aligned in CPUState,
+   so both operands are loaded with movdqu into %xmm0 and %xmm1, which
+   TCG does not otherwise use.  */
+static void tcg_out_v128(TCGContext *s, const TCGArg *args)
+{
+    int prefix = tcg_vec_opc[args[0]].prefix;
+    int opc = tcg_vec_opc[args[0]].opc;
+
+    tcg_out8(s, 0xf3); /* movdqu dofs(env), %xmm0 */
+    tcg_out_modrm_offset(s, P_EXT | 0x6f, 0, TCG_AREG0, args[1]);
+    tcg_out8(s, 0xf3); /* movdqu sofs(env), %xmm1 */
+    tcg_out_modrm_offset(s, P_EXT | 0x6f, 1, TCG_AREG0, args[2]);
+    if (prefix) {
+        tcg_out8(s, prefix);
+    }
+    tcg_out_modrm(s, P_EXT | opc, 0, 1); /* op %xmm1, %xmm0 */
+    if (opc == 0x70 || opc == 0xc6) {
+        tcg_out8(s, args[3]);
+    }
+    tcg_out8(s, 0xf3); /* movdqu %xmm0, dofs(env) */
+    tcg_out_modrm_offset(s, P_EXT | 0x7f, 0, TCG_AREG0, args[1]);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
                               const int *const_args)
 {
@@ -910,12 +1028,21 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
     
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_RAX, args[0]);
+        if (s->record_host_relocs && args[0]) {
+            tcg_out_movi_reloc(s, TCG_REG_RAX, args[0], TCG_HOST_RELOC_TB);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_RAX, args[0]);
+        }
         tcg_out_goto(s, 0, tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* keep the displacement 4-byte aligned so that it can be
+               patched atomically while other threads execute it */
+            while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                tcg_out8(s, 0x90); /* nop */
+            }
             tcg_out8(s, 0xe9); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -945,6 +1072,11 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, args[0]);
         break;
+#ifdef TCG_TARGET_HAS_v128
+    case INDEX_op_v128:
+        tcg_out_v128(s, args);
+        break;
+#endif
     case INDEX_op_movi_i32:
         tcg_out_movi(s, TCG_TYPE_I32, args[0], (uint32_t)args[1]);
         break;
@@ -1323,6 +1455,9 @@ static const TCGTargetOpDef x86_64_op_defs[] = {
     { INDEX_op_call, { "ri" } }, /* XXX: might need a specific constant constraint */
     { INDEX_op_jmp, { "ri" } }, /* XXX: might need a specific constant constraint */
     { INDEX_op_br, { } },
+#ifdef TCG_TARGET_HAS_v128
+    { INDEX_op_v128, { } },
+#endif
 
     { INDEX_op_mov_i32, { "r", "r" } },
     { INDEX_op_movi_i32, { "r" } },
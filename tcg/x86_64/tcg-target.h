@@ -91,7 +91,11 @@ enum {
 // #define TCG_TARGET_HAS_nor_i32
 // #define TCG_TARGET_HAS_nor_i64
 
+/* 128-bit SSE2 operations on CPU state, see tcg_out_v128() */
+#define TCG_TARGET_HAS_v128
+
 #define TCG_TARGET_HAS_GUEST_BASE
+#define TCG_TARGET_HAS_HOST_RELOCS
 
 /* Note: must be synced with dyngen-exec.h */
 #define TCG_AREG0 TCG_REG_R14
@@ -0,0 +1,98 @@
+/*
+ * Throughput of the zero and uniform buffer scans.
+ *
+ * Built by tests/Makefile against bufferiszero.c; "make zero-speed" times
+ * every implementation the host supports on zero pages (the case that
+ * dominates migration and image conversion), uniform nonzero pages, and
+ * pages whose only nonzero byte is the last one.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "qemu-common.h"
+
+#define BUF_SIZE   (256 << 10)
+#define N_ROUNDS   2048
+
+static const char *level_names[] = { "generic", "sse2", "avx2" };
+
+static uint8_t *buf;
+static volatile int sink;
+
+static int64_t get_ns(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000;
+}
+
+/* Scan the buffer in len byte pieces; return GB/s.  */
+static double bench(size_t len, int uniform)
+{
+    int64_t t0, t1;
+    size_t off;
+    int r, acc = 0;
+
+    t0 = get_ns();
+    for (r = 0; r < N_ROUNDS; r++) {
+        for (off = 0; off < BUF_SIZE; off += len) {
+            if (uniform) {
+                acc += buffer_is_uniform(buf + off, len);
+            } else {
+                acc += buffer_is_zero(buf + off, len);
+            }
+        }
+    }
+    t1 = get_ns();
+    sink += acc;
+    return (double)BUF_SIZE * N_ROUNDS / (t1 - t0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t off;
+    int level;
+
+    buf = malloc(BUF_SIZE);
+
+    printf("%-8s %12s %12s %12s %12s\n", "GB/s", "zero 4K", "zero 64K",
+           "uniform 4K", "last byte 4K");
+    for (level = 0; level < 3; level++) {
+        double zero4k, zero64k, uni4k, last4k;
+
+        if (buffer_accel_limit(level) != level) {
+            break;
+        }
+        memset(buf, 0, BUF_SIZE);
+        zero4k = bench(4096, 0);
+        zero64k = bench(65536, 0);
+        memset(buf, 0xa5, BUF_SIZE);
+        uni4k = bench(4096, 1);
+        memset(buf, 0, BUF_SIZE);
+        for (off = 4095; off < BUF_SIZE; off += 4096) {
+            buf[off] = 1;
+        }
+        last4k = bench(4096, 0);
+        printf("%-8s %12.2f %12.2f %12.2f %12.2f\n", level_names[level],
+               zero4k, zero64k, uni4k, last4k);
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Per-operation cost of the softfloat arithmetic.
+ *
+ * Built twice by tests/Makefile, with and without the host FPU fast path
+ * of fpu/softfloat.c, so that "make fpu-speed" shows the cost before and
+ * after.  Each operation is timed twice: with the inexact flag raised (the
+ * common case once a guest has done any rounding arithmetic, where the fast
+ * path applies) and with the flags cleared before every operation (always
+ * emulated).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "softfloat.h"
+
+#define N_OPERANDS 1024
+#define N_ROUNDS   2000
+
+enum {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = { "add", "sub", "mul", "div", "sqrt" };
+
+static float32 f32a[N_OPERANDS], f32b[N_OPERANDS];
+static float64 f64a[N_OPERANDS], f64b[N_OPERANDS];
+
+static float_status status;
+static int clear_flags;
+static volatile uint64_t sink;
+
+static int64_t get_ns(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000;
+}
+
+static void init_operands(void)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < N_OPERANDS; i++) {
+        /* positive normals of moderate magnitude, never zero */
+        double a = (rand() + 1.0) / RAND_MAX * 1000.0;
+        double b = (rand() + 1.0) / RAND_MAX * 1000.0;
+        f32a[i] = float64_to_float32(make_float64(*(uint64_t *)&a), &status);
+        f32b[i] = float64_to_float32(make_float64(*(uint64_t *)&b), &status);
+        f64a[i] = make_float64(*(uint64_t *)&a);
+        f64b[i] = make_float64(*(uint64_t *)&b);
+    }
+}
+
+static void reset_flags(void)
+{
+    set_float_exception_flags(clear_flags ? 0 : float_flag_inexact, &status);
+}
+
+static double bench_f32(int op)
+{
+    int64_t t0, t1;
+    uint32_t acc = 0;
+    int r, i;
+    float32 z;
+
+    reset_flags();
+    t0 = get_ns();
+    for (r = 0; r < N_ROUNDS; r++) {
+        for (i = 0; i < N_OPERANDS; i++) {
+            if (clear_flags) {
+                reset_flags();
+            }
+            switch (op) {
+            case OP_ADD:
+                z = float32_add(f32a[i], f32b[i], &status);
+                break;
+            case OP_SUB:
+                z = float32_sub(f32a[i], f32b[i], &status);
+                break;
+            case OP_MUL:
+                z = float32_mul(f32a[i], f32b[i], &status);
+                break;
+            case OP_DIV:
+                z = float32_div(f32a[i], f32b[i], &status);
+                break;
+            default:
+                z = float32_sqrt(f32a[i], &status);
+                break;
+            }
+            acc += float32_val(z);
+        }
+    }
+    t1 = get_ns();
+    sink += acc;
+    return (double)(t1 - t0) / ((double)N_ROUNDS * N_OPERANDS);
+}
+
+static double bench_f64(int op)
+{
+    int64_t t0, t1;
+    uint64_t acc = 0;
+    int r, i;
+    float64 z;
+
+    reset_flags();
+    t0 = get_ns();
+    for (r = 0; r < N_ROUNDS; r++) {
+        for (i = 0; i < N_OPERANDS; i++) {
+            if (clear_flags) {
+                reset_flags();
+            }
+            switch (op) {
+            case OP_ADD:
+                z = float64_add(f64a[i], f64b[i], &status);
+                break;
+            case OP_SUB:
+                z = float64_sub(f64a[i], f64b[i], &status);
+                break;
+            case OP_MUL:
+                z = float64_mul(f64a[i], f64b[i], &status);
+                break;
+            case OP_DIV:
+                z = float64_div(f64a[i], f64b[i], &status);
+                break;
+            default:
+                z = float64_sqrt(f64a[i], &status);
+                break;
+            }
+            acc += float64_val(z);
+        }
+    }
+    t1 = get_ns();
+    sink += acc;
+    return (double)(t1 - t0) / ((double)N_ROUNDS * N_OPERANDS);
+}
+
+int main(int argc, char **argv)
+{
+    int op;
+
+    set_float_rounding_mode(float_round_nearest_even, &status);
+    init_operands();
+
+    printf("%-8s %14s %14s\n", "ns/op", "inexact set", "flags cleared");
+    for (op = 0; op < OP_COUNT; op++) {
+        double fast, slow;
+
+        clear_flags = 0;
+        fast = bench_f32(op);
+        clear_flags = 1;
+        slow = bench_f32(op);
+        printf("f32 %-4s %14.2f %14.2f\n", op_names[op], fast, slow);
+    }
+    for (op = 0; op < OP_COUNT; op++) {
+        double fast, slow;
+
+        clear_flags = 0;
+        fast = bench_f64(op);
+        clear_flags = 1;
+        slow = bench_f64(op);
+        printf("f64 %-4s %14.2f %14.2f\n", op_names[op], fast, slow);
+    }
+    return 0;
+}
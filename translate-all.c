@@ -127,9 +127,9 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 
 /* The cpu state corresponding to 'searched_pc' is restored.
  */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUState *env, unsigned long searched_pc,
-                      void *puc)
+static int cpu_restore_state1(TranslationBlock *tb,
+                              CPUState *env, unsigned long searched_pc,
+                              void *puc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -181,3 +181,16 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUState *env, unsigned long searched_pc,
+                      void *puc)
+{
+    int ret;
+
+    /* the code generator state is shared between vCPU threads */
+    tb_mutex_lock();
+    ret = cpu_restore_state1(tb, env, searched_pc, puc);
+    tb_mutex_unlock();
+    return ret;
+}
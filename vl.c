@@ -142,6 +142,7 @@ int main(int argc, char **argv)
 #include "block.h"
 #include "block_int.h"
 #include "block-migration.h"
+#include "block-stream.h"
 #include "dma.h"
 #include "audio/audio.h"
 #include "migration.h"
@@ -748,6 +749,7 @@ static void bdrv_format_print(void *opaque, const char *name)
 void drive_uninit(DriveInfo *dinfo)
 {
     qemu_opts_del(dinfo->opts);
+    block_stream_abort(dinfo->bdrv);
     bdrv_delete(dinfo->bdrv);
     QTAILQ_REMOVE(&drives, dinfo, next);
     qemu_free(dinfo);
@@ -787,7 +789,9 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
     int max_devs;
     int index;
     int ro = 0;
+    int copy_on_read;
     int bdrv_flags = 0;
+    int64_t metadata_cache_size;
     int on_read_error, on_write_error;
     const char *devaddr;
     DriveInfo *dinfo;
@@ -819,6 +823,7 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -924,6 +929,8 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
         }
     }
 
+    metadata_cache_size = qemu_opt_get_size(opts, "metadata-cache-size", 0);
+
 #ifdef CONFIG_LINUX_AIO
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
         if (!strcmp(buf, "native")) {
@@ -1120,8 +1127,19 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
         }
     }
 
+    if (copy_on_read) {
+        if (ro) {
+            fprintf(stderr, "qemu: warning: disabling copy-on-read on "
+                            "read-only drive\n");
+        } else {
+            bdrv_flags |= BDRV_O_COPY_ON_READ;
+        }
+    }
+
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
+    bdrv_set_metadata_cache_size(dinfo->bdrv, metadata_cache_size);
+
     if (bdrv_open(dinfo->bdrv, file, bdrv_flags, drv) < 0) {
         fprintf(stderr, "qemu: could not open disk image %s: %s\n",
                         file, strerror(errno));
@@ -2556,6 +2574,9 @@ int main(int argc, char **argv, char **envp)
     int i;
     int snapshot, linux_boot;
     const char *icount_option = NULL;
+    const char *tcg_threads_option = NULL;
+    const char *tb_cache_file = NULL;
+    int tb_trace = 0;
     const char *initrd_filename;
     const char *kernel_filename, *kernel_cmdline;
     char boot_devices[33] = "cad"; /* default to HD->floppy->CD-ROM */
@@ -3342,6 +3363,20 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
+            case QEMU_OPTION_tcg_threads:
+                tcg_threads_option = optarg;
+                break;
+            case QEMU_OPTION_tb_trace:
+                tb_trace = strtol(optarg, NULL, 0);
+                if (tb_trace < 0 || tb_trace > 0xffff) {
+                    fprintf(stderr, "qemu: invalid -tb-trace value %s\n",
+                            optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_tb_cache:
+                tb_cache_file = optarg;
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 break;
@@ -3603,6 +3638,7 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     configure_icount(icount_option);
+    configure_tcg_threads(tcg_threads_option);
 
     if (net_init_clients() < 0) {
         exit(1);
@@ -3618,6 +3654,12 @@ int main(int argc, char **argv, char **envp)
 
     /* init the dynamic translator */
     cpu_exec_init_all(tb_size * 1024 * 1024);
+    if (tb_cache_file) {
+        tb_cache_init(tb_cache_file);
+    }
+    if (tb_trace) {
+        tb_trace_init(tb_trace);
+    }
 
     bdrv_init_with_whitelist();
 
@@ -3897,6 +3939,8 @@ int main(int argc, char **argv, char **envp)
 #endif
 
     main_loop();
+    qemu_aio_flush();
+    bdrv_close_all();
     quit_timers();
     net_cleanup();
 
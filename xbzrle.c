@@ -0,0 +1,137 @@
+/*
+ * XBZRLE page delta encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+#define LONG_ONES   (~0UL / 0xff)
+#define LONG_HIGHS  (LONG_ONES * 0x80)
+
+/* Nonzero if some byte of x is zero.  */
+static inline int has_zero_byte(unsigned long x)
+{
+    return ((x - LONG_ONES) & ~x & LONG_HIGHS) != 0;
+}
+
+static int uleb128_encode(uint8_t *dst, int dlen, uint32_t n)
+{
+    int i = 0;
+
+    do {
+        if (i == dlen) {
+            return -1;
+        }
+        dst[i] = n & 0x7f;
+        n >>= 7;
+        if (n) {
+            dst[i] |= 0x80;
+        }
+        i++;
+    } while (n);
+    return i;
+}
+
+static int uleb128_decode(const uint8_t *src, int slen, uint32_t *n)
+{
+    uint32_t val = 0;
+    int i;
+
+    for (i = 0; i < slen && i < 5; i++) {
+        val |= (uint32_t)(src[i] & 0x7f) << (7 * i);
+        if (!(src[i] & 0x80)) {
+            *n = val;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen)
+{
+    const int wsize = sizeof(unsigned long);
+    int i = 0, d = 0, start, ret;
+
+    while (i < slen) {
+        /* run of unchanged bytes, a word at a time once aligned */
+        start = i;
+        while (i < slen && (i % wsize) && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+        if (!(i % wsize)) {
+            while (i + wsize <= slen &&
+                   *(const unsigned long *)(old_buf + i) ==
+                   *(const unsigned long *)(new_buf + i)) {
+                i += wsize;
+            }
+        }
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+        if (i == slen) {
+            break;
+        }
+        ret = uleb128_encode(dst + d, dlen - d, i - start);
+        if (ret < 0) {
+            return -1;
+        }
+        d += ret;
+
+        /* run of changed bytes; a word is skipped whole when all of its
+           bytes differ */
+        start = i;
+        while (i < slen && (i % wsize) && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        if (!(i % wsize)) {
+            while (i + wsize <= slen &&
+                   !has_zero_byte(*(const unsigned long *)(old_buf + i) ^
+                                  *(const unsigned long *)(new_buf + i))) {
+                i += wsize;
+            }
+        }
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        ret = uleb128_encode(dst + d, dlen - d, i - start);
+        if (ret < 0 || d + ret + i - start > dlen) {
+            return -1;
+        }
+        d += ret;
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+    return d;
+}
+
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen)
+{
+    int i = 0, d = 0, ret;
+    uint32_t count;
+
+    while (i < slen) {
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count > dlen - d) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count == 0 || count > dlen - d ||
+            count > slen - i - ret) {
+            return -1;
+        }
+        i += ret;
+        memcpy(dst + d, src + i, count);
+        i += count;
+        d += count;
+    }
+    return d;
+}
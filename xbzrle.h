@@ -0,0 +1,29 @@
+/*
+ * XBZRLE page delta encoding
+ *
+ * A page is encoded against an older copy of itself as a sequence of
+ * (unchanged run length, changed run length, changed bytes) records.  The
+ * lengths are ULEB128 encoded; unchanged bytes at the end of the page are
+ * not encoded at all.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_XBZRLE_H
+#define QEMU_XBZRLE_H
+
+/* Encode new_buf against old_buf, both slen bytes long and aligned to a
+   host long, into dst.  Return the encoded length, 0 if the buffers are
+   equal, or -1 if the encoding does not fit in dlen bytes.  */
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+
+/* Apply the slen bytes of encoded delta at src to the dlen byte buffer
+   dst.  Return the number of bytes of dst covered, or -1 if the encoding
+   is malformed or overruns dst.  */
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen);
+
+#endif